@@ -0,0 +1,63 @@
+#include "alloc_count.h"
+
+#include <event2/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+unsigned long nr_allocs = 0;
+unsigned long nr_allocs_at_loop_begin = 0;
+unsigned long nr_loops = 0;
+unsigned long nr_allocating_loops = 0;
+
+void *__wrap_malloc(size_t size) {
+  ++nr_allocs;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  ++nr_allocs;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  ++nr_allocs;
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) { __real_free(ptr); }
+
+void *counting_malloc(size_t size) {
+  ++nr_allocs;
+  return __real_malloc(size);
+}
+
+void *counting_realloc(void *ptr, size_t size) {
+  ++nr_allocs;
+  return __real_realloc(ptr, size);
+}
+
+void counting_free(void *ptr) { __real_free(ptr); }
+
+void alloc_count_install() {
+  event_set_mem_functions(counting_malloc, counting_realloc, counting_free);
+  fprintf(stderr, "Counting allocator installed.\n");
+}
+
+void alloc_count_loop_begin() { nr_allocs_at_loop_begin = nr_allocs; }
+
+void alloc_count_loop_end() {
+  ++nr_loops;
+  unsigned long delta = nr_allocs - nr_allocs_at_loop_begin;
+  if (delta > 0) {
+    ++nr_allocating_loops;
+    fprintf(stderr,
+            "[alloc] loop %lu: %lu allocations (%lu of %lu loops allocated, "
+            "%lu allocations in total)\n",
+            nr_loops, delta, nr_allocating_loops, nr_loops, nr_allocs);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef MY_ALLOC_COUNT
+#define MY_ALLOC_COUNT
+
+// 计数分配器，用来验证事件循环在稳态下每一轮都不做任何堆内存分配。
+//
+// 只有定义了 COUNT_ALLOC 的构建才会生效（见 Makefile 中的 *_alloc_check
+// 目标），这时需要和 alloc_count.c 一起链接，并且带上
+// -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free，
+// 以便统计到我们自己的代码里的分配；libevent 内部的分配则通过
+// event_set_mem_functions 统计。没有定义 COUNT_ALLOC 时，下面的接口都是空操作。
+#ifdef COUNT_ALLOC
+
+// 安装计数分配器，必须在调用任何 libevent 函数之前调用。
+void alloc_count_install();
+
+// 标记一轮事件循环的开始。
+void alloc_count_loop_begin();
+
+// 标记一轮事件循环的结束，如果这一轮中发生了堆内存分配，向 stderr 报告。
+void alloc_count_loop_end();
+
+#else
+
+#define alloc_count_install()
+#define alloc_count_loop_begin()
+#define alloc_count_loop_end()
+
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#include "busypoll.h"
+
+#include <time.h>
+
+// 窗口缩到比这还小就不轮询了，下一次被很快叫醒时再从这里长起来。
+#define BP_MIN_WINDOW_NS 1000
+
+long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void bp_init(struct busy_poll *bp, long max_us) {
+  bp->max_ns = max_us * 1000;
+  bp->window_ns = bp->max_ns;
+  bp->nr_hits = 0;
+  bp->nr_misses = 0;
+  bp->blocked_since_ns = 0;
+}
+
+long bp_deadline(struct busy_poll *bp, long now_ns) {
+  return bp->window_ns >= BP_MIN_WINDOW_NS ? now_ns + bp->window_ns : now_ns;
+}
+
+void bp_hit(struct busy_poll *bp) { ++bp->nr_hits; }
+
+void bp_miss(struct busy_poll *bp, long now_ns) {
+  ++bp->nr_misses;
+  bp->blocked_since_ns = now_ns;
+}
+
+void bp_woke(struct busy_poll *bp, long now_ns) {
+  if (bp->max_ns == 0) {
+    return;
+  }
+  const long blocked_ns = now_ns - bp->blocked_since_ns;
+  if (blocked_ns < bp->max_ns) {
+    bp->window_ns =
+        bp->window_ns < BP_MIN_WINDOW_NS ? BP_MIN_WINDOW_NS : bp->window_ns * 2;
+    if (bp->window_ns > bp->max_ns) {
+      bp->window_ns = bp->max_ns;
+    }
+  } else if (blocked_ns > bp->max_ns) {
+    bp->window_ns /= 2;
+  }
+}
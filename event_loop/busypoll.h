@@ -0,0 +1,46 @@
+#ifndef MY_BUSYPOLL
+#define MY_BUSYPOLL
+
+// 自适应的忙轮询窗口：事件循环处理完一轮事件后先不睡，用非阻塞的方式反复检查
+// 有没有新事件（中间用 pause 让出流水线），最多检查一个窗口那么久，还没有事件
+// 才退回阻塞的等待。有流量的时候省掉了睡下去再被叫醒的那几十微秒，没有流量的
+// 时候最多多花一个窗口的 CPU。
+//
+// 窗口的大小按睡下去以后多久被叫醒来调整（和 Linux 的 haltpoll 一样）：刚放弃
+// 轮询不久事件就来了，说明窗口太小，翻倍（不超过上限）；睡了比上限还久才来，说明
+// 这段时间本来就没有流量，轮询是白费的，减半。
+
+struct busy_poll {
+  // 配置的上限，0 表示不轮询。
+  long max_ns;
+  long window_ns;
+  // 轮询期间等到了事件的次数、轮询完整个窗口也没有等到而去睡的次数。
+  unsigned long nr_hits;
+  unsigned long nr_misses;
+  long blocked_since_ns;
+};
+
+void bp_init(struct busy_poll *bp, long max_us);
+
+// 这一次最多轮询到什么时候（CLOCK_MONOTONIC 纳秒），不轮询时返回 now_ns。
+long bp_deadline(struct busy_poll *bp, long now_ns);
+
+// 轮询期间等到了事件。
+void bp_hit(struct busy_poll *bp);
+
+// 窗口用完也没有等到事件，要去睡了。
+void bp_miss(struct busy_poll *bp, long now_ns);
+
+// 睡下去以后被叫醒了（只在 bp_miss 之后调用），据此调整窗口。
+void bp_woke(struct busy_poll *bp, long now_ns);
+
+// 轮询的每一次迭代之间调用。
+static inline void bp_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+long monotonic_ns();
+
+#endif
@@ -0,0 +1,346 @@
+#include "bytes.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dqueue.h"
+#include "membudget.h"
+#include "ringbuf.h"
+
+#define BLOCKS_PER_ARENA ((int)(BYTES_ARENA_SIZE / BYTES_BLOCK_SIZE))
+
+struct bytes_arena;
+
+struct bytes_block {
+  // 空闲时挂在 free_blocks 上。
+  struct dq_node free_node;
+  struct bytes_arena *arena;
+  char *data;
+  int refcnt;
+};
+
+struct bytes_arena {
+  struct dq_node node;
+  char *mem;
+  size_t mapped_len;
+  int nr_free;
+  struct bytes_block blocks[BLOCKS_PER_ARENA];
+};
+
+// 空闲的数据块，后进先出，刚刚被释放的数据块多半还在缓存里。
+struct dqueue free_blocks = {{&free_blocks.sentinel, &free_blocks.sentinel}, 0};
+struct dqueue arenas = {{&arenas.sentinel, &arenas.sentinel}, 0};
+int nr_blocks = 0;
+
+// 正在填充的数据块和它已经提交的字节数，内存池自己持有它的一个引用。spare 是
+// bytes_get_free_iovecs 为了接在 fill 后面而提前拿出来的下一个数据块。
+struct bytes_block *fill = NULL;
+int fill_used = 0;
+struct bytes_block *spare = NULL;
+
+int add_arena() {
+  if (membudget_charge(BYTES_ARENA_SIZE) != 0) {
+    return -1;
+  }
+  struct bytes_arena *a = malloc(sizeof(struct bytes_arena));
+  a->mem = ringbuf_alloc_buf(BYTES_ARENA_SIZE, &a->mapped_len);
+  a->nr_free = BLOCKS_PER_ARENA;
+  dq_node_init(&a->node);
+  dq_push_back(&arenas, &a->node);
+  for (int i = 0; i < BLOCKS_PER_ARENA; ++i) {
+    struct bytes_block *b = &a->blocks[i];
+    dq_node_init(&b->free_node);
+    b->arena = a;
+    b->data = a->mem + i * BYTES_BLOCK_SIZE;
+    b->refcnt = 0;
+    dq_push_back(&free_blocks, &b->free_node);
+  }
+  nr_blocks += BLOCKS_PER_ARENA;
+  return 0;
+}
+
+// 从内存池取出一个数据块，引用计数为 1。超出内存预算时返回 NULL。
+struct bytes_block *take_block() {
+  if (dq_is_empty(&free_blocks) && add_arena() != 0) {
+    return NULL;
+  }
+  struct bytes_block *b =
+      dq_entry(dq_pop_front(&free_blocks), struct bytes_block, free_node);
+  --b->arena->nr_free;
+  b->refcnt = 1;
+  return b;
+}
+
+void block_unref(struct bytes_block *b) {
+  if (--b->refcnt == 0) {
+    dq_push_front(&free_blocks, &b->free_node);
+    ++b->arena->nr_free;
+  }
+}
+
+// 当前的数据块写满了，换成下一个。
+void advance_fill() {
+  if (fill != NULL) {
+    block_unref(fill);
+  }
+  fill = spare != NULL ? spare : take_block();
+  spare = NULL;
+  fill_used = 0;
+}
+
+const char *bytes_data(const struct bytes *b) {
+  return b->block->data + b->offset;
+}
+
+void bytes_ref(const struct bytes *b) { ++b->block->refcnt; }
+
+void bytes_unref(const struct bytes *b) { block_unref(b->block); }
+
+int bytes_get_free_iovecs(int len, struct iovec iov[2]) {
+  if (fill == NULL || fill_used == (int)BYTES_BLOCK_SIZE) {
+    advance_fill();
+    if (fill == NULL) {
+      return 0;
+    }
+  }
+
+  int first = BYTES_BLOCK_SIZE - fill_used;
+  if (first > len) {
+    first = len;
+  }
+  iov[0].iov_base = fill->data + fill_used;
+  iov[0].iov_len = first;
+  if (first == len) {
+    return 1;
+  }
+
+  if (spare == NULL) {
+    spare = take_block();
+    if (spare == NULL) {
+      return 1;
+    }
+  }
+  int second = len - first;
+  if (second > (int)BYTES_BLOCK_SIZE) {
+    second = BYTES_BLOCK_SIZE;
+  }
+  iov[1].iov_base = spare->data;
+  iov[1].iov_len = second;
+  return 2;
+}
+
+int bytes_commit(int nbytes, struct bytes out[2]) {
+  int n = 0;
+  while (nbytes > 0) {
+    if (fill_used == (int)BYTES_BLOCK_SIZE) {
+      advance_fill();
+    }
+    int len = BYTES_BLOCK_SIZE - fill_used;
+    if (len > nbytes) {
+      len = nbytes;
+    }
+    out[n].block = fill;
+    out[n].offset = fill_used;
+    out[n].len = len;
+    ++fill->refcnt;
+    ++n;
+    fill_used += len;
+    nbytes -= len;
+  }
+  return n;
+}
+
+long bytes_trim() {
+  long released = 0;
+  struct dq_node *n = arenas.sentinel.next;
+  while (n != &arenas.sentinel) {
+    struct dq_node *next = n->next;
+    struct bytes_arena *a = dq_entry(n, struct bytes_arena, node);
+    if (a->nr_free == BLOCKS_PER_ARENA) {
+      for (int i = 0; i < BLOCKS_PER_ARENA; ++i) {
+        dq_remove(&free_blocks, &a->blocks[i].free_node);
+      }
+      dq_remove(&arenas, &a->node);
+      ringbuf_free_buf(a->mem, a->mapped_len);
+      free(a);
+      membudget_release(BYTES_ARENA_SIZE);
+      nr_blocks -= BLOCKS_PER_ARENA;
+      released += BYTES_ARENA_SIZE;
+    }
+    n = next;
+  }
+  return released;
+}
+
+int bytes_under_pressure() {
+  return membudget_under_pressure() && dq_size(&free_blocks) < nr_blocks / 8;
+}
+
+int bytes_get_nr_busy_blocks() { return nr_blocks - dq_size(&free_blocks); }
+
+int bytes_get_nr_blocks() { return nr_blocks; }
+
+struct bytes *bytesq_slot(struct bytesq *q, int i) {
+  return &q->slots[(q->head + i) & (q->capacity - 1)];
+}
+
+void bytesq_resize(struct bytesq *q, int capacity) {
+  struct bytes *slots = malloc(sizeof(struct bytes) * capacity);
+  for (int i = 0; i < q->count; ++i) {
+    slots[i] = *bytesq_slot(q, i);
+  }
+  free(q->slots);
+  q->slots = slots;
+  q->head = 0;
+  q->capacity = capacity;
+}
+
+void bytesq_init(struct bytesq *q, int capacity) {
+  q->slots = malloc(sizeof(struct bytes) * capacity);
+  q->head = 0;
+  q->count = 0;
+  q->capacity = capacity;
+  q->size = 0;
+}
+
+void bytesq_destroy(struct bytesq *q) {
+  bytesq_clear(q);
+  free(q->slots);
+  q->slots = NULL;
+}
+
+void bytesq_push(struct bytesq *q, struct bytes *b) {
+  if (q->count > 0) {
+    struct bytes *tail = bytesq_slot(q, q->count - 1);
+    if (tail->block == b->block && tail->offset + tail->len == b->offset) {
+      tail->len += b->len;
+      q->size += b->len;
+      bytes_unref(b);
+      return;
+    }
+  }
+  if (q->count == q->capacity) {
+    bytesq_resize(q, q->capacity * 2);
+  }
+  *bytesq_slot(q, q->count) = *b;
+  ++q->count;
+  q->size += b->len;
+}
+
+int bytesq_append_range(struct bytesq *dst, struct bytesq *src, int offset,
+                        int len) {
+  const int end = offset + len < src->size ? offset + len : src->size;
+  int base = 0;
+  for (int i = 0; i < src->count && base < end; ++i) {
+    struct bytes *s = bytesq_slot(src, i);
+    const int lo = offset > base ? offset : base;
+    const int hi = base + s->len < end ? base + s->len : end;
+    if (lo < hi) {
+      struct bytes piece = {
+          .block = s->block, .offset = s->offset + lo - base, .len = hi - lo};
+      bytes_ref(&piece);
+      bytesq_push(dst, &piece);
+    }
+    base += s->len;
+  }
+  return end > offset ? end - offset : 0;
+}
+
+int bytesq_transfer(struct bytesq *dst, struct bytesq *src) {
+  const int moved = src->size;
+  for (int i = 0; i < src->count; ++i) {
+    bytesq_push(dst, bytesq_slot(src, i));
+  }
+  src->head = 0;
+  src->count = 0;
+  src->size = 0;
+  return moved;
+}
+
+void bytesq_consume(struct bytesq *q, int nbytes) {
+  while (nbytes > 0 && q->count > 0) {
+    struct bytes *s = bytesq_slot(q, 0);
+    if (s->len > nbytes) {
+      s->offset += nbytes;
+      s->len -= nbytes;
+      q->size -= nbytes;
+      return;
+    }
+    nbytes -= s->len;
+    q->size -= s->len;
+    bytes_unref(s);
+    q->head = (q->head + 1) & (q->capacity - 1);
+    --q->count;
+  }
+}
+
+void bytesq_clear(struct bytesq *q) {
+  for (int i = 0; i < q->count; ++i) {
+    bytes_unref(bytesq_slot(q, i));
+  }
+  q->head = 0;
+  q->count = 0;
+  q->size = 0;
+}
+
+int bytesq_get_iovecs(struct bytesq *q, int offset, int len,
+                      struct iovec *iov, int max_iovcnt) {
+  const int end = offset + len < q->size ? offset + len : q->size;
+  int iovcnt = 0;
+  int base = 0;
+  for (int i = 0; i < q->count && base < end && iovcnt < max_iovcnt; ++i) {
+    struct bytes *s = bytesq_slot(q, i);
+    const int lo = offset > base ? offset : base;
+    const int hi = base + s->len < end ? base + s->len : end;
+    if (lo < hi) {
+      iov[iovcnt].iov_base = (void *)(bytes_data(s) + lo - base);
+      iov[iovcnt].iov_len = hi - lo;
+      ++iovcnt;
+    }
+    base += s->len;
+  }
+  return iovcnt;
+}
+
+int bytesq_find(struct bytesq *q, int from, int to, char ch) {
+  int base = 0;
+  for (int i = 0; i < q->count && base < to; ++i) {
+    struct bytes *s = bytesq_slot(q, i);
+    const int lo = from > base ? from : base;
+    const int hi = base + s->len < to ? base + s->len : to;
+    if (lo < hi) {
+      const char *p = memchr(bytes_data(s) + lo - base, ch, hi - lo);
+      if (p != NULL) {
+        return base + (p - bytes_data(s));
+      }
+    }
+    base += s->len;
+  }
+  return -1;
+}
+
+int bytesq_rfind(struct bytesq *q, int from, int to, char ch) {
+  int base_end = q->size;
+  for (int i = q->count - 1; i >= 0 && base_end > from; --i) {
+    struct bytes *s = bytesq_slot(q, i);
+    const int base = base_end - s->len;
+    const int lo = from > base ? from : base;
+    const int hi = base_end < to ? base_end : to;
+    if (lo < hi) {
+      const char *p = memrchr(bytes_data(s) + lo - base, ch, hi - lo);
+      if (p != NULL) {
+        return base + (p - bytes_data(s));
+      }
+    }
+    base_end = base;
+  }
+  return -1;
+}
+
+int bytesq_shrink(struct bytesq *q, int capacity) {
+  if (q->count > 0 || q->capacity <= capacity) {
+    return -1;
+  }
+  bytesq_resize(q, capacity);
+  return 0;
+}
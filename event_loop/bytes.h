@@ -0,0 +1,115 @@
+#ifndef MY_BYTES
+#define MY_BYTES
+
+#include <sys/uio.h>
+
+// 引用计数的、不可变的字节切片，让数据从 read 进来到 write 出去之间不再被复制：
+// 数据被直接 read 进进程级内存池里的一个数据块（block），之后在各个队列之间传递
+// 的只是指向这个数据块的切片（block、offset、len），最后由 writev/sendmsg 直接
+// 从数据块发出去。
+//
+// 每个切片持有所在数据块的一个引用，数据块的引用计数降为 0 时回到内存池。数据块
+// 只会在末尾追加（见 bytes_get_free_iovecs、bytes_commit），已经提交的部分不会
+// 再改变，所以同一段数据可以同时挂在任意多个队列里。
+//
+// 内存池按 arena（BYTES_ARENA_SIZE，正好一个大页，用 ringbuf_alloc_buf 分配，
+// 见 ringbuf_set_large_alloc）向内存预算申请额度，一个 arena 切成若干个数据块；
+// 数据块回到内存池后并不马上归还，bytes_trim 把完全空闲的 arena 归还给内存预算。
+
+#define BYTES_BLOCK_SIZE (((0x1UL) << 10) * 64)
+#define BYTES_ARENA_SIZE (((0x1UL) << 20) * 2)
+
+struct bytes_block;
+
+// 一个切片，持有 block 的一个引用。
+struct bytes {
+  struct bytes_block *block;
+  int offset;
+  int len;
+};
+
+// 切片的首地址。
+const char *bytes_data(const struct bytes *b);
+
+// 增加、减少 b 所在数据块的引用计数。
+void bytes_ref(const struct bytes *b);
+void bytes_unref(const struct bytes *b);
+
+// 把内存池当前正在填充的数据块末尾最多 len 字节的空闲空间描述成最多两个 iovec
+// （当前数据块剩下的不够时接上下一个数据块），返回实际使用的 iovec 个数，可以直接
+// 交给 readv，然后用 bytes_commit 把读到的数据变成切片。超出内存预算、一个数据块
+// 也拿不到时返回 0。
+int bytes_get_free_iovecs(int len, struct iovec iov[2]);
+
+// 把紧跟在已提交数据之后的 nbytes 字节（已经由调用者直接写进了
+// bytes_get_free_iovecs 描述的空闲空间）提交成切片，写到 out 里（每个切片持有一个
+// 引用），返回切片的个数（最多两个）。
+int bytes_commit(int nbytes, struct bytes out[2]);
+
+// 把完全空闲的 arena 归还给内存预算，返回归还的字节数。
+long bytes_trim();
+
+// 内存池是否处于压力之下：已经不能再向内存预算申请多少 arena
+// （membudget_under_pressure），并且空闲的数据块也不到八分之一了。
+int bytes_under_pressure();
+
+// 被切片（或者正在填充）引用着的数据块个数，以及内存池里所有数据块的个数。
+int bytes_get_nr_busy_blocks();
+int bytes_get_nr_blocks();
+
+// 切片队列：按顺序排列的切片，用来代替 ringbuf 作为连接的 read_buf、write_buf
+// 和广播的这一批数据。存放切片的数组按需扩容，它的大小只和切片的个数有关，不和
+// 数据量有关：追加的切片如果在同一个数据块里紧接着队尾的切片，就直接合并到队尾的
+// 切片上，所以从同一个数据块连续读进来的数据只占一个位置。
+struct bytesq {
+  struct bytes *slots;
+  int head;
+  int count;
+  // 数组的长度，2 的幂。
+  int capacity;
+  // 所有切片加起来的字节数。
+  int size;
+};
+
+// 初始化一个可以存放 capacity 个切片（2 的幂）的空队列。
+void bytesq_init(struct bytesq *q, int capacity);
+
+// 释放队列里所有切片的引用和数组本身。
+void bytesq_destroy(struct bytesq *q);
+
+// 把切片 b 追加到队尾，b 的引用转交给队列。
+void bytesq_push(struct bytesq *q, struct bytes *b);
+
+// 把 src 中从第 offset 个字节开始的 len 字节追加到 dst 尾部（增加引用，不复制
+// 数据），返回追加的字节数。
+int bytesq_append_range(struct bytesq *dst, struct bytesq *src, int offset,
+                        int len);
+
+// 把 src 的全部内容转移到 dst 尾部，src 变为空，返回转移的字节数。
+int bytesq_transfer(struct bytesq *dst, struct bytesq *src);
+
+// 从队首丢弃 nbytes 字节（例如它们已经被 writev 发出去了）。
+void bytesq_consume(struct bytesq *q, int nbytes);
+
+// 丢弃全部内容。
+void bytesq_clear(struct bytesq *q);
+
+// 把队列中从第 offset 个字节开始的最多 len 字节描述成最多 max_iovcnt 个 iovec
+// （每个切片一个），返回实际使用的 iovec 个数，可以直接交给 writev/sendmsg。
+int bytesq_get_iovecs(struct bytesq *q, int offset, int len,
+                      struct iovec *iov, int max_iovcnt);
+
+// 在 [from, to) 范围内查找第一个（最后一个）值为 ch 的字节，返回它的偏移量，找不到
+// 时返回 -1。
+int bytesq_find(struct bytesq *q, int from, int to, char ch);
+int bytesq_rfind(struct bytesq *q, int from, int to, char ch);
+
+// 队列为空时把数组缩回 capacity 个位置，成功返回 0，否则（不为空、或者已经不比它
+// 大）返回 -1。
+int bytesq_shrink(struct bytesq *q, int capacity);
+
+static inline int bytesq_get_size(struct bytesq *q) { return q->size; }
+
+static inline int bytesq_is_empty(struct bytesq *q) { return q->size == 0; }
+
+#endif
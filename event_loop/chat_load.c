@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// chat_room 的负载生成器：开 nr_conns 个连接，每个连接发 nr_msgs 条 msg_size
+// 字节的消息，chat_room 会把每条消息广播给所有连接，所以每个连接都应该收到
+// nr_conns * nr_msgs * msg_size 字节。报告发送和接收的吞吐量；然后用第一个连接
+// 发 nr_pings 条消息、等它被广播回来，报告往返延迟。
+//
+// 地址的写法见 util.h，可以是 TCP 端口，也可以是 UNIX domain socket，用来对比
+// 两者的吞吐量和延迟。
+// 用法：chat_load [-c nr_conns] [-n nr_msgs] [-s msg_size] [-p nr_pings] <addr>
+
+#define DEFAULT_NR_CONNS 4
+#define DEFAULT_NR_MSGS 10000
+#define DEFAULT_MSG_SIZE 128
+#define DEFAULT_NR_PINGS 1000
+#define MAX_CONNS 1024
+// 收不到任何数据超过这么久就认为剩下的数据被丢掉了（比如 chat_room 的 drop 策略）。
+#define STALL_TIMEOUT_MS 2000
+#define IO_BUF_SIZE (((0x1UL) << 10) * 64)
+
+struct load_conn {
+  int fd;
+  long bytes_to_send;
+  // 下一个要发的字节在 send_buf 里的位置，send 只发出半条消息时从这里接着发。
+  long send_off;
+  long bytes_received;
+};
+
+struct load_conn conns[MAX_CONNS];
+// 一条接一条的消息，每条 msg_size 字节、以 '\n' 结尾，只填满整数条。
+char send_buf[IO_BUF_SIZE];
+long send_buf_len;
+char recv_buf[IO_BUF_SIZE];
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int cmp_long(const void *a, const void *b) {
+  const long x = *(const long *)a, y = *(const long *)b;
+  return x < y ? -1 : x > y;
+}
+
+void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <addr>\n"
+          "  <addr>        <port> or <host>:<port> for TCP, unix:<path> for a "
+          "UNIX domain socket,\n"
+          "                unix:@<name> for one in the abstract namespace\n"
+          "  -c <n>        number of connections (default %d, at most %d)\n"
+          "  -n <n>        messages sent per connection (default %d)\n"
+          "  -s <bytes>    message size (default %d)\n"
+          "  -p <n>        round trips timed after the throughput run, 0 to "
+          "skip (default %d)\n",
+          prog, DEFAULT_NR_CONNS, MAX_CONNS, DEFAULT_NR_MSGS, DEFAULT_MSG_SIZE,
+          DEFAULT_NR_PINGS);
+  exit(1);
+}
+
+// 所有连接同时发、同时收，直到每个连接都收齐了或者收不动了。返回收到的总字节数。
+long run_throughput(int nr_conns, long expected_per_conn) {
+  struct pollfd pfds[MAX_CONNS];
+  long total_received = 0;
+  long last_progress = now_ns();
+  int nr_done = 0;
+  while (nr_done < nr_conns) {
+    for (int i = 0; i < nr_conns; ++i) {
+      pfds[i].fd = conns[i].fd;
+      pfds[i].events = POLLIN;
+      if (conns[i].bytes_to_send > 0) {
+        pfds[i].events |= POLLOUT;
+      }
+    }
+    int n = poll(pfds, nr_conns, 100);
+    if (n < 0) {
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      exit(1);
+    }
+    if (n == 0) {
+      if (now_ns() - last_progress > STALL_TIMEOUT_MS * 1000000L) {
+        fprintf(stderr, "No progress for %d ms, giving up.\n",
+                STALL_TIMEOUT_MS);
+        break;
+      }
+      continue;
+    }
+
+    for (int i = 0; i < nr_conns; ++i) {
+      struct load_conn *c = &conns[i];
+      if ((pfds[i].revents & POLLOUT) && c->bytes_to_send > 0) {
+        // send 可能只发出半条消息，下次从半条消息的后半截接着发，这样 chat_room
+        // 看到的始终是完整的、以 '\n' 分隔的消息。
+        long len = send_buf_len - c->send_off;
+        if (len > c->bytes_to_send) {
+          len = c->bytes_to_send;
+        }
+        ssize_t sent =
+            send(c->fd, send_buf + c->send_off, len, MSG_DONTWAIT);
+        if (sent > 0) {
+          c->bytes_to_send -= sent;
+          c->send_off = (c->send_off + sent) % send_buf_len;
+        } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          fprintf(stderr, "send: %s\n", strerror(errno));
+          exit(1);
+        }
+      }
+      if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t got = recv(c->fd, recv_buf, sizeof(recv_buf), MSG_DONTWAIT);
+        if (got > 0) {
+          const int was_done = c->bytes_received >= expected_per_conn;
+          c->bytes_received += got;
+          total_received += got;
+          last_progress = now_ns();
+          if (!was_done && c->bytes_received >= expected_per_conn) {
+            ++nr_done;
+          }
+        } else if (got == 0) {
+          fprintf(stderr, "Connection %d closed by server.\n", i);
+          exit(1);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          fprintf(stderr, "recv: %s\n", strerror(errno));
+          exit(1);
+        }
+      }
+    }
+  }
+  return total_received;
+}
+
+// 收满 len 字节，超时返回 -1。
+int recv_exact(int fd, char *buf, int len) {
+  int got = 0;
+  while (got < len) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, STALL_TIMEOUT_MS) <= 0) {
+      return -1;
+    }
+    ssize_t n = recv(fd, buf + got, len - got, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    got += n;
+  }
+  return 0;
+}
+
+// 第一个连接发一条消息，等它被广播回来；其它连接收到的那一份也要读掉，免得
+// 它们的 write_buf 在服务器那边越积越多。
+void run_pings(int nr_conns, int nr_pings, int msg_size) {
+  long *rtts = malloc(sizeof(long) * nr_pings);
+  int nr_done = 0;
+  for (; nr_done < nr_pings; ++nr_done) {
+    const long t0 = now_ns();
+    if (send(conns[0].fd, send_buf, msg_size, 0) != msg_size) {
+      fprintf(stderr, "send: %s\n", strerror(errno));
+      break;
+    }
+    if (recv_exact(conns[0].fd, recv_buf, msg_size) != 0) {
+      fprintf(stderr, "Ping %d was not echoed back.\n", nr_done);
+      break;
+    }
+    rtts[nr_done] = now_ns() - t0;
+    for (int i = 1; i < nr_conns; ++i) {
+      if (recv_exact(conns[i].fd, recv_buf, msg_size) != 0) {
+        fprintf(stderr, "Ping %d did not reach connection %d.\n", nr_done, i);
+        break;
+      }
+    }
+  }
+
+  if (nr_done > 0) {
+    qsort(rtts, nr_done, sizeof(long), cmp_long);
+    printf("%-12s %d round trips, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           "latency", nr_done, rtts[nr_done / 2] / 1000.0,
+           rtts[nr_done * 99 / 100] / 1000.0, rtts[nr_done - 1] / 1000.0);
+  }
+  free(rtts);
+}
+
+int main(int argc, char *argv[]) {
+  int nr_conns = DEFAULT_NR_CONNS;
+  int nr_msgs = DEFAULT_NR_MSGS;
+  int msg_size = DEFAULT_MSG_SIZE;
+  int nr_pings = DEFAULT_NR_PINGS;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:s:p:")) != -1) {
+    switch (opt) {
+      case 'c':
+        nr_conns = atoi(optarg);
+        break;
+      case 'n':
+        nr_msgs = atoi(optarg);
+        break;
+      case 's':
+        msg_size = atoi(optarg);
+        break;
+      case 'p':
+        nr_pings = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc || nr_conns <= 0 || nr_conns > MAX_CONNS ||
+      nr_msgs < 0 || msg_size <= 0 || msg_size > (int)IO_BUF_SIZE ||
+      nr_pings < 0) {
+    usage(argv[0]);
+  }
+  const char *addr = argv[optind];
+
+  send_buf_len = IO_BUF_SIZE - IO_BUF_SIZE % msg_size;
+  memset(send_buf, 'x', send_buf_len);
+  for (long off = msg_size - 1; off < send_buf_len; off += msg_size) {
+    send_buf[off] = '\n';
+  }
+  for (int i = 0; i < nr_conns; ++i) {
+    conns[i].fd = connect_to(addr);
+    if (conns[i].fd == -1) {
+      exit(1);
+    }
+    conns[i].bytes_to_send = (long)nr_msgs * msg_size;
+    conns[i].send_off = 0;
+    conns[i].bytes_received = 0;
+  }
+  // 等服务器把所有连接都接受下来，否则先连上的连接发的消息广播不到后连上的连接。
+  usleep(100000);
+
+  const long expected_per_conn = (long)nr_conns * nr_msgs * msg_size;
+  const long t0 = now_ns();
+  const long received = run_throughput(nr_conns, expected_per_conn);
+  const double secs = (now_ns() - t0) / 1e9;
+  const long sent = (long)nr_conns * nr_msgs * msg_size;
+  printf("%-12s %s, %d connections, %d messages of %d bytes each\n", "target",
+         addr, nr_conns, nr_msgs, msg_size);
+  printf("%-12s %.1f MiB/s, %.0f msgs/s\n", "ingest",
+         sent / secs / (1 << 20), (double)nr_conns * nr_msgs / secs);
+  printf("%-12s %.1f MiB/s, %ld of %ld bytes received\n", "fan-out",
+         received / secs / (1 << 20), received, expected_per_conn * nr_conns);
+
+  if (received == expected_per_conn * nr_conns && nr_pings > 0) {
+    run_pings(nr_conns, nr_pings, msg_size);
+  }
+
+  for (int i = 0; i < nr_conns; ++i) {
+    close(conns[i].fd);
+  }
+  return received == expected_per_conn * nr_conns ? 0 : 1;
+}
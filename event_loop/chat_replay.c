@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lathist.h"
+#include "trace.h"
+#include "util.h"
+
+// 把 chat_room -C 记录下来的 trace（见 trace.h）重放给 chat_room 或者 socket_mux：
+// trace 里的每个连接都用一个新的连接来重放，在它当初建立的时刻 connect，把它
+// 当初读到的每一块数据按当初的大小、在当初的时刻发出去，在它当初关闭的时刻
+// close。服务器发回来的数据（比如 chat_room 的广播）都读掉丢弃，只计数。
+//
+// 默认按记录下来的节奏重放（-x 可以加快或者放慢），报告每条记录比计划晚了多久
+// 才轮到；-f 不管节奏，尽快重放，测服务器在这种流量形态下能承受的最大吞吐量。
+// -k 同时重放 k 份 trace，每一份用自己的一组连接，把负载放大 k 倍。
+//
+// 数据直接从映射进来的 trace 文件发出去，重放本身不复制数据。连接保持阻塞模式，
+// 收发都用 MSG_DONTWAIT。
+// 用法：chat_replay [-f] [-x speed] [-k copies] <trace> <addr>
+
+// 所有连接加起来最多积压这么多还没发出去的数据，超过了就先不往下读 trace，
+// 等服务器跟上来。
+#define MAX_PENDING_BYTES (((0x1UL) << 20) * 64)
+// 每读这么多条记录就 poll 一次，把服务器发回来的数据读掉。
+#define RECORDS_PER_POLL 256
+#define SEND_MAX_IOV 64
+#define INITIAL_PENDING_SLOTS 16
+// 重放完以后，收不到任何数据超过这么久就认为服务器发完了。
+#define DRAIN_IDLE_MS 200
+#define MAX_POLL_WAIT_NS 100000000L
+#define IO_BUF_SIZE (((0x1UL) << 10) * 64)
+
+struct replay_conn {
+  // 还没有 connect 或者已经 close 了的连接是 -1。
+  int fd;
+  // 在 open_slots 里的下标。
+  int open_idx;
+  // trace 里它已经关闭了，等 pending 发完再 close。
+  int close_pending;
+
+  // 还没发出去的数据块，指向 trace 文件映射进来的内存。环形数组，cap 是 2 的幂。
+  struct iovec *pending;
+  unsigned int head;
+  unsigned int count;
+  unsigned int cap;
+};
+
+struct replay_stats {
+  unsigned long nr_opens;
+  unsigned long nr_closes;
+  unsigned long nr_server_closes;
+  unsigned long nr_chunks;
+  unsigned long bytes_sent;
+  unsigned long bytes_received;
+  // 连接已经不在了（被服务器关掉了、connect 失败了）而没能发出去的数据。
+  unsigned long bytes_dropped;
+  // 按节奏重放时，每条记录轮到它的时刻比计划晚了多少。
+  struct lathist lag;
+};
+
+struct replay_conn *conns;
+// 所有打开着的连接的下标，poll 只看它们。
+int *open_slots;
+int nr_open;
+unsigned long pending_bytes;
+struct replay_stats stats;
+char recv_buf[IO_BUF_SIZE];
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <trace> <addr>\n"
+          "  <trace>       a trace recorded by chat_room -C\n"
+          "  <addr>        <port> or <host>:<port> for TCP, unix:<path> for a "
+          "UNIX domain socket,\n"
+          "                unix:@<name> for one in the abstract namespace\n"
+          "  -f            replay as fast as possible instead of at the "
+          "recorded pace\n"
+          "  -x <speed>    replay this many times faster than recorded "
+          "(default 1)\n"
+          "  -k <n>        replay n copies of the trace at once, each on its "
+          "own connections (default 1)\n",
+          prog);
+  exit(1);
+}
+
+void open_conn(int slot, const char *addr) {
+  struct replay_conn *c = &conns[slot];
+  if (c->fd >= 0) {
+    return;
+  }
+  c->fd = connect_to(addr);
+  if (c->fd < 0) {
+    return;
+  }
+  c->open_idx = nr_open;
+  open_slots[nr_open++] = slot;
+  ++stats.nr_opens;
+}
+
+void close_conn(int slot) {
+  struct replay_conn *c = &conns[slot];
+  close(c->fd);
+  c->fd = -1;
+  c->close_pending = 0;
+  for (; c->count > 0; --c->count) {
+    const unsigned long len = c->pending[c->head].iov_len;
+    stats.bytes_dropped += len;
+    pending_bytes -= len;
+    c->head = (c->head + 1) & (c->cap - 1);
+  }
+  const int moved = open_slots[--nr_open];
+  open_slots[c->open_idx] = moved;
+  conns[moved].open_idx = c->open_idx;
+}
+
+// 把积压的数据块尽量发出去。
+void flush_conn(int slot) {
+  struct replay_conn *c = &conns[slot];
+  while (c->count > 0) {
+    struct iovec iov[SEND_MAX_IOV];
+    int iovcnt = 0;
+    for (; iovcnt < SEND_MAX_IOV && iovcnt < (int)c->count; ++iovcnt) {
+      iov[iovcnt] = c->pending[(c->head + iovcnt) & (c->cap - 1)];
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t sent = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      fprintf(stderr, "send: %s\n", strerror(errno));
+      ++stats.nr_server_closes;
+      close_conn(slot);
+      return;
+    }
+    stats.bytes_sent += sent;
+    pending_bytes -= sent;
+    while (sent > 0) {
+      struct iovec *head = &c->pending[c->head];
+      if ((size_t)sent < head->iov_len) {
+        head->iov_base = (char *)head->iov_base + sent;
+        head->iov_len -= sent;
+        break;
+      }
+      sent -= head->iov_len;
+      c->head = (c->head + 1) & (c->cap - 1);
+      --c->count;
+    }
+  }
+  if (c->close_pending) {
+    ++stats.nr_closes;
+    close_conn(slot);
+  }
+}
+
+void enqueue_data(int slot, const char *data, size_t len) {
+  struct replay_conn *c = &conns[slot];
+  ++stats.nr_chunks;
+  if (c->fd < 0) {
+    stats.bytes_dropped += len;
+    return;
+  }
+  if (c->count == c->cap) {
+    // 放大一倍，把绕回去的那一段接到后面。
+    const unsigned int cap = c->cap ? c->cap * 2 : INITIAL_PENDING_SLOTS;
+    struct iovec *pending = malloc(sizeof(struct iovec) * cap);
+    for (unsigned int i = 0; i < c->count; ++i) {
+      pending[i] = c->pending[(c->head + i) & (c->cap - 1)];
+    }
+    free(c->pending);
+    c->pending = pending;
+    c->head = 0;
+    c->cap = cap;
+  }
+  c->pending[(c->head + c->count) & (c->cap - 1)] =
+      (struct iovec){.iov_base = (void *)data, .iov_len = len};
+  ++c->count;
+  pending_bytes += len;
+  if (c->count == 1) {
+    flush_conn(slot);
+  }
+}
+
+void apply_record(const struct trace_record *rec, int slot, const char *addr) {
+  switch (rec->type) {
+    case TRACE_OPEN:
+      open_conn(slot, addr);
+      break;
+    case TRACE_DATA:
+      enqueue_data(slot, rec->data, rec->len);
+      break;
+    case TRACE_CLOSE:
+      if (conns[slot].fd >= 0) {
+        conns[slot].close_pending = 1;
+        flush_conn(slot);
+      }
+      break;
+  }
+}
+
+// 读掉服务器发回来的数据，返回读到的字节数。
+long drain_conn(int slot) {
+  long total = 0;
+  while (1) {
+    ssize_t got = recv(conns[slot].fd, recv_buf, sizeof(recv_buf),
+                       MSG_DONTWAIT);
+    if (got > 0) {
+      total += got;
+      continue;
+    }
+    if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      ++stats.nr_server_closes;
+      close_conn(slot);
+    }
+    break;
+  }
+  stats.bytes_received += total;
+  return total;
+}
+
+// 等最多 timeout_ns 纳秒，处理打开着的连接上的读写，返回读到的字节数。
+long poll_conns(struct pollfd *pfds, int *slots, long timeout_ns) {
+  const int n = nr_open;
+  for (int i = 0; i < n; ++i) {
+    slots[i] = open_slots[i];
+    pfds[i].fd = conns[slots[i]].fd;
+    pfds[i].events = POLLIN;
+    if (conns[slots[i]].count > 0) {
+      pfds[i].events |= POLLOUT;
+    }
+  }
+  struct timespec ts = {.tv_sec = timeout_ns / 1000000000L,
+                        .tv_nsec = timeout_ns % 1000000000L};
+  if (ppoll(pfds, n, &ts, NULL) < 0) {
+    fprintf(stderr, "poll: %s\n", strerror(errno));
+    exit(1);
+  }
+  long received = 0;
+  for (int i = 0; i < n; ++i) {
+    struct replay_conn *c = &conns[slots[i]];
+    if ((pfds[i].revents & POLLOUT) && c->fd >= 0) {
+      flush_conn(slots[i]);
+    }
+    if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && c->fd >= 0) {
+      received += drain_conn(slots[i]);
+    }
+  }
+  return received;
+}
+
+int main(int argc, char *argv[]) {
+  int fast = 0;
+  double speed = 1.0;
+  int copies = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "fx:k:")) != -1) {
+    switch (opt) {
+      case 'f':
+        fast = 1;
+        break;
+      case 'x':
+        speed = atof(optarg);
+        break;
+      case 'k':
+        copies = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || speed <= 0 || copies <= 0) {
+    usage(argv[0]);
+  }
+  const char *path = argv[optind];
+  const char *addr = argv[optind + 1];
+
+  struct trace_reader reader;
+  if (trace_reader_open(&reader, path) != 0) {
+    exit(1);
+  }
+
+  // 先把 trace 过一遍，知道有多少个连接、多少数据。
+  struct trace_record rec;
+  unsigned long nr_trace_conns = 0, nr_records = 0, trace_bytes = 0;
+  unsigned long duration_ns = 0;
+  int result;
+  while ((result = trace_next(&reader, &rec)) == 1) {
+    if (rec.conn >= nr_trace_conns) {
+      nr_trace_conns = rec.conn + 1;
+    }
+    ++nr_records;
+    trace_bytes += rec.len;
+    duration_ns = rec.ts_ns;
+  }
+  if (result < 0) {
+    // 记录的进程被杀掉时最后一条可能不完整，前面的照样可以重放。
+    fprintf(stderr, "trace: %s is truncated after %lu records\n", path,
+            nr_records);
+  }
+  printf("%-12s %s, %lu connections, %lu records, %.1f MiB over %.3f s\n",
+         "trace", path, nr_trace_conns, nr_records, trace_bytes / 1048576.0,
+         duration_ns / 1e9);
+
+  const int nr_slots = nr_trace_conns * copies;
+  conns = calloc(nr_slots, sizeof(struct replay_conn));
+  open_slots = malloc(sizeof(int) * (nr_slots + 1));
+  struct pollfd *pfds = malloc(sizeof(struct pollfd) * (nr_slots + 1));
+  int *poll_slots = malloc(sizeof(int) * (nr_slots + 1));
+  for (int i = 0; i < nr_slots; ++i) {
+    conns[i].fd = -1;
+  }
+  lathist_reset(&stats.lag);
+
+  trace_rewind(&reader);
+  unsigned long records_left = nr_records;
+  int have_rec = records_left > 0 && trace_next(&reader, &rec) == 1;
+  const long t0 = now_ns();
+  while (have_rec || pending_bytes > 0) {
+    // 这一批的额度用完了、还有到期的记录等着时，poll 只看一眼，不等。
+    long wait_ns = 0;
+    for (int i = 0; i < RECORDS_PER_POLL && have_rec &&
+                    pending_bytes < MAX_PENDING_BYTES;
+         ++i) {
+      if (!fast) {
+        const long now = now_ns();
+        const long due = t0 + (long)(rec.ts_ns / speed);
+        if (due > now) {
+          wait_ns = due - now;
+          break;
+        }
+        lathist_record(&stats.lag, now - due);
+      }
+      for (int k = 0; k < copies; ++k) {
+        apply_record(&rec, k * nr_trace_conns + rec.conn, addr);
+      }
+      have_rec = --records_left > 0 && trace_next(&reader, &rec) == 1;
+    }
+    if (!have_rec || pending_bytes >= MAX_PENDING_BYTES ||
+        wait_ns > MAX_POLL_WAIT_NS) {
+      wait_ns = MAX_POLL_WAIT_NS;
+    }
+    poll_conns(pfds, poll_slots, wait_ns);
+  }
+  const double secs = (now_ns() - t0) / 1e9;
+
+  // 服务器可能还在往回发，读到没有数据了再关掉所有连接。
+  while (nr_open > 0 &&
+         poll_conns(pfds, poll_slots, DRAIN_IDLE_MS * 1000000L) > 0) {
+  }
+  while (nr_open > 0) {
+    close_conn(open_slots[0]);
+  }
+
+  if (fast) {
+    printf("%-12s %s, as fast as possible, %d copies\n", "replay", addr,
+           copies);
+  } else {
+    printf("%-12s %s, recorded pace x%.2f, %d copies\n", "replay", addr,
+           speed, copies);
+  }
+  printf("%-12s %.1f MiB in %.3f s, %.1f MiB/s, %.0f chunks/s\n", "sent",
+         stats.bytes_sent / 1048576.0, secs,
+         stats.bytes_sent / secs / 1048576.0, stats.nr_chunks / secs);
+  printf("%-12s %.1f MiB, %.1f MiB/s\n", "received",
+         stats.bytes_received / 1048576.0,
+         stats.bytes_received / secs / 1048576.0);
+  printf("%-12s %lu opens, %lu closes, %lu closed by server, %lu bytes "
+         "dropped\n",
+         "connections", stats.nr_opens, stats.nr_closes,
+         stats.nr_server_closes, stats.bytes_dropped);
+  if (!fast && stats.lag.count > 0) {
+    printf("%-12s p50 %.1f us, p99 %.1f us, max %.1f us behind schedule\n",
+           "lag", lathist_percentile(&stats.lag, 50) / 1000.0,
+           lathist_percentile(&stats.lag, 99) / 1000.0,
+           stats.lag.max_ns / 1000.0);
+  }
+
+  trace_reader_close(&reader);
+  return stats.bytes_dropped == 0 ? 0 : 1;
+}
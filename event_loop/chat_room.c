@@ -1,34 +1,111 @@
 #include <error.h>
 #include <event2/event.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <memory.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "alloc_count.h"
+#include "busypoll.h"
+#include "bytes.h"
+#include "dqueue.h"
+#include "lathist.h"
 #include "llist.h"
+#include "membudget.h"
+#include "readsched.h"
+#include "roomlog.h"
 #include "ringbuf.h"
+#include "timerwheel.h"
+#include "trace.h"
 #include "util.h"
 
-#define MAX_READ_BUF ((0x1UL) << 10)
+// 每个连接每次 read 的大小在 [MIN_READ_SIZE, MAX_READ_SIZE] 之间自适应：读满了就
+// 翻倍，读到的不足四分之一就减半。数据直接读进内存池的数据块（见 bytes.h），
+// 每个连接的 read_buf 里最多积压 MAX_READ_SIZE 字节还没有 collect 的数据。
+#define MIN_READ_SIZE ((0x1UL) << 10)
+#define MAX_READ_SIZE (((0x1UL) << 10) * 64)
 #define MAX_WRITE_BUF_PER_CONN (((0x1UL) << 20) * 32)
-#define MAX_SERVER_WRITE_BUF (((0x1UL) << 10) * 512)
-
-char io_stage_buf[MAX_READ_BUF];
-
-#define MAX_LISTEN_BACKLOG 20
+// 切片队列（read_buf、write_buf）一开始能放这么多个切片，按需扩容，内存紧张时
+// 空闲的 write_buf 会被缩回这么大。
+#define INITIAL_QUEUE_SLOTS 16
+
+// 一次 writev/sendmsg 最多携带的 iovec 个数。
+#define EGRESS_MAX_IOV IOV_MAX
+
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+// 最多同时监听几个地址（TCP 端口、UNIX domain socket），见 util.h。
+#define MAX_LISTENERS 8
+// 每次 listen socket 可读时最多接受多少个连接，剩下的留到下一轮事件循环，免得
+// 连接风暴期间已有的连接一直得不到服务。
+#define DEFAULT_ACCEPT_BUDGET 64
+// fd 耗尽、连预留的 fd 也没有了的时候，停止接受连接多久。
+#define ACCEPT_PAUSE_MS 1000
+#define DEFAULT_READ_QUANTUM MAX_READ_SIZE
+#define DEFAULT_MAX_READS_PER_TURN 16
+
+#define DEFAULT_BATCH_MAX_BYTES (((0x1UL) << 10) * 64)
+#define DEFAULT_METRICS_INTERVAL_SEC 10
+// 高低水位默认是每个连接积压上限（见 write_limit）的 3/4 和 1/4。
+#define DEFAULT_HIGH_WATERMARK(limit) ((limit) / 4 * 3)
+#define DEFAULT_LOW_WATERMARK(limit) ((limit) / 4)
+#define DEFAULT_MEMORY_BUDGET (((0x1UL) << 30) * 1)
+#define GOVERNOR_INTERVAL_SEC 1
+#define DEFAULT_IDLE_TIMEOUT_SEC 300
+#define DEFAULT_WRITE_STALL_TIMEOUT_SEC 30
+// write_buf 被写空以后再空闲这么久就缩回 INITIAL_QUEUE_SLOTS。
+#define WRITE_BUF_SHRINK_DELAY_MS 5000
+#define DEFAULT_CATCHUP_MSGS 100
+#define DEFAULT_CATCHUP_BYTES (((0x1UL) << 20) * 1)
+#define DEFAULT_LOG_SEGMENT_SIZE (((0x1UL) << 20) * 64)
+#define DEFAULT_LOG_RETAIN_BYTES (((0x1UL) << 30) * 1)
+#define DEFAULT_LOG_RETAIN_SEC (3600 * 24)
+#define LOG_RETAIN_INTERVAL_SEC 10
 
 struct server_ctx;
 struct conn_ctx {
   int fd;
-  ringbuf *read_buf;
-  ringbuf *write_buf;
+  // 收到的还没有 collect 的数据、还没有发出去的数据，都是内存池里的数据块的切片，
+  // 广播只是给每个连接的 write_buf 追加切片的引用，不复制数据。
+  struct bytesq read_buf;
+  struct bytesq write_buf;
   struct server_ctx *srv;
+
+  // 两个事件对象都在连接建立时创建一次（EV_PERSIST | EV_ET），之后只在状态
+  // 真正发生变化时才 event_add / event_del：read_event 一直挂着；
+  // write_event 在 write_buf 由空变为非空时 add（write_armed = 1），被写空时
+  // del（write_armed = 0）。
   struct event *write_event;
   struct event *read_event;
+  int write_armed;
+
+  // 因为是边沿触发，read_buf 满了以后我们不再读，但内核里可能还有数据、也不会
+  // 再来一次通知，所以记下来，等 read_buf 腾出空间后主动激活一次 read_event。
+  int read_paused;
+
+  // 下一次 read 的大小，见 MIN_READ_SIZE。
+  int read_size;
+  // 对端已经关闭了写方向（EV_CLOSED），这之后读到的数据不足也要一直读到 EOF。
+  int peer_closed;
+
+  // read_buf 收到了新数据的连接挂在 server 的 read_dirty_q 上，write_buf
+  // 有新的待发送数据的连接挂在 server 的 write_dirty_q 上，server_run
+  // 每一轮只处理这两个队列里的连接，而不是遍历所有连接。
+  struct dq_node read_dirty;
+  struct dq_node write_dirty;
+
+  // 读取调度的状态，见 readsched.h。
+  struct rs_conn sched;
 
   // never read from a file that is not readable
   // also never write to a file that is not writable
@@ -36,6 +113,40 @@ struct conn_ctx {
   // stdout do now, at least you can never get input from stdout!
   int readable;
   int writable;
+  int is_socket;
+
+  // 背压：write_buf 中积压的数据达到 high watermark 后，这个连接被认为是一个落后的
+  // 消费者（saturated），降到 low watermark 以下才恢复。
+  int saturated;
+
+  // 按消息（以 '\n' 结尾）边界丢弃数据时使用的分帧状态，见 plan_framed_delivery。
+  int frame_state;
+
+  // 已经决定断开这个连接，等它的 read_event 被激活时再真正释放。
+  int closing;
+
+  // 内存紧张时，最近一个周期内读入字节数最多的生产者会被限流（暂停读取），挂在
+  // server 的 throttled_q 上，内存压力解除后恢复。
+  unsigned long ingest_bytes;
+  int read_throttled;
+  struct dq_node throttled;
+
+  // 挂在 server 的时间轮上的定时器（时间单位是毫秒）。idle_timer 和
+  // write_stall_timer 到期时并不一定真的超时了：收发数据时只更新 last_active 和
+  // last_write_progress，不动定时器，到期时再根据它们决定是断开连接还是重新安排。
+  struct tw_timer idle_timer;
+  struct tw_timer write_stall_timer;
+  struct tw_timer shrink_timer;
+  unsigned long last_active;
+  unsigned long last_write_progress;
+
+  // 在 trace 里的连接编号（见 trace.h），没有在记录 trace 时是 -1。
+  long trace_conn;
+
+  // 还没发给这个新加入的连接的历史：房间日志里的 [catchup_off, catchup_end)，
+  // 发完之前不发 write_buf，见 on_ready_to_write。
+  unsigned long catchup_off;
+  unsigned long catchup_end;
 
   // for stdin, after_freed means server shutdown,
   // for ordinary network socket, after_freed means simply close socket.
@@ -52,22 +163,218 @@ void after_network_socket_close(int fd) {
   fprintf(stderr, "Socket fd %d is closed.\n", fd);
 }
 
+// 落后的消费者（write_buf 积压达到 high watermark 的连接）的处理策略。
+enum laggard_policy {
+  // 不再给它发送新的消息，直到它的积压降到 low watermark 以下，丢弃以完整的消息为单位。
+  LAGGARD_DROP,
+  // 直接断开连接。
+  LAGGARD_DISCONNECT,
+  // 暂停整个房间：停止从发布者读取数据，直到所有消费者的积压都降到 low watermark 以下。
+  LAGGARD_BLOCK,
+};
+
+enum frame_state {
+  FRAME_AT_BOUNDARY,
+  FRAME_MID_DELIVERED,
+  FRAME_MID_DROPPED,
+};
+
+// 命令行参数，见 usage()。
+struct server_config {
+  // 监听的地址，写法见 util.h。
+  char *listen_addrs[MAX_LISTENERS];
+  int nr_listen_addrs;
+
+  // 广播批处理窗口：收到数据后最多等待 batch_window_us 微秒、或者攒够
+  // batch_max_bytes 字节（先到者为准），再把这期间收到的所有数据合并成一次广播。
+  // batch_window_us 为 0 表示不攒批，每轮事件循环都立即广播。
+  long batch_window_us;
+  int batch_max_bytes;
+
+  // 每隔多少秒向 stderr 输出一次 metrics，0 表示不输出。
+  int metrics_interval_sec;
+
+  int high_watermark;
+  int low_watermark;
+  enum laggard_policy laggard_policy;
+
+  // 所有缓冲区加起来的内存预算（字节数）。
+  long memory_budget;
+
+  // 连接多少秒没有收发任何数据就断开，write_buf 中有数据却多少秒都发不出去就断开，
+  // 0 表示不限。只对网络连接生效。
+  int idle_timeout_sec;
+  int write_stall_timeout_sec;
+
+  int listen_backlog;
+  int accept_budget;
+
+  // 每个连接每一轮事件循环最多读多少字节、最多调用几次 read。
+  int read_quantum;
+  int max_reads_per_turn;
+
+  // 每一轮开始读之前先用 ioctl(FIONREAD) 问一下内核里有多少数据，按它来决定
+  // read 的大小。
+  int use_fionread;
+
+  // 忙轮询窗口的上限（微秒），0 表示不忙轮询，见 busypoll.h。
+  int busy_poll_us;
+  // 给网络连接设置的 SO_BUSY_POLL（微秒），0 表示不设置。
+  int socket_busy_poll_us;
+
+  // 内存池的 arena（见 bytes.h）怎么分配，见 ringbuf_set_large_alloc。
+  // large_alloc_size 为 0 表示全部用 malloc。
+  int large_alloc_size;
+  enum ringbuf_prefault prefault;
+
+  // 把网络连接上的流量记录到这个 trace 文件（见 trace.h），NULL 表示不记录。
+  const char *capture_path;
+
+  // 房间日志（见 roomlog.h），room_log.dir 为 NULL 表示不记录。新加入的连接先
+  // 收到最后 catchup_msgs 条、最多 catchup_bytes 字节的历史。
+  struct roomlog_config room_log;
+  long catchup_msgs;
+  long catchup_bytes;
+};
+
+struct server_metrics {
+  unsigned long nr_wakeups;
+  unsigned long nr_batches;
+  unsigned long nr_batched_chunks;
+  unsigned long nr_batched_bytes;
+  unsigned long max_batch_chunks;
+  unsigned long max_batch_bytes;
+  unsigned long nr_dropped_bytes;
+  unsigned long nr_laggard_disconnects;
+  unsigned long nr_ingest_pauses;
+  unsigned long nr_buffer_shrinks;
+  unsigned long nr_producer_throttles;
+  unsigned long nr_refused_conns;
+  unsigned long nr_idle_reaps;
+  unsigned long nr_write_stall_reaps;
+  unsigned long nr_accepts;
+  unsigned long nr_shed_conns;
+  unsigned long nr_accept_pauses;
+  unsigned long nr_reads;
+  unsigned long nr_read_bytes;
+  unsigned long nr_catchups;
+  unsigned long nr_catchup_bytes;
+};
+
+// 一个 listen socket。不管是 TCP 还是 UNIX domain socket，接受下来的连接都走同样
+// 的处理路径。
+struct listener {
+  struct server_ctx *srv;
+  const char *addr;
+  int fd;
+  struct event *accept_event;
+};
+
 struct server_ctx {
+  struct server_config *cfg;
   llist_t **all_conns;
+  int num_conns;
+  struct dqueue read_dirty_q;
+  struct dqueue write_dirty_q;
   struct event_base *evb;
-  int server_socket;
-  ringbuf *write_buf;
-  struct event *write_event;
+  struct listener listeners[MAX_LISTENERS];
+  int nr_listeners;
+  // 攒着的这一批要广播的数据。
+  struct bytesq write_buf;
+
+  // 可写的连接（消费者）的个数，以及其中 saturated 的个数。
+  int nr_consumers;
+  int nr_saturated;
+  int ingest_paused;
+  // LAGGARD_BLOCK 策略下这一批有消费者放不下，留着没有广播。
+  int batch_held;
+
+  // 当前这一批攒了多少个 chunk（每个连接每 collect 一次算一个）。
+  int batch_chunks;
+  struct event *batch_timer;
+  int batch_timer_armed;
+  int batch_deadline_passed;
+
+  struct server_metrics metrics;
+  struct event *metrics_timer;
+
+  struct dqueue throttled_q;
+  struct event *governor_timer;
+  // SIGINT、SIGTERM。
+  struct event *stop_events[2];
+
+  // 连接级别的超时都挂在这个时间轮上，server_run 每一轮推进它一次，wheel_timer
+  // 负责在下一个需要推进的时刻唤醒事件循环。
+  struct timer_wheel wheel;
+  struct event *wheel_timer;
+  unsigned long wheel_deadline;
+
+  // 预留的一个 fd，fd 用完时用来拒绝排队的连接，见 util.h 的 drop_pending_conn。
+  int reserve_fd;
+  struct tw_timer accept_resume_timer;
+
+  struct read_sched read_sched;
+
+  struct busy_poll busy_poll;
+  // 处理过的 I/O 事件数，忙轮询靠它判断这一次有没有等到事件。
+  unsigned long nr_dispatches;
+  // 数据被内核收到到被读走之间的时间（只有 TCP 连接有），每次输出 metrics 后清零。
+  struct lathist wakeup_lat;
+
+  // 正在记录的 trace，没有在记录时是 NULL。
+  struct trace_writer *trace;
+
+  // 房间日志，没有开启时是 NULL。
+  struct roomlog *room_log;
+  struct event *room_log_timer;
 };
 
+// 单调时钟，毫秒。
+unsigned long monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+void conn_ctx_free(struct conn_ctx *c);
+void on_idle_timer(struct tw_timer *t, void *arg);
+void on_write_stall_timer(struct tw_timer *t, void *arg);
+void on_shrink_timer(struct tw_timer *t, void *arg);
+
 struct conn_ctx *conn_ctx_create(int fd) {
+  if (bytes_under_pressure()) {
+    // 内存池已经快用完了，新连接读进来的数据也没有地方放。
+    return NULL;
+  }
   struct conn_ctx *c = malloc(sizeof(struct conn_ctx));
   c->fd = fd;
-  c->write_event =
-      NULL;  // this is intended, write_event are register on-demand.
-  c->read_buf = ringbuf_create(MAX_READ_BUF);
-  c->write_buf = ringbuf_create(MAX_WRITE_BUF_PER_CONN);
+  c->write_event = NULL;
+  c->read_event = NULL;
+  c->write_armed = 0;
+  c->read_paused = 0;
+  c->read_size = MIN_READ_SIZE;
+  c->peer_closed = 0;
+  c->is_socket = 0;
+  c->saturated = 0;
+  c->frame_state = FRAME_AT_BOUNDARY;
+  c->closing = 0;
+  c->ingest_bytes = 0;
+  c->read_throttled = 0;
+  dq_node_init(&c->read_dirty);
+  dq_node_init(&c->write_dirty);
+  dq_node_init(&c->throttled);
+  rs_conn_init(&c->sched);
+  tw_timer_init(&c->idle_timer, on_idle_timer, c);
+  tw_timer_init(&c->write_stall_timer, on_write_stall_timer, c);
+  tw_timer_init(&c->shrink_timer, on_shrink_timer, c);
+  c->last_active = 0;
+  c->last_write_progress = 0;
+  c->trace_conn = -1;
+  c->catchup_off = 0;
+  c->catchup_end = 0;
   c->after_freed = NULL;
+  bytesq_init(&c->read_buf, INITIAL_QUEUE_SLOTS);
+  bytesq_init(&c->write_buf, INITIAL_QUEUE_SLOTS);
 
   return c;
 }
@@ -75,14 +382,8 @@ struct conn_ctx *conn_ctx_create(int fd) {
 void conn_ctx_free(struct conn_ctx *c) {
   void *after_free_cb = c->after_freed;
   int fd = c->fd;
-  if (c->read_buf != NULL) {
-    ringbuf_free(c->read_buf);
-    c->read_buf = NULL;
-  }
-  if (c->write_buf != NULL) {
-    ringbuf_free(c->write_buf);
-    c->write_buf = NULL;
-  }
+  bytesq_destroy(&c->read_buf);
+  bytesq_destroy(&c->write_buf);
   free(c);
   if (after_free_cb != NULL) {
     void (*cb)(int fd) = after_free_cb;
@@ -112,31 +413,132 @@ void on_file_eof(struct conn_ctx *c_ctx) {
     c_ctx->write_event = NULL;
   }
 
+  struct server_ctx *srv = c_ctx->srv;
+  if (c_ctx->trace_conn >= 0) {
+    trace_close(srv->trace, c_ctx->trace_conn);
+  }
+  dq_remove(&srv->read_dirty_q, &c_ctx->read_dirty);
+  dq_remove(&srv->write_dirty_q, &c_ctx->write_dirty);
+  dq_remove(&srv->throttled_q, &c_ctx->throttled);
+  rs_remove(&srv->read_sched, &c_ctx->sched);
+  tw_cancel(&srv->wheel, &c_ctx->idle_timer);
+  tw_cancel(&srv->wheel, &c_ctx->write_stall_timer);
+  tw_cancel(&srv->wheel, &c_ctx->shrink_timer);
+  --srv->num_conns;
+  if (c_ctx->writable) {
+    --srv->nr_consumers;
+  }
+  if (c_ctx->saturated) {
+    --srv->nr_saturated;
+  }
+
   int delete_all = 0;
   list_elem_find_and_remove(c_ctx->srv->all_conns, c_ctx,
                             conn_ctx_list_elem_finder, NULL,
                             conn_ctx_list_elem_deleter, delete_all);
 }
 
+// 根据这一次 read 要了 asked 字节、读到了 got 字节来调整连接的 read 大小：
+// 读满了说明还有更多数据，下次读大一点；读到的很少说明是小消息，下次读小一点。
+// 所有连接读进同一个正在填充的数据块，read 的大小只决定一次最多读多少，小消息
+// 只占它实际的大小。
+void adapt_read_size(struct conn_ctx *c_ctx, int asked, int got) {
+  if (got == asked && asked >= c_ctx->read_size &&
+      c_ctx->read_size < (int)MAX_READ_SIZE) {
+    c_ctx->read_size *= 2;
+  } else if (got < c_ctx->read_size / 4 &&
+             c_ctx->read_size > (int)MIN_READ_SIZE) {
+    c_ctx->read_size /= 2;
+  }
+}
+
+// 内存池超出了预算，一个数据块也拿不到：和 on_governor_tick 限流一样暂停读取，
+// 内存压力解除后由 unthrottle_producers 恢复。
+void starve_reader(struct conn_ctx *c_ctx) {
+  struct server_ctx *srv = c_ctx->srv;
+  fprintf(stderr, "Out of buffer memory, pausing reads from fd %d.\n",
+          c_ctx->fd);
+  c_ctx->read_paused = 1;
+  if (!c_ctx->read_throttled) {
+    c_ctx->read_throttled = 1;
+    dq_push_back(&srv->throttled_q, &c_ctx->throttled);
+    ++srv->metrics.nr_producer_throttles;
+  }
+}
+
 void on_ready_to_read(int fd, short flags, void *closure) {
   struct conn_ctx *c_ctx = closure;
 
+  if (c_ctx->closing) {
+    fprintf(stderr, "Closing fd %d.\n", fd);
+    on_file_eof(c_ctx);
+    return;
+  }
+
   fprintf(stderr, "fd %d is now ready to read.\n", fd);
-  char buf[MAX_READ_BUF];
+  if (flags & EV_CLOSED) {
+    c_ctx->peer_closed = 1;
+  }
+
+  struct server_ctx *srv = c_ctx->srv;
+  ++srv->nr_dispatches;
+  struct read_sched *rs = &srv->read_sched;
+  long allowance = rs_begin(rs, &c_ctx->sched);
+  int pending = -1;
+  if (srv->cfg->use_fionread && ioctl(fd, FIONREAD, &pending) != 0) {
+    pending = -1;
+  }
+
+  struct iovec iov[2];
+  int first_read = 1;
   while (1) {
-    int max_read = sizeof(buf);
-    const int remain_cap = ringbuf_get_remaining_capacity(c_ctx->read_buf);
+    int want = c_ctx->read_size;
+    if (pending > want) {
+      want = pending < (int)MAX_READ_SIZE ? pending : (int)MAX_READ_SIZE;
+    }
+    const int remain_cap = MAX_READ_SIZE - bytesq_get_size(&c_ctx->read_buf);
+
+    if (remain_cap <= 0 || c_ctx->read_throttled) {
+      c_ctx->read_paused = 1;
+      rs_idle(rs, &c_ctx->sched);
+      break;
+    }
 
-    if (remain_cap <= 0) {
-      event_del(c_ctx->read_event);
+    if (rs_exhausted(rs, &c_ctx->sched)) {
+      // 这一轮的额度用完了，让别的连接先读，下一轮再接着读（见 server_run）。
+      rs_yield(rs, &c_ctx->sched);
       break;
     }
 
+    int max_read = want;
     if (remain_cap < max_read) {
       max_read = remain_cap;
     }
+    if (allowance < max_read) {
+      max_read = allowance;
+    }
 
-    int result = read(fd, buf, max_read);
+    // 直接读进内存池的数据块，读到的数据以切片的形式挂到 read_buf 上。
+    int iovcnt = bytes_get_free_iovecs(max_read, iov);
+    if (iovcnt == 0) {
+      starve_reader(c_ctx);
+      rs_idle(rs, &c_ctx->sched);
+      break;
+    }
+    max_read = iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0);
+    int result;
+    if (first_read && c_ctx->is_socket) {
+      // 每一轮的第一次读顺便取一下内核收到数据的时间，算出唤醒延迟。
+      long latency_ns;
+      result = readv_rx_latency(fd, iov, iovcnt, &latency_ns);
+      if (latency_ns >= 0) {
+        lathist_record(&srv->wakeup_lat, latency_ns);
+      }
+    } else {
+      result = readv(fd, iov, iovcnt);
+    }
+    first_read = 0;
+    ++srv->metrics.nr_reads;
     if (result == 0) {
       fprintf(stderr, "Got EOF from fd %d\n", fd);
       on_file_eof(c_ctx);
@@ -150,40 +552,162 @@ void on_ready_to_read(int fd, short flags, void *closure) {
               "fd %d is drained (for now), we would come here later (when it "
               "goes up again).\n",
               fd);
+      rs_idle(rs, &c_ctx->sched);
       break;
     } else {
       fprintf(stderr, "Got %d bytes from fd %d.\n", result, fd);
-      int exceeded = ringbuf_send_chunk(c_ctx->read_buf, buf, result);
-      if (exceeded > 0) {
-        fprintf(stderr,
-                "Warning: ringbuf 0x%016lx is fullfilled, and this is "
-                "unexpected, %d bytes of data that is "
-                "written in "
-                "earlist has been overwritten.\n",
-                (unsigned long)(c_ctx->read_buf), exceeded);
+      if (c_ctx->trace_conn >= 0) {
+        trace_data(srv->trace, c_ctx->trace_conn, iov, iovcnt, result);
+      }
+      struct bytes slices[2];
+      const int nr_slices = bytes_commit(result, slices);
+      for (int i = 0; i < nr_slices; ++i) {
+        bytesq_push(&c_ctx->read_buf, &slices[i]);
+      }
+      srv->metrics.nr_read_bytes += result;
+      c_ctx->ingest_bytes += result;
+      allowance = rs_charge(&c_ctx->sched, result);
+      c_ctx->last_active = monotonic_ms();
+      dq_push_back(&srv->read_dirty_q, &c_ctx->read_dirty);
+      if (pending >= 0) {
+        pending = pending > result ? pending - result : 0;
+      }
+
+      adapt_read_size(c_ctx, max_read, result);
+      if (result < max_read && c_ctx->is_socket && !c_ctx->peer_closed) {
+        // 读到的比要的少，socket 的接收队列已经空了，省掉一次注定返回 EAGAIN
+        // 的 read：之后再有数据到来（包括 FIN，见 EV_CLOSED）都会触发新的边沿。
+        rs_idle(rs, &c_ctx->sched);
+        break;
       }
     }
   }
 }
 
+void arm_write_event(struct conn_ctx *c_ctx) {
+  if (c_ctx->write_armed) {
+    return;
+  }
+
+  if (event_add(c_ctx->write_event, NULL) != 0) {
+    fprintf(stderr, "Failed to register write event to fd %d\n", c_ctx->fd);
+    exit(1);
+  }
+  c_ctx->write_armed = 1;
+
+  struct server_ctx *srv = c_ctx->srv;
+  tw_cancel(&srv->wheel, &c_ctx->shrink_timer);
+  if (c_ctx->is_socket && srv->cfg->write_stall_timeout_sec > 0) {
+    c_ctx->last_write_progress = monotonic_ms();
+    tw_schedule(&srv->wheel, &c_ctx->write_stall_timer,
+                c_ctx->last_write_progress +
+                    srv->cfg->write_stall_timeout_sec * 1000UL);
+  }
+}
+
+void disarm_write_event(struct conn_ctx *c_ctx) {
+  if (!c_ctx->write_armed) {
+    return;
+  }
+
+  event_del(c_ctx->write_event);
+  c_ctx->write_armed = 0;
+  tw_cancel(&c_ctx->srv->wheel, &c_ctx->write_stall_timer);
+}
+
+// 用一次 sendmsg（socket）或者 writev（其它文件）把 iov 描述的数据写到连接上，
+// 返回写出的字节数，失败时返回 -errno。more 表示确定还有数据紧随其后，这时对
+// socket 加上 MSG_MORE，让内核先攒着，不要急着发出一个不满的 TCP 段。
+long conn_sendv(struct conn_ctx *c_ctx, struct iovec *iov, int iovcnt,
+                int more) {
+  long result;
+  if (c_ctx->is_socket) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    if (more) {
+      flags |= MSG_MORE;
+    }
+    result = sendmsg(c_ctx->fd, &msg, flags);
+  } else {
+    result = writev(c_ctx->fd, iov, iovcnt);
+  }
+  return result < 0 ? -errno : result;
+}
+
+// server 的 read_dirty_q 不为空说明下一轮还有要广播的数据。但读取被暂停或者
+// 批次被扣住时，下一轮不会马上有数据跟上来，这时用 MSG_MORE 只会让已经写下去的
+// 数据在内核里多等一会儿。
+int more_output_follows(struct server_ctx *srv) {
+  return !dq_is_empty(&srv->read_dirty_q) && !srv->ingest_paused &&
+         !srv->batch_held;
+}
+
+// 在 write_buf 的积压发生变化后更新连接的 saturated 状态。
+void update_saturation(struct conn_ctx *c_ctx) {
+  struct server_ctx *srv = c_ctx->srv;
+  const int backlog = bytesq_get_size(&c_ctx->write_buf);
+  if (!c_ctx->saturated && backlog >= srv->cfg->high_watermark) {
+    fprintf(stderr, "fd %d is saturated (%d bytes pending).\n", c_ctx->fd,
+            backlog);
+    c_ctx->saturated = 1;
+    ++srv->nr_saturated;
+  } else if (c_ctx->saturated && backlog <= srv->cfg->low_watermark) {
+    fprintf(stderr, "fd %d is no longer saturated.\n", c_ctx->fd);
+    c_ctx->saturated = 0;
+    --srv->nr_saturated;
+  }
+}
+
 void on_ready_to_write(int fd, short flags, void *closure) {
   fprintf(stderr, "fd %d is now ready to write.\n", fd);
   struct conn_ctx *c_ctx = closure;
+  ++c_ctx->srv->nr_dispatches;
+  struct iovec iov[EGRESS_MAX_IOV];
+  const int more = more_output_follows(c_ctx->srv);
   while (1) {
-    if (ringbuf_is_empty(c_ctx->write_buf)) {
+    if (c_ctx->catchup_off < c_ctx->catchup_end) {
+      // 先把加入之前的历史直接从房间日志 sendfile 出去，之后才轮到 write_buf
+      // 里的实时数据。
+      long result = roomlog_sendfile(c_ctx->srv->room_log, fd,
+                                     &c_ctx->catchup_off, c_ctx->catchup_end);
+      if (result > 0) {
+        c_ctx->last_active = c_ctx->last_write_progress = monotonic_ms();
+        c_ctx->srv->metrics.nr_catchup_bytes += result;
+        continue;
+      } else if (result == -EAGAIN) {
+        break;
+      } else if (result < 0) {
+        fprintf(stderr, "sendfile on fd %d: %s, closing it.\n", fd,
+                strerror(-result));
+        on_file_eof(c_ctx);
+        break;
+      }
+    }
+
+    if (bytesq_is_empty(&c_ctx->write_buf)) {
       fprintf(
           stderr,
           "write_buf of fd %d is drained, removing its write interest now.\n",
           fd);
-      event_del(c_ctx->write_event);
+      disarm_write_event(c_ctx);
+      if (bytes_under_pressure() &&
+          bytesq_shrink(&c_ctx->write_buf, INITIAL_QUEUE_SLOTS) == 0) {
+        ++c_ctx->srv->metrics.nr_buffer_shrinks;
+      } else if (c_ctx->write_buf.capacity > INITIAL_QUEUE_SLOTS) {
+        tw_schedule(&c_ctx->srv->wheel, &c_ctx->shrink_timer,
+                    monotonic_ms() + WRITE_BUF_SHRINK_DELAY_MS);
+      }
       break;
     }
 
-    char buf[MAX_READ_BUF];
-    int chunk_size = ringbuf_receive_chunk(buf, sizeof(buf), c_ctx->write_buf);
-    fprintf(stderr, "Got %d bytes chunk from the ring buffer.\n", chunk_size);
-
-    int result = write(fd, buf, chunk_size);
+    // 一次性把 write_buf 中所有待发送的切片（最多 EGRESS_MAX_IOV 个）交给内核。
+    int iovcnt =
+        bytesq_get_iovecs(&c_ctx->write_buf, 0,
+                          bytesq_get_size(&c_ctx->write_buf), iov, EGRESS_MAX_IOV);
+    long result = conn_sendv(c_ctx, iov, iovcnt, more);
     if (result == 0) {
       fprintf(stderr,
               "Got EOF from fd %d, this means the file (or network socket) "
@@ -192,9 +716,15 @@ void on_ready_to_write(int fd, short flags, void *closure) {
       on_file_eof(c_ctx);
       break;
     } else if (result < 0) {
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        fprintf(stderr, "write: %s\n", strerror(errno));
-        exit(1);
+      if (result != -EAGAIN && result != -EWOULDBLOCK) {
+        if (!c_ctx->is_socket) {
+          fprintf(stderr, "write: %s\n", strerror(-result));
+          exit(1);
+        }
+        fprintf(stderr, "sendmsg on fd %d: %s, closing it.\n", fd,
+                strerror(-result));
+        on_file_eof(c_ctx);
+        break;
       }
       fprintf(stderr,
               "fd %d is busy for now, we would come here later (when it "
@@ -202,36 +732,48 @@ void on_ready_to_write(int fd, short flags, void *closure) {
               fd);
       break;  // return to event loop
     } else {
-      fprintf(stderr, "Emitted %d bytes to fd %d.\n", result, fd);
-      if (result < chunk_size) {
-        // need to insert them back to the ringbuf
-        fprintf(stderr, "Returning %d bytes chunk to the ring buffer.\n",
-                chunk_size - result);
-        ringbuf_return_chunk(c_ctx->write_buf, &buf[result],
-                             chunk_size - result);
-      }
+      fprintf(stderr, "Emitted %ld bytes to fd %d.\n", result, fd);
+      c_ctx->last_active = c_ctx->last_write_progress = monotonic_ms();
+      bytesq_consume(&c_ctx->write_buf, result);
+      update_saturation(c_ctx);
     }
   }
 }
 
-void register_read_interest(struct server_ctx *this, int fd,
-                            void (*after_freed)(int), int readable,
-                            int writable) {
+void create_write_event(struct conn_ctx *c_ctx) {
+  c_ctx->write_event =
+      event_new(c_ctx->srv->evb, c_ctx->fd, EV_WRITE | EV_PERSIST | EV_ET,
+                on_ready_to_write, c_ctx);
+  if (c_ctx->write_event == NULL) {
+    fprintf(stderr, "Failed to create event object for fd %d\n", c_ctx->fd);
+    exit(1);
+  }
+}
+
+struct conn_ctx *register_read_interest(struct server_ctx *this, int fd,
+                                        void (*after_freed)(int), int readable,
+                                        int writable) {
   struct event_base *evb = this->evb;
-  set_io_non_block(fd);
   struct conn_ctx *c_ctx = conn_ctx_create(fd);
+  if (c_ctx == NULL) {
+    return NULL;
+  }
   c_ctx->srv = this;
   c_ctx->after_freed = after_freed;
   c_ctx->readable = readable;
   c_ctx->writable = writable;
 
   struct event *ev =
-      event_new(evb, fd, EV_READ | EV_PERSIST, on_ready_to_read, c_ctx);
+      event_new(evb, fd, EV_READ | EV_CLOSED | EV_PERSIST | EV_ET,
+                on_ready_to_read, c_ctx);
   if (ev == NULL) {
     fprintf(stderr, "Failed to create event object for fd %d\n", fd);
     exit(1);
   }
   c_ctx->read_event = ev;
+  if (writable) {
+    create_write_event(c_ctx);
+  }
 
   if (event_add(ev, NULL) != 0) {
     fprintf(stderr, "Failed to register read event to fd %d\n", fd);
@@ -239,52 +781,184 @@ void register_read_interest(struct server_ctx *this, int fd,
   }
 
   *this->all_conns = list_insert_payload(*this->all_conns, c_ctx);
+  ++this->num_conns;
+  if (writable) {
+    ++this->nr_consumers;
+  }
   fprintf(stderr, "Registered read interest for fd %d\n", fd);
+  return c_ctx;
 }
 
 void register_stdin_read_interest(struct server_ctx *srv) {
-  register_read_interest(srv, STDIN_FILENO, after_stdin_close, 1, 0);
+  set_io_non_block(STDIN_FILENO);
+  if (register_read_interest(srv, STDIN_FILENO, after_stdin_close, 1, 0) ==
+      NULL) {
+    fprintf(stderr, "Memory budget is too small for stdin.\n");
+    exit(1);
+  }
+}
+
+// 和 stdin 关闭一样直接 exit，让 atexit 里的清理（删掉 socket 文件、写出 trace）
+// 有机会执行。信号由 libevent 转成事件，在事件循环里处理，不在信号处理函数里
+// 调用 exit。
+void on_stop_signal(evutil_socket_t sig, short flags, void *closure) {
+  fprintf(stderr, "Got signal %d, bye!\n", (int)sig);
+  exit(0);
+}
+
+void register_stop_signals(struct server_ctx *srv) {
+  const int signals[2] = {SIGINT, SIGTERM};
+  for (int i = 0; i < 2; ++i) {
+    srv->stop_events[i] =
+        evsignal_new(srv->evb, signals[i], on_stop_signal, srv);
+    if (srv->stop_events[i] == NULL ||
+        event_add(srv->stop_events[i], NULL) != 0) {
+      fprintf(stderr, "Failed to register signal %d.\n", signals[i]);
+      exit(1);
+    }
+  }
 }
 
 void register_stdout_write_interest(struct server_ctx *srv) {
-  struct event_base *evb = srv->evb;
   set_io_non_block(STDOUT_FILENO);
   struct conn_ctx *c_ctx = conn_ctx_create(STDOUT_FILENO);
+  if (c_ctx == NULL) {
+    fprintf(stderr, "Memory budget is too small for stdout.\n");
+    exit(1);
+  }
   c_ctx->after_freed = NULL;
   c_ctx->readable = 0;
   c_ctx->writable = 1;
   c_ctx->srv = srv;
+  create_write_event(c_ctx);
 
   *srv->all_conns = list_insert_payload(*srv->all_conns, c_ctx);
+  ++srv->num_conns;
+  ++srv->nr_consumers;
 }
 
-void on_ready_to_accept(int srv_skt, short libev_flags, void *closure) {
-  fprintf(stderr,
-          "Server (fd %d) is now ready to accept new incoming connection.\n",
-          srv_skt);
-
-  struct sockaddr_storage cli_addr_store;
-  socklen_t cli_addr_size = sizeof(cli_addr_size);
-  int cli_fd =
-      accept(srv_skt, (struct sockaddr *)&cli_addr_store, &cli_addr_size);
-  if (cli_fd == -1) {
-    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-      fprintf(stderr,
-              "Unknown error when accepting client connection: accept: %s\n",
-              strerror(errno));
+// 为一个刚接受的连接（已经是 O_NONBLOCK 的）建立连接上下文。
+void accept_conn(struct server_ctx *srv, int cli_fd, struct sockaddr *addr) {
+  char peer_addr[INET6_ADDRSTRLEN * 2];
+  get_peer_pretty_name(peer_addr, sizeof(peer_addr), addr);
+  fprintf(stderr, "Accepted connection from %s, fd %d\n", peer_addr, cli_fd);
+  ++srv->metrics.nr_accepts;
+  struct conn_ctx *c_ctx =
+      register_read_interest(srv, cli_fd, after_network_socket_close, 1, 1);
+  if (c_ctx == NULL) {
+    fprintf(stderr, "Memory budget exhausted, refusing fd %d.\n", cli_fd);
+    ++srv->metrics.nr_refused_conns;
+    close(cli_fd);
+    return;
+  }
+  c_ctx->is_socket = 1;
+  if (srv->trace != NULL) {
+    c_ctx->trace_conn = trace_open(srv->trace);
+  }
+  enable_rx_timestamps(cli_fd);
+  if (srv->cfg->socket_busy_poll_us > 0) {
+    set_busy_poll(cli_fd, srv->cfg->socket_busy_poll_us);
+  }
+  c_ctx->last_active = monotonic_ms();
+  if (srv->cfg->idle_timeout_sec > 0) {
+    tw_schedule(&srv->wheel, &c_ctx->idle_timer,
+                c_ctx->last_active + srv->cfg->idle_timeout_sec * 1000UL);
+  }
+  if (srv->room_log != NULL && srv->cfg->catchup_bytes > 0) {
+    // 日志的末尾正好是已经广播过的数据的末尾，之后的广播都会进 write_buf，
+    // 所以历史和实时数据之间既不重复也不遗漏。write_event 登记上之后
+    // deliver_range 不会再 write-through，write_buf 里的数据会等历史发完。
+    c_ctx->catchup_end = roomlog_get_end(srv->room_log);
+    c_ctx->catchup_off = roomlog_catchup_start(
+        srv->room_log, srv->cfg->catchup_msgs, srv->cfg->catchup_bytes);
+    if (c_ctx->catchup_off < c_ctx->catchup_end) {
+      ++srv->metrics.nr_catchups;
+      arm_write_event(c_ctx);
+    }
+  }
+}
+
+void on_accept_resume_timer(struct tw_timer *t, void *arg) {
+  struct server_ctx *srv = arg;
+  open_reserve_fd(&srv->reserve_fd);
+  fprintf(stderr, "Resuming accepting connections.\n");
+  for (int i = 0; i < srv->nr_listeners; ++i) {
+    if (event_add(srv->listeners[i].accept_event, NULL) != 0) {
+      fprintf(stderr, "Failed to add server accept event.\n");
       exit(1);
     }
+  }
+}
 
-    // simply because server is not ready to accept new incoming connection for
-    // now, so we will go back to event loop and come back to here later.
-    return;
+// fd 用完了：用预留的 fd 接受 l 上一个排队的连接并立即关闭它。成功返回 0，listen
+// 队列已经空了返回 -1；连预留的 fd 都没有时暂停所有 listener 一段时间，也返回 -1。
+int shed_pending_conn(struct listener *l) {
+  struct server_ctx *srv = l->srv;
+  const int dropped = drop_pending_conn(l->fd, &srv->reserve_fd);
+  if (dropped > 0) {
+    ++srv->metrics.nr_shed_conns;
+    return 0;
+  } else if (dropped == 0) {
+    return -1;
   }
 
-  char peer_addr[INET6_ADDRSTRLEN * 2];
-  sprint_conn(peer_addr, sizeof(peer_addr), cli_fd);
-  fprintf(stderr, "Accepted connection from %s, fd %d\n", peer_addr, cli_fd);
-  struct server_ctx *srv = closure;
-  register_read_interest(srv, cli_fd, after_network_socket_close, 1, 1);
+  fprintf(stderr, "Out of file descriptors, pausing accept for %d ms.\n",
+          ACCEPT_PAUSE_MS);
+  ++srv->metrics.nr_accept_pauses;
+  for (int i = 0; i < srv->nr_listeners; ++i) {
+    event_del(srv->listeners[i].accept_event);
+  }
+  tw_schedule(&srv->wheel, &srv->accept_resume_timer,
+              monotonic_ms() + ACCEPT_PAUSE_MS);
+  return -1;
+}
+
+// listen socket 可读：一直 accept4 到 EAGAIN（最多 accept_budget 个），
+// SOCK_NONBLOCK | SOCK_CLOEXEC 省掉了之后设置 O_NONBLOCK 的两次 fcntl。
+void on_ready_to_accept(int srv_skt, short libev_flags, void *closure) {
+  struct listener *l = closure;
+  struct server_ctx *srv = l->srv;
+  ++srv->nr_dispatches;
+  for (int i = 0; i < srv->cfg->accept_budget; ++i) {
+    struct sockaddr_storage cli_addr_store;
+    socklen_t cli_addr_size = sizeof(cli_addr_store);
+    int cli_fd = accept4(srv_skt, (struct sockaddr *)&cli_addr_store,
+                         &cli_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cli_fd >= 0) {
+      accept_conn(srv, cli_fd, (struct sockaddr *)&cli_addr_store);
+      continue;
+    }
+
+    switch (errno) {
+      case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+      case EWOULDBLOCK:
+#endif
+        // listen 队列已经空了。
+        return;
+      case EINTR:
+      case ECONNABORTED:
+      case EPROTO:
+        // 这个连接在排队期间就已经断开了，接着处理下一个。
+        continue;
+      case EMFILE:
+      case ENFILE:
+        if (shed_pending_conn(l) != 0) {
+          return;
+        }
+        continue;
+      case ENOBUFS:
+      case ENOMEM:
+        fprintf(stderr, "accept4: %s, retrying later.\n", strerror(errno));
+        return;
+      default:
+        fprintf(stderr,
+                "Unknown error when accepting client connection: accept4: "
+                "%s\n",
+                strerror(errno));
+        exit(1);
+    }
+  }
 }
 
 void register_accept_conn_interest(struct server_ctx *srv) {
@@ -292,61 +966,335 @@ void register_accept_conn_interest(struct server_ctx *srv) {
   ev_flags |= EV_READ;
   ev_flags |= EV_PERSIST;
 
-  struct event *ev = event_new(srv->evb, srv->server_socket, ev_flags,
-                               on_ready_to_accept, srv);
-  if (ev == NULL) {
-    fprintf(stderr, "Failed to create server accpet event.\n");
-    exit(1);
+  for (int i = 0; i < srv->nr_listeners; ++i) {
+    struct listener *l = &srv->listeners[i];
+    struct event *ev =
+        event_new(srv->evb, l->fd, ev_flags, on_ready_to_accept, l);
+    if (ev == NULL) {
+      fprintf(stderr, "Failed to create server accpet event.\n");
+      exit(1);
+    }
+
+    if (event_add(ev, NULL) != 0) {
+      fprintf(stderr, "Failed to add server accept event.\n");
+      exit(1);
+    }
+    l->accept_event = ev;
   }
 
-  if (event_add(ev, NULL) != 0) {
-    fprintf(stderr, "Failed to add server accept event.\n");
+  srv->reserve_fd = -1;
+  if (open_reserve_fd(&srv->reserve_fd) < 0) {
+    fprintf(stderr, "Failed to open reserved fd: %s\n", strerror(errno));
     exit(1);
   }
+  tw_timer_init(&srv->accept_resume_timer, on_accept_resume_timer, srv);
 }
 
-int server_socket_bootstrap(char *port) {
-  int srv_skt = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (srv_skt == -1) {
-    fprintf(stderr, "Failed to create server socket: socket: %s.\n",
-            strerror(errno));
-    exit(1);
+void server_socket_bootstrap(struct server_ctx *srv) {
+  struct server_config *cfg = srv->cfg;
+  for (int i = 0; i < cfg->nr_listen_addrs; ++i) {
+    struct listener *l = &srv->listeners[i];
+    l->srv = srv;
+    l->addr = cfg->listen_addrs[i];
+    l->fd = listen_on(l->addr, cfg->listen_backlog);
+    if (l->fd == -1) {
+      fprintf(stderr, "Failed to listen on %s.\n", l->addr);
+      exit(1);
+    }
+    ++srv->nr_listeners;
   }
+}
 
-  set_io_non_block(srv_skt);
+// 在下一轮事件循环中释放连接（见 on_ready_to_read）。
+void schedule_close(struct conn_ctx *c_ctx) {
+  c_ctx->closing = 1;
+  event_active(c_ctx->read_event, EV_READ, 0);
+}
+
+void on_idle_timer(struct tw_timer *t, void *arg) {
+  struct conn_ctx *c_ctx = arg;
+  struct server_ctx *srv = c_ctx->srv;
+  const unsigned long timeout_ms = srv->cfg->idle_timeout_sec * 1000UL;
+  if (c_ctx->last_active + timeout_ms > srv->wheel.now) {
+    tw_schedule(&srv->wheel, t, c_ctx->last_active + timeout_ms);
+    return;
+  }
+
+  fprintf(stderr, "fd %d has been idle for %d seconds, closing it.\n",
+          c_ctx->fd, srv->cfg->idle_timeout_sec);
+  ++srv->metrics.nr_idle_reaps;
+  schedule_close(c_ctx);
+}
 
-  struct addrinfo bind_ai_hints, *bind_ai_res;
-  memset(&bind_ai_hints, 0, sizeof(bind_ai_hints));
-  bind_ai_hints.ai_family = AF_INET;
-  bind_ai_hints.ai_socktype = SOCK_STREAM;
-  bind_ai_hints.ai_flags = AI_PASSIVE;
-  if (getaddrinfo(NULL, port, &bind_ai_hints, &bind_ai_res) == -1) {
-    fprintf(stderr, "getaddrinfo: %s\n", strerror(errno));
+void on_write_stall_timer(struct tw_timer *t, void *arg) {
+  struct conn_ctx *c_ctx = arg;
+  struct server_ctx *srv = c_ctx->srv;
+  const unsigned long timeout_ms = srv->cfg->write_stall_timeout_sec * 1000UL;
+  if (c_ctx->last_write_progress + timeout_ms > srv->wheel.now) {
+    tw_schedule(&srv->wheel, t, c_ctx->last_write_progress + timeout_ms);
+    return;
+  }
+
+  fprintf(stderr,
+          "fd %d has not accepted any output for %d seconds (%d bytes "
+          "pending), closing it.\n",
+          c_ctx->fd, srv->cfg->write_stall_timeout_sec,
+          bytesq_get_size(&c_ctx->write_buf));
+  ++srv->metrics.nr_write_stall_reaps;
+  schedule_close(c_ctx);
+}
+
+void on_shrink_timer(struct tw_timer *t, void *arg) {
+  struct conn_ctx *c_ctx = arg;
+  if (bytesq_shrink(&c_ctx->write_buf, INITIAL_QUEUE_SLOTS) == 0) {
+    ++c_ctx->srv->metrics.nr_buffer_shrinks;
+  }
+}
+
+void on_wheel_timer(int fd, short flags, void *closure) {
+  // 只是为了唤醒事件循环，时间轮在 server_run 中推进。
+  struct server_ctx *srv = closure;
+  srv->wheel_deadline = TW_NEVER;
+}
+
+// 推进时间轮，并让事件循环在下一个需要推进的时刻醒来。
+void run_wheel(struct server_ctx *srv) {
+  tw_advance(&srv->wheel, monotonic_ms());
+
+  const unsigned long next = tw_next_event(&srv->wheel);
+  if (next == srv->wheel_deadline) {
+    return;
+  }
+  srv->wheel_deadline = next;
+  if (next == TW_NEVER) {
+    evtimer_del(srv->wheel_timer);
+    return;
+  }
+
+  const unsigned long delay_ms = next - srv->wheel.now;
+  struct timeval delay = {.tv_sec = delay_ms / 1000,
+                          .tv_usec = delay_ms % 1000 * 1000};
+  if (evtimer_add(srv->wheel_timer, &delay) != 0) {
+    fprintf(stderr, "Failed to arm timing wheel timer.\n");
     exit(1);
   }
+}
+
+void on_batch_deadline(int fd, short flags, void *closure) {
+  struct server_ctx *srv = closure;
+  srv->batch_timer_armed = 0;
+  srv->batch_deadline_passed = 1;
+}
+
+void on_metrics_tick(int fd, short flags, void *closure) {
+  struct server_ctx *srv = closure;
+  struct server_metrics *m = &srv->metrics;
+  struct lathist *lat = &srv->wakeup_lat;
+  double avg_chunks = 0, avg_bytes = 0;
+  if (m->nr_batches > 0) {
+    avg_chunks = (double)m->nr_batched_chunks / m->nr_batches;
+    avg_bytes = (double)m->nr_batched_bytes / m->nr_batches;
+  }
+  fprintf(stderr,
+          "[metrics] conns=%d wakeups=%lu batches=%lu "
+          "batch_chunks(avg=%.1f max=%lu) batch_bytes(avg=%.1f max=%lu) "
+          "saturated=%d/%d dropped_bytes=%lu laggard_disconnects=%lu "
+          "ingest_pauses=%lu mem=%ld/%ld blocks=%d/%d buffer_shrinks=%lu "
+          "producer_throttles=%lu refused_conns=%lu idle_reaps=%lu "
+          "write_stall_reaps=%lu timers=%d accepts=%lu shed_conns=%lu "
+          "accept_pauses=%lu read_yields=%lu reads=%lu read_bytes=%lu "
+          "wakeup_lat_us(n=%lu avg=%.1f p50<=%.1f p99<=%.1f max=%.1f) "
+          "busy_poll(hits=%lu misses=%lu window_us=%.1f) "
+          "catchups=%lu catchup_bytes=%lu log(bytes=%lu segments=%d)\n",
+          srv->num_conns, m->nr_wakeups, m->nr_batches, avg_chunks,
+          m->max_batch_chunks, avg_bytes, m->max_batch_bytes, srv->nr_saturated,
+          srv->nr_consumers, m->nr_dropped_bytes, m->nr_laggard_disconnects,
+          m->nr_ingest_pauses, membudget_get_usage(), membudget_get_budget(),
+          bytes_get_nr_busy_blocks(), bytes_get_nr_blocks(), m->nr_buffer_shrinks, m->nr_producer_throttles, m->nr_refused_conns,
+          m->nr_idle_reaps, m->nr_write_stall_reaps, srv->wheel.nr_timers,
+          m->nr_accepts, m->nr_shed_conns, m->nr_accept_pauses,
+          srv->read_sched.nr_yields, m->nr_reads, m->nr_read_bytes,
+          lat->count, lat->count > 0 ? lat->sum_ns / 1000.0 / lat->count : 0.0,
+          lathist_percentile(lat, 50) / 1000.0,
+          lathist_percentile(lat, 99) / 1000.0, lat->max_ns / 1000.0,
+          srv->busy_poll.nr_hits, srv->busy_poll.nr_misses,
+          srv->busy_poll.window_ns / 1000.0, m->nr_catchups,
+          m->nr_catchup_bytes,
+          srv->room_log != NULL ? roomlog_get_end(srv->room_log) -
+                                      roomlog_get_start(srv->room_log)
+                                : 0,
+          srv->room_log != NULL ? roomlog_get_nr_segments(srv->room_log) : 0);
+  lathist_reset(lat);
+}
+
+int shrink_idle_write_buf_accessor(void *payload, int idx, void *closure) {
+  struct conn_ctx *c_ctx = payload;
+  struct server_ctx *srv = closure;
+  if (c_ctx->writable &&
+      bytesq_shrink(&c_ctx->write_buf, INITIAL_QUEUE_SLOTS) == 0) {
+    ++srv->metrics.nr_buffer_shrinks;
+  }
+  return 1;
+}
+
+int find_heaviest_producer_accessor(void *payload, int idx, void *closure) {
+  struct conn_ctx *c_ctx = payload;
+  struct conn_ctx **heaviest = closure;
+  if (c_ctx->readable && !c_ctx->read_throttled && c_ctx->ingest_bytes > 0 &&
+      (*heaviest == NULL || c_ctx->ingest_bytes > (*heaviest)->ingest_bytes)) {
+    *heaviest = c_ctx;
+  }
+  return 1;
+}
+
+int reset_ingest_bytes_accessor(void *payload, int idx, void *closure) {
+  ((struct conn_ctx *)payload)->ingest_bytes = 0;
+  return 1;
+}
+
+void unthrottle_producers(struct server_ctx *srv) {
+  struct dq_node *n;
+  while ((n = dq_pop_front(&srv->throttled_q)) != NULL) {
+    struct conn_ctx *c = dq_entry(n, struct conn_ctx, throttled);
+    fprintf(stderr, "Memory pressure relieved, resuming reads from fd %d.\n",
+            c->fd);
+    c->read_throttled = 0;
+    if (c->read_paused) {
+      c->read_paused = 0;
+      event_active(c->read_event, EV_READ, 0);
+    }
+  }
+}
+
+// 内存预算的周期性检查：内存紧张时收缩所有空闲连接的 write_buf、把内存池里完全
+// 空闲的 arena 还回去，并暂停读取最近一个周期内读入最多的生产者；内存压力解除后
+// 恢复被暂停的生产者。
+void on_governor_tick(int fd, short flags, void *closure) {
+  struct server_ctx *srv = closure;
+  // 顺便把 trace 缓冲区里的记录写出去，trace 自己只在有新记录时才检查要不要写，
+  // 安静下来以后之前的记录会一直留在缓冲区里。
+  if (srv->trace != NULL) {
+    trace_flush(srv->trace);
+  }
+  if (!bytes_under_pressure()) {
+    unthrottle_producers(srv);
+    return;
+  }
+
+  list_traverse_payload(*srv->all_conns, srv, shrink_idle_write_buf_accessor);
+  if (bytes_trim() > 0) {
+    ++srv->metrics.nr_buffer_shrinks;
+  }
+  if (bytes_under_pressure()) {
+    struct conn_ctx *heaviest = NULL;
+    list_traverse_payload(*srv->all_conns, &heaviest,
+                          find_heaviest_producer_accessor);
+    if (heaviest != NULL) {
+      fprintf(stderr,
+              "Memory pressure (%ld of %ld bytes), pausing reads from fd %d "
+              "(%lu bytes in the last period).\n",
+              membudget_get_usage(), membudget_get_budget(), heaviest->fd,
+              heaviest->ingest_bytes);
+      heaviest->read_throttled = 1;
+      dq_push_back(&srv->throttled_q, &heaviest->throttled);
+      ++srv->metrics.nr_producer_throttles;
+    }
+  }
+  list_traverse_payload(*srv->all_conns, NULL, reset_ingest_bytes_accessor);
+}
+
+// 房间日志按保留时间删除旧段。按大小删除在换段的时候就做了，这里只是让没有新
+// 数据写入的房间也能删掉过期的段。
+void on_room_log_tick(int fd, short flags, void *closure) {
+  struct server_ctx *srv = closure;
+  roomlog_retain(srv->room_log);
+}
 
-  if (bind(srv_skt, bind_ai_res->ai_addr, bind_ai_res->ai_addrlen) == -1) {
-    fprintf(stderr, "bind: %s\n", strerror(errno));
+void register_timers(struct server_ctx *srv) {
+  srv->batch_timer = evtimer_new(srv->evb, on_batch_deadline, srv);
+  if (srv->batch_timer == NULL) {
+    fprintf(stderr, "Failed to create batch timer.\n");
+    exit(1);
+  }
+  srv->batch_timer_armed = 0;
+  srv->batch_deadline_passed = 0;
+  srv->batch_chunks = 0;
+
+  tw_init(&srv->wheel, monotonic_ms());
+  srv->wheel_deadline = TW_NEVER;
+  srv->wheel_timer = evtimer_new(srv->evb, on_wheel_timer, srv);
+  if (srv->wheel_timer == NULL) {
+    fprintf(stderr, "Failed to create timing wheel timer.\n");
     exit(1);
   }
 
-  if (listen(srv_skt, MAX_LISTEN_BACKLOG) == -1) {
-    fprintf(stderr, "listen: %s\n", strerror(errno));
+  srv->governor_timer =
+      event_new(srv->evb, -1, EV_PERSIST, on_governor_tick, srv);
+  struct timeval governor_interval = {.tv_sec = GOVERNOR_INTERVAL_SEC,
+                                      .tv_usec = 0};
+  if (srv->governor_timer == NULL ||
+      event_add(srv->governor_timer, &governor_interval) != 0) {
+    fprintf(stderr, "Failed to register memory governor timer.\n");
     exit(1);
   }
 
-  return srv_skt;
+  srv->room_log_timer = NULL;
+  if (srv->room_log != NULL) {
+    srv->room_log_timer =
+        event_new(srv->evb, -1, EV_PERSIST, on_room_log_tick, srv);
+    struct timeval retain_interval = {.tv_sec = LOG_RETAIN_INTERVAL_SEC,
+                                      .tv_usec = 0};
+    if (srv->room_log_timer == NULL ||
+        event_add(srv->room_log_timer, &retain_interval) != 0) {
+      fprintf(stderr, "Failed to register room log timer.\n");
+      exit(1);
+    }
+  }
+
+  srv->metrics_timer = NULL;
+  if (srv->cfg->metrics_interval_sec > 0) {
+    srv->metrics_timer =
+        event_new(srv->evb, -1, EV_PERSIST, on_metrics_tick, srv);
+    struct timeval interval = {.tv_sec = srv->cfg->metrics_interval_sec,
+                               .tv_usec = 0};
+    if (srv->metrics_timer == NULL ||
+        event_add(srv->metrics_timer, &interval) != 0) {
+      fprintf(stderr, "Failed to register metrics timer.\n");
+      exit(1);
+    }
+  }
 }
 
-struct server_ctx *server_start(char *port) {
+struct server_ctx *server_start(struct server_config *cfg) {
   struct server_ctx *srv = malloc(sizeof(struct server_ctx));
+  memset(srv, 0, sizeof(struct server_ctx));
+  srv->cfg = cfg;
 
-  srv->write_buf = ringbuf_create(MAX_SERVER_WRITE_BUF);
+  bytesq_init(&srv->write_buf, INITIAL_QUEUE_SLOTS);
+  if (cfg->capture_path != NULL) {
+    srv->trace = trace_writer_create(cfg->capture_path);
+    if (srv->trace == NULL) {
+      exit(1);
+    }
+  }
+  if (cfg->room_log.dir != NULL) {
+    srv->room_log = roomlog_open(&cfg->room_log);
+    if (srv->room_log == NULL) {
+      exit(1);
+    }
+  }
 
-  srv->server_socket = server_socket_bootstrap(port);
+  server_socket_bootstrap(srv);
 
   srv->all_conns = (llist_t **)malloc(sizeof(llist_t *));
   *srv->all_conns = list_create();
+  srv->num_conns = 0;
+  dq_init(&srv->read_dirty_q);
+  dq_init(&srv->write_dirty_q);
+  dq_init(&srv->throttled_q);
+  rs_init(&srv->read_sched, cfg->read_quantum, cfg->max_reads_per_turn);
+  bp_init(&srv->busy_poll, cfg->busy_poll_us);
+  lathist_reset(&srv->wakeup_lat);
 
   srv->evb = event_base_new();
   if (srv->evb == NULL) {
@@ -356,6 +1304,8 @@ struct server_ctx *server_start(char *port) {
   register_accept_conn_interest(srv);
   register_stdin_read_interest(srv);
   register_stdout_write_interest(srv);
+  register_timers(srv);
+  register_stop_signals(srv);
 
   return srv;
 }
@@ -363,122 +1313,632 @@ struct server_ctx *server_start(char *port) {
 void server_shutdown(struct server_ctx *srv) {
   list_free(*(srv->all_conns), conn_ctx_list_elem_deleter, NULL);
   free(srv->all_conns);
+  event_free(srv->batch_timer);
+  event_free(srv->governor_timer);
+  event_free(srv->stop_events[0]);
+  event_free(srv->stop_events[1]);
+  event_free(srv->wheel_timer);
+  if (srv->metrics_timer != NULL) {
+    event_free(srv->metrics_timer);
+  }
+  if (srv->room_log != NULL) {
+    event_free(srv->room_log_timer);
+    roomlog_close(srv->room_log);
+  }
+  for (int i = 0; i < srv->nr_listeners; ++i) {
+    event_free(srv->listeners[i].accept_event);
+    close(srv->listeners[i].fd);
+  }
   event_base_free(srv->evb);
-  ringbuf_free(srv->write_buf);
+  bytesq_destroy(&srv->write_buf);
 
   free(srv);
 }
 
-int collect_input_from_each_readbuf(void *payload, int idx, void *closure) {
-  struct server_ctx *srv = closure;
-  struct conn_ctx *c = payload;
-  if (!c->readable) {
-    return 1;
+// 每个连接的 write_buf 最多积压多少字节，见 write_room。
+long write_limit(long budget) {
+  return budget / 2 < (long)MAX_WRITE_BUF_PER_CONN ? budget / 2
+                                                    : (long)MAX_WRITE_BUF_PER_CONN;
+}
+
+// 把 read_dirty_q 里的连接的 read_buf 的内容 collect 到 server 的 write_buf，
+// 只是把切片移过去。一批最多 write_limit 字节（至少一个连接的
+// read_buf），否则 LAGGARD_BLOCK 策略下即使是空闲的消费者也放不下这一批；
+// 放不下的连接留在 read_dirty_q 里等下一批。
+void collect_input_from_dirty_readbufs(struct server_ctx *srv) {
+  const long limit = write_limit(membudget_get_budget());
+  struct dq_node *n;
+  while ((n = dq_pop_front(&srv->read_dirty_q)) != NULL) {
+    struct conn_ctx *c = dq_entry(n, struct conn_ctx, read_dirty);
+    const int size = bytesq_get_size(&srv->write_buf);
+    if (size > 0 && size + bytesq_get_size(&c->read_buf) > limit) {
+      dq_push_front(&srv->read_dirty_q, n);
+      break;
+    }
+    if (bytesq_transfer(&srv->write_buf, &c->read_buf) > 0) {
+      ++srv->batch_chunks;
+    }
+
+    if (c->read_paused) {
+      // read_buf 腾出空间了，边沿触发不会再通知我们，所以主动激活一次
+      // read_event，让它在下一轮事件循环中接着读。
+      c->read_paused = 0;
+      event_active(c->read_event, EV_READ, 0);
+    }
   }
+}
 
-  int remain_cap = ringbuf_get_remaining_capacity(srv->write_buf);
-  if (remain_cap <= 0) {
-    return 1;
+// 直接把 src 中从 offset 开始的 len 字节写到连接上，返回写出的字节数。遇到
+// EAGAIN 或者错误就停下，错误留给之后的 on_ready_to_write
+// 处理（这里正在遍历连接列表，不能释放连接）。
+int try_write_through(struct conn_ctx *c_ctx, struct bytesq *src, int offset,
+                      int len) {
+  struct iovec iov[EGRESS_MAX_IOV];
+  int iovcnt = bytesq_get_iovecs(src, offset, len, iov, EGRESS_MAX_IOV);
+  long result =
+      conn_sendv(c_ctx, iov, iovcnt, more_output_follows(c_ctx->srv));
+  if (result <= 0) {
+    return 0;
   }
 
-  ringbuf_transfer(srv->write_buf, c->read_buf, remain_cap);
-  if (!event_pending(c->read_event, EV_READ, NULL)) {
-    if (event_add(c->read_event, NULL) != 0) {
-      fprintf(stderr, "Failed to register read event to fd %d\n", c->fd);
-      exit(1);
+  fprintf(stderr, "Wrote through %ld bytes to fd %d.\n", result, c_ctx->fd);
+  c_ctx->last_active = monotonic_ms();
+  return result;
+}
+
+// 把 batch 中 [from, to) 范围内的数据交给连接：write-through
+// 优先，如果这个连接没有积压的待发送数据，先直接尝试发送，只有没发完的部分才进入它的
+// write_buf（追加切片的引用），也只有这时才需要登记写事件。调用者保证 write_buf
+// 放得下。
+void deliver_range(struct conn_ctx *c_ctx, struct bytesq *batch, int from,
+                   int to) {
+  if (to <= from) {
+    return;
+  }
+
+  int sent = 0;
+  if (bytesq_is_empty(&c_ctx->write_buf) && !c_ctx->write_armed) {
+    sent = try_write_through(c_ctx, batch, from, to - from);
+  }
+
+  if (bytesq_append_range(&c_ctx->write_buf, batch, from + sent,
+                          to - from - sent) > 0) {
+    dq_push_back(&c_ctx->srv->write_dirty_q, &c_ctx->write_dirty);
+  }
+  update_saturation(c_ctx);
+}
+
+// 连接的 write_buf 还能再积压多少字节。积压的切片一直占着内存池的数据块（别的
+// 连接早就把它们发完了），所以积压最多只能占内存预算的一半，剩下的留给正在读入
+// 和广播的数据，否则一个不读数据的连接就能把内存池占满、让所有人都读不进来。
+int write_room(struct conn_ctx *c_ctx) {
+  const int room =
+      write_limit(membudget_get_budget()) - bytesq_get_size(&c_ctx->write_buf);
+  return room > 0 ? room : 0;
+}
+
+// 为了补完一条已经发出了开头的消息，write_buf 可以超出 write_room 的限制，但
+// 积压最多只能到内存预算的一半。返回还能再积压多少字节。
+int write_hard_room(struct conn_ctx *c_ctx) {
+  const long room =
+      membudget_get_budget() / 2 - bytesq_get_size(&c_ctx->write_buf);
+  return room > INT_MAX ? INT_MAX : room > 0 ? room : 0;
+}
+
+// LAGGARD_DROP 策略：决定这一批数据中的哪一段 [*from, *to)
+// 交给这个连接，其余部分丢弃。丢弃总是以完整的消息（以 '\n'
+// 结尾）为单位：已经发出了开头的消息要补完整，开头已经被丢弃的消息剩下的部分也要丢弃。
+// 补完整需要的空间超过了 write_hard_room 时返回 -1，这个连接只能断开（stdout
+// 不能断开，调用者照样把 [*from, *to)，也就是那半条消息交给它）；否则返回 0。
+int plan_framed_delivery(struct conn_ctx *c_ctx, struct bytesq *batch,
+                         int *from, int *to) {
+  const int n = bytesq_get_size(batch);
+  int begin = 0;
+  if (c_ctx->frame_state == FRAME_MID_DROPPED) {
+    int nl = bytesq_find(batch, 0, n, '\n');
+    begin = nl < 0 ? n : nl + 1;
+  }
+
+  // [begin, must) 是上一批发出了开头的那条消息剩下的部分，无论如何都要发。
+  int must = begin;
+  if (c_ctx->frame_state == FRAME_MID_DELIVERED) {
+    int nl = bytesq_find(batch, 0, n, '\n');
+    must = nl < 0 ? n : nl + 1;
+  }
+  const int too_long = must - begin > write_hard_room(c_ctx);
+
+  int end = c_ctx->saturated || too_long ? must : n;
+  const int room = write_room(c_ctx);
+  if (end - begin > room) {
+    int nl = bytesq_rfind(batch, begin, begin + room, '\n');
+    end = nl < 0 ? begin : nl + 1;
+    if (end < must) {
+      end = must;
     }
   }
 
-  return 1;
+  const int ends_at_boundary = bytesq_find(batch, n - 1, n, '\n') == n - 1;
+  if (end < n || end == begin) {
+    c_ctx->frame_state =
+        ends_at_boundary ? FRAME_AT_BOUNDARY : FRAME_MID_DROPPED;
+  } else {
+    c_ctx->frame_state =
+        ends_at_boundary ? FRAME_AT_BOUNDARY : FRAME_MID_DELIVERED;
+  }
+
+  c_ctx->srv->metrics.nr_dropped_bytes += begin + (n - end);
+  *from = begin;
+  *to = end;
+  return too_long ? -1 : 0;
+}
+
+
+// LAGGARD_DISCONNECT 策略：断开一个落后的消费者。这里正在遍历连接列表，不能直接
+// 释放连接，所以先标记，再激活它的 read_event，让 on_ready_to_read 去释放。
+void disconnect_laggard(struct conn_ctx *c_ctx) {
+  fprintf(stderr, "fd %d is lagging behind, disconnecting it.\n", c_ctx->fd);
+  ++c_ctx->srv->metrics.nr_laggard_disconnects;
+  schedule_close(c_ctx);
 }
 
 int emit_to_each_writable_conn(void *payload, int idx, void *closure) {
   struct conn_ctx *c_ctx = payload;
-  if (!c_ctx->writable) {
+  if (!c_ctx->writable || c_ctx->closing) {
     return 1;
   }
 
-  int remain_cap = ringbuf_get_remaining_capacity(c_ctx->write_buf);
-  if (remain_cap <= 0) {
-    return 1;
+  struct server_ctx *srv = closure;
+  const int nbytes = bytesq_get_size(&srv->write_buf);
+  int from = 0;
+  int to = nbytes;
+  switch (srv->cfg->laggard_policy) {
+    case LAGGARD_BLOCK:
+      // broadcast_batch 已经确认过每个连接都放得下这一批数据。
+      break;
+    case LAGGARD_DISCONNECT:
+      if (c_ctx->is_socket) {
+        if (c_ctx->saturated || write_room(c_ctx) < nbytes) {
+          disconnect_laggard(c_ctx);
+          return 1;
+        }
+        break;
+      }
+      // stdout 不能断开，退化成 LAGGARD_DROP。
+    case LAGGARD_DROP:
+      if (plan_framed_delivery(c_ctx, &srv->write_buf, &from, &to) != 0 &&
+          c_ctx->is_socket) {
+        // 剩下的半条消息太长，丢掉它会让下一条消息接在半条消息后面。
+        disconnect_laggard(c_ctx);
+        return 1;
+      }
+      break;
   }
 
-  struct server_ctx *srv = closure;
-  struct event_base *evb = srv->evb;
+  deliver_range(c_ctx, &srv->write_buf, from, to);
+  return 1;
+}
+
+int conn_lacks_room_accessor(void *payload, int idx, void *closure) {
+  struct conn_ctx *c_ctx = payload;
+  int *nbytes = closure;
+  if (c_ctx->writable && write_room(c_ctx) < *nbytes) {
+    *nbytes = -1;
+    return 0;
+  }
+  return 1;
+}
+
+// LAGGARD_BLOCK 策略：只有每个消费者都放得下这一批数据时才广播。
+int all_consumers_have_room(struct server_ctx *srv, int nbytes) {
+  list_traverse_payload(*srv->all_conns, &nbytes, conn_lacks_room_accessor);
+  return nbytes >= 0;
+}
 
-  ringbuf_copy(c_ctx->write_buf, srv->write_buf, remain_cap);
+// 判断是否应该暂停从发布者 collect 数据：LAGGARD_BLOCK
+// 策略下任何一个消费者落后、或者这一批还留着没广播就暂停，其它策略下所有消费者都落后才暂停（这时候没有人能接收新数据了）。
+// 暂停 collect 之后发布者的 read_buf 会被填满，我们也就不再从它们那里读取数据。
+int update_ingest_pause(struct server_ctx *srv) {
+  int paused = srv->batch_held;
+  if (srv->nr_saturated > 0) {
+    paused = paused || srv->cfg->laggard_policy == LAGGARD_BLOCK ||
+             srv->nr_saturated >= srv->nr_consumers;
+  }
+
+  if (paused && !srv->ingest_paused) {
+    fprintf(stderr, "Pausing ingest, %d of %d consumers are saturated.\n",
+            srv->nr_saturated, srv->nr_consumers);
+    ++srv->metrics.nr_ingest_pauses;
+  }
+  srv->ingest_paused = paused;
+  return paused;
+}
+
+// 判断现在是否应该把 server 的 write_buf 中攒下的数据广播出去，如果还不应该，
+// 确保批处理的定时器已经启动。
+int batch_should_flush(struct server_ctx *srv) {
+  struct server_config *cfg = srv->cfg;
+  if (cfg->batch_window_us <= 0 || srv->batch_deadline_passed) {
+    return 1;
+  }
+
+  // 攒够了字节数，或者 read_dirty_q 中还有没 collect 的连接（暂停了 collect）。
+  if (bytesq_get_size(&srv->write_buf) >= cfg->batch_max_bytes ||
+      !dq_is_empty(&srv->read_dirty_q)) {
+    return 1;
+  }
 
-  if (!c_ctx->write_event || c_ctx->write_event == NULL) {
-    c_ctx->write_event = event_new(evb, c_ctx->fd, EV_WRITE | EV_PERSIST,
-                                   on_ready_to_write, c_ctx);
-    if (c_ctx->write_event == NULL) {
-      fprintf(stderr, "Failed to create event object for fd %d\n", c_ctx->fd);
+  if (!srv->batch_timer_armed) {
+    struct timeval window = {.tv_sec = cfg->batch_window_us / 1000000,
+                             .tv_usec = cfg->batch_window_us % 1000000};
+    if (evtimer_add(srv->batch_timer, &window) != 0) {
+      fprintf(stderr, "Failed to arm batch timer.\n");
       exit(1);
     }
+    srv->batch_timer_armed = 1;
   }
+  return 0;
+}
 
-  if (!event_pending(c_ctx->write_event, EV_WRITE, NULL)) {
-    if (event_add(c_ctx->write_event, NULL) != 0) {
-      fprintf(stderr, "Failed to register write event to fd %d\n", c_ctx->fd);
-      exit(1);
+// 把 server 的 write_buf 中攒下的这一批数据广播给每一个可写的连接。
+void broadcast_batch(struct server_ctx *srv) {
+  struct server_metrics *m = &srv->metrics;
+  const int nbytes = bytesq_get_size(&srv->write_buf);
+  if (srv->cfg->laggard_policy == LAGGARD_BLOCK &&
+      !all_consumers_have_room(srv, nbytes)) {
+    // 留着这一批，等落后的消费者腾出空间后再广播，在那之前不再往里 collect。
+    srv->batch_held = 1;
+    return;
+  }
+  srv->batch_held = 0;
+
+  ++m->nr_batches;
+  m->nr_batched_chunks += srv->batch_chunks;
+  m->nr_batched_bytes += nbytes;
+  if ((unsigned long)srv->batch_chunks > m->max_batch_chunks) {
+    m->max_batch_chunks = srv->batch_chunks;
+  }
+  if ((unsigned long)nbytes > m->max_batch_bytes) {
+    m->max_batch_bytes = nbytes;
+  }
+
+  list_traverse_payload(*srv->all_conns, srv, emit_to_each_writable_conn);
+  if (srv->room_log != NULL) {
+    roomlog_append(srv->room_log, &srv->write_buf);
+  }
+  bytesq_clear(&srv->write_buf);
+
+  srv->batch_chunks = 0;
+  srv->batch_deadline_passed = 0;
+  if (srv->batch_timer_armed) {
+    evtimer_del(srv->batch_timer);
+    srv->batch_timer_armed = 0;
+  }
+}
+
+// 为 write_dirty_q 里的连接登记写事件。
+void flush_dirty_writebufs(struct server_ctx *srv) {
+  struct dq_node *n;
+  while ((n = dq_pop_front(&srv->write_dirty_q)) != NULL) {
+    struct conn_ctx *c = dq_entry(n, struct conn_ctx, write_dirty);
+    arm_write_event(c);
+  }
+}
+
+// 让上一轮因为额度用完而让出的连接接着读。它们是边沿触发的，内核不会再通知我们，
+// 所以主动激活它们的 read_event，按让出的先后顺序排在这一轮中。
+void resume_yielded_readers(struct server_ctx *srv) {
+  struct rs_conn *sc;
+  while ((sc = rs_pop(&srv->read_sched)) != NULL) {
+    struct conn_ctx *c = dq_entry(sc, struct conn_ctx, sched);
+    event_active(c->read_event, EV_READ, 0);
+  }
+}
+
+// 等待并处理一轮事件。开启了忙轮询时先以非阻塞的方式反复检查（epoll_wait 的
+// 超时为 0），在窗口内等到了事件就直接返回，否则退回阻塞的等待。
+void wait_for_events(struct server_ctx *srv) {
+  struct busy_poll *bp = &srv->busy_poll;
+  if (bp->max_ns > 0) {
+    long now = monotonic_ns();
+    const long deadline = bp_deadline(bp, now);
+    const unsigned long nr_dispatches = srv->nr_dispatches;
+    while (now < deadline) {
+      event_base_loop(srv->evb, EVLOOP_NONBLOCK);
+      if (srv->nr_dispatches != nr_dispatches) {
+        bp_hit(bp);
+        return;
+      }
+      bp_relax();
+      now = monotonic_ns();
     }
+    bp_miss(bp, now);
   }
 
-  return 1;
+  event_base_loop(srv->evb, EVLOOP_ONCE);
+  if (bp->max_ns > 0) {
+    bp_woke(bp, monotonic_ns());
+  }
 }
 
 int server_run(struct server_ctx *srv) {
   while (1) {
     fprintf(stderr, "Waiting IO activity...\n");
-    int evb_loop_flags = EVLOOP_ONCE;
-    event_base_loop(srv->evb, evb_loop_flags);
-
-    // 只有确保 server 的 write_buf 能容纳所有 client 的
-    // read_buf，才去 collect 每个 read_buf 的内容到 server 的 write_buf。
-    // 因为，如果 client 的 read_buf 满了，server 就会调用 event_del
-    // 移除 read interest，也就是停止（调用 read 方法）从 client
-    // 读入更多数据，迫使 client 减轻向 server
-    // 的发包速率和发包流量（发慢点、发少点），某种程度上来说你可以把这理解为一种反压措施。
-    const int sum_of_cli_read_buf_size =
-        list_get_size(*srv->all_conns) * MAX_READ_BUF;
-    if (ringbuf_get_remaining_capacity(srv->write_buf) >=
-        sum_of_cli_read_buf_size) {
-      list_traverse_payload(*srv->all_conns, srv,
-                            collect_input_from_each_readbuf);
-    }
-
-    // 检查 server 的 write_buf
-    // 是否需要动态扩容（正如刚才所说，它需要具备容纳所有 client 的 read_buf
-    // 的能力）
-    const int curr_srv_write_buf_size = ringbuf_get_capacity(srv->write_buf);
-    if (curr_srv_write_buf_size < sum_of_cli_read_buf_size) {
-      int new_size = ringbuf_upscale_if_needed(&(srv->write_buf),
-                                               sum_of_cli_read_buf_size);
-      if (new_size > curr_srv_write_buf_size) {
-        fprintf(stderr, "Server's write_buf has been up-scaled to %d bytes\n",
-                new_size);
-      }
+    alloc_count_loop_begin();
+    resume_yielded_readers(srv);
+    wait_for_events(srv);
+    ++srv->metrics.nr_wakeups;
+
+    // 只处理这一轮中收到了数据的连接，消费者落后时暂停。
+    if (!update_ingest_pause(srv)) {
+      collect_input_from_dirty_readbufs(srv);
     }
 
-    if (!ringbuf_is_empty(srv->write_buf)) {
-      list_traverse_payload(*srv->all_conns, srv, emit_to_each_writable_conn);
-      ringbuf_clear(srv->write_buf);
+    // 广播本身必然要触达每一个可写的连接，但只有真的有数据要广播、并且这一批
+    // 已经攒够了（或者到期了）时才遍历。
+    if (!bytesq_is_empty(&srv->write_buf) && batch_should_flush(srv)) {
+      broadcast_batch(srv);
     }
+
+    flush_dirty_writebufs(srv);
+    run_wheel(srv);
+    alloc_count_loop_end();
   }
 
   server_shutdown(srv);
   return 0;
 }
 
+// stdin 关闭时进程直接 exit，在 atexit 里删掉文件系统中的 socket 文件。
+struct server_config *listening_cfg = NULL;
+
+void unlisten_all() {
+  for (int i = 0; i < listening_cfg->nr_listen_addrs; ++i) {
+    unlisten(listening_cfg->listen_addrs[i]);
+  }
+}
+
+// 同样在 atexit 里把还在缓冲区里的 trace 记录写出去。
+struct server_ctx *capturing_srv = NULL;
+
+void finish_capture() { trace_writer_close(capturing_srv->trace); }
+
+void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <addr>...\n"
+          "  <addr>        where to listen, can be given up to %d times:\n"
+          "                <port> or <host>:<port> for TCP, unix:<path> for a "
+          "UNIX domain socket,\n"
+          "                unix:@<name> for one in the abstract namespace\n"
+          "  -b <us>       broadcast batching window in microseconds "
+          "(default 0, no batching)\n"
+          "  -B <bytes>    flush a batch early once it holds this many bytes "
+          "(default %lu)\n"
+          "  -m <seconds>  metrics report interval, 0 to disable "
+          "(default %d)\n"
+          "  -H <bytes>    per-connection high watermark of pending output, "
+          "at most min(M/2, %lu)\n"
+          "                (default 3/4 of that)\n"
+          "  -L <bytes>    per-connection low watermark of pending output "
+          "(default 1/4 of that)\n"
+          "  -P <policy>   what to do with consumers above the high watermark: "
+          "drop, disconnect or block (default drop)\n"
+          "  -M <bytes>    memory budget for all connection buffers "
+          "(default %lu)\n"
+          "  -I <seconds>  close connections idle for this long, 0 to disable "
+          "(default %d)\n"
+          "  -S <seconds>  close connections whose pending output makes no "
+          "progress for this long, 0 to disable (default %d)\n"
+          "  -l <n>        listen backlog (default %d)\n"
+          "  -A <n>        accept at most this many connections per wakeup "
+          "(default %d)\n"
+          "  -q <bytes>    read at most this many bytes from a connection per "
+          "loop turn (default %lu)\n"
+          "  -r <n>        call read at most this many times on a connection "
+          "per loop turn (default %d)\n"
+          "  -F            size reads by ioctl(FIONREAD)\n"
+          "  -y <us>       busy-poll for up to this long before blocking, 0 "
+          "to disable (default 0)\n"
+          "  -Y <us>       set SO_BUSY_POLL on network connections, 0 to "
+          "disable (default 0)\n"
+          "  -T <mode>     how to allocate the 2 MiB arenas of the buffer pool: "
+          "malloc, hugepage, populate\n"
+          "                (hugepage, faulted in up front) or mlock "
+          "(populate, locked in memory)\n"
+          "                (default hugepage)\n"
+          "  -C <file>     record the traffic of network connections to a "
+          "trace file for chat_replay\n"
+          "  -R <dir>      append everything broadcast to a segmented log in "
+          "this directory and\n"
+          "                send recent history to connections as they join\n"
+          "  -j <n>        history to send to a joining connection, in "
+          "messages, 0 for no limit (default %d)\n"
+          "  -J <bytes>    history to send to a joining connection, in bytes, "
+          "0 to disable (default %lu)\n"
+          "  -g <bytes>    size of a log segment (default %lu)\n"
+          "  -G <bytes>    delete the oldest log segments beyond this size, 0 "
+          "for no limit (default %lu)\n"
+          "  -E <seconds>  delete log segments last written this long ago, 0 "
+          "for no limit (default %d)\n",
+          prog, MAX_LISTENERS, DEFAULT_BATCH_MAX_BYTES, DEFAULT_METRICS_INTERVAL_SEC,
+          MAX_WRITE_BUF_PER_CONN, DEFAULT_MEMORY_BUDGET, DEFAULT_IDLE_TIMEOUT_SEC,
+          DEFAULT_WRITE_STALL_TIMEOUT_SEC, DEFAULT_LISTEN_BACKLOG,
+          DEFAULT_ACCEPT_BUDGET, DEFAULT_READ_QUANTUM,
+          DEFAULT_MAX_READS_PER_TURN, DEFAULT_CATCHUP_MSGS,
+          DEFAULT_CATCHUP_BYTES, DEFAULT_LOG_SEGMENT_SIZE,
+          DEFAULT_LOG_RETAIN_BYTES, DEFAULT_LOG_RETAIN_SEC);
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc <= 1) {
-    fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-    exit(1);
+  struct server_config cfg = {.nr_listen_addrs = 0,
+                              .batch_window_us = 0,
+                              .batch_max_bytes = DEFAULT_BATCH_MAX_BYTES,
+                              .metrics_interval_sec =
+                                  DEFAULT_METRICS_INTERVAL_SEC,
+                              .high_watermark = -1,
+                              .low_watermark = -1,
+                              .laggard_policy = LAGGARD_DROP,
+                              .memory_budget = DEFAULT_MEMORY_BUDGET,
+                              .idle_timeout_sec = DEFAULT_IDLE_TIMEOUT_SEC,
+                              .write_stall_timeout_sec =
+                                  DEFAULT_WRITE_STALL_TIMEOUT_SEC,
+                              .listen_backlog = DEFAULT_LISTEN_BACKLOG,
+                              .accept_budget = DEFAULT_ACCEPT_BUDGET,
+                              .read_quantum = DEFAULT_READ_QUANTUM,
+                              .max_reads_per_turn = DEFAULT_MAX_READS_PER_TURN,
+                              .use_fionread = 0,
+                              .busy_poll_us = 0,
+                              .socket_busy_poll_us = 0,
+                              .large_alloc_size = RINGBUF_DEFAULT_LARGE_SIZE,
+                              .prefault = RINGBUF_PREFAULT_NONE,
+                              .capture_path = NULL,
+                              .room_log = {.dir = NULL,
+                                           .segment_size =
+                                               DEFAULT_LOG_SEGMENT_SIZE,
+                                           .retain_bytes =
+                                               DEFAULT_LOG_RETAIN_BYTES,
+                                           .retain_sec =
+                                               DEFAULT_LOG_RETAIN_SEC},
+                              .catchup_msgs = DEFAULT_CATCHUP_MSGS,
+                              .catchup_bytes = DEFAULT_CATCHUP_BYTES};
+  int opt;
+  while ((opt = getopt(argc, argv, "b:B:m:H:L:P:M:I:S:l:A:q:r:Fy:Y:T:C:R:j:J:g:G:E:")) != -1) {
+    switch (opt) {
+      case 'b':
+        cfg.batch_window_us = atol(optarg);
+        break;
+      case 'B':
+        cfg.batch_max_bytes = atoi(optarg);
+        break;
+      case 'm':
+        cfg.metrics_interval_sec = atoi(optarg);
+        break;
+      case 'H':
+        cfg.high_watermark = atoi(optarg);
+        break;
+      case 'L':
+        cfg.low_watermark = atoi(optarg);
+        break;
+      case 'P':
+        if (strcmp(optarg, "drop") == 0) {
+          cfg.laggard_policy = LAGGARD_DROP;
+        } else if (strcmp(optarg, "disconnect") == 0) {
+          cfg.laggard_policy = LAGGARD_DISCONNECT;
+        } else if (strcmp(optarg, "block") == 0) {
+          cfg.laggard_policy = LAGGARD_BLOCK;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'M':
+        cfg.memory_budget = atol(optarg);
+        break;
+      case 'I':
+        cfg.idle_timeout_sec = atoi(optarg);
+        break;
+      case 'S':
+        cfg.write_stall_timeout_sec = atoi(optarg);
+        break;
+      case 'l':
+        cfg.listen_backlog = atoi(optarg);
+        break;
+      case 'A':
+        cfg.accept_budget = atoi(optarg);
+        break;
+      case 'q':
+        cfg.read_quantum = atoi(optarg);
+        break;
+      case 'r':
+        cfg.max_reads_per_turn = atoi(optarg);
+        break;
+      case 'F':
+        cfg.use_fionread = 1;
+        break;
+      case 'y':
+        cfg.busy_poll_us = atoi(optarg);
+        break;
+      case 'Y':
+        cfg.socket_busy_poll_us = atoi(optarg);
+        break;
+      case 'T':
+        // 每种方式都把两个设置都给出来，多次给出 -T 时以最后一次为准。
+        if (strcmp(optarg, "malloc") == 0) {
+          cfg.large_alloc_size = 0;
+          cfg.prefault = RINGBUF_PREFAULT_NONE;
+        } else if (strcmp(optarg, "hugepage") == 0) {
+          cfg.large_alloc_size = RINGBUF_DEFAULT_LARGE_SIZE;
+          cfg.prefault = RINGBUF_PREFAULT_NONE;
+        } else if (strcmp(optarg, "populate") == 0) {
+          cfg.large_alloc_size = RINGBUF_DEFAULT_LARGE_SIZE;
+          cfg.prefault = RINGBUF_PREFAULT_POPULATE;
+        } else if (strcmp(optarg, "mlock") == 0) {
+          cfg.large_alloc_size = RINGBUF_DEFAULT_LARGE_SIZE;
+          cfg.prefault = RINGBUF_PREFAULT_MLOCK;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'C':
+        cfg.capture_path = optarg;
+        break;
+      case 'R':
+        cfg.room_log.dir = optarg;
+        break;
+      case 'j':
+        cfg.catchup_msgs = atol(optarg);
+        break;
+      case 'J':
+        cfg.catchup_bytes = atol(optarg);
+        break;
+      case 'g':
+        cfg.room_log.segment_size = atol(optarg);
+        break;
+      case 'G':
+        cfg.room_log.retain_bytes = atol(optarg);
+        break;
+      case 'E':
+        cfg.room_log.retain_sec = atol(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  // 积压超过 write_limit 的数据根本放不进 write_buf，高水位比它还高的话永远
+  // 不会触发。
+  const long limit = write_limit(cfg.memory_budget);
+  if (cfg.high_watermark < 0) {
+    cfg.high_watermark = DEFAULT_HIGH_WATERMARK(limit);
+  }
+  if (cfg.low_watermark < 0) {
+    cfg.low_watermark = DEFAULT_LOW_WATERMARK(limit);
+  }
+  if (optind >= argc || argc - optind > MAX_LISTENERS ||
+      cfg.accept_budget <= 0 || cfg.read_quantum <= 0 ||
+      cfg.max_reads_per_turn <= 0 || cfg.busy_poll_us < 0 ||
+      cfg.socket_busy_poll_us < 0 || cfg.catchup_msgs < 0 ||
+      cfg.catchup_bytes < 0 || cfg.room_log.segment_size <= 0 ||
+      cfg.room_log.retain_bytes < 0 || cfg.room_log.retain_sec < 0 ||
+      cfg.low_watermark > cfg.high_watermark ||
+      cfg.high_watermark > limit || limit < (long)MAX_READ_SIZE) {
+    usage(argv[0]);
+  }
+  for (int i = optind; i < argc; ++i) {
+    cfg.listen_addrs[cfg.nr_listen_addrs++] = argv[i];
   }
-  char *port = argv[1];
 
-  struct server_ctx *srv = server_start(port);
-  fprintf(stderr, "Server listening on %s\n", port);
+  alloc_count_install();
+  membudget_init(cfg.memory_budget);
+  ringbuf_set_large_alloc(cfg.large_alloc_size, cfg.prefault);
+  struct server_ctx *srv = server_start(&cfg);
+  listening_cfg = &cfg;
+  atexit(unlisten_all);
+  if (srv->trace != NULL) {
+    capturing_srv = srv;
+    atexit(finish_capture);
+  }
+  for (int i = 0; i < cfg.nr_listen_addrs; ++i) {
+    fprintf(stderr, "Server listening on %s\n", cfg.listen_addrs[i]);
+  }
 
   return server_run(srv);
 }
\ No newline at end of file
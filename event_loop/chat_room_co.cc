@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "coro.hpp"
+
+extern "C" {
+#include "alloc_count.h"
+#include "membudget.h"
+#include "ringbuf.h"
+#include "util.h"
+}
+
+// chat_room 的协程版本：每个连接一个读协程、一个写协程，连接的处理逻辑都是顺序
+// 的代码（见 read_loop、write_loop），跑在 coro.hpp 的事件循环上。数据的路径和
+// chat_room 一样：直接读进内存池的数据块（bytes.h），广播只是给每个连接的
+// write_buf 追加切片。
+//
+// 它只实现了 chat_room 的主干：落后的消费者只有 block 一种处理方式（任何一个消费者
+// 的积压超过 high watermark 时所有读协程都停下来，降到 low watermark 以下再继续），
+// 内存只有预算（-M，内存池一个数据块也拿不到时读协程等着，内存紧张时拒绝新连接），
+// 没有 chat_room 周期性的内存治理（收缩空闲的缓冲区、限流最大的生产者），也没有
+// 攒批窗口、空闲和写停滞超时、忙轮询和唤醒延迟的统计。
+//
+// 用法：chat_room_co [-H bytes] [-L bytes] [-M bytes] [-m seconds] <addr>...
+
+// 每个连接每一轮事件循环最多读这么多字节，然后让出，免得一个大流量的生产者霸占
+// 事件循环。
+#define READ_QUANTUM (((0x1UL) << 10) * 64)
+#define MAX_WRITE_BUF_PER_CONN (((0x1UL) << 20) * 32)
+#define DEFAULT_HIGH_WATERMARK (MAX_WRITE_BUF_PER_CONN / 4 * 3)
+#define DEFAULT_LOW_WATERMARK (MAX_WRITE_BUF_PER_CONN / 4)
+#define DEFAULT_MEMORY_BUDGET (((0x1UL) << 30) * 1)
+#define DEFAULT_METRICS_INTERVAL_SEC 10
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+// fd 或者内存耗尽、连预留的 fd 也没有了的时候，过多久再试着 accept。
+#define ACCEPT_RETRY_MS 1000
+#define MAX_LISTENERS 8
+#define INITIAL_QUEUE_SLOTS 16
+
+struct server_config {
+  char *listen_addrs[MAX_LISTENERS];
+  int nr_listen_addrs;
+  int high_watermark;
+  int low_watermark;
+  long memory_budget;
+  int metrics_interval_sec;
+};
+
+struct server_metrics {
+  unsigned long nr_accepts;
+  unsigned long nr_refused_conns;
+  unsigned long nr_shed_conns;
+  unsigned long nr_accept_pauses;
+  unsigned long nr_reads;
+  unsigned long nr_read_bytes;
+  unsigned long nr_written_bytes;
+  unsigned long nr_batches;
+  unsigned long nr_ingest_pauses;
+};
+
+struct server;
+
+struct conn {
+  struct server *srv;
+  co_fd io;
+  bool is_socket;
+  // 还没有发出去的数据，内存池里的数据块的切片。
+  struct bytesq write_buf;
+  // write_buf 为空时写协程在这里等。
+  co_signal output;
+  // 可写的连接挂在 server 的 consumers 上，积压超过 high watermark 的连接还挂在
+  // saturated 上。
+  struct dq_node consumer;
+  struct dq_node saturated;
+  bool closing;
+  // 还在运行的协程个数，最后一个退出时释放连接。
+  int nr_tasks;
+};
+
+struct server {
+  // 必须最先构造：之后创建的协程都从它的帧池分配帧。
+  co_loop loop;
+  struct server_config *cfg;
+  struct server_metrics metrics;
+  co_fd listeners[MAX_LISTENERS];
+  int nr_listeners;
+  int nr_conns;
+  // 这一轮事件循环里读协程读到的数据，轮末广播。
+  struct bytesq batch;
+  struct dqueue consumers;
+  struct dqueue saturated;
+  // 有消费者落后时读协程在这里等。
+  co_signal room;
+  // 内存池一个数据块也拿不到时读协程在这里等。
+  co_signal memory;
+  struct event *metrics_timer;
+  // fd 耗尽时用来拒绝排队的连接的预留 fd（见 drop_pending_conn）。
+  int reserve_fd;
+  // listen socket 是边沿触发的，accept 暂停之后已经排队的连接不会再带来新的
+  // 事件，由这个定时器到时把所有 listener 重新激活一次。
+  struct event *accept_retry_timer;
+};
+
+void conn_release(struct conn *c) {
+  if (--c->nr_tasks > 0) {
+    return;
+  }
+  struct server *srv = c->srv;
+  co_fd_close(&c->io);
+  bytesq_destroy(&c->write_buf);
+  --srv->nr_conns;
+  if (c->is_socket) {
+    close(c->io.fd);
+    fprintf(stderr, "Socket fd %d is closed.\n", c->io.fd);
+  }
+  delete c;
+}
+
+// 决定断开连接：不再给它广播，叫醒它的写协程让它退出；shutdown 让还在等 fd 的
+// 读协程（或者写协程）醒过来，看到 EOF 或者错误。
+void conn_close(struct conn *c) {
+  if (c->closing) {
+    return;
+  }
+  struct server *srv = c->srv;
+  c->closing = true;
+  dq_remove(&srv->consumers, &c->consumer);
+  if (dq_node_is_queued(&c->saturated)) {
+    dq_remove(&srv->saturated, &c->saturated);
+    if (dq_is_empty(&srv->saturated)) {
+      srv->room.notify_all(&srv->loop);
+    }
+  }
+  if (c->is_socket) {
+    shutdown(c->io.fd, SHUT_RDWR);
+  }
+  c->output.notify_all(&srv->loop);
+}
+
+detached read_loop(struct conn *c) {
+  struct server *srv = c->srv;
+  struct iovec iov[2];
+  long quantum = READ_QUANTUM;
+  while (!c->closing) {
+    if (!dq_is_empty(&srv->saturated)) {
+      co_await srv->room.wait();
+      continue;
+    }
+    if (quantum <= 0) {
+      quantum = READ_QUANTUM;
+      co_await srv->loop.yield();
+      continue;
+    }
+    co_await readable(&c->io);
+    if (c->closing) {
+      break;
+    }
+
+    // 直接读进内存池的数据块，读到的数据以切片的形式追加到这一轮的 batch。
+    const int iovcnt = bytes_get_free_iovecs(quantum, iov);
+    if (iovcnt == 0) {
+      co_await srv->memory.wait();
+      continue;
+    }
+    const long want = iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0);
+    const ssize_t result = readv(c->io.fd, iov, iovcnt);
+    ++srv->metrics.nr_reads;
+    if (result > 0) {
+      struct bytes slices[2];
+      const int nr_slices = bytes_commit(result, slices);
+      for (int i = 0; i < nr_slices; ++i) {
+        bytesq_push(&srv->batch, &slices[i]);
+      }
+      srv->metrics.nr_read_bytes += result;
+      quantum -= result;
+      if (result < want && c->is_socket && !c->io.peer_closed) {
+        // 接收队列已经空了，省掉一次注定返回 EAGAIN 的 read。
+        c->io.can_read = false;
+      }
+    } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      c->io.can_read = false;
+    } else if (result < 0 && errno == EINTR) {
+      continue;
+    } else {
+      if (result < 0 && c->is_socket) {
+        fprintf(stderr, "read from fd %d: %s\n", c->io.fd, strerror(errno));
+      }
+      break;
+    }
+  }
+
+  if (!c->is_socket) {
+    fprintf(stderr, "Bye!\n");
+    exit(0);
+  }
+  fprintf(stderr, "Got EOF from fd %d\n", c->io.fd);
+  conn_close(c);
+  conn_release(c);
+}
+
+detached write_loop(struct conn *c) {
+  struct server *srv = c->srv;
+  while (true) {
+    while (bytesq_is_empty(&c->write_buf) && !c->closing) {
+      co_await c->output.wait();
+    }
+    if (c->closing) {
+      break;
+    }
+    const long result = co_await send_all(&c->io, &c->write_buf, c->is_socket);
+    if (result < 0) {
+      if (!c->is_socket) {
+        fprintf(stderr, "write: %s\n", strerror(-result));
+        exit(1);
+      }
+      fprintf(stderr, "sendmsg on fd %d: %s, closing it.\n", c->io.fd,
+              strerror(-result));
+      conn_close(c);
+      break;
+    }
+    srv->metrics.nr_written_bytes += result;
+  }
+  conn_release(c);
+}
+
+// readable、writable 表示要不要读协程、写协程。
+struct conn *conn_start(struct server *srv, int fd, bool is_socket,
+                        bool readable, bool writable) {
+  struct conn *c = new conn;
+  c->srv = srv;
+  c->is_socket = is_socket;
+  c->closing = false;
+  c->nr_tasks = readable + writable;
+  bytesq_init(&c->write_buf, INITIAL_QUEUE_SLOTS);
+  dq_node_init(&c->consumer);
+  dq_node_init(&c->saturated);
+  short what = 0;
+  if (readable) {
+    what |= EV_READ;
+    if (is_socket) {
+      what |= EV_CLOSED;
+    }
+  }
+  if (writable) {
+    what |= EV_WRITE;
+    dq_push_back(&srv->consumers, &c->consumer);
+  }
+  co_fd_open(&c->io, &srv->loop, fd, what);
+  ++srv->nr_conns;
+  if (readable) {
+    read_loop(c);
+  }
+  if (writable) {
+    write_loop(c);
+  }
+  return c;
+}
+
+void on_accept_retry(int fd, short flags, void *closure) {
+  struct server *srv = static_cast<struct server *>(closure);
+  open_reserve_fd(&srv->reserve_fd);
+  fprintf(stderr, "Resuming accepting connections.\n");
+  for (int i = 0; i < srv->nr_listeners; ++i) {
+    event_active(srv->listeners[i].ev, EV_READ, 0);
+  }
+}
+
+// 暂停 accept：等 ACCEPT_RETRY_MS 以后由 on_accept_retry 叫醒。
+void pause_accept(struct server *srv, co_fd *l) {
+  l->can_read = false;
+  if (evtimer_pending(srv->accept_retry_timer, NULL)) {
+    return;
+  }
+  ++srv->metrics.nr_accept_pauses;
+  struct timeval delay = {.tv_sec = ACCEPT_RETRY_MS / 1000,
+                          .tv_usec = ACCEPT_RETRY_MS % 1000 * 1000};
+  if (evtimer_add(srv->accept_retry_timer, &delay) != 0) {
+    fprintf(stderr, "Failed to arm accept retry timer.\n");
+    exit(1);
+  }
+}
+
+// listen socket 可读：一直 accept4 到 EAGAIN。fd 用完时用预留的 fd 拒绝排队的
+// 连接；连它也没有了、或者内核内存不足时暂停一会儿再试，不能等下一个连接带来
+// 新的边沿，否则已经排队的连接要一直等下去。
+detached accept_loop(struct server *srv, co_fd *l) {
+  while (true) {
+    co_await readable(l);
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    const int fd = accept4(l->fd, (struct sockaddr *)&addr, &addr_len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd >= 0) {
+      char peer_addr[INET6_ADDRSTRLEN * 2];
+      get_peer_pretty_name(peer_addr, sizeof(peer_addr),
+                           (struct sockaddr *)&addr);
+      fprintf(stderr, "Accepted connection from %s, fd %d\n", peer_addr, fd);
+      ++srv->metrics.nr_accepts;
+      if (bytes_under_pressure()) {
+        fprintf(stderr, "Memory budget exhausted, refusing fd %d.\n", fd);
+        ++srv->metrics.nr_refused_conns;
+        close(fd);
+        continue;
+      }
+      conn_start(srv, fd, true, true, true);
+      continue;
+    }
+
+    switch (errno) {
+      case EINTR:
+      case ECONNABORTED:
+      case EPROTO:
+        break;
+      case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+      case EWOULDBLOCK:
+#endif
+        l->can_read = false;
+        break;
+      case EMFILE:
+      case ENFILE: {
+        const int dropped = drop_pending_conn(l->fd, &srv->reserve_fd);
+        if (dropped > 0) {
+          ++srv->metrics.nr_shed_conns;
+        } else if (dropped == 0) {
+          l->can_read = false;
+        } else {
+          fprintf(stderr, "Out of file descriptors, pausing accept for %d "
+                  "ms.\n", ACCEPT_RETRY_MS);
+          pause_accept(srv, l);
+        }
+        break;
+      }
+      case ENOBUFS:
+      case ENOMEM:
+        fprintf(stderr, "accept4: %s, retrying in %d ms.\n", strerror(errno),
+                ACCEPT_RETRY_MS);
+        pause_accept(srv, l);
+        break;
+      default:
+        fprintf(stderr, "accept4: %s\n", strerror(errno));
+        exit(1);
+    }
+  }
+}
+
+// 广播这一轮读到的数据：给每个消费者的 write_buf 追加切片，叫醒在等数据的写协程
+// （它们在接下来的 run_ready 中直接把数据写出去）。
+void broadcast_batch(struct server *srv) {
+  const int nbytes = bytesq_get_size(&srv->batch);
+  for (struct dq_node *n = srv->consumers.sentinel.next;
+       n != &srv->consumers.sentinel; n = n->next) {
+    struct conn *c = dq_entry(n, struct conn, consumer);
+    bytesq_append_range(&c->write_buf, &srv->batch, 0, nbytes);
+    c->output.notify_all(&srv->loop);
+    if (bytesq_get_size(&c->write_buf) >= srv->cfg->high_watermark &&
+        !dq_node_is_queued(&c->saturated)) {
+      fprintf(stderr, "fd %d is saturated (%d bytes pending).\n", c->io.fd,
+              bytesq_get_size(&c->write_buf));
+      if (dq_is_empty(&srv->saturated)) {
+        ++srv->metrics.nr_ingest_pauses;
+      }
+      dq_push_back(&srv->saturated, &c->saturated);
+    }
+  }
+  bytesq_clear(&srv->batch);
+  ++srv->metrics.nr_batches;
+}
+
+// 积压降到 low watermark 以下的消费者不再算落后，全都不落后时叫醒读协程。
+void update_saturation(struct server *srv) {
+  if (dq_is_empty(&srv->saturated)) {
+    return;
+  }
+  struct dq_node *n = srv->saturated.sentinel.next;
+  while (n != &srv->saturated.sentinel) {
+    struct dq_node *next = n->next;
+    struct conn *c = dq_entry(n, struct conn, saturated);
+    if (bytesq_get_size(&c->write_buf) <= srv->cfg->low_watermark) {
+      fprintf(stderr, "fd %d is no longer saturated.\n", c->io.fd);
+      dq_remove(&srv->saturated, n);
+    }
+    n = next;
+  }
+  if (dq_is_empty(&srv->saturated)) {
+    srv->room.notify_all(&srv->loop);
+  }
+}
+
+void on_metrics_tick(int fd, short flags, void *closure) {
+  struct server *srv = static_cast<struct server *>(closure);
+  struct server_metrics *m = &srv->metrics;
+  frame_pool &frames = srv->loop.frames();
+  fprintf(stderr,
+          "[metrics] conns=%d turns=%lu resumes=%lu batches=%lu "
+          "saturated=%d/%d ingest_pauses=%lu mem=%ld/%ld blocks=%d/%d "
+          "accepts=%lu refused_conns=%lu shed_conns=%lu accept_pauses=%lu "
+          "reads=%lu read_bytes=%lu "
+          "written_bytes=%lu frames(in_use=%lu heap_allocs=%lu)\n",
+          srv->nr_conns, srv->loop.nr_turns(), srv->loop.nr_resumes(),
+          m->nr_batches, dq_size(&srv->saturated), dq_size(&srv->consumers),
+          m->nr_ingest_pauses, membudget_get_usage(), membudget_get_budget(),
+          bytes_get_nr_busy_blocks(), bytes_get_nr_blocks(), m->nr_accepts,
+          m->nr_refused_conns, m->nr_shed_conns, m->nr_accept_pauses,
+          m->nr_reads, m->nr_read_bytes,
+          m->nr_written_bytes, frames.nr_in_use(), frames.nr_heap_allocs());
+}
+
+void server_start(struct server *srv, struct server_config *cfg) {
+  srv->cfg = cfg;
+  memset(&srv->metrics, 0, sizeof(srv->metrics));
+  srv->nr_listeners = 0;
+  srv->nr_conns = 0;
+  bytesq_init(&srv->batch, INITIAL_QUEUE_SLOTS);
+  dq_init(&srv->consumers);
+  dq_init(&srv->saturated);
+
+  srv->reserve_fd = -1;
+  if (open_reserve_fd(&srv->reserve_fd) < 0) {
+    fprintf(stderr, "Failed to open reserved fd: %s\n", strerror(errno));
+    exit(1);
+  }
+  srv->accept_retry_timer =
+      evtimer_new(srv->loop.base(), on_accept_retry, srv);
+  if (srv->accept_retry_timer == NULL) {
+    fprintf(stderr, "Failed to create accept retry timer.\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < cfg->nr_listen_addrs; ++i) {
+    const int fd = listen_on(cfg->listen_addrs[i], DEFAULT_LISTEN_BACKLOG);
+    if (fd == -1) {
+      fprintf(stderr, "Failed to listen on %s.\n", cfg->listen_addrs[i]);
+      exit(1);
+    }
+    co_fd *l = &srv->listeners[srv->nr_listeners++];
+    co_fd_open(l, &srv->loop, fd, EV_READ);
+    accept_loop(srv, l);
+  }
+
+  set_io_non_block(STDIN_FILENO);
+  set_io_non_block(STDOUT_FILENO);
+  conn_start(srv, STDIN_FILENO, false, true, false);
+  conn_start(srv, STDOUT_FILENO, false, false, true);
+
+  srv->metrics_timer = NULL;
+  if (cfg->metrics_interval_sec > 0) {
+    srv->metrics_timer =
+        event_new(srv->loop.base(), -1, EV_PERSIST, on_metrics_tick, srv);
+    struct timeval interval = {.tv_sec = cfg->metrics_interval_sec,
+                               .tv_usec = 0};
+    if (srv->metrics_timer == NULL ||
+        event_add(srv->metrics_timer, &interval) != 0) {
+      fprintf(stderr, "Failed to register metrics timer.\n");
+      exit(1);
+    }
+  }
+}
+
+void server_run(struct server *srv) {
+  while (true) {
+    alloc_count_loop_begin();
+    srv->loop.run_once();
+    update_saturation(srv);
+    if (!bytesq_is_empty(&srv->batch)) {
+      broadcast_batch(srv);
+    }
+    if (srv->memory.has_waiters() && !bytes_under_pressure()) {
+      srv->memory.notify_all(&srv->loop);
+    }
+    srv->loop.run_ready();
+    alloc_count_loop_end();
+  }
+}
+
+// stdin 关闭时进程直接 exit，在 atexit 里删掉文件系统中的 socket 文件。
+struct server_config *listening_cfg = NULL;
+
+void unlisten_all() {
+  for (int i = 0; i < listening_cfg->nr_listen_addrs; ++i) {
+    unlisten(listening_cfg->listen_addrs[i]);
+  }
+}
+
+void usage(char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <addr>...\n"
+          "  <addr>        where to listen, can be given up to %d times:\n"
+          "                <port> or <host>:<port> for TCP, unix:<path> for a "
+          "UNIX domain socket,\n"
+          "                unix:@<name> for one in the abstract namespace\n"
+          "  -H <bytes>    pause all readers while a connection has this much "
+          "pending output (default %lu)\n"
+          "  -L <bytes>    resume them once every connection is below this "
+          "(default %lu)\n"
+          "  -M <bytes>    memory budget for all connection buffers "
+          "(default %lu)\n"
+          "  -m <seconds>  metrics report interval, 0 to disable "
+          "(default %d)\n",
+          prog, MAX_LISTENERS, DEFAULT_HIGH_WATERMARK, DEFAULT_LOW_WATERMARK,
+          DEFAULT_MEMORY_BUDGET, DEFAULT_METRICS_INTERVAL_SEC);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct server_config cfg = {.nr_listen_addrs = 0,
+                              .high_watermark = DEFAULT_HIGH_WATERMARK,
+                              .low_watermark = DEFAULT_LOW_WATERMARK,
+                              .memory_budget = DEFAULT_MEMORY_BUDGET,
+                              .metrics_interval_sec =
+                                  DEFAULT_METRICS_INTERVAL_SEC};
+  int opt;
+  while ((opt = getopt(argc, argv, "H:L:M:m:")) != -1) {
+    switch (opt) {
+      case 'H':
+        cfg.high_watermark = atoi(optarg);
+        break;
+      case 'L':
+        cfg.low_watermark = atoi(optarg);
+        break;
+      case 'M':
+        cfg.memory_budget = atol(optarg);
+        break;
+      case 'm':
+        cfg.metrics_interval_sec = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc || argc - optind > MAX_LISTENERS ||
+      cfg.low_watermark > cfg.high_watermark ||
+      cfg.high_watermark > (int)MAX_WRITE_BUF_PER_CONN) {
+    usage(argv[0]);
+  }
+  for (int i = optind; i < argc; ++i) {
+    cfg.listen_addrs[cfg.nr_listen_addrs++] = argv[i];
+  }
+
+  alloc_count_install();
+  membudget_init(cfg.memory_budget);
+  struct server *srv = new server;
+  server_start(srv, &cfg);
+  listening_cfg = &cfg;
+  atexit(unlisten_all);
+  for (int i = 0; i < cfg.nr_listen_addrs; ++i) {
+    fprintf(stderr, "Server listening on %s\n", cfg.listen_addrs[i]);
+  }
+
+  server_run(srv);
+  return 0;
+}
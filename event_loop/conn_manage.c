@@ -6,7 +6,7 @@
 #include "llist.h"
 
 struct cm_ctx_impl {
-  struct llist_t *fds;
+  llist_t *fds;
 };
 
 struct conn_ctx_impl {
@@ -58,10 +58,9 @@ struct cm_ctx_conn_traverse_closure {
   void *closure;
 };
 
-int cm_ctx_conn_traverse_accessor(struct llist_t *elem, int idx,
-                                  void *closure) {
+int cm_ctx_conn_traverse_accessor(void *payload, int idx, void *closure) {
   struct cm_ctx_conn_traverse_closure *wrapped_closure = closure;
-  struct conn_ctx_impl *conn = elem->payload;
+  struct conn_ctx_impl *conn = payload;
 
   if (!conn->dead) {
     wrapped_closure->cb(conn->fd, idx, wrapped_closure->closure);
@@ -76,13 +75,13 @@ void cm_ctx_traverse(conn_manage_ctx cm_ctx, void *closure,
   struct cm_ctx_conn_traverse_closure closure_wrap;
   closure_wrap.cb = cb;
   closure_wrap.closure = closure;
-  list_traverse(impl->fds, (void *)&closure_wrap,
-                cm_ctx_conn_traverse_accessor);
+  list_traverse_payload(impl->fds, (void *)&closure_wrap,
+                        cm_ctx_conn_traverse_accessor);
 }
 
-int find_fd_accessor(struct llist_t *elem, int idx, void *closure) {
+int find_fd_accessor(void *payload, int idx, void *closure) {
   int *fd_ptr = closure;
-  struct conn_ctx_impl *conn = elem->payload;
+  struct conn_ctx_impl *conn = payload;
   return conn->fd == *fd_ptr ? 1 : 0;
 }
 
@@ -90,9 +89,9 @@ int cm_ctx_get_num_conns(conn_manage_ctx cm_ctx) {
   return list_get_size(((struct cm_ctx_impl *)cm_ctx)->fds);
 }
 
-int get_max_fd_traverse_accessor(struct llist_t *elem, int idx, void *closure) {
+int get_max_fd_traverse_accessor(void *payload, int idx, void *closure) {
   int *max_fd = closure;
-  struct conn_ctx_impl *conn = elem->payload;
+  struct conn_ctx_impl *conn = payload;
   if (conn->fd > *max_fd) {
     *max_fd = conn->fd;
   }
@@ -102,13 +101,13 @@ int get_max_fd_traverse_accessor(struct llist_t *elem, int idx, void *closure) {
 int cm_ctx_get_max_fd(conn_manage_ctx cm_ctx) {
   int max_fd = 0;
   struct cm_ctx_impl *impl = (void *)cm_ctx;
-  list_traverse(impl->fds, &max_fd, get_max_fd_traverse_accessor);
+  list_traverse_payload(impl->fds, &max_fd, get_max_fd_traverse_accessor);
   return max_fd;
 }
 
-int mark_dead_traverse_accessor(struct llist_t *elem, int idx, void *closure) {
+int mark_dead_traverse_accessor(void *payload, int idx, void *closure) {
   int *fd = (int *)closure;
-  struct conn_ctx_impl *conn = elem->payload;
+  struct conn_ctx_impl *conn = payload;
   if (conn->fd == *fd) {
     conn->dead = 1;
     return 0;
@@ -118,7 +117,7 @@ int mark_dead_traverse_accessor(struct llist_t *elem, int idx, void *closure) {
 
 void cm_ctx_conn_mark_dead(conn_manage_ctx cm_ctx, int fd) {
   struct cm_ctx_impl *impl = cm_ctx;
-  list_traverse(impl->fds, &fd, mark_dead_traverse_accessor);
+  list_traverse_payload(impl->fds, &fd, mark_dead_traverse_accessor);
 }
 
 int gc_predicate(void *payload, int idx, void *closure) {
@@ -133,6 +132,7 @@ void gc_before_elem_delete(void *payload, void *closure) {
   struct conn_ctx_impl *conn = payload;
   struct cm_ctx_gc_closure *c = closure;
   c->before_conn_remove(conn->fd);
+  conn_ctx_free(conn);
 }
 
 void cm_ctx_gc(conn_manage_ctx cm_ctx, void (*before_conn_remove)(int fd)) {
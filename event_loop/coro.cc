@@ -0,0 +1,173 @@
+#include "coro.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// send_all 一次 sendmsg/writev 最多带这么多个 iovec。iov 数组放在 send_all 的
+// 协程帧里，太大的话帧就超出了帧池的范围。
+#define SEND_MAX_IOV 64
+
+frame_pool::~frame_pool() {
+  for (std::size_t i = 0; i < NR_CLASSES; ++i) {
+    while (free_[i] != nullptr) {
+      free_frame *f = free_[i];
+      free_[i] = f->next;
+      std::free(f);
+    }
+  }
+}
+
+void *frame_pool::allocate(std::size_t n) {
+  ++nr_in_use_;
+  const std::size_t cls = (n + GRANULE - 1) / GRANULE - 1;
+  if (cls < NR_CLASSES && free_[cls] != nullptr) {
+    free_frame *f = free_[cls];
+    free_[cls] = f->next;
+    return f;
+  }
+
+  ++nr_heap_allocs_;
+  void *p = std::malloc(cls < NR_CLASSES ? (cls + 1) * GRANULE : n);
+  if (p == nullptr) {
+    fprintf(stderr, "Out of memory for a coroutine frame of %zu bytes.\n", n);
+    std::abort();
+  }
+  return p;
+}
+
+void frame_pool::deallocate(void *p, std::size_t n) {
+  --nr_in_use_;
+  const std::size_t cls = (n + GRANULE - 1) / GRANULE - 1;
+  if (cls >= NR_CLASSES) {
+    std::free(p);
+    return;
+  }
+  free_frame *f = static_cast<free_frame *>(p);
+  f->next = free_[cls];
+  free_[cls] = f;
+}
+
+co_loop::co_loop() {
+  evb_ = event_base_new();
+  if (evb_ == nullptr) {
+    fprintf(stderr, "Failed to create event base.\n");
+    exit(1);
+  }
+  dq_init(&ready_);
+  dq_init(&yielded_);
+  current_ = this;
+}
+
+co_loop::~co_loop() {
+  event_base_free(evb_);
+  current_ = nullptr;
+}
+
+void co_loop::run_once() {
+  ++nr_turns_;
+  struct dq_node *n;
+  while ((n = dq_pop_front(&yielded_)) != nullptr) {
+    dq_push_back(&ready_, n);
+  }
+  event_base_loop(evb_, dq_is_empty(&ready_) ? EVLOOP_ONCE : EVLOOP_NONBLOCK);
+  run_ready();
+}
+
+void co_loop::run_ready() {
+  struct dq_node *n;
+  while ((n = dq_pop_front(&ready_)) != nullptr) {
+    co_waiter *w = dq_entry(n, co_waiter, node);
+    ++nr_resumes_;
+    w->handle.resume();
+  }
+}
+
+void on_fd_event(int fd, short what, void *arg) {
+  co_fd *io = static_cast<co_fd *>(arg);
+  co_loop *loop = co_loop::current();
+  if (what & EV_CLOSED) {
+    io->peer_closed = true;
+    what |= EV_READ;
+  }
+  if (what & EV_READ) {
+    io->can_read = true;
+    if (io->reader != nullptr) {
+      loop->schedule(io->reader);
+      io->reader = nullptr;
+    }
+  }
+  if (what & EV_WRITE) {
+    io->can_write = true;
+    if (io->writer != nullptr) {
+      loop->schedule(io->writer);
+      io->writer = nullptr;
+    }
+  }
+}
+
+void co_fd_open(co_fd *io, co_loop *loop, int fd, short what) {
+  io->fd = fd;
+  io->ev = event_new(loop->base(), fd, what | EV_PERSIST | EV_ET, on_fd_event,
+                     io);
+  if (io->ev == nullptr) {
+    fprintf(stderr, "Failed to create event object for fd %d\n", fd);
+    exit(1);
+  }
+  if (event_add(io->ev, nullptr) != 0) {
+    // 普通文件、/dev/null 不能放进 epoll，它们的读写也从来不会 EAGAIN。
+    fprintf(stderr, "fd %d cannot be polled, treating it as always ready.\n",
+            fd);
+    io->always_ready = true;
+  }
+}
+
+void co_fd_close(co_fd *io) {
+  if (io->ev != nullptr) {
+    event_del(io->ev);
+    event_free(io->ev);
+    io->ev = nullptr;
+  }
+}
+
+void co_signal::notify_all(co_loop *loop) {
+  struct dq_node *n;
+  while ((n = dq_pop_front(&waiters_)) != nullptr) {
+    loop->schedule(dq_entry(n, co_waiter, node));
+  }
+}
+
+task<long> send_all(co_fd *io, struct bytesq *q, bool is_socket) {
+  struct iovec iov[SEND_MAX_IOV];
+  long total = 0;
+  while (!bytesq_is_empty(q)) {
+    co_await writable(io);
+    const int iovcnt =
+        bytesq_get_iovecs(q, 0, bytesq_get_size(q), iov, SEND_MAX_IOV);
+    long result;
+    if (is_socket) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      result = sendmsg(io->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } else {
+      result = writev(io->fd, iov, iovcnt);
+    }
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        io->can_write = false;
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      co_return -errno;
+    }
+    bytesq_consume(q, result);
+    total += result;
+  }
+  co_return total;
+}
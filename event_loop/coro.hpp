@@ -0,0 +1,302 @@
+#ifndef MY_CORO
+#define MY_CORO
+
+#include <event2/event.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <type_traits>
+
+extern "C" {
+#include "bytes.h"
+#include "dqueue.h"
+}
+
+// 跑在 libevent 事件循环上的 C++20 协程：连接的处理逻辑可以写成一段顺序的代码，
+//
+//   while (...) {
+//     co_await readable(io);
+//     ... readv ...
+//   }
+//
+// 而不用拆成 on_ready_to_read、on_ready_to_write 几个回调，再用 conn_ctx 里的
+// 标志位把它们串起来。
+//
+// 协程的帧从所在事件循环（co_loop）的帧池（frame_pool）里分配，释放后留在池里给
+// 下一个协程用。挂起、恢复本身不分配内存：等待者（co_waiter）就放在协程的帧里，
+// 用侵入式的 dqueue 串起来；每个 fd 只在打开时创建一个 EV_ET | EV_PERSIST 的
+// 事件，之后再也不 event_add / event_del。所以稳态下事件循环的每一轮都没有任何
+// 堆内存分配（见 chat_room_co_alloc_check）。
+//
+// 事件回调里并不直接恢复协程，只是把它挂到就绪队列上，由 co_loop::run_ready 在
+// 事件分派结束之后依次恢复：协程可能在恢复后把自己的连接（包括那个 fd 的事件）
+// 释放掉，回调里不能再碰它们。
+
+class co_loop;
+
+// 按 64 字节的粒度分级的空闲链表，只在某一级的空闲链表为空时才向 malloc 要内存，
+// 释放的帧回到它那一级的空闲链表，不还给 malloc。超过 4 KiB 的帧直接用 malloc。
+class frame_pool {
+ public:
+  frame_pool() = default;
+  frame_pool(const frame_pool &) = delete;
+  frame_pool &operator=(const frame_pool &) = delete;
+  ~frame_pool();
+
+  void *allocate(std::size_t n);
+  void deallocate(void *p, std::size_t n);
+
+  // 向 malloc 要过的帧的个数、正在使用的帧的个数。
+  unsigned long nr_heap_allocs() const { return nr_heap_allocs_; }
+  unsigned long nr_in_use() const { return nr_in_use_; }
+
+ private:
+  static constexpr std::size_t GRANULE = 64;
+  static constexpr std::size_t NR_CLASSES = 64;
+
+  struct free_frame {
+    free_frame *next;
+  };
+
+  free_frame *free_[NR_CLASSES] = {};
+  unsigned long nr_heap_allocs_ = 0;
+  unsigned long nr_in_use_ = 0;
+};
+
+// 一个挂起的协程，放在它自己的帧里（awaiter 对象的成员）。
+struct co_waiter {
+  struct dq_node node;
+  std::coroutine_handle<> handle;
+};
+
+// 事件循环：包着一个 event_base、一个帧池和一个就绪队列。同一时刻只有一个
+// co_loop 在运行（co_loop::current），协程的帧从它的帧池里分配。
+class co_loop {
+ public:
+  co_loop();
+  co_loop(const co_loop &) = delete;
+  co_loop &operator=(const co_loop &) = delete;
+  ~co_loop();
+
+  static co_loop *current() { return current_; }
+
+  struct event_base *base() const { return evb_; }
+  frame_pool &frames() { return frames_; }
+
+  // 把 w 挂到就绪队列上，在这一轮的 run_ready 中恢复。
+  void schedule(co_waiter *w) { dq_push_back(&ready_, &w->node); }
+
+  // 等待并分派一轮事件，然后恢复所有就绪的协程。有就绪的或者让出的协程时不阻塞。
+  void run_once();
+
+  // 依次恢复就绪队列里的协程，直到它为空（恢复的协程又唤醒的协程也在其中）。
+  void run_ready();
+
+  // co_await loop.yield()：让出到下一轮事件循环，先让别的连接读一读。
+  struct yield_awaiter {
+    co_loop *loop;
+    co_waiter w;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      w.handle = h;
+      dq_node_init(&w.node);
+      dq_push_back(&loop->yielded_, &w.node);
+    }
+    void await_resume() const noexcept {}
+  };
+  yield_awaiter yield() { return {this, {}}; }
+
+  // 经历过的轮数、恢复过的协程的次数。
+  unsigned long nr_turns() const { return nr_turns_; }
+  unsigned long nr_resumes() const { return nr_resumes_; }
+
+ private:
+  static inline co_loop *current_ = nullptr;
+
+  struct event_base *evb_;
+  frame_pool frames_;
+  struct dqueue ready_;
+  struct dqueue yielded_;
+  unsigned long nr_turns_ = 0;
+  unsigned long nr_resumes_ = 0;
+};
+
+// 协程的 promise 都从当前事件循环的帧池分配帧。
+struct pooled_promise {
+  static void *operator new(std::size_t n) {
+    return co_loop::current()->frames().allocate(n);
+  }
+  static void operator delete(void *p, std::size_t n) {
+    co_loop::current()->frames().deallocate(p, n);
+  }
+  // 编译时没有异常（-fno-exceptions），协程里不会有异常逃出来。
+  void unhandled_exception() noexcept { std::abort(); }
+};
+
+// 一个独立运行的协程（比如一个连接的读循环）：调用时立刻开始执行，执行完时帧
+// 自动释放，没有人等它的结果。
+struct detached {
+  struct promise_type : pooled_promise {
+    detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+  };
+};
+
+template <typename T>
+class task;
+
+template <typename T>
+struct task_promise_base : pooled_promise {
+  std::coroutine_handle<> continuation;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  // 执行完时直接切换回等待它的协程（对称转移），不经过事件循环。
+  struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation;
+    }
+    void await_resume() const noexcept {}
+  };
+  final_awaiter final_suspend() noexcept { return {}; }
+};
+
+template <typename T>
+struct task_promise : task_promise_base<T> {
+  T value{};
+  task<T> get_return_object() noexcept;
+  void return_value(T v) noexcept { value = v; }
+};
+
+template <>
+struct task_promise<void> : task_promise_base<void> {
+  task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+};
+
+// 一个由别的协程 co_await 的子协程，返回一个 T。被 co_await 时才开始执行，执行完
+// 时切换回等待它的协程，帧在 task 析构时释放。
+template <typename T = void>
+class task {
+ public:
+  using promise_type = task_promise<T>;
+
+  explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+  task(task &&other) noexcept : h_(other.h_) { other.h_ = nullptr; }
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+  ~task() {
+    if (h_) {
+      h_.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+    h_.promise().continuation = h;
+    return h_;
+  }
+  T await_resume() noexcept {
+    if constexpr (!std::is_void_v<T>) {
+      return h_.promise().value;
+    }
+  }
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+template <typename T>
+task<T> task_promise<T>::get_return_object() noexcept {
+  return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+  return task<void>(
+      std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+// 一个 fd 的读写就绪状态。边沿触发：can_read、can_write 在事件到来时置位，由
+// 调用者在 read/write 返回 EAGAIN 时清掉，清掉之后再 co_await 才会真正挂起。
+// 同一时刻每个方向最多一个协程在等。
+struct co_fd {
+  int fd = -1;
+  struct event *ev = nullptr;
+  bool can_read = true;
+  bool can_write = true;
+  // epoll 不支持的 fd（普通文件、/dev/null）总是就绪的，永远不挂起。
+  bool always_ready = false;
+  // 对端已经关闭了写方向（EV_CLOSED），这之后读到的数据不足也要一直读到 EOF。
+  bool peer_closed = false;
+  co_waiter *reader = nullptr;
+  co_waiter *writer = nullptr;
+};
+
+// 在 loop 上打开 fd（what 是 EV_READ、EV_WRITE、EV_CLOSED 的组合），只创建、登记
+// 一次事件。
+void co_fd_open(co_fd *io, co_loop *loop, int fd, short what);
+
+// 删除并释放事件，不关闭 fd。调用者保证已经没有协程在等它。
+void co_fd_close(co_fd *io);
+
+struct fd_awaiter {
+  co_fd *io;
+  bool reading;
+  co_waiter w;
+  bool await_ready() const noexcept {
+    return io->always_ready || (reading ? io->can_read : io->can_write);
+  }
+  void await_suspend(std::coroutine_handle<> h) noexcept {
+    w.handle = h;
+    dq_node_init(&w.node);
+    (reading ? io->reader : io->writer) = &w;
+  }
+  void await_resume() const noexcept {}
+};
+
+// co_await readable(io) / writable(io)：等到 fd 可读 / 可写（或者出错、对端关闭，
+// 这时接下来的 read/write 会返回错误）。
+inline fd_awaiter readable(co_fd *io) { return {io, true, {}}; }
+inline fd_awaiter writable(co_fd *io) { return {io, false, {}}; }
+
+// 一个条件：协程在上面等（co_await sig.wait()），notify_all 把它们都挂到就绪
+// 队列上。
+class co_signal {
+ public:
+  co_signal() { dq_init(&waiters_); }
+  co_signal(const co_signal &) = delete;
+  co_signal &operator=(const co_signal &) = delete;
+
+  struct awaiter {
+    co_signal *sig;
+    co_waiter w;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept {
+      w.handle = h;
+      dq_node_init(&w.node);
+      dq_push_back(&sig->waiters_, &w.node);
+    }
+    void await_resume() const noexcept {}
+  };
+  awaiter wait() { return {this, {}}; }
+
+  bool has_waiters() { return !dq_is_empty(&waiters_); }
+
+  void notify_all(co_loop *loop);
+
+ private:
+  struct dqueue waiters_;
+};
+
+// co_await send_all(io, q, more)：用 sendmsg（socket）或者 writev（其它文件）把 q
+// 的全部内容写出去，写一部分就从 q 里 consume 一部分，遇到 EAGAIN 就等到可写再
+// 接着写。返回写出的字节数，出错时返回 -errno（q 里剩下的留给调用者处理）。
+task<long> send_all(co_fd *io, struct bytesq *q, bool is_socket);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef MY_DQUEUE
+#define MY_DQUEUE
+
+#include <stddef.h>
+
+// 侵入式（intrusive）双向链表队列：节点 dq_node 直接嵌在被管理的结构体里，入队、
+// 出队、从任意位置移除都是 O(1) 的，并且不需要分配内存。
+//
+// 一个节点同一时刻最多在一个队列中，重复入队是空操作，所以它也可以被当成一个
+// 「集合」来用（例如 dirty set）。
+struct dq_node {
+  struct dq_node *prev;
+  struct dq_node *next;
+};
+
+// 队列本身是一个带哨兵节点的环形链表。
+struct dqueue {
+  struct dq_node sentinel;
+  int size;
+};
+
+// 由节点指针得到包含它的结构体的指针。
+#define dq_entry(node_ptr, type, member) \
+  ((type *)((char *)(node_ptr) - offsetof(type, member)))
+
+static inline void dq_init(struct dqueue *q) {
+  q->sentinel.prev = &q->sentinel;
+  q->sentinel.next = &q->sentinel;
+  q->size = 0;
+}
+
+static inline void dq_node_init(struct dq_node *n) {
+  n->prev = NULL;
+  n->next = NULL;
+}
+
+static inline int dq_node_is_queued(struct dq_node *n) { return n->next != NULL; }
+
+static inline int dq_is_empty(struct dqueue *q) { return q->size == 0; }
+
+static inline int dq_size(struct dqueue *q) { return q->size; }
+
+// 把 n 追加到队尾，如果 n 已经在某个队列中，什么都不做。
+static inline void dq_push_back(struct dqueue *q, struct dq_node *n) {
+  if (dq_node_is_queued(n)) {
+    return;
+  }
+  n->prev = q->sentinel.prev;
+  n->next = &q->sentinel;
+  q->sentinel.prev->next = n;
+  q->sentinel.prev = n;
+  ++q->size;
+}
+
+// 把 n 插到队首，如果 n 已经在某个队列中，什么都不做。
+static inline void dq_push_front(struct dqueue *q, struct dq_node *n) {
+  if (dq_node_is_queued(n)) {
+    return;
+  }
+  n->prev = &q->sentinel;
+  n->next = q->sentinel.next;
+  q->sentinel.next->prev = n;
+  q->sentinel.next = n;
+  ++q->size;
+}
+
+// 把 n 从它所在的队列 q 中移除，如果 n 不在队列中，什么都不做。
+static inline void dq_remove(struct dqueue *q, struct dq_node *n) {
+  if (!dq_node_is_queued(n)) {
+    return;
+  }
+  n->prev->next = n->next;
+  n->next->prev = n->prev;
+  dq_node_init(n);
+  --q->size;
+}
+
+// 取出并返回队首节点，队列为空时返回 NULL。
+static inline struct dq_node *dq_pop_front(struct dqueue *q) {
+  if (dq_is_empty(q)) {
+    return NULL;
+  }
+  struct dq_node *n = q->sentinel.next;
+  dq_remove(q, n);
+  return n;
+}
+
+#endif
@@ -7,10 +7,16 @@
 #include <sys/select.h>
 #include <unistd.h>
 
+#include "rawsys.h"
+
 const int fd_capacity_per_int = sizeof(int) * 8;
 int fdset_storage[3 * FD_SETSIZE / fd_capacity_per_int];
 
-const int max_io_buf_size = 256;
+// 每次从 stdin 读多少字节在 [min_read_size, max_io_buf_size] 之间自适应：读满了就
+// 翻倍，读到的不足四分之一就减半。
+#define max_io_buf_size (64 * 1024)
+const int min_read_size = 256;
+int read_size = min_read_size;
 char read_buf[max_io_buf_size];
 int write_buf_start = 0;
 int write_buf_current_size = 0;
@@ -98,7 +104,13 @@ int main() {
     // 每一次 select() 函数调用 return 后，没有 ready 的文件对应的 flags 会被置
     // 0，而 ready 立等可取的文件的 flags 会被保留，所以在每轮循环开始都手动调用
     // FD_SET() macro 设定一遍。
-    FD_SET(STDIN_FILENO, read_interest);
+    // write_buf 满了就先不读 stdin，等 stdout 把数据写出去再说，不然读进来的数据
+    // 只能覆盖掉还没写出去的数据。
+    if (get_write_buf_remain_capacity() > 0) {
+      FD_SET(STDIN_FILENO, read_interest);
+    } else {
+      FD_CLR(STDIN_FILENO, read_interest);
+    }
     FD_SET(STDOUT_FILENO, write_interest);
 
     FD_SET(STDIN_FILENO, err_interest);
@@ -137,15 +149,15 @@ int main() {
           max_write = sizeof(write_buf) - write_buf_start;
         }
         write_result =
-            write(STDOUT_FILENO, &write_buf[write_buf_start], max_write);
+            sys_write(STDOUT_FILENO, &write_buf[write_buf_start], max_write);
         if (write_result == 0) {
           fprintf(stderr, "Got EOF from stdout, exitting...\n");
           return 0;
         } else if (write_result < 0) {
-          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          if (write_result != -EAGAIN && write_result != -EWOULDBLOCK) {
             fprintf(stderr,
                     "Un-expected error on stdin, errorno = %d, exitting...\n",
-                    errno);
+                    -write_result);
             exit(1);
           }
           fprintf(stderr, "stdout is blocking now, would try again later.\n");
@@ -165,15 +177,19 @@ int main() {
     if (FD_ISSET(STDIN_FILENO, read_interest)) {
       fprintf(stderr, "stdin is now ready to read.\n");
 
-      int bytes_read = read(STDIN_FILENO, read_buf, max_io_buf_size);
+      int asked = read_size;
+      if (asked > get_write_buf_remain_capacity()) {
+        asked = get_write_buf_remain_capacity();
+      }
+      int bytes_read = sys_read(STDIN_FILENO, read_buf, asked);
       if (bytes_read == 0) {
         fprintf(stderr, "Got EOF from stdin, exitting...\n");
         return 0;
       } else if (bytes_read < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (bytes_read != -EAGAIN && bytes_read != -EWOULDBLOCK) {
           fprintf(stderr,
                   "Un-expected error on stdin, errorno = %d, exitting...\n",
-                  errno);
+                  -bytes_read);
           exit(1);
         }
         fprintf(stderr, "stdin is blocking now, would try again later.\n");
@@ -181,6 +197,11 @@ int main() {
         fprintf(stderr,
                 "Got %d bytes from stdin, writing them to write_buf...\n",
                 bytes_read);
+        if (bytes_read == read_size && read_size < max_io_buf_size) {
+          read_size *= 2;
+        } else if (bytes_read < read_size / 4 && read_size > min_read_size) {
+          read_size /= 2;
+        }
         int nr_exceed_bytes = bytes_read - get_write_buf_remain_capacity();
         if (nr_exceed_bytes > 0) {
           fprintf(stderr,
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "alloc_count.h"
 #include "util.h"
 
 #define MAX_READ_BUF 1024
@@ -19,8 +20,42 @@ struct ringbuf {
   int capacity;
 };
 
+// stdin 和 stdout 的事件对象都只创建一次（EV_PERSIST | EV_ET），stdin
+// 的读事件一直挂着，stdout 的写事件只在 ring buffer 由空变为非空时 add，
+// 在 ring buffer 被写空时 del。
+struct io_echo_ctx {
+  struct ringbuf rb;
+  struct event *stdin_ev;
+  struct event *stdout_ev;
+  int stdout_armed;
+};
+
+void arm_stdout(struct io_echo_ctx *ctx) {
+  if (ctx->stdout_armed) {
+    return;
+  }
+
+  if (event_add(ctx->stdout_ev, NULL) != 0) {
+    fprintf(stderr, "Failed to register write event to stdout.\n");
+    exit(1);
+  }
+  ctx->stdout_armed = 1;
+  fprintf(stderr, "stdout write interest is registered.\n");
+}
+
+void disarm_stdout(struct io_echo_ctx *ctx) {
+  if (!ctx->stdout_armed) {
+    return;
+  }
+
+  event_del(ctx->stdout_ev);
+  ctx->stdout_armed = 0;
+  fprintf(stderr, "stdout write interest is removed.\n");
+}
+
 void on_stdin_activity(int fd, short flags, void *closure) {
   fprintf(stderr, "stdin is now ready to read.\n");
+  struct io_echo_ctx *ctx = closure;
   char buf[MAX_READ_BUF];
   while (1) {
     int result = read(fd, buf, sizeof(buf));
@@ -38,7 +73,7 @@ void on_stdin_activity(int fd, short flags, void *closure) {
       break;
     } else {
       fprintf(stderr, "Got %d bytes from stdin.\n", result);
-      struct ringbuf *c = closure;
+      struct ringbuf *c = &ctx->rb;
       int exceeded = cp_to_ring_buf(c->buf, &(c->start_offset), &(c->size),
                                     c->capacity, buf, result);
       if (exceeded > 0) {
@@ -49,18 +84,21 @@ void on_stdin_activity(int fd, short flags, void *closure) {
             "earlist would be overwritten.\n",
             (unsigned long)(c->buf), exceeded);
       }
+      arm_stdout(ctx);
     }
   }
 }
 
 void on_stdout_ready_to_write(int fd, short flags, void *closure) {
   fprintf(stderr, "stdout is now ready to write.\n");
-  struct ringbuf *c = closure;
+  struct io_echo_ctx *ctx = closure;
+  struct ringbuf *c = &ctx->rb;
   while (1) {
     char buf[MAX_READ_BUF];
     int chunk_size = get_chunk_from_ring_buf(
         buf, sizeof(buf), c->buf, &(c->start_offset), &(c->size), c->capacity);
     if (chunk_size == 0) {
+      disarm_stdout(ctx);
       break;
     }
 
@@ -95,50 +133,51 @@ void on_stdout_ready_to_write(int fd, short flags, void *closure) {
 }
 
 int main() {
+  alloc_count_install();
+
   struct event_base *ev_base = event_base_new();
   if (ev_base == NULL) {
     fprintf(stderr, "Failed to create event base.\n");
     exit(1);
   }
 
-  struct ringbuf closure = {.buf = io_stage_buf,
-                            .capacity = sizeof(io_stage_buf),
-                            .size = 0,
-                            .start_offset = 0};
+  struct io_echo_ctx ctx = {.rb = {.buf = io_stage_buf,
+                                   .capacity = sizeof(io_stage_buf),
+                                   .size = 0,
+                                   .start_offset = 0},
+                            .stdout_armed = 0};
 
   set_io_non_block(STDIN_FILENO);
   set_io_non_block(STDOUT_FILENO);
 
-  while (1) {
-    struct event *stdin_ev =
-        event_new(ev_base, STDIN_FILENO, EV_READ, on_stdin_activity, &closure);
-    if (event_add(stdin_ev, NULL) != 0) {
-      fprintf(stderr, "Failed to register read event to stdin.\n");
-      exit(1);
-    } else {
-      fprintf(stderr, "stdin read interest is registered.\n");
-    }
+  ctx.stdin_ev = event_new(ev_base, STDIN_FILENO, EV_READ | EV_PERSIST | EV_ET,
+                           on_stdin_activity, &ctx);
+  ctx.stdout_ev =
+      event_new(ev_base, STDOUT_FILENO, EV_WRITE | EV_PERSIST | EV_ET,
+                on_stdout_ready_to_write, &ctx);
+  if (ctx.stdin_ev == NULL || ctx.stdout_ev == NULL) {
+    fprintf(stderr, "Failed to create event object for stdin/stdout.\n");
+    exit(1);
+  }
 
-    if (closure.size > 0) {
-      fprintf(
-          stderr,
-          "IO buf is non-empty, getting a chance to emit them to stdout...\n");
-      struct event *stdout_ev = event_new(ev_base, STDOUT_FILENO, EV_WRITE,
-                                          on_stdout_ready_to_write, &closure);
-      if (event_add(stdout_ev, NULL) != 0) {
-        fprintf(stderr, "Failed to register write event to stdout.\n");
-        exit(1);
-      } else {
-        fprintf(stderr, "stdout write interest is registered.\n");
-      }
-    }
+  if (event_add(ctx.stdin_ev, NULL) != 0) {
+    fprintf(stderr, "Failed to register read event to stdin.\n");
+    exit(1);
+  } else {
+    fprintf(stderr, "stdin read interest is registered.\n");
+  }
 
+  while (1) {
     fprintf(stderr, "Waiting IO activity...\n");
+    alloc_count_loop_begin();
     int evb_loop_flags = EVLOOP_ONCE;
     event_base_loop(ev_base, evb_loop_flags);
+    alloc_count_loop_end();
   }
 
+  event_free(ctx.stdin_ev);
+  event_free(ctx.stdout_ev);
   event_base_free(ev_base);
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,38 @@
+#include "lathist.h"
+
+#include <string.h>
+
+void lathist_reset(struct lathist *h) { memset(h, 0, sizeof(*h)); }
+
+void lathist_record(struct lathist *h, long ns) {
+  if (ns < 0) {
+    ns = 0;
+  }
+  int idx = ns == 0 ? 0 : 64 - __builtin_clzl(ns);
+  if (idx >= LATHIST_BUCKETS) {
+    idx = LATHIST_BUCKETS - 1;
+  }
+  ++h->buckets[idx];
+  ++h->count;
+  h->sum_ns += ns;
+  if ((unsigned long)ns > h->max_ns) {
+    h->max_ns = ns;
+  }
+}
+
+unsigned long lathist_percentile(struct lathist *h, int p) {
+  if (h->count == 0) {
+    return 0;
+  }
+  // 第 rank 个样本（从 1 开始数）。
+  const unsigned long rank = (h->count * p + 99) / 100;
+  unsigned long seen = 0;
+  for (int i = 0; i < LATHIST_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank && seen > 0) {
+      const unsigned long upper = i == 0 ? 0 : 1UL << i;
+      return upper < h->max_ns ? upper : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
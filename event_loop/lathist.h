@@ -0,0 +1,24 @@
+#ifndef MY_LATHIST
+#define MY_LATHIST
+
+// 延迟直方图：按 2 的幂给纳秒数分桶，记录一个样本是 O(1) 的，不分配内存，
+// 分位数只能精确到所在的桶（上界最多是真实值的两倍）。
+
+#define LATHIST_BUCKETS 40
+
+struct lathist {
+  unsigned long count;
+  unsigned long sum_ns;
+  unsigned long max_ns;
+  // buckets[i] 是落在 [2^(i-1), 2^i) 纳秒里的样本数，buckets[0] 是 0 纳秒。
+  unsigned long buckets[LATHIST_BUCKETS];
+};
+
+void lathist_reset(struct lathist *h);
+
+void lathist_record(struct lathist *h, long ns);
+
+// 返回第 p 百分位（0 到 100）的样本所在的桶的上界（纳秒），没有样本时返回 0。
+unsigned long lathist_percentile(struct lathist *h, int p);
+
+#endif
@@ -99,9 +99,10 @@ void list_elem_find_and_remove(
     int delete_all) {
   int idx;
   struct llist_impl_t *head = *root;
-  struct llist_impl_t *prev, *curr;
-  for (idx = 0, prev = NULL, curr = head; curr != NULL;
-       curr = curr->next, ++idx) {
+  struct llist_impl_t *prev, *curr, *next;
+  for (idx = 0, prev = NULL, curr = head; curr != NULL; curr = next, ++idx) {
+    // curr 可能会被释放，先记下它的下一个元素。
+    next = curr->next;
     if (predicate(curr->payload, idx, predicate_closure)) {
       if (prev != NULL) {
         prev->next = curr->next;
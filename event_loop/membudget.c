@@ -0,0 +1,26 @@
+#include "membudget.h"
+
+#include <limits.h>
+
+long membudget_budget = LONG_MAX;
+long membudget_usage = 0;
+
+void membudget_init(long budget) { membudget_budget = budget; }
+
+int membudget_charge(long nbytes) {
+  if (nbytes > membudget_budget - membudget_usage) {
+    return -1;
+  }
+  membudget_usage += nbytes;
+  return 0;
+}
+
+void membudget_release(long nbytes) { membudget_usage -= nbytes; }
+
+long membudget_get_usage() { return membudget_usage; }
+
+long membudget_get_budget() { return membudget_budget; }
+
+int membudget_under_pressure() {
+  return membudget_usage > membudget_budget / 8 * 7;
+}
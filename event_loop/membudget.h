@@ -0,0 +1,26 @@
+#ifndef MY_MEMBUDGET
+#define MY_MEMBUDGET
+
+// 进程级的内存预算，所有 ringbuf 的分配（包括扩容）、bytes.h 的内存池的 arena 都要
+// 先向它申请额度，释放（包括缩容）时归还额度。没有调用 membudget_init 时预算是无限的。
+
+// 设定预算（字节数）。
+void membudget_init(long budget);
+
+// 申请 nbytes 字节的额度，成功返回 0，超出预算时返回 -1（不会记账）。
+int membudget_charge(long nbytes);
+
+// 归还 nbytes 字节的额度。
+void membudget_release(long nbytes);
+
+// 获取当前已用额度。
+long membudget_get_usage();
+
+// 获取预算。
+long membudget_get_budget();
+
+// 判断是否处于内存压力之下（已用额度超过预算的 7/8），这时应该收缩空闲的缓冲区、
+// 限制大流量的生产者。
+int membudget_under_pressure();
+
+#endif
@@ -0,0 +1,100 @@
+#include "mpscq.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+void mpscq_init(struct mpscq *q) {
+  atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+  atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+  q->tail = &q->stub;
+  atomic_store(&q->bell, 0);
+  atomic_store(&q->consumer_waiting, 0);
+  atomic_store(&q->nr_sleeps, 0);
+  atomic_store(&q->nr_wakes, 0);
+}
+
+long mpscq_futex(_Atomic unsigned int *word, int op, unsigned int val,
+                 const struct timespec *timeout) {
+  return syscall(SYS_futex, word, op | FUTEX_PRIVATE_FLAG, val, timeout, NULL,
+                 0);
+}
+
+// 把 n 挂到队尾，不叫醒消费者。
+void mpscq_link(struct mpscq *q, struct mpscq_node *n) {
+  atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+  struct mpscq_node *prev =
+      atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+  // 在这之前消费者从 prev 走不到 n，pop 会以为队列暂时是空的。
+  atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+void mpscq_push(struct mpscq *q, struct mpscq_node *n) {
+  mpscq_link(q, n);
+  atomic_thread_fence(memory_order_seq_cst);
+  // 消费者登记过要睡的话，撤销登记并叫醒它。只有一个生产者能撤销成功。
+  if (atomic_load_explicit(&q->consumer_waiting, memory_order_relaxed) &&
+      atomic_exchange(&q->consumer_waiting, 0)) {
+    atomic_fetch_add(&q->bell, 1);
+    mpscq_futex(&q->bell, FUTEX_WAKE, 1, NULL);
+    atomic_fetch_add_explicit(&q->nr_wakes, 1, memory_order_relaxed);
+  }
+}
+
+struct mpscq_node *mpscq_pop(struct mpscq *q) {
+  struct mpscq_node *tail = q->tail;
+  struct mpscq_node *next =
+      atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &q->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    q->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&next->next, memory_order_acquire);
+  }
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+    // 有生产者 push 到一半。
+    return NULL;
+  }
+  // tail 是最后一个节点：把 stub 放回队尾，tail 就有了后继，可以取走了。
+  mpscq_link(q, &q->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+int mpscq_has_data(struct mpscq *q) {
+  return q->tail != &q->stub ||
+         atomic_load_explicit(&q->head, memory_order_acquire) != &q->stub;
+}
+
+// 先登记、后检查条件；生产者先发布、后检查登记，两边中间都有一个全序的 fence，
+// 所以不会两边都错过。
+int mpscq_wait(struct mpscq *q, int timeout_ms) {
+  if (mpscq_has_data(q)) {
+    return 1;
+  }
+  const unsigned int seq = atomic_load(&q->bell);
+  atomic_store(&q->consumer_waiting, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (mpscq_has_data(q)) {
+    atomic_store(&q->consumer_waiting, 0);
+    return 1;
+  }
+
+  struct timespec ts = {.tv_sec = timeout_ms / 1000,
+                        .tv_nsec = timeout_ms % 1000 * 1000000L};
+  mpscq_futex(&q->bell, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &ts);
+  atomic_fetch_add_explicit(&q->nr_sleeps, 1, memory_order_relaxed);
+  atomic_store(&q->consumer_waiting, 0);
+  return mpscq_has_data(q);
+}
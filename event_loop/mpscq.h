@@ -0,0 +1,55 @@
+#ifndef MY_MPSCQ
+#define MY_MPSCQ
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// 多生产者、单消费者的无锁侵入式队列（Vyukov 的算法）：push 只有一次
+// atomic_exchange 和一次 store，不会失败也不用重试；pop 只由一个线程调用，通常
+// 没有任何原子的读改写。队列本身不限长度，要限制内存的话由生产者限制手里的
+// 节点数（socket_mux_mt 里每个读线程只有固定数目的 chunk）。
+//
+// 消费者没事可做时可以用 mpscq_wait 睡在 futex 上，和 shmring 的门铃一样：睡之前
+// 先登记，生产者 push 之后看到登记了才发起 FUTEX_WAKE，所以双方都忙着的时候
+// 两边都没有 syscall。
+
+#define MPSCQ_CACHELINE_SIZE 64
+
+struct mpscq_node {
+  _Atomic(struct mpscq_node *) next;
+};
+
+struct mpscq {
+  // 生产者写：最后一个节点。
+  _Alignas(MPSCQ_CACHELINE_SIZE) _Atomic(struct mpscq_node *) head;
+
+  // 消费者写：下一个要 pop 的节点。队列空的时候 head 和 tail 都指向 stub。
+  _Alignas(MPSCQ_CACHELINE_SIZE) struct mpscq_node *tail;
+  struct mpscq_node stub;
+
+  // 消费者等数据时的 futex 字和登记。
+  _Alignas(MPSCQ_CACHELINE_SIZE) _Atomic unsigned int bell;
+  _Atomic unsigned int consumer_waiting;
+
+  // 消费者为了等数据而睡下去的次数，生产者为了叫醒它发起 FUTEX_WAKE 的次数。
+  _Atomic unsigned long nr_sleeps;
+  _Atomic unsigned long nr_wakes;
+};
+
+void mpscq_init(struct mpscq *q);
+
+// 任何线程都可以调用。消费者在等数据时叫醒它。
+void mpscq_push(struct mpscq *q, struct mpscq_node *n);
+
+// 只能由消费者调用。返回最早 push 进来的节点，队列为空时返回 NULL。有生产者
+// 正 push 到一半时也可能返回 NULL，这时 mpscq_wait 会立即返回，再 pop 一次即可。
+struct mpscq_node *mpscq_pop(struct mpscq *q);
+
+// 只能由消费者调用。等到队列不为空或者等了 timeout_ms 毫秒（-1 表示不限），
+// 返回队列是否不为空。
+int mpscq_wait(struct mpscq *q, int timeout_ms);
+
+#define mpscq_entry(node_ptr, type, member) \
+  ((type *)((char *)(node_ptr) - offsetof(type, member)))
+
+#endif
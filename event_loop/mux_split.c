@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "muxframe.h"
+#include "shmring.h"
+
+// socket_mux -f 输出的分帧流的消费者：按帧头把各个来源的数据重新分开。-d 把每
+// 个来源的数据写到 dir/<source> 里，不给 -d 时只统计。输入默认是 stdin：是普通
+// 文件时整个映射进来原地解析，是管道时读进一块缓冲区解析；-s 直接在 socket_mux
+// -o 的共享内存环里原地解析。解析只是按帧头里的长度往后跳，数据本身一次也不
+// 复制（除了写到 -d 的文件里）。
+// 用法：mux_split [-d dir] [-s shm_path]
+
+#define READ_BUF_SIZE (1024 * 1024 * 4)
+#define SHM_SPIN 1000
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "write: %s\n", strerror(errno));
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+struct split_ctx {
+  const char *dir;
+  struct mux_demux demux;
+  int started;
+  // 按来源编号索引的输出文件，还没打开或者已经关闭的是 -1。
+  int *out_fds;
+  unsigned int nr_out_fds;
+  unsigned long nr_frames;
+  unsigned long nr_bytes;
+  unsigned long nr_sources;
+  unsigned long nr_closed;
+  uint64_t first_ts_ns;
+  uint64_t last_ts_ns;
+};
+
+int open_output(struct split_ctx *ctx, uint32_t source) {
+  if (source >= ctx->nr_out_fds) {
+    unsigned int n = ctx->nr_out_fds > 0 ? ctx->nr_out_fds : 64;
+    while (n <= source) {
+      n *= 2;
+    }
+    ctx->out_fds = realloc(ctx->out_fds, n * sizeof(int));
+    for (unsigned int i = ctx->nr_out_fds; i < n; ++i) {
+      ctx->out_fds[i] = -1;
+    }
+    ctx->nr_out_fds = n;
+  }
+  if (ctx->out_fds[source] < 0) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%u", ctx->dir, source);
+    ctx->out_fds[source] =
+        open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (ctx->out_fds[source] < 0) {
+      fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    }
+  }
+  return ctx->out_fds[source];
+}
+
+// 解析 buf 里所有完整的帧，返回消耗的字节数；剩下的是半帧，等更多的数据。
+// 流不是分帧的时返回 -1。
+long split(struct split_ctx *ctx, const char *buf, size_t len) {
+  size_t pos = 0;
+  if (!ctx->started) {
+    int n = mux_demux_init(&ctx->demux, buf, len);
+    if (n <= 0) {
+      if (n < 0) {
+        fprintf(stderr, "Input is not a framed stream (socket_mux -f).\n");
+      }
+      return n;
+    }
+    ctx->started = 1;
+    pos = n;
+  }
+
+  struct mux_frame f;
+  size_t n;
+  while ((n = mux_demux_next(&ctx->demux, buf + pos, len - pos, &f)) > 0) {
+    pos += n;
+    ++ctx->nr_frames;
+    if (f.source >= ctx->nr_sources) {
+      ctx->nr_sources = f.source + 1;
+    }
+    if (f.ts_ns != 0) {
+      if (ctx->first_ts_ns == 0) {
+        ctx->first_ts_ns = f.ts_ns;
+      }
+      ctx->last_ts_ns = f.ts_ns;
+    }
+    if (f.len == 0) {
+      ++ctx->nr_closed;
+      if (f.source < ctx->nr_out_fds && ctx->out_fds[f.source] >= 0) {
+        close(ctx->out_fds[f.source]);
+        ctx->out_fds[f.source] = -1;
+      }
+      continue;
+    }
+    ctx->nr_bytes += f.len;
+    if (ctx->dir != NULL) {
+      int fd = open_output(ctx, f.source);
+      if (fd >= 0) {
+        write_all(fd, f.data, f.len);
+      }
+    }
+  }
+  return pos;
+}
+
+int split_mapped(struct split_ctx *ctx, int fd, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s\n", strerror(errno));
+    return -1;
+  }
+  madvise((void *)map, size, MADV_SEQUENTIAL);
+  long n = split(ctx, map, size);
+  munmap((void *)map, size);
+  if (n >= 0 && (size_t)n < size) {
+    fprintf(stderr, "Input ends in the middle of a frame (%zu bytes left).\n",
+            size - n);
+  }
+  return n < 0 ? -1 : 0;
+}
+
+int split_stream(struct split_ctx *ctx, int fd) {
+  size_t cap = READ_BUF_SIZE;
+  char *buf = malloc(cap);
+  size_t used = 0;
+  while (1) {
+    if (used == cap) {
+      // 一帧比整个缓冲区还大。
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    ssize_t n = read(fd, buf + used, cap - used);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "read: %s\n", strerror(errno));
+      break;
+    } else if (n == 0) {
+      break;
+    }
+    used += n;
+    long consumed = split(ctx, buf, used);
+    if (consumed < 0) {
+      free(buf);
+      return -1;
+    }
+    // 半帧挪到缓冲区开头，通常只有几十个字节。
+    memmove(buf, buf + consumed, used - consumed);
+    used -= consumed;
+  }
+  if (used > 0) {
+    fprintf(stderr, "Input ends in the middle of a frame (%zu bytes left).\n",
+            used);
+  }
+  free(buf);
+  return 0;
+}
+
+// socket_mux 每次 commit 的都是完整的帧，而共享内存环的数据区被连续映射了两次，
+// peek 到的总是一段连续的、以帧的边界结束的数据。
+int split_shm(struct split_ctx *ctx, const char *path) {
+  shmring *r = shmring_open(path);
+  if (r == NULL) {
+    return -1;
+  }
+  while (1) {
+    int len;
+    const char *data = shmring_peek(r, &len);
+    if (len == 0) {
+      if (shmring_wait_data(r, SHM_SPIN, -1) < 0) {
+        break;
+      }
+      continue;
+    }
+    long n = split(ctx, data, len);
+    if (n < 0) {
+      shmring_close(r);
+      return -1;
+    }
+    shmring_consume(r, n);
+  }
+  shmring_close(r);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct split_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  const char *shm_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:")) != -1) {
+    switch (opt) {
+      case 'd':
+        ctx.dir = optarg;
+        break;
+      case 's':
+        shm_path = optarg;
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-d dir] [-s shm_path]\n"
+                "  -d  write the data of every source to dir/<source> instead "
+                "of just counting it\n"
+                "  -s  read from the shared memory ring of socket_mux -o "
+                "instead of stdin\n",
+                argv[0]);
+        exit(1);
+    }
+  }
+  if (ctx.dir != NULL && mkdir(ctx.dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "mkdir %s: %s\n", ctx.dir, strerror(errno));
+    exit(1);
+  }
+
+  const long t0 = now_ns();
+  int result;
+  struct stat st;
+  if (shm_path != NULL) {
+    result = split_shm(&ctx, shm_path);
+  } else if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+    result = split_mapped(&ctx, STDIN_FILENO, st.st_size);
+  } else {
+    result = split_stream(&ctx, STDIN_FILENO);
+  }
+  const double secs = (now_ns() - t0) / 1e9;
+
+  fprintf(stderr,
+          "%lu frames, %lu bytes from %lu sources (%lu closed) in %.3f s, "
+          "%.1f MiB/s",
+          ctx.nr_frames, ctx.nr_bytes, ctx.nr_sources, ctx.nr_closed, secs,
+          secs > 0 ? ctx.nr_bytes / secs / (1 << 20) : 0.0);
+  if (ctx.demux.flags & MUX_STREAM_TIMESTAMPS) {
+    fprintf(stderr, ", received over %.3f s",
+            (ctx.last_ts_ns - ctx.first_ts_ns) / 1e9);
+  }
+  fprintf(stderr, "\n");
+  for (unsigned int i = 0; i < ctx.nr_out_fds; ++i) {
+    if (ctx.out_fds[i] >= 0) {
+      close(ctx.out_fds[i]);
+    }
+  }
+  free(ctx.out_fds);
+  return result == 0 ? 0 : 1;
+}
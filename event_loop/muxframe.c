@@ -0,0 +1,33 @@
+#include "muxframe.h"
+
+#include <string.h>
+
+int mux_header_len(uint32_t flags) {
+  return flags & MUX_STREAM_TIMESTAMPS ? 16 : 8;
+}
+
+void mux_put_preamble(char *buf, uint32_t flags) {
+  memcpy(buf, MUX_MAGIC, MUX_MAGIC_LEN);
+  memcpy(buf + MUX_MAGIC_LEN, &flags, sizeof(flags));
+}
+
+void mux_put_header(char *buf, uint32_t flags, uint32_t source, uint32_t len,
+                    uint64_t ts_ns) {
+  const uint32_t header[2] = {source, len};
+  memcpy(buf, header, sizeof(header));
+  if (flags & MUX_STREAM_TIMESTAMPS) {
+    memcpy(buf + sizeof(header), &ts_ns, sizeof(ts_ns));
+  }
+}
+
+int mux_demux_init(struct mux_demux *d, const char *buf, size_t len) {
+  if (len < MUX_PREAMBLE_LEN) {
+    return 0;
+  }
+  if (memcmp(buf, MUX_MAGIC, MUX_MAGIC_LEN) != 0) {
+    return -1;
+  }
+  memcpy(&d->flags, buf + MUX_MAGIC_LEN, sizeof(d->flags));
+  d->header_len = mux_header_len(d->flags);
+  return MUX_PREAMBLE_LEN;
+}
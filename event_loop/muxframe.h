@@ -0,0 +1,82 @@
+#ifndef MY_MUXFRAME
+#define MY_MUXFRAME
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// socket_mux -f 的分帧输出格式。不分帧时所有连接的数据按 read 的边界混在一起
+// 写出去，下游分不清哪一段是谁的；分帧后每一段数据前面有一个定长的帧头，下游
+// 只要按帧头里的长度往后跳，不用逐字节扫描，就能把多个来源的数据重新分开。
+//
+// 流的开头是 8 字节的前导：4 字节的 MUX_MAGIC，再加 4 字节的 flags。之后是一帧
+// 接一帧：
+//
+//   source  u32   来源（连接）的编号，按连接建立的顺序从 0 开始，和 fd 无关
+//   len     u32   数据的长度，0 表示这个来源已经关闭
+//   ts_ns   u64   只在 flags 有 MUX_STREAM_TIMESTAMPS 时出现：数据被内核收到（没有
+//                 内核时间戳时是被读到）的 CLOCK_REALTIME 纳秒数
+//   data          len 字节
+//
+// 整数都是小端的，帧头不对齐（读的时候用 memcpy）。一个流里的帧头都一样长，
+// 所以 socket_mux 可以在 read 之前就给帧头留好位置。
+
+#define MUX_MAGIC "MUXF"
+#define MUX_MAGIC_LEN 4
+#define MUX_PREAMBLE_LEN 8
+#define MUX_STREAM_TIMESTAMPS 0x1U
+// 最长的帧头。
+#define MUX_MAX_HEADER_LEN 16
+
+struct mux_frame {
+  uint32_t source;
+  uint32_t len;
+  uint64_t ts_ns;
+  // 指向调用者给的缓冲区，不复制。
+  const char *data;
+};
+
+// 一个流的帧头有多长。
+int mux_header_len(uint32_t flags);
+
+// 把前导写到 buf（至少 MUX_PREAMBLE_LEN 字节）。
+void mux_put_preamble(char *buf, uint32_t flags);
+
+// 把一个帧头写到 buf（至少 mux_header_len(flags) 字节）。
+void mux_put_header(char *buf, uint32_t flags, uint32_t source, uint32_t len,
+                    uint64_t ts_ns);
+
+struct mux_demux {
+  uint32_t flags;
+  int header_len;
+};
+
+// 从 buf 开头解析前导。返回消耗的字节数（MUX_PREAMBLE_LEN），数据还不够时返回
+// 0，不是分帧的流时返回 -1。
+int mux_demux_init(struct mux_demux *d, const char *buf, size_t len);
+
+// 从 buf 开头解析一帧，f->data 直接指向 buf 里的数据。返回这一帧一共占了多少
+// 字节（帧头加数据），buf 里还不是完整的一帧时返回 0，调用者攒够更多数据再从
+// 同一个位置解析。
+static inline size_t mux_demux_next(const struct mux_demux *d, const char *buf,
+                                    size_t len, struct mux_frame *f) {
+  if (len < (size_t)d->header_len) {
+    return 0;
+  }
+  uint32_t header[2];
+  memcpy(header, buf, sizeof(header));
+  const size_t frame_len = d->header_len + (size_t)header[1];
+  if (len < frame_len) {
+    return 0;
+  }
+  f->source = header[0];
+  f->len = header[1];
+  f->ts_ns = 0;
+  if (d->flags & MUX_STREAM_TIMESTAMPS) {
+    memcpy(&f->ts_ns, buf + sizeof(header), sizeof(f->ts_ns));
+  }
+  f->data = buf + d->header_len;
+  return frame_len;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef MY_RAWSYS
+#define MY_RAWSYS
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct epoll_event;
+struct mmsghdr;
+struct timespec;
+
+// 下面这些函数由 rawsys.S 实现，直接发起 syscall，成功时返回非负数，失败时返回
+// -errno（例如 -EAGAIN），不会修改 errno。
+long rawsys_read(int fd, void *buf, size_t count);
+long rawsys_write(int fd, const void *buf, size_t count);
+long rawsys_readv(int fd, const struct iovec *iov, int iovcnt);
+long rawsys_writev(int fd, const struct iovec *iov, int iovcnt);
+long rawsys_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen,
+                    int flags);
+long rawsys_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                       int timeout);
+long rawsys_splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+                   size_t len, unsigned int flags);
+long rawsys_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+                     int flags, struct timespec *timeout);
+
+// sys_* 是 demo 程序实际调用的接口，返回值约定和 rawsys_* 一致（失败返回
+// -errno）。编译时定义了 USE_RAWSYS 就直接用 rawsys.S 里的 stub，否则退回到 libc
+// 的 wrapper，再把 errno 转换成负数返回值。
+#ifdef USE_RAWSYS
+
+#define sys_read rawsys_read
+#define sys_write rawsys_write
+#define sys_readv rawsys_readv
+#define sys_writev rawsys_writev
+#define sys_accept4 rawsys_accept4
+#define sys_recvmmsg rawsys_recvmmsg
+
+#else
+
+static inline long sys_ret(long result) { return result < 0 ? -errno : result; }
+
+static inline long sys_read(int fd, void *buf, size_t count) {
+  return sys_ret(read(fd, buf, count));
+}
+
+static inline long sys_write(int fd, const void *buf, size_t count) {
+  return sys_ret(write(fd, buf, count));
+}
+
+static inline long sys_readv(int fd, const struct iovec *iov, int iovcnt) {
+  return sys_ret(readv(fd, iov, iovcnt));
+}
+
+static inline long sys_writev(int fd, const struct iovec *iov, int iovcnt) {
+  return sys_ret(writev(fd, iov, iovcnt));
+}
+
+static inline long sys_accept4(int fd, struct sockaddr *addr,
+                               socklen_t *addrlen, int flags) {
+  return sys_ret(accept4(fd, addr, addrlen, flags));
+}
+
+static inline long sys_recvmmsg(int fd, struct mmsghdr *msgvec,
+                                unsigned int vlen, int flags,
+                                struct timespec *timeout) {
+  return sys_ret(recvmmsg(fd, msgvec, vlen, flags, timeout));
+}
+
+#endif
+
+#endif
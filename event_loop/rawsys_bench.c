@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rawsys.h"
+
+// 对比 libc（musl）的 syscall wrapper 和 rawsys.S 中的 stub 的单次调用开销。
+// 用法：rawsys_bench [iterations]
+
+#define DEFAULT_ITERATIONS 1000000
+char bench_buf[64];
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+long libc_write_1(int fd) { return write(fd, bench_buf, 1); }
+
+long raw_write_1(int fd) { return rawsys_write(fd, bench_buf, 1); }
+
+long libc_read_1(int fd) { return read(fd, bench_buf, 1); }
+
+long raw_read_1(int fd) { return rawsys_read(fd, bench_buf, 1); }
+
+long libc_writev_2(int fd) {
+  struct iovec iov[2] = {{bench_buf, 1}, {bench_buf + 1, 1}};
+  return writev(fd, iov, 2);
+}
+
+long raw_writev_2(int fd) {
+  struct iovec iov[2] = {{bench_buf, 1}, {bench_buf + 1, 1}};
+  return rawsys_writev(fd, iov, 2);
+}
+
+// 以 EAGAIN 结束的调用，用来观察错误路径上 errno 写入（TLS 访问）的开销。
+long libc_read_eagain(int fd) { return read(fd, bench_buf, 1); }
+
+long raw_read_eagain(int fd) { return rawsys_read(fd, bench_buf, 1); }
+
+void bench(const char *name, long (*fn)(int fd), int fd, long iterations) {
+  // 先热身，避免把首次调用的缺页、cache miss 算进去。
+  for (long i = 0; i < iterations / 10; ++i) {
+    fn(fd);
+  }
+
+  long t0 = now_ns();
+  for (long i = 0; i < iterations; ++i) {
+    fn(fd);
+  }
+  long elapsed = now_ns() - t0;
+
+  printf("%-24s %8.1f ns/call\n", name, (double)elapsed / iterations);
+}
+
+int open_or_panic(const char *path, int flags) {
+  int fd = open(path, flags);
+  if (fd < 0) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = DEFAULT_ITERATIONS;
+  if (argc > 1) {
+    iterations = atol(argv[1]);
+  }
+
+  int null_fd = open_or_panic("/dev/null", O_WRONLY);
+  int zero_fd = open_or_panic("/dev/zero", O_RDONLY);
+
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_NONBLOCK) < 0) {
+    fprintf(stderr, "pipe2: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  bench("libc write /dev/null", libc_write_1, null_fd, iterations);
+  bench("rawsys write /dev/null", raw_write_1, null_fd, iterations);
+  bench("libc read /dev/zero", libc_read_1, zero_fd, iterations);
+  bench("rawsys read /dev/zero", raw_read_1, zero_fd, iterations);
+  bench("libc writev /dev/null", libc_writev_2, null_fd, iterations);
+  bench("rawsys writev /dev/null", raw_writev_2, null_fd, iterations);
+  bench("libc read EAGAIN", libc_read_eagain, pipe_fds[0], iterations);
+  bench("rawsys read EAGAIN", raw_read_eagain, pipe_fds[0], iterations);
+
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include "readsched.h"
+
+void rs_init(struct read_sched *s, long quantum, int max_reads) {
+  dq_init(&s->runq);
+  s->quantum = quantum;
+  s->max_reads = max_reads;
+  s->nr_yields = 0;
+}
+
+void rs_conn_init(struct rs_conn *c) {
+  dq_node_init(&c->runnable);
+  c->deficit = 0;
+  c->nr_reads = 0;
+}
+
+long rs_begin(struct read_sched *s, struct rs_conn *c) {
+  // 被主动唤醒之前它也可能因为新数据到来而被事件循环调度，这时 runq
+  // 里的那一次就不需要了。
+  dq_remove(&s->runq, &c->runnable);
+  c->deficit += s->quantum;
+  c->nr_reads = 0;
+  return c->deficit;
+}
+
+long rs_charge(struct rs_conn *c, long nbytes) {
+  c->deficit -= nbytes;
+  ++c->nr_reads;
+  return c->deficit;
+}
+
+int rs_exhausted(struct read_sched *s, struct rs_conn *c) {
+  return c->deficit <= 0 || c->nr_reads >= s->max_reads;
+}
+
+void rs_yield(struct read_sched *s, struct rs_conn *c) {
+  if (c->deficit > s->quantum) {
+    // 因为 read 次数用完而让出时额度可能还有剩余，最多只留一个 quantum。
+    c->deficit = s->quantum;
+  }
+  dq_push_back(&s->runq, &c->runnable);
+  ++s->nr_yields;
+}
+
+void rs_idle(struct read_sched *s, struct rs_conn *c) {
+  dq_remove(&s->runq, &c->runnable);
+  c->deficit = 0;
+}
+
+void rs_remove(struct read_sched *s, struct rs_conn *c) {
+  dq_remove(&s->runq, &c->runnable);
+}
+
+struct rs_conn *rs_pop(struct read_sched *s) {
+  struct dq_node *n = dq_pop_front(&s->runq);
+  return n == NULL ? NULL : dq_entry(n, struct rs_conn, runnable);
+}
@@ -0,0 +1,53 @@
+#ifndef MY_READSCHED
+#define MY_READSCHED
+
+#include "dqueue.h"
+
+// 读取调度：每个连接在每一轮事件循环中最多读 quantum 字节、最多调用 max_reads
+// 次 read，用不完的额度（deficit）留到下一轮（deficit round robin），这样一个
+// 一直在发数据的连接不会独占一轮事件循环，别的连接也不会因为它而等待。
+//
+// 额度用完时内核里可能还有数据。对于边沿触发的事件循环，这个连接不会再收到通知，
+// 调用者用 rs_yield 把它排进 runq，下一轮开始前用 rs_pop 依次取出、主动让它接着
+// 读；水平触发的事件循环（select）下一轮自然还会报告它可读，不需要 runq。
+
+struct rs_conn {
+  struct dq_node runnable;
+  long deficit;
+  int nr_reads;
+};
+
+struct read_sched {
+  struct dqueue runq;
+  long quantum;
+  int max_reads;
+  // 因为额度用完而让出的次数。
+  unsigned long nr_yields;
+};
+
+void rs_init(struct read_sched *s, long quantum, int max_reads);
+
+void rs_conn_init(struct rs_conn *c);
+
+// 连接轮到读取时调用：补充一个 quantum 的额度，返回这一轮最多还能读多少字节。
+long rs_begin(struct read_sched *s, struct rs_conn *c);
+
+// 读到了 nbytes 字节，返回这一轮剩下的额度。
+long rs_charge(struct rs_conn *c, long nbytes);
+
+// 这一轮的额度（字节数或者 read 次数）是否已经用完。
+int rs_exhausted(struct read_sched *s, struct rs_conn *c);
+
+// 额度用完了但可能还有数据：排到 runq 末尾，下一轮继续。
+void rs_yield(struct read_sched *s, struct rs_conn *c);
+
+// 连接暂时没有数据可读（EAGAIN），或者暂停读取：清空额度，空闲的连接不积累额度。
+void rs_idle(struct read_sched *s, struct rs_conn *c);
+
+// 连接关闭时调用。
+void rs_remove(struct read_sched *s, struct rs_conn *c);
+
+// 从 runq 队首取出一个让出过的连接，runq 为空时返回 NULL。
+struct rs_conn *rs_pop(struct read_sched *s);
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef MY_RING
+#define MY_RING
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <type_traits>
+
+// 编译期确定容量的环形缓冲区，相当于 ringbuf.h 的 C++20 模板版本。
+//
+// 容量 Capacity 是模板参数，必须是 2 的幂，下标都是 constexpr 的 & mask，不用像
+// ringbuf 那样对每个位置做一次除法（%）。元素必须是 trivially copyable 的，连续的
+// 一段元素整段用 std::copy_n（也就是 memmove）搬运，单字节元素的查找用
+// memchr/memrchr。所有成员函数都在这个头文件里，编译器可以把它们完全内联、向量化。
+//
+// ring 不拥有存储空间：构造时由调用者给出正好 Capacity 个元素的一段内存（一个
+// std::array、或者 ringbuf_alloc_buf 分配的大页内存）。和 ringbuf 一样，剩余容量
+// 不足时写入操作只写入放得下的部分，已有的内容永远不会被覆盖。
+//
+// ring_shim.cc 用它实现了 ringbuf.h 的全部接口，C 程序链接 ring_shim.o 代替
+// ringbuf.c 就能换上它。
+template <std::size_t Capacity, typename T = char>
+class ring {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "ring capacity must be a power of two");
+  static_assert(std::is_trivially_copyable_v<T>,
+                "ring elements must be trivially copyable");
+
+ public:
+  static constexpr std::size_t capacity = Capacity;
+  static constexpr std::size_t mask = Capacity - 1;
+  // find、rfind 找不到时的返回值。
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  explicit ring(std::span<T, Capacity> storage) : buf_(storage.data()) {}
+
+  T *data() const { return buf_; }
+
+  std::size_t size() const { return tail_ - head_; }
+
+  bool empty() const { return head_ == tail_; }
+
+  std::size_t remaining() const { return Capacity - size(); }
+
+  // 从第 offset 个元素开始的一段连续内存。数据可能绕回到缓冲区开头，所以它可能
+  // 比 offset 之后剩下的数据短，这时用 offset + 它的长度再取下一段。
+  std::span<const T> peek(std::size_t offset) const {
+    if (offset >= size()) {
+      return {};
+    }
+    const std::size_t begin = (head_ + offset) & mask;
+    return {buf_ + begin, std::min(size() - offset, Capacity - begin)};
+  }
+
+  // 结束于第 end 个元素（不含）的一段连续内存，peek 的反方向版本。
+  std::span<const T> peek_before(std::size_t end) const {
+    if (end == 0 || end > size()) {
+      return {};
+    }
+    const std::size_t last = (head_ + end - 1) & mask;
+    const std::size_t len = std::min(end, last + 1);
+    return {buf_ + last + 1 - len, len};
+  }
+
+  // 尾部第 offset 个空闲位置开始的一段连续空闲空间，调用者直接写进去（比如
+  // readv）之后用 commit 计入 size。
+  std::span<T> free_span(std::size_t offset) {
+    if (offset >= remaining()) {
+      return {};
+    }
+    const std::size_t begin = (tail_ + offset) & mask;
+    return {buf_ + begin, std::min(remaining() - offset, Capacity - begin)};
+  }
+
+  void commit(std::size_t n) { tail_ += n; }
+
+  void consume(std::size_t n) { head_ += n; }
+
+  void clear() { tail_ = head_; }
+
+  // 追加到尾部，返回实际写入的元素个数（受限于剩余容量）。
+  std::size_t push(std::span<const T> src) {
+    const std::size_t n = std::min(src.size(), remaining());
+    const std::size_t pos = tail_ & mask;
+    const std::size_t first = std::min(n, Capacity - pos);
+    std::copy_n(src.data(), first, buf_ + pos);
+    std::copy_n(src.data() + first, n - first, buf_);
+    tail_ += n;
+    return n;
+  }
+
+  // 把从第 offset 个元素开始的数据复制到 dst（不取出），返回复制的元素个数。
+  std::size_t copy_out(std::size_t offset, std::span<T> dst) const {
+    if (offset >= size()) {
+      return 0;
+    }
+    const std::size_t n = std::min(dst.size(), size() - offset);
+    const std::size_t pos = (head_ + offset) & mask;
+    const std::size_t first = std::min(n, Capacity - pos);
+    std::copy_n(buf_ + pos, first, dst.data());
+    std::copy_n(buf_, n - first, dst.data() + first);
+    return n;
+  }
+
+  // 从首部取出最多 dst.size() 个元素，返回实际取出的个数。
+  std::size_t pop(std::span<T> dst) {
+    const std::size_t n = copy_out(0, dst);
+    head_ += n;
+    return n;
+  }
+
+  // 把（之前取出但没用完的）数据放回首部，pop 的逆操作，调用者保证放得下。
+  void unpop(std::span<const T> src) {
+    head_ -= src.size();
+    const std::size_t pos = head_ & mask;
+    const std::size_t first = std::min(src.size(), Capacity - pos);
+    std::copy_n(src.data(), first, buf_ + pos);
+    std::copy_n(src.data() + first, src.size() - first, buf_);
+  }
+
+  // 在 [from, to) 范围内查找第一个等于 value 的元素，返回它的偏移量。
+  std::size_t find(std::size_t from, std::size_t to, const T &value) const {
+    to = std::min(to, size());
+    while (from < to) {
+      std::span<const T> s = peek(from);
+      s = s.first(std::min(s.size(), to - from));
+      const T *p = find_in(s, value);
+      if (p != nullptr) {
+        return from + (p - s.data());
+      }
+      from += s.size();
+    }
+    return npos;
+  }
+
+  // 在 [from, to) 范围内查找最后一个等于 value 的元素，返回它的偏移量。
+  std::size_t rfind(std::size_t from, std::size_t to, const T &value) const {
+    to = std::min(to, size());
+    while (to > from) {
+      std::span<const T> s = peek_before(to);
+      s = s.last(std::min(s.size(), to - from));
+      const T *p = rfind_in(s, value);
+      if (p != nullptr) {
+        return to - s.size() + (p - s.data());
+      }
+      to -= s.size();
+    }
+    return npos;
+  }
+
+ private:
+  static const T *find_in(std::span<const T> s, const T &value) {
+    if constexpr (sizeof(T) == 1 && std::is_integral_v<T>) {
+      return static_cast<const T *>(std::memchr(s.data(), value, s.size()));
+    } else {
+      const T *end = s.data() + s.size();
+      const T *p = std::find(s.data(), end, value);
+      return p != end ? p : nullptr;
+    }
+  }
+
+  static const T *rfind_in(std::span<const T> s, const T &value) {
+    if constexpr (sizeof(T) == 1 && std::is_integral_v<T>) {
+      return static_cast<const T *>(memrchr(s.data(), value, s.size()));
+    } else {
+      for (std::size_t i = s.size(); i > 0; --i) {
+        if (s[i - 1] == value) {
+          return &s[i - 1];
+        }
+      }
+      return nullptr;
+    }
+  }
+
+  T *buf_;
+  // 自由增长的读写位置，size 是两者之差，下标是它们 & mask。
+  std::size_t head_ = 0;
+  std::size_t tail_ = 0;
+};
+
+#endif
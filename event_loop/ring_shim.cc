@@ -0,0 +1,306 @@
+#include <array>
+#include <cstdio>
+#include <utility>
+#include <variant>
+
+#include "ring.hpp"
+
+extern "C" {
+#include "membudget.h"
+#include "ringbuf.h"
+}
+
+// 用 ring.hpp 实现 ringbuf.h 的全部接口，导出的符号和 ringbuf.c 完全一样，C 程序
+// 链接 ring_shim.o 代替 ringbuf.c 就能换上它，不用改一行代码。
+//
+// ring 的容量是编译期常量，这里把 4 KiB 到 64 MiB 之间每个 2 的幂都实例化一份，
+// 一个 ringbuf 是其中之一（std::variant），每个接口函数用 std::visit 按容量分派
+// 一次，之后就全是常量 mask 的内联代码。申请的容量向上取整到 2 的幂，所以
+// ringbuf_get_capacity 可能比 ringbuf_create、ringbuf_grow 给的大；超过 64 MiB 的
+// 申请会失败。
+
+constexpr std::size_t MIN_SHIFT = 12;
+constexpr std::size_t MAX_SHIFT = 26;
+constexpr std::size_t NR_SIZES = MAX_SHIFT - MIN_SHIFT + 1;
+
+template <std::size_t... I>
+std::variant<ring<(std::size_t{1} << (MIN_SHIFT + I))>...> any_ring_of(
+    std::index_sequence<I...>);
+
+using any_ring =
+    decltype(any_ring_of(std::make_index_sequence<NR_SIZES>()));
+
+template <std::size_t Shift>
+any_ring make_ring(char *buf) {
+  constexpr std::size_t cap = std::size_t{1} << Shift;
+  return any_ring(std::in_place_type<ring<cap>>, std::span<char, cap>(buf, cap));
+}
+
+template <std::size_t... I>
+constexpr auto make_factories(std::index_sequence<I...>) {
+  return std::array<any_ring (*)(char *), NR_SIZES>{
+      &make_ring<MIN_SHIFT + I>...};
+}
+
+// factories[i] 在 buf 上构造一个容量为 2^(MIN_SHIFT + i) 的 ring。
+constexpr auto factories = make_factories(std::make_index_sequence<NR_SIZES>());
+
+struct ringbuf_impl {
+  any_ring r;
+  // 见 ringbuf_alloc_buf。
+  size_t mapped_len;
+};
+
+// 不小于 capacity 的最小的实例化容量的 shift，太大时返回 -1。
+int fit_shift(long capacity) {
+  for (std::size_t shift = MIN_SHIFT; shift <= MAX_SHIFT; ++shift) {
+    if ((std::size_t{1} << shift) >= static_cast<std::size_t>(capacity)) {
+      return shift;
+    }
+  }
+  fprintf(stderr, "ringbuf: capacity %ld is too large for ring.hpp\n",
+          capacity);
+  return -1;
+}
+
+int capacity_of(const ringbuf_impl *rb) {
+  return std::visit([](const auto &r) { return static_cast<int>(r.capacity); },
+                    rb->r);
+}
+
+char *buf_of(const ringbuf_impl *rb) {
+  return std::visit([](const auto &r) { return r.data(); }, rb->r);
+}
+
+// 把 rb 的内容搬到一个容量为 2^shift 的新 ring 中，调用者负责预算的记账。
+void relocate(ringbuf_impl *rb, int shift) {
+  size_t mapped_len;
+  char *buf = ringbuf_alloc_buf(1 << shift, &mapped_len);
+  any_ring r = factories[shift - MIN_SHIFT](buf);
+  std::visit(
+      [](auto &dst, const auto &src) {
+        for (std::size_t off = 0; off < src.size();) {
+          off += dst.push(src.peek(off));
+        }
+      },
+      r, rb->r);
+  ringbuf_free_buf(buf_of(rb), rb->mapped_len);
+  rb->r = r;
+  rb->mapped_len = mapped_len;
+}
+
+extern "C" {
+
+ringbuf *ringbuf_create(int size) {
+  const int shift = fit_shift(size);
+  if (shift < 0 || membudget_charge(1L << shift) != 0) {
+    return NULL;
+  }
+  size_t mapped_len;
+  char *buf = ringbuf_alloc_buf(1 << shift, &mapped_len);
+  return new ringbuf_impl{factories[shift - MIN_SHIFT](buf), mapped_len};
+}
+
+void ringbuf_free(ringbuf *rb) {
+  membudget_release(capacity_of(rb));
+  ringbuf_free_buf(buf_of(rb), rb->mapped_len);
+  delete rb;
+}
+
+int ringbuf_send_chunk(ringbuf *dst, const char *src, const int nbytes) {
+  return std::visit(
+      [&](auto &r) {
+        return nbytes - static_cast<int>(r.push({src, (std::size_t)nbytes}));
+      },
+      dst->r);
+}
+
+int ringbuf_receive_chunk(char *dst, const int dst_bytes_max_writes,
+                          ringbuf *src) {
+  return std::visit(
+      [&](auto &r) {
+        return static_cast<int>(
+            r.pop({dst, (std::size_t)dst_bytes_max_writes}));
+      },
+      src->r);
+}
+
+void ringbuf_return_chunk(ringbuf *dst, const char *src, const int nbytes) {
+  std::visit([&](auto &r) { r.unpop({src, (std::size_t)nbytes}); }, dst->r);
+}
+
+int ringbuf_copy(ringbuf *dst, ringbuf *src, const int len) {
+  return ringbuf_copy_from(dst, src, 0, len);
+}
+
+int ringbuf_copy_from(ringbuf *dst, ringbuf *src, const int offset,
+                      const int len) {
+  return std::visit(
+      [&](auto &d, const auto &s) {
+        const std::size_t limit = std::min<std::size_t>(len, d.remaining());
+        std::size_t copied = 0;
+        while (copied < limit) {
+          std::span<const char> span = s.peek(offset + copied);
+          if (span.empty()) {
+            break;
+          }
+          copied += d.push(span.first(std::min(span.size(), limit - copied)));
+        }
+        return static_cast<int>(copied);
+      },
+      dst->r, src->r);
+}
+
+int ringbuf_peek_span(ringbuf *rb, const int offset, const char **span) {
+  return std::visit(
+      [&](const auto &r) {
+        std::span<const char> s = r.peek(offset);
+        *span = s.data();
+        return static_cast<int>(s.size());
+      },
+      rb->r);
+}
+
+int ringbuf_get_iovecs(ringbuf *rb, const int offset, const int len,
+                       struct iovec *iov, const int max_iovcnt) {
+  return std::visit(
+      [&](const auto &r) {
+        int iovcnt = 0;
+        std::size_t pos = offset;
+        const std::size_t end = offset + len;
+        while (iovcnt < max_iovcnt && pos < end) {
+          std::span<const char> s = r.peek(pos);
+          if (s.empty()) {
+            break;
+          }
+          s = s.first(std::min(s.size(), end - pos));
+          iov[iovcnt].iov_base = const_cast<char *>(s.data());
+          iov[iovcnt].iov_len = s.size();
+          ++iovcnt;
+          pos += s.size();
+        }
+        return iovcnt;
+      },
+      rb->r);
+}
+
+int ringbuf_find(ringbuf *rb, const int from, const int to, const char ch) {
+  return std::visit(
+      [&](const auto &r) {
+        const std::size_t i = r.find(from, to, ch);
+        return i == r.npos ? -1 : static_cast<int>(i);
+      },
+      rb->r);
+}
+
+int ringbuf_rfind(ringbuf *rb, const int from, const int to, const char ch) {
+  return std::visit(
+      [&](const auto &r) {
+        const std::size_t i = r.rfind(from, to, ch);
+        return i == r.npos ? -1 : static_cast<int>(i);
+      },
+      rb->r);
+}
+
+void ringbuf_consume(ringbuf *rb, const int nbytes) {
+  std::visit([&](auto &r) { r.consume(nbytes); }, rb->r);
+}
+
+int ringbuf_get_free_iovecs(ringbuf *rb, const int len, struct iovec *iov,
+                            const int max_iovcnt) {
+  return std::visit(
+      [&](auto &r) {
+        int iovcnt = 0;
+        std::size_t pos = 0;
+        while (iovcnt < max_iovcnt && pos < (std::size_t)len) {
+          std::span<char> s = r.free_span(pos);
+          if (s.empty()) {
+            break;
+          }
+          s = s.first(std::min(s.size(), len - pos));
+          iov[iovcnt].iov_base = s.data();
+          iov[iovcnt].iov_len = s.size();
+          ++iovcnt;
+          pos += s.size();
+        }
+        return iovcnt;
+      },
+      rb->r);
+}
+
+void ringbuf_commit(ringbuf *rb, const int nbytes) {
+  std::visit([&](auto &r) { r.commit(nbytes); }, rb->r);
+}
+
+int ringbuf_transfer(ringbuf *dst, ringbuf *src, const int len) {
+  const int moved = ringbuf_copy_from(dst, src, 0, len);
+  ringbuf_consume(src, moved);
+  return moved;
+}
+
+void ringbuf_clear(ringbuf *rb) {
+  std::visit([](auto &r) { r.clear(); }, rb->r);
+}
+
+int ringbuf_is_empty(ringbuf *rb) {
+  return std::visit([](const auto &r) { return r.empty() ? 1 : 0; }, rb->r);
+}
+
+int ringbuf_get_remaining_capacity(ringbuf *rb) {
+  return std::visit(
+      [](const auto &r) { return static_cast<int>(r.remaining()); }, rb->r);
+}
+
+int ringbuf_upscale_if_needed(ringbuf **rb, const int expected_size) {
+  ringbuf_grow(*rb, expected_size);
+  return capacity_of(*rb);
+}
+
+int ringbuf_grow(ringbuf *rb, const int new_capacity) {
+  const int capacity = capacity_of(rb);
+  if (new_capacity <= capacity) {
+    return 0;
+  }
+  const int shift = fit_shift(new_capacity);
+  if (shift < 0 || membudget_charge((1L << shift) - capacity) != 0) {
+    return -1;
+  }
+  relocate(rb, shift);
+  return 0;
+}
+
+int ringbuf_shrink(ringbuf *rb, const int new_capacity) {
+  const int capacity = capacity_of(rb);
+  const int shift = fit_shift(new_capacity);
+  if (shift < 0 || (1 << shift) >= capacity ||
+      ringbuf_get_size(rb) > (1 << shift)) {
+    return -1;
+  }
+  membudget_release(capacity - (1 << shift));
+  relocate(rb, shift);
+  return 0;
+}
+
+int ringbuf_reserve(ringbuf *rb, const int nbytes, const int max_capacity) {
+  const int capacity = capacity_of(rb);
+  const int size = ringbuf_get_size(rb);
+  if (capacity - size < nbytes && capacity < max_capacity) {
+    long wanted = capacity;
+    while (wanted - size < nbytes && wanted < max_capacity) {
+      wanted *= 2;
+    }
+    if (wanted > max_capacity) {
+      wanted = max_capacity;
+    }
+    ringbuf_grow(rb, wanted);
+  }
+  return ringbuf_get_remaining_capacity(rb);
+}
+
+int ringbuf_get_capacity(ringbuf *rb) { return capacity_of(rb); }
+
+int ringbuf_get_size(ringbuf *rb) {
+  return std::visit([](const auto &r) { return static_cast<int>(r.size()); },
+                    rb->r);
+}
+}
@@ -1,17 +1,25 @@
 #include "ringbuf.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#include "membudget.h"
 
 struct ringbuf_impl {
   char *buf;
   int start_offset;
   int size;
   int capacity;
+  // buf 是 mmap 出来的时候为映射的长度（按大页取整），malloc 出来的时候为 0。
+  size_t mapped_len;
 };
 
 struct ringbuf_impl *ringbuf_create(int size) {
+  if (membudget_charge(size) != 0) {
+    return NULL;
+  }
   struct ringbuf_impl *c = malloc(sizeof(struct ringbuf_impl));
-  c->buf = malloc(size);
+  c->buf = ringbuf_alloc_buf(size, &c->mapped_len);
   c->start_offset = 0;
   c->size = 0;
   c->capacity = size;
@@ -19,28 +27,87 @@ struct ringbuf_impl *ringbuf_create(int size) {
 }
 
 void ringbuf_free(struct ringbuf_impl *c) {
-  free(c->buf);
+  membudget_release(c->capacity);
+  ringbuf_free_buf(c->buf, c->mapped_len);
   free(c);
 }
 
-int ringbuf_send_chunk(struct ringbuf_impl *dst, const char *src,
-                       const int nbytes) {
-  const int start_offset = dst->start_offset;
-  const int size0 = dst->size;
-  for (int i = 0; i < nbytes; ++i) {
-    dst->buf[(start_offset + size0 + i) % dst->capacity] = src[i];
+// 把 rb 的内容搬到一块容量为 new_capacity 的新内存中（从新内存的开头开始存放），
+// 调用者负责预算的记账。
+void ringbuf_relocate(struct ringbuf_impl *rb, const int new_capacity) {
+  size_t new_mapped_len;
+  char *new_buf = ringbuf_alloc_buf(new_capacity, &new_mapped_len);
+  const char *span;
+  int copied = 0;
+  int span_len;
+  while ((span_len = ringbuf_peek_span(rb, copied, &span)) > 0) {
+    memcpy(new_buf + copied, span, span_len);
+    copied += span_len;
   }
+  ringbuf_free_buf(rb->buf, rb->mapped_len);
+  rb->buf = new_buf;
+  rb->mapped_len = new_mapped_len;
+  rb->start_offset = 0;
+  rb->capacity = new_capacity;
+}
 
-  dst->size += nbytes;
-  const int exceeded = dst->size - dst->capacity;
-  if (exceeded > 0) {
-    dst->start_offset = (dst->start_offset + exceeded) % dst->capacity;
-    dst->size = dst->capacity;
-    return exceeded;
+int ringbuf_grow(struct ringbuf_impl *rb, const int new_capacity) {
+  if (new_capacity <= rb->capacity) {
+    return 0;
   }
+  if (membudget_charge(new_capacity - rb->capacity) != 0) {
+    return -1;
+  }
+  ringbuf_relocate(rb, new_capacity);
   return 0;
 }
 
+int ringbuf_shrink(struct ringbuf_impl *rb, const int new_capacity) {
+  if (new_capacity >= rb->capacity || rb->size > new_capacity) {
+    return -1;
+  }
+  membudget_release(rb->capacity - new_capacity);
+  ringbuf_relocate(rb, new_capacity);
+  return 0;
+}
+
+int ringbuf_reserve(struct ringbuf_impl *rb, const int nbytes,
+                    const int max_capacity) {
+  if (rb->capacity - rb->size < nbytes && rb->capacity < max_capacity) {
+    long wanted = rb->capacity;
+    while (wanted - rb->size < nbytes && wanted < max_capacity) {
+      wanted *= 2;
+    }
+    if (wanted > max_capacity) {
+      wanted = max_capacity;
+    }
+    ringbuf_grow(rb, wanted);
+  }
+  return rb->capacity - rb->size;
+}
+
+// 把 nbytes 字节追加到已有数据之后（调用者保证放得下），绕回时分成两次 memcpy。
+void ringbuf_append(struct ringbuf_impl *rb, const char *src, const int nbytes) {
+  const int pos = (rb->start_offset + rb->size) % rb->capacity;
+  int first = rb->capacity - pos;
+  if (first > nbytes) {
+    first = nbytes;
+  }
+  memcpy(rb->buf + pos, src, first);
+  memcpy(rb->buf, src + first, nbytes - first);
+  rb->size += nbytes;
+}
+
+int ringbuf_send_chunk(struct ringbuf_impl *dst, const char *src,
+                       const int nbytes) {
+  int nbytes_fit = nbytes;
+  if (nbytes_fit > dst->capacity - dst->size) {
+    nbytes_fit = dst->capacity - dst->size;
+  }
+  ringbuf_append(dst, src, nbytes_fit);
+  return nbytes - nbytes_fit;
+}
+
 int ringbuf_receive_chunk(char *dst, const int dst_bytes_max_writes,
                           struct ringbuf_impl *src) {
   const int ring_size = src->size;
@@ -74,36 +141,120 @@ void ringbuf_return_chunk(struct ringbuf_impl *dst, const char *src,
 
 int ringbuf_copy(struct ringbuf_impl *dst, struct ringbuf_impl *src,
                  const int len) {
-  int actual_writes = 0;
-  for (int i = 0; i < src->size && i < len; ++i) {
-    dst->buf[(dst->start_offset + dst->size + i) % dst->capacity] =
-        src->buf[(src->start_offset + i) % src->capacity];
-    ++actual_writes;
+  return ringbuf_copy_from(dst, src, 0, len);
+}
+
+int ringbuf_copy_from(struct ringbuf_impl *dst, struct ringbuf_impl *src,
+                      const int offset, const int len) {
+  int limit = len;
+  if (limit > dst->capacity - dst->size) {
+    limit = dst->capacity - dst->size;
   }
-  dst->size += actual_writes;
-  if (dst->size > dst->capacity) {
-    int exceeded = dst->size - dst->capacity;
-    dst->size = dst->capacity;
-    dst->start_offset = (dst->start_offset + exceeded) % dst->capacity;
+  int actual_writes = 0;
+  const char *span;
+  int span_len;
+  while (actual_writes < limit &&
+         (span_len = ringbuf_peek_span(src, offset + actual_writes, &span)) >
+             0) {
+    if (span_len > limit - actual_writes) {
+      span_len = limit - actual_writes;
+    }
+    ringbuf_append(dst, span, span_len);
+    actual_writes += span_len;
   }
   return actual_writes;
 }
 
-int ringbuf_transfer(struct ringbuf_impl *dst, struct ringbuf_impl *src,
-                     const int len) {
-  int actual_writes = 0;
-  for (int i = 0; i < src->size && i < len; ++i) {
-    dst->buf[(dst->start_offset + dst->size + i) % dst->capacity] =
-        src->buf[(src->start_offset + i) % src->capacity];
-    ++actual_writes;
+int ringbuf_peek_span(struct ringbuf_impl *rb, const int offset,
+                      const char **span) {
+  if (offset >= rb->size) {
+    return 0;
+  }
+
+  const int begin = (rb->start_offset + offset) % rb->capacity;
+  int len = rb->size - offset;
+  if (begin + len > rb->capacity) {
+    len = rb->capacity - begin;
   }
+  *span = &rb->buf[begin];
+  return len;
+}
 
-  dst->size += actual_writes;
-  if (dst->size > dst->capacity) {
-    int exceeded = dst->size - dst->capacity;
-    dst->size = dst->capacity;
-    dst->start_offset = (dst->start_offset + exceeded) % dst->capacity;
+int ringbuf_get_iovecs(struct ringbuf_impl *rb, const int offset,
+                       const int len, struct iovec *iov,
+                       const int max_iovcnt) {
+  int iovcnt = 0;
+  int pos = offset;
+  const char *span;
+  int span_len;
+  while (iovcnt < max_iovcnt && pos < offset + len &&
+         (span_len = ringbuf_peek_span(rb, pos, &span)) > 0) {
+    if (span_len > offset + len - pos) {
+      span_len = offset + len - pos;
+    }
+    iov[iovcnt].iov_base = (void *)span;
+    iov[iovcnt].iov_len = span_len;
+    ++iovcnt;
+    pos += span_len;
   }
+  return iovcnt;
+}
+
+int ringbuf_find(struct ringbuf_impl *rb, const int from, const int to,
+                 const char ch) {
+  for (int i = from; i < to && i < rb->size; ++i) {
+    if (rb->buf[(rb->start_offset + i) % rb->capacity] == ch) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int ringbuf_rfind(struct ringbuf_impl *rb, const int from, const int to,
+                  const char ch) {
+  for (int i = (to < rb->size ? to : rb->size) - 1; i >= from; --i) {
+    if (rb->buf[(rb->start_offset + i) % rb->capacity] == ch) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void ringbuf_consume(struct ringbuf_impl *rb, const int nbytes) {
+  rb->start_offset = (rb->start_offset + nbytes) % rb->capacity;
+  rb->size -= nbytes;
+}
+
+int ringbuf_get_free_iovecs(struct ringbuf_impl *rb, const int len,
+                            struct iovec *iov, const int max_iovcnt) {
+  int remain = rb->capacity - rb->size;
+  if (remain > len) {
+    remain = len;
+  }
+
+  int iovcnt = 0;
+  int pos = (rb->start_offset + rb->size) % rb->capacity;
+  while (iovcnt < max_iovcnt && remain > 0) {
+    int span_len = rb->capacity - pos;
+    if (span_len > remain) {
+      span_len = remain;
+    }
+    iov[iovcnt].iov_base = &rb->buf[pos];
+    iov[iovcnt].iov_len = span_len;
+    ++iovcnt;
+    remain -= span_len;
+    pos = 0;
+  }
+  return iovcnt;
+}
+
+void ringbuf_commit(struct ringbuf_impl *rb, const int nbytes) {
+  rb->size += nbytes;
+}
+
+int ringbuf_transfer(struct ringbuf_impl *dst, struct ringbuf_impl *src,
+                     const int len) {
+  int actual_writes = ringbuf_copy_from(dst, src, 0, len);
 
   src->size -= actual_writes;
   src->start_offset = (src->start_offset + actual_writes) % src->capacity;
@@ -121,17 +272,10 @@ int ringbuf_get_remaining_capacity(ringbuf *rb) {
 
 int ringbuf_upscale_if_needed(struct ringbuf_impl **rb,
                               const int expected_size) {
-  struct ringbuf_impl *src = *rb;
-  if (src->size >= expected_size) {
-    return src->size;
-  }
-
-  struct ringbuf_impl *new_rb = ringbuf_create(expected_size);
-  for (int i = 0; i < src->size; ++i) {
-    new_rb->buf[i] = src->buf[(src->start_offset + i) % src->capacity];
-  }
-  *rb = new_rb;
-  return new_rb->size;
+  ringbuf_grow(*rb, expected_size);
+  return (*rb)->capacity;
 }
 
-int ringbuf_get_capacity(struct ringbuf_impl *rb) { return rb->capacity; }
\ No newline at end of file
+int ringbuf_get_capacity(struct ringbuf_impl *rb) { return rb->capacity; }
+
+int ringbuf_get_size(struct ringbuf_impl *rb) { return rb->size; }
\ No newline at end of file
@@ -1,18 +1,46 @@
 #ifndef MYRINGBUF
 #define MYRINGBUF
 
+#include <stddef.h>
+#include <sys/uio.h>
+
 struct ringbuf_impl;
 typedef struct ringbuf_impl ringbuf;
 
+// 不小于这么大的缓冲区默认用 mmap 分配，见 ringbuf_set_large_alloc。
+#define RINGBUF_DEFAULT_LARGE_SIZE (((0x1UL) << 20) * 2)
+
+// 大缓冲区在分配时是否就把页面准备好：不准备（第一次写到的时候才缺页）、准备好
+// （MADV_POPULATE_WRITE）、准备好并且锁在内存里（mlock，失败时退回准备好）。
+enum ringbuf_prefault {
+  RINGBUF_PREFAULT_NONE,
+  RINGBUF_PREFAULT_POPULATE,
+  RINGBUF_PREFAULT_MLOCK,
+};
+
+// 容量不小于 size 字节的缓冲区（比如每个连接 32 MiB 的 write_buf）用 mmap 分配，
+// 按 2 MiB 对齐并 madvise(MADV_HUGEPAGE)，让透明大页来铺：大块拷贝的 TLB miss
+// 少得多，缺页也是 2 MiB 一次而不是 4 KiB 一次。prefault 决定是不是在分配时就把
+// 缺页处理掉，免得第一次广播时才在拷贝中间一页一页地缺页。小的缓冲区仍然用
+// malloc。size 为 0 表示全部用 malloc。只影响之后的分配（包括扩容、缩容）。
+void ringbuf_set_large_alloc(int size, enum ringbuf_prefault prefault);
+
+// 按 ringbuf_set_large_alloc 的设置分配一块 capacity 字节的内存（不向内存预算
+// 记账），*mapped_len 留给 ringbuf_free_buf 用。bytes.h 的内存池也用它分配 arena。
+char *ringbuf_alloc_buf(int capacity, size_t *mapped_len);
+void ringbuf_free_buf(char *buf, size_t mapped_len);
+
 // 创建一个 ringbuf 对象，一个 ringbuf
-// 是一个固定容量的、首尾相接的、「环形」的二进制数据存储区域。它理论上可以写入任意多的字节，但是当剩余容量不足时，最早写入的内容会被覆盖，并且
-// size 最大增加至不超过它的 capacity。
+// 是一个固定容量的、首尾相接的、「环形」的二进制数据存储区域。剩余容量不足时，写入操作只写入能容纳的部分，
+// 已有的内容永远不会被覆盖，size 最大增加至不超过它的 capacity。
+// 容量要向进程级的内存预算（见 membudget.h）申请，超出预算时返回 NULL。
 ringbuf *ringbuf_create(int size);
 
 // 释放一个 ringbuf 对象
 void ringbuf_free(ringbuf *rb);
 
-// 把一个 nbytes 大小的 chunk（基址由 src 表示）追加到 ringbuf 尾部。
+// 把一个 nbytes 大小的 chunk（基址由 src 表示）追加到 ringbuf 尾部，返回因为
+// 剩余容量不足而没能写入的字节数（0 表示全部写入）。
 int ringbuf_send_chunk(ringbuf *dst, const char *src, const int nbytes);
 
 // 从 ringbuf 首部取出一个最大为 dst_bytes_max_writes bytes 的 chunk（基址由 dst
@@ -24,9 +52,44 @@ int ringbuf_receive_chunk(char *dst, const int dst_bytes_max_writes,
 // ringbuf_receive_chunk 的逆操作。
 void ringbuf_return_chunk(ringbuf *dst, const char *src, const int nbytes);
 
-// 从 src 复制最多 len 字节大小的数据到 dst 尾部
+// 从 src 复制最多 len 字节大小的数据到 dst 尾部，返回实际复制的字节数（受限于
+// dst 的剩余容量）
 int ringbuf_copy(ringbuf *dst, ringbuf *src, const int len);
 
+// 从 src 的第 offset 个字节开始，复制最多 len 字节大小的数据到 dst 尾部，返回
+// 实际复制的字节数。
+int ringbuf_copy_from(ringbuf *dst, ringbuf *src, const int offset,
+                      const int len);
+
+// 获取 ringbuf 中从第 offset 个字节开始的一段连续内存，*span
+// 指向它的首地址，返回它的长度。因为数据可能绕回到缓冲区开头，返回的长度可能小于
+// offset 之后剩余数据的长度，这时可以用 offset + 返回值再取下一段。没有数据时返回 0。
+int ringbuf_peek_span(ringbuf *rb, const int offset, const char **span);
+
+// 把 ringbuf 中从第 offset 个字节开始的最多 len 字节的数据描述成最多 max_iovcnt
+// 个 iovec（不复制数据），返回实际使用的 iovec 个数，可以直接交给 writev/sendmsg。
+int ringbuf_get_iovecs(ringbuf *rb, const int offset, const int len,
+                       struct iovec *iov, const int max_iovcnt);
+
+// 在 ringbuf 的 [from, to) 范围内查找第一个值为 ch 的字节，返回它的偏移量，找不到时返回 -1。
+int ringbuf_find(ringbuf *rb, const int from, const int to, const char ch);
+
+// 在 ringbuf 的 [from, to) 范围内查找最后一个值为 ch 的字节，返回它的偏移量，找不到时返回 -1。
+int ringbuf_rfind(ringbuf *rb, const int from, const int to, const char ch);
+
+// 从 ringbuf 首部丢弃 nbytes 字节的数据（例如它们已经被 writev 发出去了）。
+void ringbuf_consume(ringbuf *rb, const int nbytes);
+
+// 把 ringbuf 尾部最多 len 字节的空闲空间描述成最多 max_iovcnt 个
+// iovec，返回实际使用的 iovec 个数，可以直接交给 readv 把数据读进 ringbuf，然后用
+// ringbuf_commit 把读到的字节数计入 size。
+int ringbuf_get_free_iovecs(ringbuf *rb, const int len, struct iovec *iov,
+                            const int max_iovcnt);
+
+// 把紧跟在已有数据之后的 nbytes 字节（已经由调用者直接写进了
+// ringbuf_get_free_iovecs 描述的空闲空间）计入 size。
+void ringbuf_commit(ringbuf *rb, const int nbytes);
+
 // 从 src 转移最多 len 字节大小的数据到 dst 尾部
 int ringbuf_transfer(ringbuf *dst, ringbuf *src, const int len);
 
@@ -42,10 +105,25 @@ int ringbuf_get_remaining_capacity(ringbuf *rb);
 
 // 当实际容量不及预期容量时进行扩容（i.e.
 // 条件扩容），返回实际容量，如果扩容了，返回扩容后的实际容量（不一定等于
-// expected_size，但一定不小于它）。
+// expected_size，但一定不小于它）。超出内存预算时不扩容，返回原来的容量。
 int ringbuf_upscale_if_needed(ringbuf **rb, const int expected_size);
 
+// 把容量扩大到 new_capacity，已有的内容保持不变，成功返回 0，超出内存预算时返回
+// -1（容量不变）。
+int ringbuf_grow(ringbuf *rb, const int new_capacity);
+
+// 把容量缩小到 new_capacity，把多余的内存归还给内存预算，已有的内容必须能放得下，
+// 成功返回 0，否则返回 -1（容量不变）。
+int ringbuf_shrink(ringbuf *rb, const int new_capacity);
+
+// 确保剩余容量至少有 nbytes 字节：必要时按倍数扩容，但容量不超过
+// max_capacity，也不超出内存预算。返回（扩容后的）剩余容量，它可能仍然小于 nbytes。
+int ringbuf_reserve(ringbuf *rb, const int nbytes, const int max_capacity);
+
 // 获取 ringbuf 的容量（不是 size）
 int ringbuf_get_capacity(ringbuf *rb);
 
+// 获取 ringbuf 中已有数据的字节数（size）
+int ringbuf_get_size(ringbuf *rb);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "ringbuf.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// ringbuf.h 中分配缓冲区内存的部分，ringbuf.c 和 ring_shim.cc（ring.hpp 的 C 接口）
+// 共用。
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define HUGE_PAGE_SIZE (((0x1UL) << 20) * 2)
+#define SMALL_PAGE_SIZE 4096
+
+int large_size = RINGBUF_DEFAULT_LARGE_SIZE;
+enum ringbuf_prefault large_prefault = RINGBUF_PREFAULT_NONE;
+
+void ringbuf_set_large_alloc(int size, enum ringbuf_prefault prefault) {
+  large_size = size;
+  large_prefault = prefault;
+}
+
+// 在分配的时候就把页面都准备好。MAP_POPULATE 只能在 mmap 的时候给，那时还没有
+// madvise(MADV_HUGEPAGE)，所以用 MADV_POPULATE_WRITE（Linux 5.14）代替，更老的
+// 内核上退回到逐页写一个字节。
+void ringbuf_prefault(char *buf, size_t len) {
+  if (large_prefault == RINGBUF_PREFAULT_MLOCK) {
+    if (mlock(buf, len) == 0) {
+      return;
+    }
+    perror("mlock");
+  }
+  if (madvise(buf, len, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+  for (size_t off = 0; off < len; off += SMALL_PAGE_SIZE) {
+    buf[off] = 0;
+  }
+}
+
+// 大的缓冲区用 mmap 分配：多映射一个大页的长度，把首尾不对齐的部分还回去，剩下
+// 的按 2 MiB 对齐，再 madvise(MADV_HUGEPAGE)，这样透明大页可以铺满整个缓冲区。
+// mmap 失败时退回 malloc。
+char *ringbuf_alloc_buf(int capacity, size_t *mapped_len) {
+  *mapped_len = 0;
+  if (large_size <= 0 || capacity < large_size) {
+    return malloc(capacity);
+  }
+
+  const size_t len = (capacity + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  char *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return malloc(capacity);
+  }
+  char *buf = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+                       ~(HUGE_PAGE_SIZE - 1));
+  if (buf > raw) {
+    munmap(raw, buf - raw);
+  }
+  if (raw + HUGE_PAGE_SIZE > buf) {
+    munmap(buf + len, raw + HUGE_PAGE_SIZE - buf);
+  }
+  madvise(buf, len, MADV_HUGEPAGE);
+  if (large_prefault != RINGBUF_PREFAULT_NONE) {
+    ringbuf_prefault(buf, len);
+  }
+  *mapped_len = len;
+  return buf;
+}
+
+void ringbuf_free_buf(char *buf, size_t mapped_len) {
+  if (mapped_len > 0) {
+    munmap(buf, mapped_len);
+  } else {
+    free(buf);
+  }
+}
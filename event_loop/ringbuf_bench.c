@@ -0,0 +1,159 @@
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lathist.h"
+#include "ringbuf.h"
+
+// 模拟 chat_room 的广播：nr_rings 个 32 MiB 的 write_buf，每一批数据（64 KiB）
+// 依次拷进每一个 write_buf，直到写满，然后全部清空再来一遍。分别用 malloc、
+// mmap + MADV_HUGEPAGE、再加上预先缺页（populate、mlock）来分配这些缓冲区，报告：
+//
+//   - 第一遍（缓冲区刚分配，页面还没碰过）和第二遍每一批广播的延迟；
+//   - 第二遍的 dTLB miss 数（perf_event_open，拿不到硬件计数器时显示 n/a）；
+//   - 有多少内存是透明大页（/proc/self/smaps_rollup 的 AnonHugePages）。
+//
+// 用法：ringbuf_bench [nr_rings]
+
+#define DEFAULT_NR_RINGS 8
+#define RING_SIZE (((0x1UL) << 20) * 32)
+#define CHUNK_SIZE (((0x1UL) << 10) * 64)
+
+struct alloc_mode {
+  const char *name;
+  int large_size;
+  enum ringbuf_prefault prefault;
+};
+
+struct alloc_mode modes[] = {
+    {"malloc", 0, RINGBUF_PREFAULT_NONE},
+    {"hugepage", RINGBUF_DEFAULT_LARGE_SIZE, RINGBUF_PREFAULT_NONE},
+    {"populate", RINGBUF_DEFAULT_LARGE_SIZE, RINGBUF_PREFAULT_POPULATE},
+    {"mlock", RINGBUF_DEFAULT_LARGE_SIZE, RINGBUF_PREFAULT_MLOCK},
+};
+
+char chunk[CHUNK_SIZE];
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int open_dtlb_counter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_WRITE << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// 返回进程里透明大页的总量（KiB），读不到时返回 -1。
+long anon_huge_kb() {
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+// 广播一遍：每一批依次拷进每个缓冲区，直到写满。每一批的延迟记到 h 里。
+void broadcast_pass(ringbuf **rings, int nr_rings, struct lathist *h) {
+  for (unsigned long filled = 0; filled < RING_SIZE; filled += CHUNK_SIZE) {
+    const long t0 = now_ns();
+    for (int i = 0; i < nr_rings; ++i) {
+      ringbuf_send_chunk(rings[i], chunk, CHUNK_SIZE);
+    }
+    lathist_record(h, now_ns() - t0);
+  }
+  for (int i = 0; i < nr_rings; ++i) {
+    ringbuf_clear(rings[i]);
+  }
+}
+
+void print_pass(const char *mode, const char *pass, struct lathist *h,
+                long total_ns) {
+  printf("%-10s %-6s total %8.1f ms  batch p50<=%7.1f us p99<=%7.1f us "
+         "max %8.1f us",
+         mode, pass, total_ns / 1e6, lathist_percentile(h, 50) / 1000.0,
+         lathist_percentile(h, 99) / 1000.0, h->max_ns / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+  int nr_rings = DEFAULT_NR_RINGS;
+  if (argc > 1) {
+    nr_rings = atoi(argv[1]);
+  }
+  memset(chunk, 'x', sizeof(chunk));
+  ringbuf **rings = malloc(sizeof(ringbuf *) * nr_rings);
+  const int dtlb_fd = open_dtlb_counter();
+
+  printf("%d rings of %lu MiB, %lu KiB per batch\n", nr_rings,
+         RING_SIZE >> 20, CHUNK_SIZE >> 10);
+  for (unsigned long m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    ringbuf_set_large_alloc(modes[m].large_size, modes[m].prefault);
+
+    long t0 = now_ns();
+    for (int i = 0; i < nr_rings; ++i) {
+      rings[i] = ringbuf_create(RING_SIZE);
+    }
+    const long alloc_ns = now_ns() - t0;
+
+    struct lathist h;
+    lathist_reset(&h);
+    t0 = now_ns();
+    broadcast_pass(rings, nr_rings, &h);
+    print_pass(modes[m].name, "first", &h, now_ns() - t0);
+    printf("  alloc %.1f ms, huge pages %ld MiB\n", alloc_ns / 1e6,
+           anon_huge_kb() / 1024);
+
+    lathist_reset(&h);
+    if (dtlb_fd >= 0) {
+      ioctl(dtlb_fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(dtlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    t0 = now_ns();
+    broadcast_pass(rings, nr_rings, &h);
+    const long warm_ns = now_ns() - t0;
+    long long dtlb_misses = -1;
+    if (dtlb_fd >= 0) {
+      ioctl(dtlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(dtlb_fd, &dtlb_misses, sizeof(dtlb_misses)) !=
+          sizeof(dtlb_misses)) {
+        dtlb_misses = -1;
+      }
+    }
+    print_pass(modes[m].name, "warm", &h, warm_ns);
+    if (dtlb_misses >= 0) {
+      printf("  dTLB store misses %lld\n", dtlb_misses);
+    } else {
+      printf("  dTLB store misses n/a\n");
+    }
+
+    for (int i = 0; i < nr_rings; ++i) {
+      ringbuf_free(rings[i]);
+    }
+  }
+
+  free(rings);
+  return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ringbuf.h"
+
+// 逐个测量 ringbuf.h 各个操作的开销：Makefile 把这同一个程序分别链接 ringbuf.c
+// （ringbuf_ops_bench）和 ring.hpp 的 C 接口 ring_shim.o（ringbuf_ops_bench_tmpl），
+// 两者的输出放在一起比较。每个测试还打印一个由操作结果算出来的校验和，两个版本
+// 的校验和必须一样。
+//
+// 数据是随机长度的、以 '\n' 结尾的行，模拟 chat_room 在 ringbuf 上做的事情：
+// 小块写入、整块读出、按行查找、缓冲区之间的复制、拿 iovec 交给 readv/writev。
+// 用法：ringbuf_ops_bench [MiB per test]
+
+#define DEFAULT_MIB 256
+#define RING_SIZE (((0x1UL) << 20) * 1)
+#define DATA_SIZE (((0x1UL) << 20) * 4)
+#define MAX_LINE 200
+
+char data[DATA_SIZE];
+char out[DATA_SIZE];
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// 一个测试：每次调用处理大约 chunk 字节，返回加进校验和的值。
+struct bench_case {
+  const char *name;
+  int chunk;
+  unsigned long (*run)(ringbuf *a, ringbuf *b, int chunk);
+};
+
+long data_pos = 0;
+
+const char *next_data(int len) {
+  if (data_pos + len > (long)DATA_SIZE) {
+    data_pos = 0;
+  }
+  const char *p = data + data_pos;
+  data_pos += len;
+  return p;
+}
+
+// 小块写入，写满之后一次清掉。
+unsigned long run_send_small(ringbuf *a, ringbuf *b, int chunk) {
+  if (ringbuf_send_chunk(a, next_data(chunk), chunk) != 0) {
+    ringbuf_consume(a, ringbuf_get_size(a));
+    ringbuf_send_chunk(a, next_data(chunk), chunk);
+  }
+  return ringbuf_get_size(a);
+}
+
+// 写入一块再把它读出来，读到的数据要么被用掉要么一部分退回。
+unsigned long run_send_receive(ringbuf *a, ringbuf *b, int chunk) {
+  ringbuf_send_chunk(a, next_data(chunk), chunk);
+  const int n = ringbuf_receive_chunk(out, chunk, a);
+  ringbuf_return_chunk(a, out + n / 2, n - n / 2);
+  ringbuf_consume(a, n - n / 2);
+  return (unsigned char)out[n / 3] + n;
+}
+
+// 保持缓冲区里有一段数据，在里面找第一个和最后一个换行。
+unsigned long run_find(ringbuf *a, ringbuf *b, int chunk) {
+  if (ringbuf_get_remaining_capacity(a) < chunk) {
+    ringbuf_consume(a, chunk);
+  }
+  ringbuf_send_chunk(a, next_data(chunk), chunk);
+  const int size = ringbuf_get_size(a);
+  const int first = ringbuf_find(a, size - chunk, size, '\n');
+  const int last = ringbuf_rfind(a, size - chunk, size, '\n');
+  return first + last;
+}
+
+// 在两个缓冲区之间复制、转移。
+unsigned long run_copy(ringbuf *a, ringbuf *b, int chunk) {
+  if (ringbuf_get_remaining_capacity(a) < chunk) {
+    ringbuf_consume(a, chunk);
+  }
+  ringbuf_send_chunk(a, next_data(chunk), chunk);
+  if (ringbuf_get_remaining_capacity(b) < 2 * chunk) {
+    ringbuf_clear(b);
+  }
+  const int copied = ringbuf_copy_from(b, a, ringbuf_get_size(a) - chunk, chunk);
+  const int moved = ringbuf_transfer(b, a, chunk / 2);
+  return copied + moved + ringbuf_get_size(b);
+}
+
+// readv/writev 的簿记：拿空闲空间的 iovec、提交，拿数据的 iovec、消耗，只碰元
+// 数据，不碰数据。
+unsigned long run_iovecs(ringbuf *a, ringbuf *b, int chunk) {
+  struct iovec iov[2];
+  int iovcnt = ringbuf_get_free_iovecs(a, chunk, iov, 2);
+  int n = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    n += iov[i].iov_len;
+  }
+  ringbuf_commit(a, n);
+  iovcnt = ringbuf_get_iovecs(a, 0, chunk - 7, iov, 2);
+  if (iovcnt == 0) {
+    return 0;
+  }
+  ringbuf_consume(a, iov[0].iov_len);
+  return iovcnt + iov[0].iov_len;
+}
+
+struct bench_case cases[] = {
+    {"send 64B", 64, run_send_small},
+    {"send/recv 1.5K", 1500, run_send_receive},
+    {"find/rfind 4K", 4096, run_find},
+    {"copy 64K", 65536, run_copy},
+    {"iovecs 16K", 16384, run_iovecs},
+};
+
+int main(int argc, char *argv[]) {
+  long mib = DEFAULT_MIB;
+  if (argc > 1) {
+    mib = atol(argv[1]);
+  }
+
+  srand(1);
+  for (unsigned long i = 0; i < DATA_SIZE;) {
+    int len = 1 + rand() % MAX_LINE;
+    for (int j = 0; j < len - 1 && i < DATA_SIZE; ++j) {
+      data[i++] = 'a' + rand() % 26;
+    }
+    if (i < DATA_SIZE) {
+      data[i++] = '\n';
+    }
+  }
+
+  ringbuf *a = ringbuf_create(RING_SIZE);
+  ringbuf *b = ringbuf_create(RING_SIZE);
+  for (unsigned long c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+    ringbuf_clear(a);
+    ringbuf_clear(b);
+    data_pos = 0;
+    const long nr_calls = (mib << 20) / cases[c].chunk;
+    unsigned long checksum = 0;
+    const long t0 = now_ns();
+    for (long i = 0; i < nr_calls; ++i) {
+      checksum = checksum * 31 + cases[c].run(a, b, cases[c].chunk);
+    }
+    const long ns = now_ns() - t0;
+    printf("%-16s %8.1f ns/call %9.1f MiB/s  checksum %016lx\n",
+           cases[c].name, (double)ns / nr_calls,
+           ns > 0 ? mib * 1e9 / ns : 0.0, checksum);
+  }
+  ringbuf_free(a);
+  ringbuf_free(b);
+  return 0;
+}
@@ -0,0 +1,483 @@
+#include "roomlog.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INITIAL_SEGMENT_SLOTS 8
+#define INITIAL_INDEX_SLOTS 64
+// 一次 sendfile 最多发这么多，免得一个追赶的连接一直占着事件循环。
+#define SENDFILE_CHUNK (((0x1UL) << 20) * 1)
+
+struct roomlog_segment {
+  unsigned long base;
+  unsigned long size;
+  int fd;
+  int index_fd;
+  // 最后一次写入的时间（秒，CLOCK_REALTIME，和文件的 mtime 一样）。
+  long mtime;
+};
+
+struct roomlog {
+  struct roomlog_config cfg;
+  // 按 base 排列，最后一个是正在写的段。
+  struct roomlog_segment *segs;
+  int nr_segs;
+  int segs_capacity;
+
+  // 所有还保留着的段的索引项，按偏移排列。
+  struct roomlog_index_entry *index;
+  int nr_index;
+  int index_capacity;
+
+  // 日志里一共有多少条消息（'\n' 的个数）。
+  unsigned long nr_msgs;
+  long page_size;
+};
+
+long roomlog_now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec;
+}
+
+void segment_path(char *buf, size_t len, const char *dir, unsigned long base,
+                  const char *ext) {
+  snprintf(buf, len, "%s/%020lu.%s", dir, base, ext);
+}
+
+struct roomlog_segment *last_segment(struct roomlog *log) {
+  return &log->segs[log->nr_segs - 1];
+}
+
+void add_index_entry(struct roomlog *log, unsigned long nr_msgs,
+                     unsigned long offset) {
+  if (log->nr_index == log->index_capacity) {
+    log->index_capacity *= 2;
+    log->index = realloc(log->index, sizeof(struct roomlog_index_entry) *
+                                         log->index_capacity);
+  }
+  log->index[log->nr_index++] =
+      (struct roomlog_index_entry){.nr_msgs = nr_msgs, .offset = offset};
+}
+
+// 打开（create 为真时创建）base 开始的段，追加到 segs 末尾。
+int open_segment(struct roomlog *log, unsigned long base, int create) {
+  char path[PATH_MAX];
+  segment_path(path, sizeof(path), log->cfg.dir, base, "log");
+  const int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+  int fd = open(path, flags, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "roomlog: open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "roomlog: stat %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  segment_path(path, sizeof(path), log->cfg.dir, base, "idx");
+  int index_fd = open(path,
+                      O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC |
+                          (create ? O_TRUNC : 0),
+                      0644);
+  if (index_fd < 0) {
+    fprintf(stderr, "roomlog: open %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  // 索引项只追加，每个都是一次完整的 write，读回来时丢掉最后不完整的一项（以及
+  // 指向段末尾之后的项，见 roomlog_open）。
+  struct roomlog_index_entry e;
+  while (read(index_fd, &e, sizeof(e)) == sizeof(e)) {
+    if (e.offset <= base + st.st_size) {
+      add_index_entry(log, e.nr_msgs, e.offset);
+    }
+  }
+
+  if (log->nr_segs == log->segs_capacity) {
+    log->segs_capacity *= 2;
+    log->segs = realloc(log->segs,
+                        sizeof(struct roomlog_segment) * log->segs_capacity);
+  }
+  log->segs[log->nr_segs++] =
+      (struct roomlog_segment){.base = base,
+                               .size = st.st_size,
+                               .fd = fd,
+                               .index_fd = index_fd,
+                               .mtime = st.st_mtime};
+  return 0;
+}
+
+void delete_oldest_segment(struct roomlog *log) {
+  struct roomlog_segment *seg = &log->segs[0];
+  char path[PATH_MAX];
+  segment_path(path, sizeof(path), log->cfg.dir, seg->base, "log");
+  unlink(path);
+  segment_path(path, sizeof(path), log->cfg.dir, seg->base, "idx");
+  unlink(path);
+  // 正在从这个段 sendfile 的连接下一次会跳到下一个段，见 roomlog_sendfile。
+  close(seg->fd);
+  close(seg->index_fd);
+  --log->nr_segs;
+  memmove(log->segs, log->segs + 1,
+          sizeof(struct roomlog_segment) * log->nr_segs);
+
+  const unsigned long start = log->segs[0].base;
+  int dropped = 0;
+  while (dropped < log->nr_index && log->index[dropped].offset < start) {
+    ++dropped;
+  }
+  log->nr_index -= dropped;
+  memmove(log->index, log->index + dropped,
+          sizeof(struct roomlog_index_entry) * log->nr_index);
+}
+
+int roomlog_retain(struct roomlog *log) {
+  const long now = roomlog_now_sec();
+  int nr_deleted = 0;
+  while (log->nr_segs > 1) {
+    const struct roomlog_segment *oldest = &log->segs[0];
+    const unsigned long size = roomlog_get_end(log) - oldest->base;
+    const int too_big = log->cfg.retain_bytes > 0 &&
+                        size > (unsigned long)log->cfg.retain_bytes;
+    const int too_old = log->cfg.retain_sec > 0 &&
+                        oldest->mtime + log->cfg.retain_sec < now;
+    if (!too_big && !too_old) {
+      break;
+    }
+    delete_oldest_segment(log);
+    ++nr_deleted;
+  }
+  return nr_deleted;
+}
+
+// 找到包含 off 的段，off 在所有段之前时返回第一个段，在最后一个段之后（等于
+// end）时返回 NULL。
+struct roomlog_segment *find_segment(struct roomlog *log, unsigned long off) {
+  for (int i = log->nr_segs - 1; i >= 0; --i) {
+    struct roomlog_segment *seg = &log->segs[i];
+    if (off >= seg->base) {
+      return off < seg->base + seg->size ? seg : NULL;
+    }
+  }
+  return &log->segs[0];
+}
+
+// 从 from 开始往后数 *n 个 '\n'，返回第 *n 个之后的位置，不够时返回 end，*n 减去
+// 数到的个数。直接在映射进来的段上找，不读进缓冲区。
+unsigned long skip_newlines(struct roomlog *log, unsigned long from,
+                            unsigned long *n) {
+  const unsigned long end = roomlog_get_end(log);
+  while (*n > 0 && from < end) {
+    struct roomlog_segment *seg = find_segment(log, from);
+    if (seg == NULL) {
+      break;
+    }
+    if (from < seg->base) {
+      from = seg->base;
+    }
+    const unsigned long rel = from - seg->base;
+    const unsigned long aligned = rel & ~(log->page_size - 1);
+    const size_t map_len = seg->size - aligned;
+    char *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, seg->fd, aligned);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "roomlog: mmap: %s\n", strerror(errno));
+      return end;
+    }
+    const char *p = map + (rel - aligned);
+    const char *seg_end = map + map_len;
+    while (*n > 0 && p < seg_end) {
+      const char *nl = memchr(p, '\n', seg_end - p);
+      if (nl == NULL) {
+        p = seg_end;
+        break;
+      }
+      p = nl + 1;
+      --*n;
+    }
+    from = seg->base + aligned + (p - map);
+    munmap(map, map_len);
+  }
+  return from;
+}
+
+struct roomlog *roomlog_open(const struct roomlog_config *cfg) {
+  if (mkdir(cfg->dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "roomlog: mkdir %s: %s\n", cfg->dir, strerror(errno));
+    return NULL;
+  }
+  DIR *dir = opendir(cfg->dir);
+  if (dir == NULL) {
+    fprintf(stderr, "roomlog: opendir %s: %s\n", cfg->dir, strerror(errno));
+    return NULL;
+  }
+
+  struct roomlog *log = malloc(sizeof(struct roomlog));
+  log->cfg = *cfg;
+  log->segs_capacity = INITIAL_SEGMENT_SLOTS;
+  log->segs = malloc(sizeof(struct roomlog_segment) * log->segs_capacity);
+  log->nr_segs = 0;
+  log->index_capacity = INITIAL_INDEX_SLOTS;
+  log->index =
+      malloc(sizeof(struct roomlog_index_entry) * log->index_capacity);
+  log->nr_index = 0;
+  log->nr_msgs = 0;
+  log->page_size = sysconf(_SC_PAGESIZE);
+
+  // 已有的段按 base 排序后依次打开。
+  int nr_bases = 0, bases_capacity = INITIAL_SEGMENT_SLOTS;
+  unsigned long *bases = malloc(sizeof(unsigned long) * bases_capacity);
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    char *suffix;
+    unsigned long base = strtoul(de->d_name, &suffix, 10);
+    if (suffix == de->d_name || strcmp(suffix, ".log") != 0) {
+      continue;
+    }
+    if (nr_bases == bases_capacity) {
+      bases_capacity *= 2;
+      bases = realloc(bases, sizeof(unsigned long) * bases_capacity);
+    }
+    bases[nr_bases++] = base;
+  }
+  closedir(dir);
+  for (int i = 1; i < nr_bases; ++i) {
+    for (int j = i; j > 0 && bases[j - 1] > bases[j]; --j) {
+      unsigned long t = bases[j];
+      bases[j] = bases[j - 1];
+      bases[j - 1] = t;
+    }
+  }
+
+  int failed = 0;
+  for (int i = 0; i < nr_bases && !failed; ++i) {
+    failed = open_segment(log, bases[i], 0) != 0;
+  }
+  free(bases);
+  if (!failed && log->nr_segs == 0) {
+    failed = open_segment(log, 0, 1) != 0;
+  }
+  if (failed) {
+    roomlog_close(log);
+    return NULL;
+  }
+
+  // 消息的个数接着最后一个索引项往后数。
+  unsigned long from = roomlog_get_start(log);
+  if (log->nr_index > 0) {
+    from = log->index[log->nr_index - 1].offset;
+    log->nr_msgs = log->index[log->nr_index - 1].nr_msgs;
+  }
+  unsigned long n = ULONG_MAX;
+  skip_newlines(log, from, &n);
+  log->nr_msgs += ULONG_MAX - n;
+  fprintf(stderr,
+          "roomlog: %s holds [%lu, %lu) in %d segments, %lu messages\n",
+          cfg->dir, roomlog_get_start(log), roomlog_get_end(log),
+          log->nr_segs, log->nr_msgs);
+  return log;
+}
+
+void roomlog_close(struct roomlog *log) {
+  for (int i = 0; i < log->nr_segs; ++i) {
+    close(log->segs[i].fd);
+    close(log->segs[i].index_fd);
+  }
+  free(log->segs);
+  free(log->index);
+  free(log);
+}
+
+// 换一个新段，它从日志的末尾开始。
+int roll_segment(struct roomlog *log) {
+  if (open_segment(log, roomlog_get_end(log), 1) != 0) {
+    return -1;
+  }
+  roomlog_retain(log);
+  return 0;
+}
+
+void append_index_entry(struct roomlog *log, struct roomlog_segment *seg,
+                        unsigned long nr_msgs, unsigned long offset) {
+  add_index_entry(log, nr_msgs, offset);
+  if (write(seg->index_fd, &log->index[log->nr_index - 1],
+            sizeof(struct roomlog_index_entry)) !=
+      sizeof(struct roomlog_index_entry)) {
+    fprintf(stderr, "roomlog: failed to write index: %s\n", strerror(errno));
+  }
+}
+
+int roomlog_append(struct roomlog *log, struct bytesq *q) {
+  const int n = bytesq_get_size(q);
+  if (n == 0) {
+    return 0;
+  }
+  struct roomlog_segment *seg = last_segment(log);
+  if (seg->size > 0 && seg->size + n > (unsigned long)log->cfg.segment_size) {
+    if (roll_segment(log) != 0) {
+      return -1;
+    }
+    seg = last_segment(log);
+  }
+
+  // 写的同时数一下这一批里有几个 '\n'，记下第一个和最后一个之后的位置。
+  struct iovec iov[IOV_MAX];
+  int written = 0;
+  long first_boundary = -1, last_boundary = -1;
+  unsigned long first_nr_msgs = 0;
+  while (written < n) {
+    const int iovcnt =
+        bytesq_get_iovecs(q, written, n - written, iov, IOV_MAX);
+    ssize_t result = pwritev(seg->fd, iov, iovcnt, seg->size);
+    if (result <= 0) {
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "roomlog: pwritev: %s\n",
+              result < 0 ? strerror(errno) : "nothing written");
+      break;
+    }
+    for (int i = 0; i < iovcnt && result > 0; ++i) {
+      const char *p = iov[i].iov_base;
+      const size_t len =
+          (size_t)result < iov[i].iov_len ? (size_t)result : iov[i].iov_len;
+      const char *end = p + len;
+      while ((p = memchr(p, '\n', end - p)) != NULL) {
+        ++p;
+        ++log->nr_msgs;
+        last_boundary = seg->base + seg->size + (p - (char *)iov[i].iov_base);
+        if (first_boundary < 0) {
+          first_boundary = last_boundary;
+          first_nr_msgs = log->nr_msgs;
+        }
+      }
+      seg->size += len;
+      written += len;
+      result -= len;
+    }
+  }
+  seg->mtime = roomlog_now_sec();
+
+  unsigned long last_indexed =
+      log->nr_index > 0 ? log->index[log->nr_index - 1].offset : 0;
+  // 每个段的第一个边界总有一个索引项（这样段里在它之前的只是上一段最后一条
+  // 消息的后半截），之后大约每隔 ROOMLOG_INDEX_INTERVAL 一个。
+  if (first_boundary >= 0 &&
+      (log->nr_index == 0 || last_indexed < seg->base)) {
+    append_index_entry(log, seg, first_nr_msgs, first_boundary);
+    last_indexed = first_boundary;
+  }
+  if (last_boundary >= 0 &&
+      last_boundary - last_indexed >= ROOMLOG_INDEX_INTERVAL) {
+    append_index_entry(log, seg, log->nr_msgs, last_boundary);
+  }
+  return written == n ? 0 : -1;
+}
+
+unsigned long roomlog_get_start(struct roomlog *log) {
+  return log->segs[0].base;
+}
+
+unsigned long roomlog_get_end(struct roomlog *log) {
+  const struct roomlog_segment *seg = last_segment(log);
+  return seg->base + seg->size;
+}
+
+int roomlog_get_nr_segments(struct roomlog *log) { return log->nr_segs; }
+
+unsigned long roomlog_catchup_start(struct roomlog *log, long max_msgs,
+                                    long max_bytes) {
+  const unsigned long start = roomlog_get_start(log);
+  const unsigned long end = roomlog_get_end(log);
+  if (max_bytes <= 0 || start == end) {
+    return end;
+  }
+
+  // 按字节数：end - max_bytes 之后的第一个消息边界。日志的开头（偏移 0）也是
+  // 边界，旧段被删掉之后的开头就不一定是了。
+  unsigned long from = end - start > (unsigned long)max_bytes ? end - max_bytes
+                                                              : start;
+  if (from > 0) {
+    unsigned long n = 1;
+    from = skip_newlines(log, from > start ? from - 1 : start, &n);
+  }
+  if (max_msgs <= 0 || (unsigned long)max_msgs >= log->nr_msgs) {
+    return from;
+  }
+
+  // 按消息数：第 nr_msgs - max_msgs 条消息之后的位置。先找不超过它的最后一个
+  // 索引项，再从那里往后数剩下的几条。
+  const unsigned long target = log->nr_msgs - max_msgs;
+  int lo = 0, hi = log->nr_index;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (log->index[mid].nr_msgs <= target) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  unsigned long msg_start;
+  if (lo > 0) {
+    const struct roomlog_index_entry *e = &log->index[lo - 1];
+    unsigned long n = target - e->nr_msgs;
+    msg_start = skip_newlines(log, e->offset, &n);
+  } else if (start == 0) {
+    // 日志的开头相当于一个 (0, 0) 的索引项。
+    unsigned long n = target;
+    msg_start = skip_newlines(log, 0, &n);
+  } else {
+    // 要的消息比保留着的还早，从保留着的第一条完整的消息开始。
+    msg_start = log->nr_index > 0 ? log->index[0].offset : end;
+  }
+  return msg_start > from ? msg_start : from;
+}
+
+long roomlog_sendfile(struct roomlog *log, int sock, unsigned long *off,
+                      unsigned long end) {
+  while (*off < end) {
+    struct roomlog_segment *seg = find_segment(log, *off);
+    if (seg == NULL) {
+      // 超出了日志的末尾，不应该发生。
+      *off = end;
+      return 0;
+    }
+    if (*off < seg->base) {
+      // 追到一半的段被删掉了，跳过去。
+      *off = seg->base;
+      continue;
+    }
+    unsigned long count = seg->base + seg->size - *off;
+    if (count > end - *off) {
+      count = end - *off;
+    }
+    if (count > SENDFILE_CHUNK) {
+      count = SENDFILE_CHUNK;
+    }
+    off_t file_off = *off - seg->base;
+    ssize_t result = sendfile(sock, seg->fd, &file_off, count);
+    if (result < 0) {
+      return -errno;
+    }
+    if (result == 0) {
+      // 段文件比记录的短（被截断了），跳过这一段。
+      *off = seg->base + seg->size;
+      continue;
+    }
+    *off += result;
+    return result;
+  }
+  return 0;
+}
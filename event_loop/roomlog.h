@@ -0,0 +1,81 @@
+#ifndef MY_ROOMLOG
+#define MY_ROOMLOG
+
+#include "bytes.h"
+
+// 房间日志：chat_room 广播出去的每一批数据都追加到一个分段的、只追加的日志里，
+// 新加入（或者重连）的连接先收到最近的一段历史，再接上实时的广播。
+//
+// 日志是一个目录，里面每个段是一对文件：
+//
+//   <base>.log   段的内容，base 是它的第一个字节在整个日志里的偏移（20 位十进制）
+//   <base>.idx   稀疏的偏移索引（struct roomlog_index_entry 的数组）：段里的第
+//                一个消息边界（'\n' 之后），以及之后大约每 ROOMLOG_INDEX_INTERVAL
+//                字节一个边界的偏移和它之前一共有多少条消息
+//
+// 写入：每一批数据用一次 pwritev 直接从内存池的数据块（bytesq 的切片）写进当前
+// 段，不复制到别的缓冲区，顺便用 memchr 数一下其中有几条消息。当前段写满
+// segment_size 后换一个新段。超出保留大小、或者最后一次写入已经超过保留时间的
+// 旧段被删除（当前段永远不删）。日志只写进 page cache，不 fsync：进程崩溃不丢
+// 数据，机器掉电可能丢掉最后一段。
+//
+// 追赶：roomlog_catchup_start 用索引找到最后 N 条消息的开头（从不超过它的最后
+// 一个索引项开始，在映射进来的段上最多再往后数 ROOMLOG_INDEX_INTERVAL 字节左右），
+// roomlog_sendfile 用 sendfile 把历史直接从 page cache 发到 socket，既不经过
+// 用户态，也不碰广播的路径：实时数据照常进连接的 write_buf，只是要等历史发完
+// 才轮到它们。
+//
+// 重新启动时接着目录里已有的段继续写，偏移也接着原来的。
+
+#define ROOMLOG_INDEX_INTERVAL (((0x1UL) << 10) * 64)
+
+struct roomlog_index_entry {
+  // 这个边界之前一共有多少条消息（从日志创建起）。
+  unsigned long nr_msgs;
+  // 边界在日志里的偏移。
+  unsigned long offset;
+};
+
+struct roomlog_config {
+  const char *dir;
+  // 一个段写到多大就换新段。
+  long segment_size;
+  // 所有段加起来最多保留多少字节、最后一次写入之后最多保留多少秒，0 表示不限。
+  long retain_bytes;
+  long retain_sec;
+};
+
+struct roomlog;
+
+// 打开 dir（不存在时创建）下的日志，接着已有的段继续写。失败时打印原因并返回
+// NULL。
+struct roomlog *roomlog_open(const struct roomlog_config *cfg);
+
+void roomlog_close(struct roomlog *log);
+
+// 把 q 的全部内容（不消耗 q）追加到日志，需要时先换一个新段。写入失败时打印原因
+// 并返回 -1，这时只有写进去了的部分算在日志里。
+int roomlog_append(struct roomlog *log, struct bytesq *q);
+
+// 日志中还保留着的范围 [start, end)，都是从日志创建起的字节偏移。
+unsigned long roomlog_get_start(struct roomlog *log);
+unsigned long roomlog_get_end(struct roomlog *log);
+
+int roomlog_get_nr_segments(struct roomlog *log);
+
+// 新加入的连接从哪里开始追：最后 max_msgs 条消息（以 '\n' 结尾），并且最多
+// max_bytes 字节，从一个消息的边界开始；max_msgs 为 0 表示只按字节数算。追到
+// roomlog_get_end 为止。
+unsigned long roomlog_catchup_start(struct roomlog *log, long max_msgs,
+                                    long max_bytes);
+
+// 用 sendfile 把 [*off, end) 的一部分发到 sock（O_NONBLOCK 的 socket），*off
+// 随之前进。*off 所在的段已经被删掉时跳到还保留着的部分。返回发出的字节数，
+// 已经追到 end 时返回 0，出错时返回 -errno（包括 -EAGAIN）。
+long roomlog_sendfile(struct roomlog *log, int sock, unsigned long *off,
+                      unsigned long end);
+
+// 按保留大小和保留时间删除旧段，返回删除的段数。追加时换段也会检查一次。
+int roomlog_retain(struct roomlog *log);
+
+#endif
@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+// shmring 的消费者：打开 socket_mux -o 创建的共享内存环，原地读取数据。默认把
+// 数据写到 stdout（方便接到管道里，但这样又多了一次拷贝和 write）；-q 只统计不
+// 输出，每秒向 stderr 报告一次吞吐量和为了等数据而睡下去的次数（也就是消费者
+// 在环上花掉的全部 syscall）。
+// 用法：shm_cat [-q] [-p spin] <path>
+
+#define DEFAULT_SPIN 1000
+#define REPORT_INTERVAL_NS 1000000000L
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int write_all(int fd, const char *buf, int len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "write: %s\n", strerror(errno));
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+void report(shmring *r, unsigned long nbytes, unsigned long nr_chunks,
+            double secs) {
+  fprintf(stderr,
+          "%lu bytes in %lu chunks, %.1f MiB/s, %lu sleeps, %lu wakes\n",
+          nbytes, nr_chunks, secs > 0 ? nbytes / secs / (1 << 20) : 0.0,
+          shmring_get_nr_sleeps(r), shmring_get_nr_wakes(r));
+}
+
+int main(int argc, char *argv[]) {
+  int quiet = 0;
+  int spin = DEFAULT_SPIN;
+  int opt;
+  while ((opt = getopt(argc, argv, "qp:")) != -1) {
+    switch (opt) {
+      case 'q':
+        quiet = 1;
+        break;
+      case 'p':
+        spin = atoi(optarg);
+        break;
+      default:
+        optind = argc;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr,
+            "Usage: %s [-q] [-p spin (default %d)] <path>\n"
+            "  -q  count the data instead of copying it to stdout\n",
+            argv[0], DEFAULT_SPIN);
+    exit(1);
+  }
+
+  shmring *r = shmring_open(argv[optind]);
+  if (r == NULL) {
+    exit(1);
+  }
+
+  unsigned long total = 0, nr_chunks = 0, interval_bytes = 0;
+  const long t0 = now_ns();
+  long last_report = t0;
+  while (1) {
+    int len;
+    const char *data = shmring_peek(r, &len);
+    if (len == 0) {
+      int status = shmring_wait_data(r, spin, quiet ? 1000 : -1);
+      if (status < 0) {
+        break;
+      }
+    } else {
+      if (!quiet && write_all(STDOUT_FILENO, data, len) != 0) {
+        break;
+      }
+      shmring_consume(r, len);
+      total += len;
+      interval_bytes += len;
+      ++nr_chunks;
+    }
+
+    if (quiet && interval_bytes > 0) {
+      const long now = now_ns();
+      if (now - last_report >= REPORT_INTERVAL_NS) {
+        report(r, total, nr_chunks, (now - t0) / 1e9);
+        last_report = now;
+        interval_bytes = 0;
+      }
+    }
+  }
+
+  report(r, total, nr_chunks, (now_ns() - t0) / 1e9);
+  shmring_close(r);
+  return 0;
+}
@@ -0,0 +1,335 @@
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// 共享文件的布局：第一页是 shmring_hdr，数据区从第二页开始。
+#define SHMRING_MAGIC 0x31676e69726d6873UL
+#define SHMRING_HDR_SIZE 4096
+#define CACHELINE_SIZE 64
+
+// 生产者写的字段和消费者写的字段放在不同的 cache line 上。head、tail
+// 是一直增长的字节计数，head - tail 就是环里的数据量。
+struct shmring_hdr {
+  _Atomic unsigned long magic;
+  unsigned long capacity;
+
+  // 生产者写，消费者读。data_bell 是消费者等数据时的 futex 字。
+  _Alignas(CACHELINE_SIZE) _Atomic unsigned long head;
+  _Atomic unsigned int data_bell;
+  _Atomic unsigned int producer_waiting;
+  _Atomic unsigned int closed;
+
+  // 消费者写，生产者读。space_bell 是生产者等空间时的 futex 字。
+  _Alignas(CACHELINE_SIZE) _Atomic unsigned long tail;
+  _Atomic unsigned int space_bell;
+  _Atomic unsigned int consumer_waiting;
+};
+
+struct shmring_impl {
+  struct shmring_hdr *hdr;
+  // 数据区被连续映射了两次，data[i] 和 data[i + capacity] 是同一个字节。
+  char *data;
+  int capacity;
+  int fd;
+  int is_producer;
+
+  // 对方的位置（生产者看 tail，消费者看 head）在本地的缓存：按缓存看还有空间
+  // （数据）时就不去读共享的那个，免得那条 cache line 在两个 CPU 之间来回。
+  unsigned long cached_peer;
+
+  unsigned long nr_sleeps;
+  unsigned long nr_wakes;
+};
+
+long shmring_futex(_Atomic unsigned int *word, int op, unsigned int val,
+                   const struct timespec *timeout) {
+  // 共享内存里的 futex，不能用 FUTEX_PRIVATE_FLAG。
+  return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+void shmring_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// 把数据区映射两次，紧挨着放在一段预留好的地址空间里。
+char *shmring_map_data(int fd, int capacity, int prot) {
+  char *base = mmap(NULL, 2 * (size_t)capacity, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (mmap(base + (size_t)i * capacity, capacity, prot, MAP_SHARED | MAP_FIXED,
+             fd, SHMRING_HDR_SIZE) == MAP_FAILED) {
+      munmap(base, 2 * (size_t)capacity);
+      return NULL;
+    }
+  }
+  return base;
+}
+
+shmring *shmring_map(int fd, int capacity, int is_producer) {
+  shmring *r = malloc(sizeof(shmring));
+  if (r == NULL) {
+    return NULL;
+  }
+  memset(r, 0, sizeof(shmring));
+  r->fd = fd;
+  r->capacity = capacity;
+  r->is_producer = is_producer;
+  r->hdr = mmap(NULL, SHMRING_HDR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                0);
+  if (r->hdr == MAP_FAILED) {
+    free(r);
+    return NULL;
+  }
+  r->data = shmring_map_data(
+      fd, capacity, is_producer ? PROT_READ | PROT_WRITE : PROT_READ);
+  if (r->data == NULL) {
+    munmap(r->hdr, SHMRING_HDR_SIZE);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+shmring *shmring_create(const char *path, int capacity) {
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (capacity < page_size || capacity % page_size != 0 ||
+      (capacity & (capacity - 1)) != 0) {
+    fprintf(stderr, "shmring capacity %d must be a power of 2 and a multiple "
+            "of the page size.\n", capacity);
+    return NULL;
+  }
+
+  // 先删掉旧文件再建新的：还映射着旧文件的消费者不会因为文件被截断而 SIGBUS，它
+  // 会一直等在旧的环上，重新 open 才能看到新的。
+  unlink(path);
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (ftruncate(fd, SHMRING_HDR_SIZE + (off_t)capacity) == -1) {
+    fprintf(stderr, "ftruncate %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  shmring *r = shmring_map(fd, capacity, 1);
+  if (r == NULL) {
+    fprintf(stderr, "mmap %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  // ftruncate 出来的文件全是 0，只需要填 capacity，最后写 magic，消费者看到
+  // magic 时其它字段一定已经就绪。
+  r->hdr->capacity = capacity;
+  atomic_store_explicit(&r->hdr->magic, SHMRING_MAGIC, memory_order_release);
+  return r;
+}
+
+shmring *shmring_open(const char *path) {
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  struct shmring_hdr *hdr = mmap(NULL, SHMRING_HDR_SIZE, PROT_READ, MAP_SHARED,
+                                 fd, 0);
+  if (fstat(fd, &st) == -1 || st.st_size < SHMRING_HDR_SIZE ||
+      hdr == MAP_FAILED) {
+    fprintf(stderr, "%s is not a shmring.\n", path);
+    if (hdr != MAP_FAILED) {
+      munmap(hdr, SHMRING_HDR_SIZE);
+    }
+    close(fd);
+    return NULL;
+  }
+  const unsigned long magic =
+      atomic_load_explicit(&hdr->magic, memory_order_acquire);
+  const unsigned long capacity = hdr->capacity;
+  munmap(hdr, SHMRING_HDR_SIZE);
+  if (magic != SHMRING_MAGIC || capacity > INT_MAX ||
+      st.st_size != SHMRING_HDR_SIZE + (off_t)capacity) {
+    fprintf(stderr, "%s is not a shmring.\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  shmring *r = shmring_map(fd, capacity, 0);
+  if (r == NULL) {
+    fprintf(stderr, "mmap %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  return r;
+}
+
+// 对方在 *waiting 上登记过要睡的话，撤销登记并叫醒它。只有一方能撤销成功，
+// 所以对方一次睡眠最多被叫一次。
+void shmring_ring_bell(shmring *r, _Atomic unsigned int *waiting,
+                       _Atomic unsigned int *bell) {
+  if (atomic_load_explicit(waiting, memory_order_relaxed) &&
+      atomic_exchange(waiting, 0)) {
+    atomic_fetch_add(bell, 1);
+    shmring_futex(bell, FUTEX_WAKE, 1, NULL);
+    ++r->nr_wakes;
+  }
+}
+
+// 在 *waiting 上登记，然后在 bell 上睡到被叫醒或者超时。ready 在登记之后再检查
+// 一遍条件：对方先发布、后检查登记，我们先登记、后检查条件，两边中间都有一个
+// 全序的 fence，所以不会两边都错过。
+int shmring_sleep(shmring *r, _Atomic unsigned int *waiting,
+                  _Atomic unsigned int *bell, int (*ready)(shmring *r),
+                  int timeout_ms) {
+  const unsigned int seq = atomic_load(bell);
+  atomic_store(waiting, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (ready(r)) {
+    atomic_store(waiting, 0);
+    return 1;
+  }
+
+  struct timespec ts = {.tv_sec = timeout_ms / 1000,
+                        .tv_nsec = timeout_ms % 1000 * 1000000L};
+  shmring_futex(bell, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &ts);
+  ++r->nr_sleeps;
+  atomic_store(waiting, 0);
+  return ready(r);
+}
+
+void shmring_close(shmring *r) {
+  if (r->is_producer) {
+    atomic_store(&r->hdr->closed, 1);
+    atomic_fetch_add(&r->hdr->data_bell, 1);
+    shmring_futex(&r->hdr->data_bell, FUTEX_WAKE, 1, NULL);
+  }
+  munmap(r->data, 2 * (size_t)r->capacity);
+  munmap(r->hdr, SHMRING_HDR_SIZE);
+  close(r->fd);
+  free(r);
+}
+
+int shmring_free_space(shmring *r) {
+  const unsigned long head =
+      atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+  return r->capacity - (int)(head - r->cached_peer);
+}
+
+int shmring_has_space(shmring *r) {
+  r->cached_peer = atomic_load_explicit(&r->hdr->tail, memory_order_acquire);
+  return shmring_free_space(r) > 0;
+}
+
+char *shmring_reserve(shmring *r, int *len) {
+  int free_space = shmring_free_space(r);
+  if (free_space < *len) {
+    r->cached_peer = atomic_load_explicit(&r->hdr->tail, memory_order_acquire);
+    free_space = shmring_free_space(r);
+  }
+  if (free_space == 0) {
+    *len = 0;
+    return NULL;
+  }
+  if (*len > free_space) {
+    *len = free_space;
+  }
+  const unsigned long head =
+      atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+  return r->data + (head & (r->capacity - 1));
+}
+
+void shmring_commit(shmring *r, int nbytes) {
+  const unsigned long head =
+      atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+  atomic_store_explicit(&r->hdr->head, head + nbytes, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  shmring_ring_bell(r, &r->hdr->consumer_waiting, &r->hdr->data_bell);
+}
+
+int shmring_wait_space(shmring *r, int timeout_ms) {
+  if (shmring_has_space(r)) {
+    return 1;
+  }
+  return shmring_sleep(r, &r->hdr->producer_waiting, &r->hdr->space_bell,
+                       shmring_has_space, timeout_ms);
+}
+
+int shmring_has_data(shmring *r) {
+  r->cached_peer = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+  return r->cached_peer !=
+         atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+}
+
+const char *shmring_peek(shmring *r, int *len) {
+  const unsigned long tail =
+      atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+  if (r->cached_peer == tail) {
+    r->cached_peer = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+  }
+  *len = (int)(r->cached_peer - tail);
+  return r->data + (tail & (r->capacity - 1));
+}
+
+void shmring_consume(shmring *r, int nbytes) {
+  const unsigned long tail =
+      atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+  atomic_store_explicit(&r->hdr->tail, tail + nbytes, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  shmring_ring_bell(r, &r->hdr->producer_waiting, &r->hdr->space_bell);
+}
+
+// 关闭时生产者只是推一下 data_bell，不看消费者有没有登记：消费者检查过
+// closed、还没读 data_bell 的时候关闭的话，它会在已经推过的 data_bell 上睡下去，
+// 所以登记之后也要检查 closed。
+int shmring_has_data_or_closed(shmring *r) {
+  return shmring_has_data(r) || atomic_load(&r->hdr->closed);
+}
+
+int shmring_wait_data(shmring *r, int spin, int timeout_ms) {
+  for (int i = 0; i <= spin; ++i) {
+    if (shmring_has_data(r)) {
+      return 1;
+    }
+    shmring_cpu_relax();
+  }
+
+  while (1) {
+    // 生产者先发布最后的数据再标记关闭，所以看到关闭以后再检查一次数据。
+    if (atomic_load(&r->hdr->closed)) {
+      return shmring_has_data(r) ? 1 : -1;
+    }
+    if (shmring_has_data(r)) {
+      return 1;
+    }
+    if (!shmring_sleep(r, &r->hdr->consumer_waiting, &r->hdr->data_bell,
+                       shmring_has_data_or_closed, timeout_ms) &&
+        timeout_ms >= 0) {
+      return 0;
+    }
+  }
+}
+
+int shmring_get_capacity(shmring *r) { return r->capacity; }
+
+unsigned long shmring_get_nr_sleeps(shmring *r) { return r->nr_sleeps; }
+
+unsigned long shmring_get_nr_wakes(shmring *r) { return r->nr_wakes; }
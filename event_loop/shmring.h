@@ -0,0 +1,59 @@
+#ifndef MY_SHMRING
+#define MY_SHMRING
+
+// 放在共享文件（一般在 /dev/shm 下）中的单生产者、单消费者字节环，用来把
+// socket_mux 的输出交给同一台机器上的另一个进程：生产者直接把 socket 里的数据
+// read 进环里，消费者直接在环里读，整条路径上只有内核把数据从 socket 拷进来的
+// 那一次拷贝。
+//
+// 数据区在进程里被连续映射两次，所以不管从哪里开始，reserve 和 peek 得到的总是
+// 一段连续的内存，不需要在环的末尾拆成两段。
+//
+// 读写位置都在共享内存里，双方各自只写一个、只读另一个。只有一方没事可做、要
+// 睡下去的时候才会用到 futex（门铃）：睡的一方先在共享内存里登记，另一方看到
+// 登记了才发起 FUTEX_WAKE。所以双方都忙着的时候（稳态）两边都没有任何 syscall。
+
+struct shmring_impl;
+typedef struct shmring_impl shmring;
+
+// 生产者：创建（或者覆盖）path 处的共享文件，数据区大小为 capacity 字节，
+// capacity 必须是页大小的整数倍并且是 2 的幂。失败时打印原因并返回 NULL。
+shmring *shmring_create(const char *path, int capacity);
+
+// 消费者：打开生产者创建的共享文件，失败时打印原因并返回 NULL。
+shmring *shmring_open(const char *path);
+
+// 解除映射、关闭文件。生产者调用时先把环标记为已关闭并叫醒消费者，消费者读完
+// 剩下的数据后会看到 EOF。
+void shmring_close(shmring *r);
+
+// 生产者：返回一段可以直接写入的连续空闲空间的首地址，*len 被设为它的长度（最多
+// 为调用时 *len 的值），没有空闲空间时返回 NULL。写完用 shmring_commit 发布。
+char *shmring_reserve(shmring *r, int *len);
+
+// 生产者：发布 reserve 得到的空间的前 nbytes 字节，消费者在等数据时叫醒它。
+void shmring_commit(shmring *r, int nbytes);
+
+// 生产者：等到有空闲空间或者等了 timeout_ms 毫秒，返回是否有空闲空间。
+int shmring_wait_space(shmring *r, int timeout_ms);
+
+// 消费者：返回还没有读的数据的首地址（在共享内存里，不复制），*len
+// 被设为它的长度，没有数据时 *len 为 0。
+const char *shmring_peek(shmring *r, int *len);
+
+// 消费者：丢弃 peek 得到的数据的前 nbytes 字节，生产者在等空间时叫醒它。
+void shmring_consume(shmring *r, int nbytes);
+
+// 消费者：等到有数据可读。先检查 spin 次，还没有数据再睡，最多睡 timeout_ms
+// 毫秒（-1 表示不限）。返回 1 表示有数据，0 表示超时，-1 表示生产者已经关闭并且
+// 数据已经读完了。
+int shmring_wait_data(shmring *r, int spin, int timeout_ms);
+
+int shmring_get_capacity(shmring *r);
+
+// 这一端为了等待而睡下去的次数、为了叫醒对方而发起 FUTEX_WAKE 的次数，也就是
+// 这一端在环上花掉的全部 syscall。
+unsigned long shmring_get_nr_sleeps(shmring *r);
+unsigned long shmring_get_nr_wakes(shmring *r);
+
+#endif
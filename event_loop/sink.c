@@ -0,0 +1,537 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rawsys.h"
+#include "shmring.h"
+
+// 共享内存的消费者不见了的话生产者会一直等下去，每等这么久报告一次。
+#define SHM_SINK_STALL_REPORT_MS 5000
+
+struct stdout_sink {
+  struct mux_sink base;
+  int capacity;
+  char buf[];
+};
+
+char *stdout_sink_reserve(struct mux_sink *s, int *len) {
+  struct stdout_sink *sink = (struct stdout_sink *)s;
+  if (*len > sink->capacity) {
+    *len = sink->capacity;
+  }
+  return sink->buf;
+}
+
+int stdout_sink_commit(struct mux_sink *s, int nbytes) {
+  struct stdout_sink *sink = (struct stdout_sink *)s;
+  int nbytes_written = 0;
+  while (nbytes_written < nbytes) {
+    long result = sys_write(STDOUT_FILENO, sink->buf + nbytes_written,
+                            nbytes - nbytes_written);
+    if (result < 0) {
+      fprintf(stderr, "Unknown error: write: %s\n", strerror(-result));
+      return -1;
+    } else if (result == 0) {
+      fprintf(stderr, "Got EOF from stdout.\n");
+      return -1;
+    }
+    nbytes_written += result;
+  }
+  return 0;
+}
+
+// 写完 iov 描述的全部数据，会改写 iov。
+int stdout_writev_all(struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    long result = sys_writev(STDOUT_FILENO, iov, iovcnt);
+    if (result < 0) {
+      fprintf(stderr, "Unknown error: writev: %s\n", strerror(-result));
+      return -1;
+    } else if (result == 0) {
+      fprintf(stderr, "Got EOF from stdout.\n");
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+      result -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + result;
+      iov->iov_len -= result;
+    }
+  }
+  return 0;
+}
+
+int stdout_sink_commit_frame(struct mux_sink *s, const char *hdr,
+                             int nbytes) {
+  struct stdout_sink *sink = (struct stdout_sink *)s;
+  struct iovec iov[2] = {{.iov_base = (void *)hdr, .iov_len = s->headroom},
+                         {.iov_base = sink->buf, .iov_len = nbytes}};
+  return stdout_writev_all(iov, nbytes > 0 ? 2 : 1);
+}
+
+// 一次最多写出这么多个 iovec，超出的部分分几次写。
+#define STDOUT_SINK_MAX_IOV 1024
+
+int stdout_sink_writev(struct mux_sink *s, const struct iovec *iov,
+                       int iovcnt) {
+  struct iovec copy[STDOUT_SINK_MAX_IOV];
+  while (iovcnt > 0) {
+    const int n = iovcnt < STDOUT_SINK_MAX_IOV ? iovcnt : STDOUT_SINK_MAX_IOV;
+    memcpy(copy, iov, n * sizeof(struct iovec));
+    if (stdout_writev_all(copy, n) != 0) {
+      return -1;
+    }
+    iov += n;
+    iovcnt -= n;
+  }
+  return 0;
+}
+
+void stdout_sink_close(struct mux_sink *s) { free(s); }
+
+struct mux_sink *stdout_sink_create(int capacity) {
+  struct stdout_sink *sink = malloc(sizeof(struct stdout_sink) + capacity);
+  if (sink == NULL) {
+    return NULL;
+  }
+  sink->base.reserve = stdout_sink_reserve;
+  sink->base.commit = stdout_sink_commit;
+  sink->base.commit_frame = stdout_sink_commit_frame;
+  sink->base.writev = stdout_sink_writev;
+  sink->base.flush = NULL;
+  sink->base.flush_interval_ms = 0;
+  sink->base.close = stdout_sink_close;
+  sink->base.headroom = 0;
+  sink->capacity = capacity;
+  return &sink->base;
+}
+
+struct shm_sink {
+  struct mux_sink base;
+  shmring *ring;
+  // 分帧时最近一次 reserve 得到的空间（包括留给帧头的部分）。
+  char *frame;
+};
+
+// 分帧时帧头直接写在环里数据的前面，多要 headroom 字节，并且除了帧头至少还要
+// 有一个字节（只写帧头时除外）的空间。
+char *shm_sink_reserve(struct mux_sink *s, int *len) {
+  struct shm_sink *sink = (struct shm_sink *)s;
+  const int want = *len + s->headroom;
+  const int least = *len > 0 ? s->headroom + 1 : s->headroom;
+  int got = want;
+  char *dst = shmring_reserve(sink->ring, &got);
+  while (dst == NULL || got < least) {
+    if (!shmring_wait_space(sink->ring, SHM_SINK_STALL_REPORT_MS)) {
+      fprintf(stderr, "shmring has been full for %d ms, is the consumer "
+              "alive?\n", SHM_SINK_STALL_REPORT_MS);
+    }
+    got = want;
+    dst = shmring_reserve(sink->ring, &got);
+  }
+  sink->frame = dst;
+  *len = got - s->headroom;
+  return dst + s->headroom;
+}
+
+int shm_sink_commit(struct mux_sink *s, int nbytes) {
+  struct shm_sink *sink = (struct shm_sink *)s;
+  shmring_commit(sink->ring, nbytes);
+  return 0;
+}
+
+int shm_sink_commit_frame(struct mux_sink *s, const char *hdr, int nbytes) {
+  struct shm_sink *sink = (struct shm_sink *)s;
+  memcpy(sink->frame, hdr, s->headroom);
+  shmring_commit(sink->ring, s->headroom + nbytes);
+  return 0;
+}
+
+// 共享内存环只能拷贝进去：一段一段地 reserve、拷贝，最后一起 commit，消费者
+// 一次看到整批数据。环里放不下整批的时候先 commit 已经拷进去的部分。
+int shm_sink_writev(struct mux_sink *s, const struct iovec *iov, int iovcnt) {
+  struct shm_sink *sink = (struct shm_sink *)s;
+  int pending = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    const char *src = iov[i].iov_base;
+    int left = iov[i].iov_len;
+    while (left > 0) {
+      int len = pending + left;
+      char *dst = shmring_reserve(sink->ring, &len);
+      if (dst == NULL || len <= pending) {
+        shmring_commit(sink->ring, pending);
+        pending = 0;
+        // 只是为了等到有空间。
+        int want = left;
+        shm_sink_reserve(s, &want);
+        continue;
+      }
+      const int n = len - pending;
+      memcpy(dst + pending, src, n);
+      pending += n;
+      src += n;
+      left -= n;
+    }
+  }
+  shmring_commit(sink->ring, pending);
+  return 0;
+}
+
+void shm_sink_close(struct mux_sink *s) {
+  struct shm_sink *sink = (struct shm_sink *)s;
+  shmring_close(sink->ring);
+  free(sink);
+}
+
+struct mux_sink *shm_sink_create(const char *path, int capacity) {
+  struct shm_sink *sink = malloc(sizeof(struct shm_sink));
+  if (sink == NULL) {
+    return NULL;
+  }
+  sink->ring = shmring_create(path, capacity);
+  if (sink->ring == NULL) {
+    free(sink);
+    return NULL;
+  }
+  sink->base.reserve = shm_sink_reserve;
+  sink->base.commit = shm_sink_commit;
+  sink->base.commit_frame = shm_sink_commit_frame;
+  sink->base.writev = shm_sink_writev;
+  sink->base.flush = NULL;
+  sink->base.flush_interval_ms = 0;
+  sink->base.close = shm_sink_close;
+  sink->base.headroom = 0;
+  return &sink->base;
+}
+
+struct file_sink {
+  struct mux_sink base;
+  struct file_sink_config cfg;
+  int fd;
+  // 轮转时当前文件的编号，不轮转时是 -1。
+  int file_index;
+  // 暂存区，buf[0] 对应文件里的 file_off，O_DIRECT 时 file_off 总是对齐的。
+  char *buf;
+  int used;
+  long file_off;
+  // fallocate 已经预留到了文件的什么位置。
+  long allocated;
+  // 上次 fdatasync 之后写出的字节数。
+  long unsynced;
+  // 分帧时最近一次 reserve 得到的空间（包括留给帧头的部分）。
+  char *frame;
+  // 写出失败过，之后的 commit 都返回 -1。
+  int failed;
+
+  unsigned long nr_writes;
+  unsigned long nr_bytes;
+  unsigned long nr_syncs;
+  unsigned long sync_ns;
+  unsigned long max_sync_ns;
+  unsigned long nr_rotations;
+};
+
+long file_sink_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int file_sink_open(struct file_sink *sink) {
+  char path[4096];
+  if (sink->file_index < 0) {
+    snprintf(path, sizeof(path), "%s", sink->cfg.path);
+  } else {
+    snprintf(path, sizeof(path), "%s.%06d", sink->cfg.path, sink->file_index);
+  }
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  if (sink->cfg.direct) {
+    flags |= O_DIRECT;
+  }
+  sink->fd = open(path, flags, 0644);
+  if (sink->fd < 0) {
+    fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  sink->file_off = 0;
+  sink->allocated = 0;
+  return 0;
+}
+
+// 预留空间失败（比如文件系统不支持）只是少了一个优化，报告一次就不再预留。
+void file_sink_prealloc(struct file_sink *sink, long end) {
+  while (sink->cfg.prealloc_bytes > 0 && sink->allocated < end) {
+    if (fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, sink->allocated,
+                  sink->cfg.prealloc_bytes) != 0) {
+      fprintf(stderr, "fallocate: %s, not preallocating any more\n",
+              strerror(errno));
+      sink->cfg.prealloc_bytes = 0;
+      return;
+    }
+    sink->allocated += sink->cfg.prealloc_bytes;
+  }
+}
+
+int file_sink_pwrite_all(struct file_sink *sink, const char *buf, long len,
+                         long off) {
+  while (len > 0) {
+    ssize_t n = pwrite(sink->fd, buf, len, off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "pwrite: %s\n", strerror(errno));
+      return -1;
+    }
+    ++sink->nr_writes;
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+// 把暂存区写出去。O_DIRECT 时只写整块，末尾不满一块的数据留在暂存区开头；
+// tail 不为 0 时把它补零、连同整块一起写出，但仍然留着它，下次从这一块的开头
+// 重写。
+int file_sink_write_out(struct file_sink *sink, int tail) {
+  int len = sink->used;
+  int keep = 0;
+  int padded = len;
+  if (sink->cfg.direct) {
+    keep = len % FILE_SINK_ALIGN;
+    len -= keep;
+    padded = len;
+    if (tail && keep > 0) {
+      padded = len + FILE_SINK_ALIGN;
+      memset(sink->buf + sink->used, 0, padded - sink->used);
+    }
+  }
+  if (padded == 0) {
+    return 0;
+  }
+  // 轮转之后，下一个文件等到第一次写出时才打开。
+  if (sink->fd < 0 && file_sink_open(sink) != 0) {
+    return -1;
+  }
+  file_sink_prealloc(sink, sink->file_off + padded);
+  if (file_sink_pwrite_all(sink, sink->buf, padded, sink->file_off) != 0) {
+    return -1;
+  }
+  // 留下来的那一块下次还要写，到那时（或者关闭文件时）才计入 nr_bytes；但它
+  // 现在就需要落盘。
+  sink->nr_bytes += len;
+  sink->unsynced += sink->used;
+  sink->file_off += len;
+  sink->used = keep;
+  if (keep > 0) {
+    memmove(sink->buf, sink->buf + len, keep);
+  }
+  return 0;
+}
+
+int file_sink_sync(struct file_sink *sink) {
+  if (sink->unsynced == 0) {
+    return 0;
+  }
+  const long t0 = file_sink_now_ns();
+  if (fdatasync(sink->fd) != 0) {
+    fprintf(stderr, "fdatasync: %s\n", strerror(errno));
+    return -1;
+  }
+  const unsigned long ns = file_sink_now_ns() - t0;
+  ++sink->nr_syncs;
+  sink->sync_ns += ns;
+  if (ns > sink->max_sync_ns) {
+    sink->max_sync_ns = ns;
+  }
+  sink->unsynced = 0;
+  return 0;
+}
+
+// 写出暂存区里还没写出的全部数据、落盘，然后把文件截断到实际的长度（O_DIRECT
+// 补的零和预留的空间都不要了）并关闭。轮转之后什么都没写过时文件还没有创建，
+// 什么都不用做。
+int file_sink_finish(struct file_sink *sink) {
+  int result = file_sink_write_out(sink, 1);
+  if (sink->fd < 0) {
+    return result;
+  }
+  // 没有打开按时间或者按大小落盘时，关闭文件也不落盘，和重定向 stdout 一样。
+  if (result == 0 && (sink->cfg.sync_bytes > 0 || sink->cfg.sync_ms > 0)) {
+    result = file_sink_sync(sink);
+  }
+  sink->nr_bytes += sink->used;
+  if (ftruncate(sink->fd, sink->file_off + sink->used) != 0) {
+    fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+    result = -1;
+  }
+  close(sink->fd);
+  sink->fd = -1;
+  sink->unsynced = 0;
+  return result;
+}
+
+// 写出之后：攒够了（或者 force_sync）就落盘，文件够大了就换下一个。
+int file_sink_after_write(struct file_sink *sink, int force_sync) {
+  if ((force_sync || (sink->cfg.sync_bytes > 0 &&
+                      sink->unsynced >= sink->cfg.sync_bytes)) &&
+      file_sink_sync(sink) != 0) {
+    return -1;
+  }
+  if (sink->cfg.rotate_bytes > 0 &&
+      sink->file_off + sink->used >= sink->cfg.rotate_bytes) {
+    if (file_sink_finish(sink) != 0) {
+      return -1;
+    }
+    sink->used = 0;
+    sink->file_off = 0;
+    ++sink->file_index;
+    ++sink->nr_rotations;
+  }
+  return 0;
+}
+
+// 暂存区满了：写出去。
+int file_sink_drain(struct file_sink *sink) {
+  if (file_sink_write_out(sink, 0) != 0) {
+    return -1;
+  }
+  return file_sink_after_write(sink, 0);
+}
+
+// 写出失败之后数据只能丢掉，暂存区照常给出去，由接下来的 commit 报告失败。
+void file_sink_make_room(struct file_sink *sink, int need) {
+  if (sink->cfg.buf_size - sink->used >= need || sink->failed) {
+    if (sink->failed) {
+      sink->used = 0;
+    }
+    return;
+  }
+  if (file_sink_drain(sink) != 0) {
+    sink->failed = 1;
+    sink->used = 0;
+  }
+}
+
+char *file_sink_reserve(struct mux_sink *s, int *len) {
+  struct file_sink *sink = (struct file_sink *)s;
+  file_sink_make_room(sink, s->headroom + *len);
+  const int space = sink->cfg.buf_size - sink->used - s->headroom;
+  if (*len > space) {
+    *len = space;
+  }
+  sink->frame = sink->buf + sink->used;
+  return sink->frame + s->headroom;
+}
+
+int file_sink_commit(struct mux_sink *s, int nbytes) {
+  struct file_sink *sink = (struct file_sink *)s;
+  sink->used += nbytes;
+  return sink->failed ? -1 : 0;
+}
+
+int file_sink_commit_frame(struct mux_sink *s, const char *hdr, int nbytes) {
+  struct file_sink *sink = (struct file_sink *)s;
+  memcpy(sink->frame, hdr, s->headroom);
+  sink->used += s->headroom + nbytes;
+  return sink->failed ? -1 : 0;
+}
+
+int file_sink_writev(struct mux_sink *s, const struct iovec *iov,
+                     int iovcnt) {
+  struct file_sink *sink = (struct file_sink *)s;
+  for (int i = 0; i < iovcnt; ++i) {
+    const char *src = iov[i].iov_base;
+    size_t left = iov[i].iov_len;
+    while (left > 0) {
+      file_sink_make_room(sink, 1);
+      size_t n = sink->cfg.buf_size - sink->used;
+      if (n > left) {
+        n = left;
+      }
+      memcpy(sink->buf + sink->used, src, n);
+      sink->used += n;
+      src += n;
+      left -= n;
+    }
+  }
+  return sink->failed ? -1 : 0;
+}
+
+// 按时间的成组提交：这段时间里到达的数据一次写出、一次落盘。
+int file_sink_flush(struct mux_sink *s) {
+  struct file_sink *sink = (struct file_sink *)s;
+  if (sink->failed || file_sink_write_out(sink, 1) != 0 ||
+      file_sink_after_write(sink, 1) != 0) {
+    sink->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+void file_sink_close(struct mux_sink *s) {
+  struct file_sink *sink = (struct file_sink *)s;
+  if (!sink->failed) {
+    file_sink_finish(sink);
+  } else if (sink->fd >= 0) {
+    close(sink->fd);
+  }
+  fprintf(stderr,
+          "[file_sink] bytes=%lu writes=%lu (%.1f KiB per write) syncs=%lu "
+          "sync_ms(avg=%.2f max=%.2f) rotations=%lu\n",
+          sink->nr_bytes, sink->nr_writes,
+          sink->nr_writes > 0 ? sink->nr_bytes / 1024.0 / sink->nr_writes
+                              : 0.0,
+          sink->nr_syncs,
+          sink->nr_syncs > 0 ? sink->sync_ns / 1e6 / sink->nr_syncs : 0.0,
+          sink->max_sync_ns / 1e6, sink->nr_rotations);
+  free(sink->buf);
+  free(sink);
+}
+
+struct mux_sink *file_sink_create(const struct file_sink_config *cfg) {
+  if (cfg->buf_size < 2 * FILE_SINK_ALIGN ||
+      cfg->buf_size % FILE_SINK_ALIGN != 0) {
+    fprintf(stderr, "The buffer of a file sink must be a multiple of %d "
+            "bytes and at least %d bytes.\n", FILE_SINK_ALIGN,
+            2 * FILE_SINK_ALIGN);
+    return NULL;
+  }
+  struct file_sink *sink = malloc(sizeof(struct file_sink));
+  if (sink == NULL) {
+    return NULL;
+  }
+  memset(sink, 0, sizeof(struct file_sink));
+  sink->cfg = *cfg;
+  sink->file_index = cfg->rotate_bytes > 0 ? 0 : -1;
+  // O_DIRECT 要求内存也是对齐的。
+  if (posix_memalign((void **)&sink->buf, FILE_SINK_ALIGN, cfg->buf_size) !=
+      0) {
+    free(sink);
+    return NULL;
+  }
+  if (file_sink_open(sink) != 0) {
+    free(sink->buf);
+    free(sink);
+    return NULL;
+  }
+  sink->base.reserve = file_sink_reserve;
+  sink->base.commit = file_sink_commit;
+  sink->base.commit_frame = file_sink_commit_frame;
+  sink->base.writev = file_sink_writev;
+  sink->base.flush = cfg->sync_ms > 0 ? file_sink_flush : NULL;
+  sink->base.flush_interval_ms = cfg->sync_ms;
+  sink->base.close = file_sink_close;
+  sink->base.headroom = 0;
+  return &sink->base;
+}
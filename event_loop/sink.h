@@ -0,0 +1,82 @@
+#ifndef MY_SINK
+#define MY_SINK
+
+#include <sys/uio.h>
+
+// socket_mux 的输出端。socket_mux 先向 sink 要一段空间，把 socket 里的数据直接
+// read 进去，再把读到的部分提交给 sink：这样 sink 可以把自己的存储（比如共享
+// 内存里的环）直接交给 read，省掉一次拷贝。
+struct mux_sink {
+  // 返回一段可以直接写入的连续空间，*len 被设为它的长度（最多为调用时 *len
+  // 的值）。下游暂时满了时一直等到有空间为止，就像往阻塞的 stdout 写一样。
+  char *(*reserve)(struct mux_sink *s, int *len);
+
+  // 把 reserve 得到的空间的前 nbytes 字节交给下游。成功返回 0，下游已经关闭
+  // 时返回 -1。
+  int (*commit)(struct mux_sink *s, int nbytes);
+
+  // 分帧输出（见 muxframe.h）：把 hdr（headroom 字节的帧头）和 reserve 得到的
+  // 空间的前 nbytes 字节作为一帧交给下游，返回值和 commit 一样。nbytes 可以是
+  // 0，这时只写出帧头。
+  int (*commit_frame)(struct mux_sink *s, const char *hdr, int nbytes);
+
+  // 把 iov 描述的数据原样交给下游，数据不在 reserve 得到的空间里（比如
+  // recvmmsg 一批收进来的 datagram）。stdout 上是一次 writev（写不完时再接着
+  // 写），返回值和 commit 一样。
+  int (*writev)(struct mux_sink *s, const struct iovec *iov, int iovcnt);
+
+  // 可选，NULL 表示不需要：每隔 flush_interval_ms 毫秒调用一次，把缓冲着的数据
+  // 写出去（并按 sink 自己的策略让它落盘）。返回值和 commit 一样。
+  int (*flush)(struct mux_sink *s);
+  int flush_interval_ms;
+
+  void (*close)(struct mux_sink *s);
+
+  // 分帧输出时帧头的长度，开始分帧之前由调用者设置，之后不再改变。需要把帧头
+  // 和数据放在一起的 sink 在 reserve 给出的空间之前留出这么多字节；把帧头单独
+  // 写出去的 sink 不用理会它。
+  int headroom;
+};
+
+// 写到 stdout 的 sink，数据先 read 进一块 capacity 字节的缓冲区，再 write 出去，
+// 分帧时帧头和数据用一次 writev 写出去。
+struct mux_sink *stdout_sink_create(int capacity);
+
+// 写到共享内存环（见 shmring.h）的 sink，同一台机器上的消费者用 shmring_open
+// 打开 path 就可以原地读取。
+struct mux_sink *shm_sink_create(const char *path, int capacity);
+
+// 写到文件的 sink。数据直接 read 进一块对齐的暂存区，攒满了才用一次 pwrite 写
+// 出去，而不是每块数据一次 write。
+//
+// 落盘用的是成组提交：sync_bytes 和 sync_ms 都是攒够了（写出了这么多字节、或者
+// 数据已经等了这么久）才调用一次 fdatasync，期间所有连接的数据共用这一次；机器
+// 掉电最多丢掉这个窗口里的数据。两个都是 0 时从不 fdatasync，和重定向 stdout
+// 一样不管掉电。sync_ms 为 0 时暂存区只在满了或者关闭时写出，没有 flush。
+//
+// direct 用 O_DIRECT 绕过 page cache，每次写的都是整块（FILE_SINK_ALIGN 的整
+// 数倍）：暂存区末尾不满一块的数据留到下一次，需要按时间落盘时补零写出整块，
+// 下一次再从这一块的开头重写。文件最后被截断到实际的长度。
+//
+// prealloc_bytes 让文件每次用 fallocate 预留这么大的空间（不改变文件的长度），
+// 文件系统可以分配连续的区段，写的时候也不用再分配。rotate_bytes 让文件写到
+// 这么大时（在一次写出之后）换下一个，文件名是 path.000000、path.000001……，
+// 按顺序拼起来就是完整的输出。一次写出最多是整个暂存区，所以文件最多可能比
+// rotate_bytes 大 buf_size；下一个文件等到真的有数据要写时才创建，不会留下空文件。
+#define FILE_SINK_ALIGN 4096
+
+struct file_sink_config {
+  const char *path;
+  // 暂存区的大小，FILE_SINK_ALIGN 的整数倍。
+  int buf_size;
+  int direct;
+  long sync_bytes;
+  int sync_ms;
+  long prealloc_bytes;
+  long rotate_bytes;
+};
+
+// 失败时打印原因并返回 NULL。
+struct mux_sink *file_sink_create(const struct file_sink_config *cfg);
+
+#endif
@@ -1,28 +1,185 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/ip.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "busypoll.h"
 #include "conn_manage.h"
+#include "lathist.h"
+#include "muxframe.h"
+#include "rawsys.h"
+#include "readsched.h"
+#include "sink.h"
+#include "timerwheel.h"
+#include "udp_ingest.h"
 #include "util.h"
 
 #define MAX_PEER_NAME 256
 char peer_name_buf[MAX_PEER_NAME];
 
-#define MAX_READ_BUFFER 1024
-char read_buf[MAX_READ_BUFFER];
-
+// 每个连接每次 read 的大小在 [MIN_READ_SIZE, MAX_READ_BUFFER] 之间自适应：读满了
+// 就翻倍，读到的不足四分之一就减半。数据直接 read 进 sink 给的空间里。
+#define MIN_READ_SIZE 1024
+#define MAX_READ_BUFFER (1024 * 64)
+#define DEFAULT_SHM_RING_SIZE (1024 * 1024 * 4)
+// -w 的文件 sink 的暂存区大小和按时间落盘的间隔。
+#define DEFAULT_FILE_BUF_SIZE (1024 * 1024 * 4)
+#define DEFAULT_FILE_SYNC_MS 1000
+
+// 所有连接的数据都交给它，默认是 stdout，见 sink.h。
+struct mux_sink *sink;
+
+// -f 分帧输出（见 muxframe.h），-t 在帧头里带上收到数据的时间。
+int framing = 0;
+uint32_t frame_flags = 0;
+// 下一个连接的来源编号。
+uint32_t next_source = 0;
+
+// 收到 SIGINT/SIGTERM 后退出主循环，关闭 sink：共享内存的消费者因此能看到 EOF。
+volatile sig_atomic_t stopping = 0;
+
+void on_stop_signal(int sig) { stopping = 1; }
+
+#define DEFAULT_IDLE_TIMEOUT_SEC 300
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+// 最多同时监听几个地址（TCP 端口、UNIX domain socket），见 util.h。
+#define MAX_LISTENERS 8
+// 每轮最多接受多少个连接。
+#define ACCEPT_BUDGET 64
+// fd 耗尽、连预留的 fd 也没有了的时候，停止接受连接多久。
+#define ACCEPT_PAUSE_MS 1000
+// 每个连接每轮最多读多少字节、调用几次 read。
+#define READ_QUANTUM MAX_READ_BUFFER
+#define MAX_READS_PER_TURN 16
+// 每隔多久向 stderr 报告一次唤醒延迟和忙轮询的统计。
+#define METRICS_INTERVAL_MS 10000
+// 每个 UDP 监听地址每轮最多调用几次 recvmmsg。
+#define UDP_MAX_BATCHES_PER_TURN 16
+
+// 按 fd 索引的连接状态：空闲超时的 idle_timer
+// 挂在时间轮上，收到数据时只更新 last_active，到期时再决定是断开还是重新安排；
+// sched 是读取调度的额度。
 struct conn_ctx {
   int fd;
+  struct tw_timer idle_timer;
+  unsigned long last_active;
+  struct rs_conn sched;
+  int read_size;
+  // 分帧输出时帧头里的来源编号。
+  uint32_t source;
 };
+struct conn_ctx conns[FD_SETSIZE];
+
+// 时间轮的 tick 是毫秒。
+struct timer_wheel wheel;
+unsigned long idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_SEC * 1000UL;
+
+// select 是水平触发的，额度用完的连接下一轮还会被报告可读，所以这里只用到了
+// 额度的记账，没有用到 runq。
+struct read_sched read_sched;
+
+// -y 开启忙轮询（见 busypoll.h），-Y 给连接设置 SO_BUSY_POLL。
+struct busy_poll busy_poll;
+int socket_busy_poll_us = 0;
+// 数据被内核收到到被读走之间的时间（只有 TCP 连接有），每次报告后清零。
+struct lathist wakeup_lat;
+struct tw_timer metrics_timer;
+// fd 耗尽时用来拒绝排队的连接的预留 fd（见 drop_pending_conn），连它也没有了
+// 就暂停 accept，到时 accept_resume_timer 恢复。
+int reserve_fd = -1;
+int accept_paused = 0;
+struct tw_timer accept_resume_timer;
+unsigned long nr_shed_conns = 0;
+unsigned long nr_accept_pauses = 0;
+// sink 有 flush 时（-w）按它要求的间隔调用。
+struct tw_timer flush_timer;
+
+// udp:<addr> 监听地址（见 udp_ingest.h），-G 开启 UDP_GRO。每个 UDP 监听地址
+// 在分帧输出里是一个来源。
+struct udp_ingest *udp_ingests[MAX_LISTENERS];
+uint32_t udp_sources[MAX_LISTENERS];
+int nr_udp_ingests = 0;
+
+unsigned long monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+void on_idle_timer(struct tw_timer *t, void *arg) {
+  struct conn_ctx *conn = tw_entry(t, struct conn_ctx, idle_timer);
+  if (conn->last_active + idle_timeout_ms > wheel.now) {
+    tw_schedule(&wheel, t, conn->last_active + idle_timeout_ms);
+    return;
+  }
+
+  fprintf(stderr, "fd=%d has been idle for %lu ms, would close it.\n",
+          conn->fd, wheel.now - conn->last_active);
+  cm_ctx_conn_mark_dead(arg, conn->fd);
+}
+
+void report_udp_stats() {
+  for (int i = 0; i < nr_udp_ingests; ++i) {
+    const struct udp_ingest_stats *st = udp_ingest_get_stats(udp_ingests[i]);
+    fprintf(stderr,
+            "[metrics] udp%d datagrams=%lu batches=%lu (%.1f per batch) "
+            "bytes=%lu gro_buffers=%lu truncated=%lu drops=%lu\n",
+            i, st->nr_datagrams, st->nr_batches,
+            st->nr_batches > 0 ? (double)st->nr_datagrams / st->nr_batches
+                               : 0.0,
+            st->nr_bytes, st->nr_gro_buffers, st->nr_truncated, st->nr_drops);
+  }
+}
+
+void on_metrics_timer(struct tw_timer *t, void *arg) {
+  struct lathist *lat = &wakeup_lat;
+  fprintf(stderr,
+          "[metrics] conns=%d wakeup_lat_us(n=%lu avg=%.1f p50<=%.1f "
+          "p99<=%.1f max=%.1f) busy_poll(hits=%lu misses=%lu window_us=%.1f) "
+          "shed_conns=%lu accept_pauses=%lu\n",
+          cm_ctx_get_num_conns(arg), lat->count,
+          lat->count > 0 ? lat->sum_ns / 1000.0 / lat->count : 0.0,
+          lathist_percentile(lat, 50) / 1000.0,
+          lathist_percentile(lat, 99) / 1000.0, lat->max_ns / 1000.0,
+          busy_poll.nr_hits, busy_poll.nr_misses, busy_poll.window_ns / 1000.0,
+          nr_shed_conns, nr_accept_pauses);
+  report_udp_stats();
+  lathist_reset(lat);
+  tw_schedule(&wheel, t, wheel.now + METRICS_INTERVAL_MS);
+}
+
+void on_flush_timer(struct tw_timer *t, void *arg) {
+  if (sink->flush(sink) != 0) {
+    fprintf(stderr, "Output is closed, exitting...\n");
+    exit(0);
+  }
+  tw_schedule(&wheel, t, wheel.now + sink->flush_interval_ms);
+}
+
+void track_conn(int fd, conn_manage_ctx cm_ctx) {
+  struct conn_ctx *conn = &conns[fd];
+  conn->fd = fd;
+  conn->last_active = monotonic_ms();
+  rs_conn_init(&conn->sched);
+  conn->read_size = MIN_READ_SIZE;
+  conn->source = next_source++;
+  tw_timer_init(&conn->idle_timer, on_idle_timer, cm_ctx);
+  if (idle_timeout_ms > 0) {
+    tw_schedule(&wheel, &conn->idle_timer,
+                conn->last_active + idle_timeout_ms);
+  }
+}
 
 #define FD_CAPACITY_PER_INT (sizeof(int) * 8)
 int read_fdset_storage[FD_SETSIZE / FD_CAPACITY_PER_INT];
@@ -31,7 +188,38 @@ int write_fdset_storage[FD_SETSIZE / FD_CAPACITY_PER_INT];
 fd_set *read_interest = (void *)read_fdset_storage;
 fd_set *write_interest = (void *)write_fdset_storage;
 
+unsigned long realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// 把刚 read 进 sink 的 nbytes 字节交给下游，分帧时在前面加上帧头。nbytes 为 0
+// 时（只在分帧时）写出一个表示来源已经关闭的空帧。
+int emit(struct conn_ctx *conn, int nbytes, long latency_ns) {
+  if (!framing) {
+    return sink->commit(sink, nbytes);
+  }
+  uint64_t ts_ns = 0;
+  if (frame_flags & MUX_STREAM_TIMESTAMPS) {
+    ts_ns = realtime_ns() - (latency_ns > 0 ? latency_ns : 0);
+  }
+  char hdr[MUX_MAX_HEADER_LEN];
+  mux_put_header(hdr, frame_flags, conn->source, nbytes, ts_ns);
+  return sink->commit_frame(sink, hdr, nbytes);
+}
+
 void close_fd_or_panic(int fd) {
+  tw_cancel(&wheel, &conns[fd].idle_timer);
+  if (framing) {
+    int len = 0;
+    sink->reserve(sink, &len);
+    if (emit(&conns[fd], 0, -1) != 0) {
+      fprintf(stderr, "Output is closed, exitting...\n");
+      exit(0);
+    }
+  }
+
   if (FD_ISSET(fd, read_interest)) {
     FD_CLR(fd, read_interest);
   }
@@ -65,6 +253,15 @@ void conn_travese_accessor(int fd, int idx, void *closure) {
   }
 }
 
+void adapt_read_size(struct conn_ctx *conn, int asked, int got) {
+  if (got == asked && asked >= conn->read_size &&
+      conn->read_size < MAX_READ_BUFFER) {
+    conn->read_size *= 2;
+  } else if (got < conn->read_size / 4 && conn->read_size > MIN_READ_SIZE) {
+    conn->read_size /= 2;
+  }
+}
+
 struct conn_activity_check_closure {
   int num_actives;
   conn_manage_ctx cm_ctx;
@@ -78,35 +275,161 @@ void conn_check_ready_accessor(int fd, int idx, void *closure) {
     ++ctx->num_actives;
     fprintf(stderr, "Positive.\n");
 
-    int nbytes = read(fd, read_buf, sizeof(read_buf));
-    if (nbytes > 0) {
-      fprintf(stderr, "Got %d bytes from fd=%d address=%s, emitting now.\n",
-              nbytes, fd, peer_name_buf);
-      int nbytes_written = write(STDOUT_FILENO, read_buf, nbytes);
-      if (nbytes_written < 0) {
-        fprintf(stderr, "Unknown error: write: %s\n", strerror(errno));
-      } else if (nbytes_written > 0) {
-        fprintf(stderr, "Wrote %d bytes to stdout.\n", nbytes_written);
-      } else {
-        fprintf(stderr, "Got EOF from stdout, exitting...\n");
-        exit(0);
+    struct rs_conn *sched = &conns[fd].sched;
+    long allowance = rs_begin(&read_sched, sched);
+    int first_read = 1;
+    while (!rs_exhausted(&read_sched, sched)) {
+      int max_read = conns[fd].read_size;
+      if (allowance < max_read) {
+        max_read = allowance;
       }
-    } else if (nbytes < 0) {
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        fprintf(stderr, "Unknown error: read: %s\n", strerror(errno));
-        exit(1);
+      char *dst = sink->reserve(sink, &max_read);
+      int nbytes;
+      long latency_ns = -1;
+      if (first_read) {
+        // 每一轮的第一次读顺便取一下内核收到数据的时间，算出唤醒延迟。
+        struct iovec iov = {.iov_base = dst, .iov_len = max_read};
+        nbytes = readv_rx_latency(fd, &iov, 1, &latency_ns);
+        if (nbytes < 0) {
+          nbytes = -errno;
+        }
+        if (latency_ns >= 0) {
+          lathist_record(&wakeup_lat, latency_ns);
+        }
+        first_read = 0;
+      } else {
+        nbytes = sys_read(fd, dst, max_read);
       }
-    } else {
-      fprintf(stderr, "Got EOF from fd=%d address=%s, would close it.\n", fd,
-              peer_name_buf);
+      if (nbytes > 0) {
+        conns[fd].last_active = monotonic_ms();
+        allowance = rs_charge(sched, nbytes);
+        fprintf(stderr, "Got %d bytes from fd=%d address=%s, emitting now.\n",
+                nbytes, fd, peer_name_buf);
+        if (emit(&conns[fd], nbytes, latency_ns) != 0) {
+          fprintf(stderr, "Output is closed, exitting...\n");
+          exit(0);
+        }
+
+        adapt_read_size(&conns[fd], max_read, nbytes);
+        if (nbytes < max_read) {
+          // 读到的比要的少，接收队列已经空了，不再用一次 read 去确认 EAGAIN，
+          // 还有数据（或者 EOF）的话下一次 select 会告诉我们。
+          rs_idle(&read_sched, sched);
+          break;
+        }
+      } else if (nbytes < 0) {
+        if (nbytes != -EAGAIN && nbytes != -EWOULDBLOCK) {
+          fprintf(stderr, "Unknown error: read: %s\n", strerror(-nbytes));
+          exit(1);
+        }
+        rs_idle(&read_sched, sched);
+        break;
+      } else {
+        fprintf(stderr, "Got EOF from fd=%d address=%s, would close it.\n",
+                fd, peer_name_buf);
 
-      cm_ctx_conn_mark_dead(ctx->cm_ctx, fd);
+        cm_ctx_conn_mark_dead(ctx->cm_ctx, fd);
+        break;
+      }
     }
   } else {
     fprintf(stderr, "Negative.\n");
   }
 }
 
+void on_accept_resume_timer(struct tw_timer *t, void *arg) {
+  open_reserve_fd(&reserve_fd);
+  fprintf(stderr, "Resuming accepting connections.\n");
+  accept_paused = 0;
+}
+
+// 一直接受到 listen 队列为空（最多 ACCEPT_BUDGET 个），新的 fd 直接就是
+// O_NONBLOCK 的。fd 用完时用预留的 fd 拒绝排队的连接，连它也没有了就暂停
+// accept（select 是水平触发的，不暂停的话会一直报告 listen socket 可读）。
+void accept_pending_conns(int srv_skt, conn_manage_ctx cm_ctx) {
+  for (int i = 0; i < ACCEPT_BUDGET; ++i) {
+    struct sockaddr_storage cli_addr_store;
+    socklen_t cli_addr_size = sizeof(cli_addr_store);
+
+    int cli_skt = sys_accept4(srv_skt, (struct sockaddr *)(&cli_addr_store),
+                              &cli_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cli_skt == -EMFILE || cli_skt == -ENFILE) {
+      const int dropped = drop_pending_conn(srv_skt, &reserve_fd);
+      if (dropped > 0) {
+        ++nr_shed_conns;
+        continue;
+      } else if (dropped < 0) {
+        fprintf(stderr, "Out of file descriptors, pausing accept for %d "
+                "ms.\n", ACCEPT_PAUSE_MS);
+        ++nr_accept_pauses;
+        accept_paused = 1;
+        tw_schedule(&wheel, &accept_resume_timer,
+                    monotonic_ms() + ACCEPT_PAUSE_MS);
+      }
+      break;
+    }
+    if (cli_skt < 0) {
+      if (cli_skt != -EAGAIN && cli_skt != -EWOULDBLOCK) {
+        fprintf(stderr,
+                "Error occurred while accepting client connection: %s\n",
+                strerror(-cli_skt));
+      }
+      break;
+    }
+
+    if (cli_skt >= FD_SETSIZE) {
+      fprintf(stderr, "fd %d does not fit in an fd_set, closing it.\n",
+              cli_skt);
+      close(cli_skt);
+      continue;
+    }
+
+    print_accept_conn(cli_skt);
+    enable_rx_timestamps(cli_skt);
+    if (socket_busy_poll_us > 0) {
+      set_busy_poll(cli_skt, socket_busy_poll_us);
+    }
+
+    cm_ctx_add_conn(cm_ctx, cli_skt);
+    track_conn(cli_skt, cm_ctx);
+    fprintf(stderr, "Now we have %d connections.\n",
+            cm_ctx_get_num_conns(cm_ctx));
+  }
+}
+
+// 等待 I/O，返回值和 select 一样。开启了忙轮询时先用超时为 0 的 select 反复
+// 检查，在窗口内等到了就直接返回，否则退回阻塞的 select。
+int wait_for_io(int nfds, struct timeval *timeout) {
+  if (busy_poll.max_ns > 0) {
+    // select 会改写 fd_set，每次检查之前都要恢复。
+    const fd_set read_saved = *read_interest;
+    const fd_set write_saved = *write_interest;
+    long now = monotonic_ns();
+    const long deadline = bp_deadline(&busy_poll, now);
+    while (now < deadline) {
+      struct timeval zero = {.tv_sec = 0, .tv_usec = 0};
+      int n = select(nfds, read_interest, write_interest, NULL, &zero);
+      if (n != 0) {
+        if (n > 0) {
+          bp_hit(&busy_poll);
+        }
+        return n;
+      }
+      *read_interest = read_saved;
+      *write_interest = write_saved;
+      bp_relax();
+      now = monotonic_ns();
+    }
+    bp_miss(&busy_poll, now);
+  }
+
+  int n = select(nfds, read_interest, write_interest, NULL, timeout);
+  if (busy_poll.max_ns > 0) {
+    bp_woke(&busy_poll, monotonic_ns());
+  }
+  return n;
+}
+
 void init_interests() {
   FD_ZERO(read_interest);
   fprintf(stderr, "read_interest at 0x%016lx sized %ld is intialized.\n",
@@ -125,52 +448,223 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  int status;
-  if (argc <= 1) {
-    fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-    exit(1);
+  char *shm_path = NULL;
+  int shm_ring_size = DEFAULT_SHM_RING_SIZE;
+  int busy_poll_us = 0;
+  int udp_gro = 0;
+  int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+  struct file_sink_config file_cfg = {.path = NULL,
+                                      .buf_size = DEFAULT_FILE_BUF_SIZE,
+                                      .direct = 0,
+                                      .sync_bytes = 0,
+                                      .sync_ms = DEFAULT_FILE_SYNC_MS,
+                                      .prealloc_bytes = 0,
+                                      .rotate_bytes = 0};
+  int opt;
+  while ((opt = getopt(argc, argv, "o:s:y:Y:ftGw:b:DS:T:P:R:l:")) != -1) {
+    switch (opt) {
+      case 'o':
+        shm_path = optarg;
+        break;
+      case 's':
+        shm_ring_size = atoi(optarg);
+        break;
+      case 'y':
+        busy_poll_us = atoi(optarg);
+        break;
+      case 'Y':
+        socket_busy_poll_us = atoi(optarg);
+        break;
+      case 'f':
+        framing = 1;
+        break;
+      case 't':
+        framing = 1;
+        frame_flags |= MUX_STREAM_TIMESTAMPS;
+        break;
+      case 'G':
+        udp_gro = 1;
+        break;
+      case 'w':
+        file_cfg.path = optarg;
+        break;
+      case 'b':
+        file_cfg.buf_size = atoi(optarg);
+        break;
+      case 'D':
+        file_cfg.direct = 1;
+        break;
+      case 'S':
+        file_cfg.sync_bytes = atol(optarg);
+        break;
+      case 'T':
+        file_cfg.sync_ms = atoi(optarg);
+        break;
+      case 'P':
+        file_cfg.prealloc_bytes = atol(optarg);
+        break;
+      case 'R':
+        file_cfg.rotate_bytes = atol(optarg);
+        break;
+      case 'l':
+        listen_backlog = atoi(optarg);
+        break;
+      default:
+        optind = argc;
+    }
   }
-
-  char *port = argv[1];
-  fprintf(stderr, "Port number is: %s\n", port);
-
-  int srv_skt = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  set_io_non_block(srv_skt);
-
-  if (srv_skt == -1) {
-    fprintf(stderr, "Failed to open socket. %s\n", strerror(errno));
+  if (optind >= argc || listen_backlog <= 0) {
+    fprintf(stderr,
+            "Usage: %s [-o <shm_path> [-s <ring_bytes>]] [-y <us>] [-Y <us>] "
+            "[-f] [-t] [-G] [-l <n>]\n"
+            "       [-w <path> [-b <buf_bytes>] [-D] [-S <bytes>] [-T <ms>] "
+            "[-P <bytes>] [-R <bytes>]]\n"
+            "       <addr>[,<addr>...] [idle_timeout_sec (default %d, 0 to "
+            "disable)]\n"
+            "  <addr> is <port> or <host>:<port> for TCP, unix:<path> for a "
+            "UNIX domain socket,\n"
+            "  unix:@<name> for one in the abstract namespace, udp:<port> or "
+            "udp:<host>:<port> to\n"
+            "  receive datagrams\n"
+            "  -o publishes the output into a shared memory ring at shm_path "
+            "(e.g. /dev/shm/socket_mux)\n"
+            "     instead of stdout, read it with shm_cat (default ring size "
+            "%d)\n"
+            "  -y busy-polls for up to this many microseconds before blocking\n"
+            "  -Y sets SO_BUSY_POLL to this many microseconds on connections\n"
+            "  -f frames the output: every chunk gets a header with its "
+            "source and length,\n"
+            "     split it back apart with mux_split (format in muxframe.h)\n"
+            "  -t also puts the time each chunk was received in its header, "
+            "implies -f\n"
+            "  -G enables UDP_GRO on udp: addresses\n"
+            "  -l listen backlog (default %d)\n"
+            "  -w writes the output to a file through a staging buffer "
+            "(default %d bytes) instead\n"
+            "     of stdout, -D opens it with O_DIRECT\n"
+            "  -S fdatasyncs every this many bytes, -T every this many "
+            "milliseconds (default %d,\n"
+            "     0 to write the buffer out only when it is full)\n"
+            "  -P preallocates the file this many bytes at a time\n"
+            "  -R starts a new file every this many bytes, named "
+            "<path>.000000, <path>.000001, ...\n",
+            argv[0], DEFAULT_IDLE_TIMEOUT_SEC, DEFAULT_SHM_RING_SIZE,
+            DEFAULT_LISTEN_BACKLOG, DEFAULT_FILE_BUF_SIZE, DEFAULT_FILE_SYNC_MS);
     exit(1);
   }
+  if (optind + 1 < argc) {
+    idle_timeout_ms = atol(argv[optind + 1]) * 1000UL;
+  }
 
-  struct addrinfo hints, *res;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-
-  status = getaddrinfo(NULL, port, &hints, &res);
-  if (status == -1) {
-    fprintf(stderr, "Failed to getaddrinfo. %s\n", strerror(errno));
+  if (shm_path != NULL) {
+    sink = shm_sink_create(shm_path, shm_ring_size);
+  } else if (file_cfg.path != NULL) {
+    sink = file_sink_create(&file_cfg);
+  } else {
+    sink = stdout_sink_create(MAX_READ_BUFFER);
+  }
+  if (sink == NULL) {
+    fprintf(stderr, "Failed to create output sink.\n");
     exit(1);
   }
-
-  status = bind(srv_skt, res->ai_addr, res->ai_addrlen);
-  if (status == -1) {
-    fprintf(stderr, "Failed to bind. %s\n", strerror(errno));
+  if (framing) {
+    int len = MUX_PREAMBLE_LEN;
+    char *dst = sink->reserve(sink, &len);
+    mux_put_preamble(dst, frame_flags);
+    if (sink->commit(sink, MUX_PREAMBLE_LEN) != 0) {
+      exit(1);
+    }
+    sink->headroom = mux_header_len(frame_flags);
+  }
+  tw_init(&wheel, monotonic_ms());
+  rs_init(&read_sched, READ_QUANTUM, MAX_READS_PER_TURN);
+  bp_init(&busy_poll, busy_poll_us);
+  lathist_reset(&wakeup_lat);
+  tw_timer_init(&metrics_timer, on_metrics_timer, cm_ctx);
+  tw_schedule(&wheel, &metrics_timer, wheel.now + METRICS_INTERVAL_MS);
+  tw_timer_init(&accept_resume_timer, on_accept_resume_timer, NULL);
+  if (open_reserve_fd(&reserve_fd) < 0) {
+    fprintf(stderr, "Failed to open reserved fd: %s\n", strerror(errno));
     exit(1);
   }
+  if (sink->flush != NULL) {
+    tw_timer_init(&flush_timer, on_flush_timer, NULL);
+    tw_schedule(&wheel, &flush_timer, wheel.now + sink->flush_interval_ms);
+  }
 
-  int backlog = 20;
-  status = listen(srv_skt, backlog);
-  if (status == -1) {
-    fprintf(stderr, "Failed to listen. %s\n", strerror(errno));
-    exit(1);
+  // 同一台机器上的生产者可以连 UNIX domain socket，和 TCP 连接走同样的处理路径。
+  char *listen_addrs[MAX_LISTENERS];
+  int listen_fds[MAX_LISTENERS];
+  int nr_listeners = 0;
+  char *saveptr = NULL;
+  for (char *addr = strtok_r(argv[optind], ",", &saveptr); addr != NULL;
+       addr = strtok_r(NULL, ",", &saveptr)) {
+    if (nr_listeners + nr_udp_ingests == MAX_LISTENERS) {
+      fprintf(stderr, "Too many listen addresses, at most %d.\n",
+              MAX_LISTENERS);
+      exit(1);
+    }
+    if (is_udp_addr(addr)) {
+      struct udp_ingest *u = udp_ingest_open(
+          addr, udp_gro, frame_flags & MUX_STREAM_TIMESTAMPS);
+      if (u == NULL || udp_ingest_get_fd(u) >= FD_SETSIZE) {
+        fprintf(stderr, "Failed to listen on %s.\n", addr);
+        exit(1);
+      }
+      fprintf(stderr, "Receiving datagrams on %s, fd=%d\n", addr,
+              udp_ingest_get_fd(u));
+      udp_sources[nr_udp_ingests] = next_source++;
+      udp_ingests[nr_udp_ingests++] = u;
+      continue;
+    }
+    int fd = listen_on(addr, listen_backlog);
+    if (fd == -1 || fd >= FD_SETSIZE) {
+      fprintf(stderr, "Failed to listen on %s.\n", addr);
+      exit(1);
+    }
+    fprintf(stderr, "Listening on %s, fd=%d\n", addr, fd);
+    listen_addrs[nr_listeners] = addr;
+    listen_fds[nr_listeners] = fd;
+    ++nr_listeners;
   }
 
-  struct timeval *timeout = NULL;
-  while (1) {
-    int max_fd = srv_skt;
-    FD_SET(srv_skt, read_interest);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  struct timeval timeout_storage;
+  while (!stopping) {
+    // select 最多等到时间轮下一个需要推进的时刻。
+    struct timeval *timeout = NULL;
+    unsigned long next_timer = tw_next_event(&wheel);
+    if (next_timer != TW_NEVER) {
+      unsigned long now = monotonic_ms();
+      unsigned long delay_ms = next_timer > now ? next_timer - now : 0;
+      timeout_storage.tv_sec = delay_ms / 1000;
+      timeout_storage.tv_usec = delay_ms % 1000 * 1000;
+      timeout = &timeout_storage;
+    }
+
+    int max_fd = 0;
+    for (int i = 0; i < nr_listeners; ++i) {
+      if (accept_paused) {
+        FD_CLR(listen_fds[i], read_interest);
+        continue;
+      }
+      FD_SET(listen_fds[i], read_interest);
+      if (listen_fds[i] > max_fd) {
+        max_fd = listen_fds[i];
+      }
+    }
+    for (int i = 0; i < nr_udp_ingests; ++i) {
+      const int fd = udp_ingest_get_fd(udp_ingests[i]);
+      FD_SET(fd, read_interest);
+      if (fd > max_fd) {
+        max_fd = fd;
+      }
+    }
 
     if (cm_ctx_get_num_conns(cm_ctx) > 0) {
       struct conn_traverse_closure closure;
@@ -181,30 +675,29 @@ int main(int argc, char *argv[]) {
 
     fprintf(stderr, "Waiting for IO activity.\n");
     int nfds = max_fd + 1;
-    if (select(nfds, read_interest, write_interest, NULL, timeout) == -1) {
+    if (wait_for_io(nfds, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
       fprintf(stderr, "Error returned from select: %s\n", strerror(errno));
       exit(1);
     }
 
-    if (FD_ISSET(srv_skt, read_interest)) {
-      fprintf(stderr, "Server socket is now readable.\n");
-      struct sockaddr_storage cli_addr_store;
-      socklen_t cli_addr_size = sizeof(cli_addr_size);
-
-      int cli_skt =
-          accept(srv_skt, (struct sockaddr *)(&cli_addr_store), &cli_addr_size);
-      if (cli_skt == -1) {
-        fprintf(stderr, "Error occurred while accepting client connection.\n");
-        continue;
+    for (int i = 0; i < nr_listeners; ++i) {
+      if (FD_ISSET(listen_fds[i], read_interest)) {
+        fprintf(stderr, "Server socket %s is now readable.\n",
+                listen_addrs[i]);
+        accept_pending_conns(listen_fds[i], cm_ctx);
       }
+    }
 
-      print_accept_conn(cli_skt);
-
-      set_io_non_block(cli_skt);
-
-      cm_ctx_add_conn(cm_ctx, cli_skt);
-      fprintf(stderr, "Now we have %d connections.\n",
-              cm_ctx_get_num_conns(cm_ctx));
+    for (int i = 0; i < nr_udp_ingests; ++i) {
+      if (FD_ISSET(udp_ingest_get_fd(udp_ingests[i]), read_interest) &&
+          udp_ingest_drain(udp_ingests[i], sink, framing, frame_flags,
+                           udp_sources[i], UDP_MAX_BATCHES_PER_TURN) < 0) {
+        fprintf(stderr, "Output is closed, exitting...\n");
+        exit(0);
+      }
     }
 
     if (cm_ctx_get_num_conns(cm_ctx) > 0) {
@@ -218,11 +711,21 @@ int main(int argc, char *argv[]) {
       }
     }
 
+    tw_advance(&wheel, monotonic_ms());
+
     fprintf(stderr, "GC: Cleaning dead connections...");
     cm_ctx_gc(cm_ctx, close_fd_or_panic);
   }
 
-  close(srv_skt);
+  for (int i = 0; i < nr_listeners; ++i) {
+    close(listen_fds[i]);
+    unlisten(listen_addrs[i]);
+  }
+  report_udp_stats();
+  for (int i = 0; i < nr_udp_ingests; ++i) {
+    udp_ingest_close(udp_ingests[i]);
+  }
+  sink->close(sink);
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,562 @@
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpscq.h"
+#include "muxframe.h"
+#include "rawsys.h"
+#include "util.h"
+
+// socket_mux 的多线程版本：socket_mux 在同一个线程里 select、read 所有连接，
+// 再对每一块数据阻塞地 write 一次 stdout，stdout 慢下来的时候所有连接的读取都跟着
+// 停下来。这里：
+//
+//   - 主线程只负责 accept，把新连接轮流分给 N 个读线程；
+//   - 每个读线程有自己的 epoll，把自己那些连接的数据直接 read 进 chunk，再把
+//     chunk 放进写线程的 MPSC 队列（见 mpscq.h），不等 stdout；
+//   - 唯一的写线程把队列里攒下的 chunk 一次 writev 写到 stdout，再把它们还给
+//     各自的读线程。
+//
+// 每个读线程只有固定数目（-c）的 chunk，用完了（stdout 跟不上）就停下来等写线程
+// 还回来，这时它的连接的数据留在内核的接收队列里，由 TCP 的流控去限制发送方；
+// 在用完之前，stdout 的停顿完全不影响读取。一个连接只由一个读线程读，MPSC 队列
+// 保持每个生产者的顺序，所以同一个连接的数据在输出里的顺序不变。
+//
+// 输出的格式和 socket_mux 一样，-f、-t 分帧（见 muxframe.h）。
+
+#define CHUNK_SIZE (1024 * 64)
+#define DEFAULT_NR_READERS 4
+#define MAX_READERS 64
+#define DEFAULT_CHUNKS_PER_READER 64
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+// 最多同时监听几个地址（TCP 端口、UNIX domain socket），见 util.h。
+#define MAX_LISTENERS 8
+// 每轮最多接受多少个连接。
+#define ACCEPT_BUDGET 64
+// fd 耗尽、连预留的 fd 也没有了的时候，停止接受连接多久。
+#define ACCEPT_PAUSE_MS 1000
+// 读线程一次 epoll_wait 最多处理多少个连接。
+#define MAX_EVENTS 64
+// 写线程一次 writev 最多写出多少个 chunk（分帧时每个 chunk 占两个 iovec）。
+#define MAX_BATCH (IOV_MAX / 2)
+// 各个线程至少每隔这么久检查一次是不是该退出了。
+#define STOP_CHECK_MS 100
+// 每隔多久向 stderr 报告一次各个线程的统计。
+#define METRICS_INTERVAL_MS 10000
+
+struct reader;
+
+// 一次 read 读到的数据。len 为 0 的 chunk（只在分帧时）表示 source 已经关闭。
+struct chunk {
+  struct mpscq_node node;
+  struct reader *owner;
+  int len;
+  char hdr[MUX_MAX_HEADER_LEN];
+  char data[CHUNK_SIZE];
+};
+
+struct conn {
+  int fd;
+  uint32_t source;
+};
+
+struct reader {
+  pthread_t thread;
+  int id;
+  int epfd;
+  // 空闲的 chunk：写线程写完后 push 回来，读线程自己 pop。
+  struct mpscq free_q;
+  // 上一次 read 没有读到数据，留着下一次用的 chunk，免得在队列上来回。
+  struct chunk *spare;
+  struct chunk *chunks;
+
+  _Alignas(MPSCQ_CACHELINE_SIZE) _Atomic unsigned long nr_bytes;
+  _Atomic unsigned long nr_reads;
+  _Atomic unsigned long nr_stalls;
+  _Atomic int nr_conns;
+};
+
+struct writer {
+  pthread_t thread;
+  struct mpscq q;
+
+  _Alignas(MPSCQ_CACHELINE_SIZE) _Atomic unsigned long nr_writevs;
+  _Atomic unsigned long nr_chunks;
+  _Atomic unsigned long nr_bytes;
+};
+
+struct reader readers[MAX_READERS];
+int nr_readers = DEFAULT_NR_READERS;
+int chunks_per_reader = DEFAULT_CHUNKS_PER_READER;
+struct writer writer;
+
+// -f 分帧输出（见 muxframe.h），-t 在帧头里带上收到数据的时间。
+int framing = 0;
+uint32_t frame_flags = 0;
+int header_len = 0;
+
+// 收到 SIGINT/SIGTERM 后各个线程退出；读线程都退出以后写线程写完队列里剩下的
+// 数据再退出。
+_Atomic int stopping = 0;
+_Atomic int readers_done = 0;
+
+void on_stop_signal(int sig) { atomic_store(&stopping, 1); }
+
+unsigned long realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+unsigned long monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+// 拿一个空闲的 chunk，都在写线程手里时一直等到它还回来一个，要退出时返回 NULL。
+struct chunk *get_chunk(struct reader *r) {
+  if (r->spare != NULL) {
+    struct chunk *c = r->spare;
+    r->spare = NULL;
+    return c;
+  }
+  struct mpscq_node *n = mpscq_pop(&r->free_q);
+  if (n == NULL) {
+    atomic_fetch_add_explicit(&r->nr_stalls, 1, memory_order_relaxed);
+    while ((n = mpscq_pop(&r->free_q)) == NULL) {
+      if (atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        return NULL;
+      }
+      mpscq_wait(&r->free_q, STOP_CHECK_MS);
+    }
+  }
+  return mpscq_entry(n, struct chunk, node);
+}
+
+void emit_chunk(struct chunk *c, uint32_t source, int len, long latency_ns) {
+  c->len = len;
+  if (framing) {
+    uint64_t ts_ns = 0;
+    if (frame_flags & MUX_STREAM_TIMESTAMPS) {
+      ts_ns = realtime_ns() - (latency_ns > 0 ? latency_ns : 0);
+    }
+    mux_put_header(c->hdr, frame_flags, source, len, ts_ns);
+  }
+  mpscq_push(&writer.q, &c->node);
+}
+
+void close_conn(struct reader *r, struct conn *conn) {
+  epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  if (framing) {
+    struct chunk *c = get_chunk(r);
+    if (c != NULL) {
+      emit_chunk(c, conn->source, 0, -1);
+    }
+  }
+  free(conn);
+  atomic_fetch_sub_explicit(&r->nr_conns, 1, memory_order_relaxed);
+}
+
+// epoll 是水平触发的，每个可读的连接每轮只读一次（最多一个 chunk），还有数据的
+// 话下一轮还会被报告，所有连接轮流来。
+void read_conn(struct reader *r, struct conn *conn) {
+  struct chunk *c = get_chunk(r);
+  if (c == NULL) {
+    return;
+  }
+  long nbytes;
+  long latency_ns = -1;
+  if (frame_flags & MUX_STREAM_TIMESTAMPS) {
+    struct iovec iov = {.iov_base = c->data, .iov_len = CHUNK_SIZE};
+    nbytes = readv_rx_latency(conn->fd, &iov, 1, &latency_ns);
+    if (nbytes < 0) {
+      nbytes = -errno;
+    }
+  } else {
+    nbytes = sys_read(conn->fd, c->data, CHUNK_SIZE);
+  }
+  atomic_fetch_add_explicit(&r->nr_reads, 1, memory_order_relaxed);
+
+  if (nbytes > 0) {
+    atomic_fetch_add_explicit(&r->nr_bytes, nbytes, memory_order_relaxed);
+    emit_chunk(c, conn->source, nbytes, latency_ns);
+    return;
+  }
+  r->spare = c;
+  if (nbytes == -EAGAIN || nbytes == -EWOULDBLOCK || nbytes == -EINTR) {
+    return;
+  }
+  if (nbytes < 0) {
+    fprintf(stderr, "read from fd %d: %s, closing it.\n", conn->fd,
+            strerror(-nbytes));
+  }
+  close_conn(r, conn);
+}
+
+void *reader_main(void *arg) {
+  struct reader *r = arg;
+  struct epoll_event events[MAX_EVENTS];
+  while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+    int n = epoll_wait(r->epfd, events, MAX_EVENTS, STOP_CHECK_MS);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "reader %d: epoll_wait: %s\n", r->id, strerror(errno));
+      exit(1);
+    }
+    for (int i = 0; i < n; ++i) {
+      read_conn(r, events[i].data.ptr);
+    }
+  }
+  return NULL;
+}
+
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    long result = sys_writev(fd, iov, iovcnt);
+    if (result < 0) {
+      if (result == -EINTR) {
+        continue;
+      }
+      fprintf(stderr, "writev: %s\n", strerror(-result));
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+      result -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + result;
+      iov->iov_len -= result;
+    }
+  }
+  return 0;
+}
+
+// 把队列里攒下的 chunk（最多 MAX_BATCH 个）一次 writev 出去。stdout 写得慢的时候
+// 攒下的就多，一次 writev 写得也多。
+void *writer_main(void *arg) {
+  struct writer *w = arg;
+  struct iovec iov[MAX_BATCH * 2];
+  struct chunk *batch[MAX_BATCH];
+  while (1) {
+    int nr_chunks = 0;
+    struct mpscq_node *n;
+    while (nr_chunks < MAX_BATCH && (n = mpscq_pop(&w->q)) != NULL) {
+      batch[nr_chunks++] = mpscq_entry(n, struct chunk, node);
+    }
+    if (nr_chunks == 0) {
+      if (atomic_load(&readers_done)) {
+        if (!mpscq_wait(&w->q, 0)) {
+          break;
+        }
+      } else {
+        mpscq_wait(&w->q, STOP_CHECK_MS);
+      }
+      continue;
+    }
+
+    int iovcnt = 0;
+    unsigned long nbytes = 0;
+    for (int i = 0; i < nr_chunks; ++i) {
+      struct chunk *c = batch[i];
+      if (framing) {
+        iov[iovcnt++] =
+            (struct iovec){.iov_base = c->hdr, .iov_len = header_len};
+      }
+      if (c->len > 0) {
+        iov[iovcnt++] = (struct iovec){.iov_base = c->data, .iov_len = c->len};
+      }
+      nbytes += c->len;
+    }
+    if (writev_all(STDOUT_FILENO, iov, iovcnt) != 0) {
+      fprintf(stderr, "Output is closed, exitting...\n");
+      exit(0);
+    }
+    for (int i = 0; i < nr_chunks; ++i) {
+      mpscq_push(&batch[i]->owner->free_q, &batch[i]->node);
+    }
+    atomic_fetch_add_explicit(&w->nr_writevs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->nr_chunks, nr_chunks, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->nr_bytes, nbytes, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+void start_reader(struct reader *r, int id) {
+  r->id = id;
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd < 0) {
+    fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+    exit(1);
+  }
+  mpscq_init(&r->free_q);
+  r->spare = NULL;
+  r->chunks = malloc(sizeof(struct chunk) * chunks_per_reader);
+  if (r->chunks == NULL) {
+    fprintf(stderr, "Failed to allocate chunks for reader %d.\n", id);
+    exit(1);
+  }
+  for (int i = 0; i < chunks_per_reader; ++i) {
+    r->chunks[i].owner = r;
+    mpscq_push(&r->free_q, &r->chunks[i].node);
+  }
+  if (pthread_create(&r->thread, NULL, reader_main, r) != 0) {
+    fprintf(stderr, "Failed to start reader %d.\n", id);
+    exit(1);
+  }
+}
+
+uint32_t next_source = 0;
+int next_reader = 0;
+
+// fd 耗尽时用来拒绝排队的连接的预留 fd（见 drop_pending_conn），连它也没有了
+// 就暂停 accept 到 accept_resume_at。只有主线程访问。
+int reserve_fd = -1;
+unsigned long accept_resume_at = 0;
+unsigned long nr_shed_conns = 0;
+unsigned long nr_accept_pauses = 0;
+
+// 一直接受到 listen 队列为空（最多 ACCEPT_BUDGET 个），轮流分给读线程。fd 用完
+// 时用预留的 fd 拒绝排队的连接，连它也没有了就暂停 accept（poll 是水平触发的，
+// 不暂停的话会一直报告 listen socket 可读）。
+void accept_pending_conns(int srv_skt) {
+  for (int i = 0; i < ACCEPT_BUDGET; ++i) {
+    int cli_skt = sys_accept4(srv_skt, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cli_skt == -EMFILE || cli_skt == -ENFILE) {
+      const int dropped = drop_pending_conn(srv_skt, &reserve_fd);
+      if (dropped > 0) {
+        ++nr_shed_conns;
+        continue;
+      } else if (dropped < 0) {
+        fprintf(stderr, "Out of file descriptors, pausing accept for %d "
+                "ms.\n", ACCEPT_PAUSE_MS);
+        ++nr_accept_pauses;
+        accept_resume_at = monotonic_ms() + ACCEPT_PAUSE_MS;
+      }
+      break;
+    }
+    if (cli_skt < 0) {
+      if (cli_skt != -EAGAIN && cli_skt != -EWOULDBLOCK) {
+        fprintf(stderr,
+                "Error occurred while accepting client connection: %s\n",
+                strerror(-cli_skt));
+      }
+      break;
+    }
+    if (frame_flags & MUX_STREAM_TIMESTAMPS) {
+      enable_rx_timestamps(cli_skt);
+    }
+
+    struct conn *conn = malloc(sizeof(struct conn));
+    conn->fd = cli_skt;
+    conn->source = next_source++;
+    struct reader *r = &readers[next_reader];
+    next_reader = (next_reader + 1) % nr_readers;
+    atomic_fetch_add_explicit(&r->nr_conns, 1, memory_order_relaxed);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, cli_skt, &ev) != 0) {
+      fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+      atomic_fetch_sub_explicit(&r->nr_conns, 1, memory_order_relaxed);
+      close(cli_skt);
+      free(conn);
+    }
+  }
+}
+
+void report_metrics() {
+  fprintf(stderr, "[metrics] writer(writevs=%lu chunks_per_writev=%.1f "
+          "bytes=%lu sleeps=%lu)",
+          atomic_load(&writer.nr_writevs),
+          atomic_load(&writer.nr_writevs) > 0
+              ? (double)atomic_load(&writer.nr_chunks) /
+                    atomic_load(&writer.nr_writevs)
+              : 0.0,
+          atomic_load(&writer.nr_bytes), atomic_load(&writer.q.nr_sleeps));
+  for (int i = 0; i < nr_readers; ++i) {
+    struct reader *r = &readers[i];
+    fprintf(stderr, " reader%d(conns=%d reads=%lu bytes=%lu stalls=%lu)", i,
+            atomic_load(&r->nr_conns), atomic_load(&r->nr_reads),
+            atomic_load(&r->nr_bytes), atomic_load(&r->nr_stalls));
+  }
+  fprintf(stderr, " acceptor(shed_conns=%lu accept_pauses=%lu)\n",
+          nr_shed_conns, nr_accept_pauses);
+}
+
+int main(int argc, char *argv[]) {
+  int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:c:ftl:")) != -1) {
+    switch (opt) {
+      case 'n':
+        nr_readers = atoi(optarg);
+        break;
+      case 'c':
+        chunks_per_reader = atoi(optarg);
+        break;
+      case 'f':
+        framing = 1;
+        break;
+      case 't':
+        framing = 1;
+        frame_flags |= MUX_STREAM_TIMESTAMPS;
+        break;
+      case 'l':
+        listen_backlog = atoi(optarg);
+        break;
+      default:
+        optind = argc;
+    }
+  }
+  if (optind >= argc || nr_readers <= 0 || nr_readers > MAX_READERS ||
+      chunks_per_reader <= 0 || listen_backlog <= 0) {
+    fprintf(stderr,
+            "Usage: %s [-n <readers>] [-c <chunks>] [-f] [-t] [-l <n>] "
+            "<addr>[,<addr>...]\n"
+            "  <addr> is <port> or <host>:<port> for TCP, unix:<path> for a "
+            "UNIX domain socket,\n"
+            "  unix:@<name> for one in the abstract namespace\n"
+            "  -n reader threads, each with its own epoll (default %d, at "
+            "most %d)\n"
+            "  -c %d KiB chunks per reader, a reader stops reading once all "
+            "of them wait for\n"
+            "     stdout (default %d)\n"
+            "  -f frames the output: every chunk gets a header with its "
+            "source and length,\n"
+            "     split it back apart with mux_split (format in muxframe.h)\n"
+            "  -t also puts the time each chunk was received in its header, "
+            "implies -f\n"
+            "  -l listen backlog (default %d)\n",
+            argv[0], DEFAULT_NR_READERS, MAX_READERS, CHUNK_SIZE / 1024,
+            DEFAULT_CHUNKS_PER_READER, DEFAULT_LISTEN_BACKLOG);
+    exit(1);
+  }
+
+  char *listen_addrs[MAX_LISTENERS];
+  struct pollfd listen_fds[MAX_LISTENERS];
+  int nr_listeners = 0;
+  char *saveptr = NULL;
+  for (char *addr = strtok_r(argv[optind], ",", &saveptr); addr != NULL;
+       addr = strtok_r(NULL, ",", &saveptr)) {
+    if (nr_listeners == MAX_LISTENERS) {
+      fprintf(stderr, "Too many listen addresses, at most %d.\n",
+              MAX_LISTENERS);
+      exit(1);
+    }
+    int fd = listen_on(addr, listen_backlog);
+    if (fd == -1) {
+      fprintf(stderr, "Failed to listen on %s.\n", addr);
+      exit(1);
+    }
+    fprintf(stderr, "Listening on %s, fd=%d\n", addr, fd);
+    listen_addrs[nr_listeners] = addr;
+    listen_fds[nr_listeners] = (struct pollfd){.fd = fd, .events = POLLIN};
+    ++nr_listeners;
+  }
+
+  if (open_reserve_fd(&reserve_fd) < 0) {
+    fprintf(stderr, "Failed to open reserved fd: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  if (framing) {
+    char preamble[MUX_PREAMBLE_LEN];
+    mux_put_preamble(preamble, frame_flags);
+    struct iovec iov = {.iov_base = preamble, .iov_len = MUX_PREAMBLE_LEN};
+    if (writev_all(STDOUT_FILENO, &iov, 1) != 0) {
+      exit(1);
+    }
+    header_len = mux_header_len(frame_flags);
+  }
+
+  // 信号只交给主线程：其它线程启动时继承屏蔽了 SIGINT/SIGTERM 的信号掩码。
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigset_t stop_signals, saved_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &saved_mask);
+
+  mpscq_init(&writer.q);
+  if (pthread_create(&writer.thread, NULL, writer_main, &writer) != 0) {
+    fprintf(stderr, "Failed to start the writer.\n");
+    exit(1);
+  }
+  for (int i = 0; i < nr_readers; ++i) {
+    start_reader(&readers[i], i);
+  }
+  pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+  fprintf(stderr, "Started %d readers with %d chunks each.\n", nr_readers,
+          chunks_per_reader);
+
+  unsigned long next_report = monotonic_ms() + METRICS_INTERVAL_MS;
+  while (!atomic_load(&stopping)) {
+    const unsigned long now = monotonic_ms();
+    unsigned long wake_at = next_report;
+    if (accept_resume_at != 0 && now >= accept_resume_at) {
+      open_reserve_fd(&reserve_fd);
+      fprintf(stderr, "Resuming accepting connections.\n");
+      accept_resume_at = 0;
+    } else if (accept_resume_at != 0 && accept_resume_at < wake_at) {
+      wake_at = accept_resume_at;
+    }
+    // 暂停 accept 时 poll 只等时间，不看 listen socket。
+    for (int i = 0; i < nr_listeners; ++i) {
+      listen_fds[i].events = accept_resume_at != 0 ? 0 : POLLIN;
+    }
+    const int timeout = wake_at > now ? (int)(wake_at - now) : 0;
+    int n = poll(listen_fds, nr_listeners, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      exit(1);
+    }
+    for (int i = 0; i < nr_listeners; ++i) {
+      if (listen_fds[i].revents & POLLIN) {
+        accept_pending_conns(listen_fds[i].fd);
+      }
+    }
+    if (monotonic_ms() >= next_report) {
+      report_metrics();
+      next_report = monotonic_ms() + METRICS_INTERVAL_MS;
+    }
+  }
+
+  for (int i = 0; i < nr_readers; ++i) {
+    pthread_join(readers[i].thread, NULL);
+  }
+  atomic_store(&readers_done, 1);
+  pthread_join(writer.thread, NULL);
+  report_metrics();
+
+  for (int i = 0; i < nr_listeners; ++i) {
+    close(listen_fds[i].fd);
+    unlisten(listen_addrs[i]);
+  }
+  for (int i = 0; i < nr_readers; ++i) {
+    close(readers[i].epfd);
+    free(readers[i].chunks);
+  }
+  return 0;
+}
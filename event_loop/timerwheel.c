@@ -0,0 +1,157 @@
+#include "timerwheel.h"
+
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+void tw_init(struct timer_wheel *w, unsigned long now) {
+  w->now = now;
+  w->nr_timers = 0;
+  for (int level = 0; level < TW_LEVELS; ++level) {
+    for (int i = 0; i < TW_SLOTS; ++i) {
+      dq_init(&w->slots[level][i]);
+    }
+  }
+}
+
+void tw_timer_init(struct tw_timer *t, tw_callback cb, void *arg) {
+  dq_node_init(&t->node);
+  t->slot = NULL;
+  t->expires = 0;
+  t->cb = cb;
+  t->arg = arg;
+}
+
+int tw_timer_is_pending(struct tw_timer *t) { return t->slot != NULL; }
+
+// 把定时器放进它该在的槽里。base 是下一个要处理的 tick，到期时间离 base 不到
+// TW_SLOTS^(l+1) 个 tick 的定时器放在第 l 层，槽的下标取到期时间的第 l 组
+// TW_LEVEL_BITS 位，这样第 l 层的每个槽恰好在它覆盖的那段时间开始时被下放。
+void tw_enqueue(struct timer_wheel *w, struct tw_timer *t) {
+  const unsigned long base = w->now + 1;
+  if (t->expires < base) {
+    t->expires = base;
+  }
+  if (t->expires - base >= TW_MAX_TICKS) {
+    t->expires = base + TW_MAX_TICKS - 1;
+  }
+
+  const unsigned long delta = t->expires - base;
+  int level = 0;
+  while (level < TW_LEVELS - 1 &&
+         delta >= (1UL << (TW_LEVEL_BITS * (level + 1)))) {
+    ++level;
+  }
+  int idx = (t->expires >> (TW_LEVEL_BITS * level)) & TW_SLOT_MASK;
+  t->slot = &w->slots[level][idx];
+  dq_push_back(t->slot, &t->node);
+}
+
+void tw_schedule(struct timer_wheel *w, struct tw_timer *t,
+                 unsigned long expires) {
+  tw_cancel(w, t);
+  t->expires = expires;
+  tw_enqueue(w, t);
+  ++w->nr_timers;
+}
+
+void tw_cancel(struct timer_wheel *w, struct tw_timer *t) {
+  if (t->slot == NULL) {
+    return;
+  }
+  dq_remove(t->slot, &t->node);
+  t->slot = NULL;
+  --w->nr_timers;
+}
+
+// 把第 level 层下标为 idx 的槽里的定时器重新放一遍，它们都会落到更低的层。
+void tw_cascade(struct timer_wheel *w, int level, int idx) {
+  struct dqueue *slot = &w->slots[level][idx];
+  struct dq_node *n;
+  while ((n = dq_pop_front(slot)) != NULL) {
+    tw_enqueue(w, dq_entry(n, struct tw_timer, node));
+  }
+}
+
+// 处理 tick 这一个时刻：先逐层下放，再触发第 0 层对应槽里的定时器。调用时
+// w->now 必须是 tick - 1。
+int tw_run_tick(struct timer_wheel *w, unsigned long tick) {
+  for (int level = 1; level < TW_LEVELS; ++level) {
+    const int shift = TW_LEVEL_BITS * level;
+    if ((tick & ((1UL << shift) - 1)) != 0) {
+      break;
+    }
+    tw_cascade(w, level, (tick >> shift) & TW_SLOT_MASK);
+  }
+
+  w->now = tick;
+
+  // 回调中新安排的定时器可能正好落到这个槽里（到期时间是 TW_SLOTS 个 tick
+  // 之后），所以先把到期的定时器挪出来再逐个触发。
+  struct dqueue expired;
+  dq_init(&expired);
+  struct dqueue *slot = &w->slots[0][tick & TW_SLOT_MASK];
+  struct dq_node *n;
+  while ((n = dq_pop_front(slot)) != NULL) {
+    dq_push_back(&expired, n);
+    dq_entry(n, struct tw_timer, node)->slot = &expired;
+  }
+
+  int nr_fired = 0;
+  while ((n = dq_pop_front(&expired)) != NULL) {
+    struct tw_timer *t = dq_entry(n, struct tw_timer, node);
+    t->slot = NULL;
+    --w->nr_timers;
+    ++nr_fired;
+    t->cb(t, t->arg);
+  }
+  return nr_fired;
+}
+
+unsigned long tw_next_event(struct timer_wheel *w) {
+  if (w->nr_timers == 0) {
+    return TW_NEVER;
+  }
+
+  const unsigned long base = w->now + 1;
+  unsigned long next = TW_NEVER;
+  for (int level = 0; level < TW_LEVELS; ++level) {
+    const int shift = TW_LEVEL_BITS * level;
+    // 按时间顺序检查这一层的槽：base 所在的那一段如果已经下放过了（base
+    // 不是这一段的开头），它的槽里装的是转了一圈之后的那一段，排在最后。
+    unsigned long block = base >> shift;
+    if ((block << shift) < base) {
+      ++block;
+    }
+    for (int i = 0; i < TW_SLOTS; ++i) {
+      if (!dq_is_empty(&w->slots[level][(block + i) & TW_SLOT_MASK])) {
+        const unsigned long tick = (block + i) << shift;
+        if (tick < next) {
+          next = tick;
+        }
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+int tw_advance(struct timer_wheel *w, unsigned long now) {
+  int nr_fired = 0;
+  while (w->now < now) {
+    if (now - w->now <= TW_SLOTS) {
+      // 推进得不多时逐个 tick 处理，每个空的 tick 只是一次判空。
+      nr_fired += tw_run_tick(w, w->now + 1);
+      continue;
+    }
+
+    // 推进得多时跳过中间什么都不用做的 tick，开销只和到期、下放的次数有关，和
+    // 经过了多少个 tick 无关。
+    const unsigned long next = tw_next_event(w);
+    if (next > now) {
+      w->now = now;
+      break;
+    }
+    w->now = next - 1;
+    nr_fired += tw_run_tick(w, next);
+  }
+  return nr_fired;
+}
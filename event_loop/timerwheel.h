@@ -0,0 +1,76 @@
+#ifndef MY_TIMERWHEEL
+#define MY_TIMERWHEEL
+
+#include "dqueue.h"
+
+// 分层时间轮（hierarchical timing wheel）：TW_LEVELS 层，每层 TW_SLOTS
+// 个槽，第 l 层的一个槽覆盖 TW_SLOTS^l 个 tick。定时器按到期时间离现在有多远被放进
+// 某一层的某个槽里，时间走到那一层的槽时再被逐层下放（cascade），直到第 0
+// 层的槽到期时被触发。
+//
+// 添加、取消定时器都是 O(1) 的，和定时器的个数无关；定时器本身（tw_timer）由调用者
+// 嵌在自己的结构体里，时间轮从不分配内存。
+//
+// 时间轮不读时钟，tick 的单位（比如毫秒）由调用者决定，调用者通过 tw_advance
+// 告诉它现在是什么时候，所以也可以用一个假的时钟来驱动它。
+
+#define TW_LEVEL_BITS 6
+#define TW_SLOTS (1 << TW_LEVEL_BITS)
+#define TW_LEVELS 4
+
+// 最远能安排到 TW_MAX_TICKS - 1 个 tick 之后，更远的会被提前到这个时间。
+#define TW_MAX_TICKS (1UL << (TW_LEVEL_BITS * TW_LEVELS))
+
+// 没有任何定时器时 tw_next_event 的返回值。
+#define TW_NEVER (~0UL)
+
+struct tw_timer;
+typedef void (*tw_callback)(struct tw_timer *t, void *arg);
+
+struct tw_timer {
+  struct dq_node node;
+  // 所在的槽，不在时间轮里时为 NULL。
+  struct dqueue *slot;
+  unsigned long expires;
+  tw_callback cb;
+  void *arg;
+};
+
+struct timer_wheel {
+  // 当前时间，到期时间不晚于它的定时器都已经被触发了。
+  unsigned long now;
+  int nr_timers;
+  struct dqueue slots[TW_LEVELS][TW_SLOTS];
+};
+
+// 由定时器指针得到包含它的结构体的指针。
+#define tw_entry(timer_ptr, type, member) \
+  ((type *)((char *)(timer_ptr) - offsetof(type, member)))
+
+// 初始化时间轮，now 是当前时间。
+void tw_init(struct timer_wheel *w, unsigned long now);
+
+// 初始化定时器，定时器到期时会以 cb(t, arg) 的形式被回调。
+void tw_timer_init(struct tw_timer *t, tw_callback cb, void *arg);
+
+// 定时器是否在时间轮里（已经安排、还没有到期也没有被取消）。
+int tw_timer_is_pending(struct tw_timer *t);
+
+// 安排定时器在 expires 时刻到期，已经安排过的定时器会先被取消。expires
+// 不晚于当前时间的定时器在下一个 tick 到期。
+void tw_schedule(struct timer_wheel *w, struct tw_timer *t,
+                 unsigned long expires);
+
+// 取消定时器，不在时间轮里的定时器什么都不做。
+void tw_cancel(struct timer_wheel *w, struct tw_timer *t);
+
+// 把时间推进到 now，依次触发这期间到期的定时器，返回触发的个数。回调中可以安排
+// 或者取消任何定时器（包括它自己）。
+int tw_advance(struct timer_wheel *w, unsigned long now);
+
+// 返回下一个需要调用 tw_advance 的时刻（某个定时器到期或者需要下放的时刻），这个
+// 时刻不晚于最早到期的定时器的到期时间，没有定时器时返回 TW_NEVER。事件循环可以
+// 一直睡到这个时刻。
+unsigned long tw_next_event(struct timer_wheel *w);
+
+#endif
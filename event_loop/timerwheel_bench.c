@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+// 用一个假的时钟驱动时间轮：安排大量到期时间随机（横跨所有层）的定时器，取消其中
+// 一部分、在回调里重新安排一部分，然后以随机的步长推进时钟，检查每个定时器都恰好在
+// 它的到期时刻被触发、被取消的定时器从不触发，并报告各个操作的平均开销。
+// 用法：timerwheel_bench [nr_timers]
+
+#define DEFAULT_NR_TIMERS 100000
+#define MAX_DELAY (TW_MAX_TICKS / 4)
+#define MAX_STEP 5000
+
+struct bench_timer {
+  struct tw_timer timer;
+  unsigned long due;
+  int cancelled;
+  int nr_fired;
+  // 在回调中重新安排自己的次数（模拟周期性的任务）。
+  int nr_reschedules;
+};
+
+struct timer_wheel wheel;
+unsigned long nr_errors = 0;
+unsigned long nr_callbacks = 0;
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+unsigned long random_delay() {
+  // 大部分定时器离现在很近，少部分很远，和实际的超时分布差不多。
+  switch (rand() % 4) {
+    case 0:
+      return 1 + rand() % TW_SLOTS;
+    case 1:
+      return 1 + rand() % (TW_SLOTS * TW_SLOTS);
+    default:
+      return 1 + (unsigned long)rand() % MAX_DELAY;
+  }
+}
+
+void on_bench_timer(struct tw_timer *t, void *arg) {
+  struct bench_timer *bt = tw_entry(t, struct bench_timer, timer);
+  ++nr_callbacks;
+  ++bt->nr_fired;
+  if (bt->cancelled || wheel.now != bt->due) {
+    if (nr_errors++ < 10) {
+      fprintf(stderr, "timer %ld fired at %lu, due %lu, cancelled %d\n",
+              bt - (struct bench_timer *)arg, wheel.now, bt->due,
+              bt->cancelled);
+    }
+  }
+
+  if (bt->nr_reschedules > 0) {
+    --bt->nr_reschedules;
+    --bt->nr_fired;
+    bt->due = wheel.now + random_delay();
+    tw_schedule(&wheel, t, bt->due);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int nr_timers = DEFAULT_NR_TIMERS;
+  if (argc > 1) {
+    nr_timers = atoi(argv[1]);
+  }
+
+  srand(1);
+  struct bench_timer *timers = calloc(nr_timers, sizeof(struct bench_timer));
+  tw_init(&wheel, 0);
+
+  long t0 = now_ns();
+  for (int i = 0; i < nr_timers; ++i) {
+    struct bench_timer *bt = &timers[i];
+    tw_timer_init(&bt->timer, on_bench_timer, timers);
+    bt->due = random_delay();
+    bt->nr_reschedules = i % 7 == 0 ? 3 : 0;
+    tw_schedule(&wheel, &bt->timer, bt->due);
+  }
+  long schedule_ns = now_ns() - t0;
+
+  t0 = now_ns();
+  int nr_cancelled = 0;
+  for (int i = 0; i < nr_timers; i += 10) {
+    timers[i].cancelled = 1;
+    tw_cancel(&wheel, &timers[i].timer);
+    ++nr_cancelled;
+  }
+  long cancel_ns = now_ns() - t0;
+
+  t0 = now_ns();
+  unsigned long fake_now = 0;
+  unsigned long nr_advances = 0;
+  while (wheel.nr_timers > 0) {
+    fake_now += 1 + rand() % MAX_STEP;
+    tw_advance(&wheel, fake_now);
+    ++nr_advances;
+  }
+  long advance_ns = now_ns() - t0;
+
+  for (int i = 0; i < nr_timers; ++i) {
+    const int expected = timers[i].cancelled ? 0 : 1;
+    if (timers[i].nr_fired != expected) {
+      if (nr_errors++ < 10) {
+        fprintf(stderr, "timer %d fired %d times, expected %d\n", i,
+                timers[i].nr_fired, expected);
+      }
+    }
+  }
+
+  printf("%d timers (%d cancelled), fake clock advanced to %lu ticks in %lu "
+         "steps\n",
+         nr_timers, nr_cancelled, fake_now, nr_advances);
+  printf("%-24s %8.1f ns/timer\n", "schedule",
+         (double)schedule_ns / nr_timers);
+  printf("%-24s %8.1f ns/timer\n", "cancel",
+         (double)cancel_ns / nr_cancelled);
+  printf("%-24s %8.1f ns/callback (%lu callbacks)\n", "advance + fire",
+         (double)advance_ns / nr_callbacks, nr_callbacks);
+  printf("%lu errors\n", nr_errors);
+
+  free(timers);
+  return nr_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,231 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_BUF_SIZE (((0x1UL) << 20) * 1)
+#define TRACE_FLUSH_INTERVAL_NS 1000000000L
+// 一条记录的头部最多多长：类型，再加三个 LEB128 编码的 64 位整数。
+#define TRACE_MAX_HEADER (1 + 3 * 10)
+
+struct trace_writer {
+  int fd;
+  unsigned long nr_conns;
+  unsigned long last_ts;
+  unsigned long last_flush_ts;
+  size_t used;
+  unsigned char buf[TRACE_BUF_SIZE];
+};
+
+unsigned long trace_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+unsigned char *trace_put_varint(unsigned char *p, unsigned long v) {
+  while (v >= 0x80) {
+    *p++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+void trace_write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // 记录 trace 只是顺带的，写不下去不影响服务本身。
+      fprintf(stderr, "trace: write: %s\n", strerror(errno));
+      return;
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+struct trace_writer *trace_writer_create(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "trace: open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  struct trace_writer *w = malloc(sizeof(struct trace_writer));
+  w->fd = fd;
+  w->nr_conns = 0;
+  w->last_ts = w->last_flush_ts = trace_now_ns();
+  memcpy(w->buf, TRACE_MAGIC, TRACE_MAGIC_LEN);
+  w->used = TRACE_MAGIC_LEN;
+  return w;
+}
+
+void trace_flush(struct trace_writer *w) {
+  trace_write_all(w->fd, w->buf, w->used);
+  w->used = 0;
+}
+
+// 在缓冲区里放下一条记录的头部，返回它之后的位置。
+unsigned char *trace_put_header(struct trace_writer *w,
+                                enum trace_type type, unsigned long conn,
+                                unsigned long now) {
+  if (w->used + TRACE_MAX_HEADER > TRACE_BUF_SIZE) {
+    trace_flush(w);
+  }
+  unsigned char *p = w->buf + w->used;
+  *p++ = type;
+  p = trace_put_varint(p, conn);
+  p = trace_put_varint(p, now - w->last_ts);
+  w->last_ts = now;
+  return p;
+}
+
+void trace_maybe_flush(struct trace_writer *w, unsigned long now) {
+  if (now - w->last_flush_ts >= TRACE_FLUSH_INTERVAL_NS) {
+    trace_flush(w);
+    w->last_flush_ts = now;
+  }
+}
+
+unsigned long trace_open(struct trace_writer *w) {
+  const unsigned long now = trace_now_ns();
+  const unsigned long conn = w->nr_conns++;
+  unsigned char *p = trace_put_header(w, TRACE_OPEN, conn, now);
+  w->used = p - w->buf;
+  trace_maybe_flush(w, now);
+  return conn;
+}
+
+void trace_data(struct trace_writer *w, unsigned long conn,
+                const struct iovec *iov, int iovcnt, size_t len) {
+  const unsigned long now = trace_now_ns();
+  unsigned char *p = trace_put_header(w, TRACE_DATA, conn, now);
+  p = trace_put_varint(p, len);
+  w->used = p - w->buf;
+  for (int i = 0; i < iovcnt && len > 0; ++i) {
+    size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+    if (w->used + n > TRACE_BUF_SIZE) {
+      // 放不进缓冲区的大块数据直接写出去。
+      trace_flush(w);
+      trace_write_all(w->fd, iov[i].iov_base, n);
+    } else {
+      memcpy(w->buf + w->used, iov[i].iov_base, n);
+      w->used += n;
+    }
+    len -= n;
+  }
+  trace_maybe_flush(w, now);
+}
+
+void trace_close(struct trace_writer *w, unsigned long conn) {
+  const unsigned long now = trace_now_ns();
+  unsigned char *p = trace_put_header(w, TRACE_CLOSE, conn, now);
+  w->used = p - w->buf;
+  trace_maybe_flush(w, now);
+}
+
+void trace_writer_close(struct trace_writer *w) {
+  trace_flush(w);
+  close(w->fd);
+  free(w);
+}
+
+int trace_reader_open(struct trace_reader *r, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "trace: open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "trace: stat %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (st.st_size < TRACE_MAGIC_LEN) {
+    fprintf(stderr, "trace: %s is not a trace file\n", path);
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "trace: mmap %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (memcmp(map, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+    fprintf(stderr, "trace: %s is not a trace file\n", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  // 重放是从头到尾顺序读的。
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  r->begin = map;
+  r->end = r->begin + st.st_size;
+  r->map_len = st.st_size;
+  trace_rewind(r);
+  return 0;
+}
+
+int trace_get_varint(struct trace_reader *r, unsigned long *v) {
+  unsigned long result = 0;
+  for (int shift = 0; shift < 64 && r->pos < r->end; shift += 7) {
+    const unsigned char b = *r->pos++;
+    result |= (unsigned long)(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      *v = result;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int trace_next(struct trace_reader *r, struct trace_record *rec) {
+  if (r->pos == r->end) {
+    return 0;
+  }
+  rec->type = *r->pos++;
+  if (rec->type < TRACE_OPEN || rec->type > TRACE_CLOSE) {
+    return -1;
+  }
+  unsigned long dt;
+  if (trace_get_varint(r, &rec->conn) != 0 ||
+      trace_get_varint(r, &dt) != 0) {
+    return -1;
+  }
+  r->ts_ns += dt;
+  rec->ts_ns = r->ts_ns;
+  rec->data = NULL;
+  rec->len = 0;
+  if (rec->type == TRACE_DATA) {
+    unsigned long len;
+    if (trace_get_varint(r, &len) != 0 ||
+        len > (unsigned long)(r->end - r->pos)) {
+      return -1;
+    }
+    rec->data = (const char *)r->pos;
+    rec->len = len;
+    r->pos += len;
+  }
+  return 1;
+}
+
+void trace_rewind(struct trace_reader *r) {
+  r->pos = r->begin + TRACE_MAGIC_LEN;
+  r->ts_ns = 0;
+}
+
+void trace_reader_close(struct trace_reader *r) {
+  munmap((void *)r->begin, r->map_len);
+}
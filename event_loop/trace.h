@@ -0,0 +1,84 @@
+#ifndef MY_TRACE
+#define MY_TRACE
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// 流量 trace：chat_room -C 把每个网络连接的建立、读到的每一块数据和关闭连同
+// 时间戳记录到一个二进制文件里，chat_replay 再按记录下来的节奏（或者尽快）把
+// 它重放给 chat_room 或者 socket_mux，用真实的流量形态（突发的大小、消息的长短、
+// 连接的来去）跑出可以重复的基准数字。
+//
+// 文件的格式：8 字节的 magic（TRACE_MAGIC），之后是一条接一条的记录。每条记录
+// 以 1 字节的类型开头，后面跟着几个 LEB128 编码的无符号变长整数：
+//
+//   TRACE_OPEN    conn dt
+//   TRACE_DATA    conn dt len，然后是 len 字节的数据
+//   TRACE_CLOSE   conn dt
+//
+// conn 是记录时按连接建立的顺序分配的编号（从 0 开始，和 fd 无关），dt 是和上
+// 一条记录相隔的纳秒数。小消息的一条记录只有几个字节的开销。
+
+#define TRACE_MAGIC "CHTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+enum trace_type {
+  TRACE_OPEN = 1,
+  TRACE_DATA = 2,
+  TRACE_CLOSE = 3,
+};
+
+struct trace_writer;
+
+// 创建（或者截断）path 处的 trace 文件，失败时打印原因并返回 NULL。
+struct trace_writer *trace_writer_create(const char *path);
+
+// 分配一个新的连接编号，并记录它的建立。
+unsigned long trace_open(struct trace_writer *w);
+
+// 记录 conn 读到的 len 字节数据，数据在 iov 描述的（一段或几段）内存里。
+void trace_data(struct trace_writer *w, unsigned long conn,
+                const struct iovec *iov, int iovcnt, size_t len);
+
+void trace_close(struct trace_writer *w, unsigned long conn);
+
+// 写出缓冲的记录。有新记录时距离上次写出超过一秒左右也会顺便写出；没有新记录
+// 的时候不会，调用者要定期调用它（chat_room 在每秒一次的 governor tick 里调用），
+// 进程被 SIGKILL 之类杀掉时最多丢掉最后这一点。
+void trace_flush(struct trace_writer *w);
+
+// 写出缓冲的记录，关闭文件，释放 w。
+void trace_writer_close(struct trace_writer *w);
+
+struct trace_record {
+  enum trace_type type;
+  unsigned long conn;
+  // 从开始记录起过了多少纳秒。
+  unsigned long ts_ns;
+  // TRACE_DATA 的数据，指向映射进来的 trace 文件。
+  const char *data;
+  size_t len;
+};
+
+// 把整个 trace 文件映射进来顺序读取，重放时数据直接从映射的内存发出去。
+struct trace_reader {
+  const unsigned char *begin;
+  const unsigned char *pos;
+  const unsigned char *end;
+  size_t map_len;
+  unsigned long ts_ns;
+};
+
+// 失败时打印原因并返回 -1。
+int trace_reader_open(struct trace_reader *r, const char *path);
+
+// 读出下一条记录。返回 1 表示读到了，0 表示到了文件末尾，-1 表示文件损坏（或者
+// 记录的进程还没来得及写完最后一条）。
+int trace_next(struct trace_reader *r, struct trace_record *rec);
+
+// 回到第一条记录。
+void trace_rewind(struct trace_reader *r);
+
+void trace_reader_close(struct trace_reader *r);
+
+#endif
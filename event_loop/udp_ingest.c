@@ -0,0 +1,249 @@
+#include "udp_ingest.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "muxframe.h"
+#include "rawsys.h"
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+
+// 每个 datagram 的控制消息：GRO 的段长、溢出计数、时间戳。
+#define UDP_CONTROL_SIZE                                     \
+  (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t)) + \
+   CMSG_SPACE(sizeof(struct timespec)))
+// 交给 sink 的一次 writev 最多有多少个 iovec。分帧时每个 datagram 两个，GRO 切出
+// 来的 datagram 太多、放不下时一批分几次写。
+#define UDP_MAX_OUT_IOV 1024
+
+struct udp_ingest {
+  int fd;
+  struct udp_ingest_stats stats;
+  // UDP_BATCH 个 UDP_BUF_SIZE 字节的缓冲区，只有收到过的部分才真的占用内存。
+  char *bufs;
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec msg_iov[UDP_BATCH];
+  char control[UDP_BATCH][UDP_CONTROL_SIZE];
+  struct iovec out_iov[UDP_MAX_OUT_IOV];
+  char headers[UDP_MAX_OUT_IOV / 2][MUX_MAX_HEADER_LEN];
+};
+
+int is_udp_addr(const char *addr) {
+  return strncmp(addr, UDP_ADDR_PREFIX, strlen(UDP_ADDR_PREFIX)) == 0;
+}
+
+// 把 udp:<port> 或者 udp:<host>:<port> 解析成一个 IPv4 地址。
+int make_udp_addr(struct sockaddr_storage *ss, socklen_t *len,
+                  const char *addr) {
+  char host_buf[256];
+  const char *host = NULL;
+  const char *port = addr + strlen(UDP_ADDR_PREFIX);
+  const char *colon = strrchr(port, ':');
+  if (colon != NULL) {
+    if (colon - port >= (long)sizeof(host_buf)) {
+      fprintf(stderr, "Bad UDP address: %s\n", addr);
+      return -1;
+    }
+    memcpy(host_buf, port, colon - port);
+    host_buf[colon - port] = '\0';
+    host = host_buf;
+    port = colon + 1;
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  int status = getaddrinfo(host, port, &hints, &res);
+  if (status != 0) {
+    fprintf(stderr, "getaddrinfo %s: %s\n", addr, gai_strerror(status));
+    return -1;
+  }
+  memcpy(ss, res->ai_addr, res->ai_addrlen);
+  *len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+struct udp_ingest *udp_ingest_open(const char *addr, int gro, int timestamps) {
+  struct sockaddr_storage ss;
+  socklen_t len;
+  if (make_udp_addr(&ss, &len, addr) != 0) {
+    return NULL;
+  }
+  int fd = socket(ss.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "socket %s: %s\n", addr, strerror(errno));
+    return NULL;
+  }
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1) {
+    fprintf(stderr, "setsockopt SO_RXQ_OVFL on %s: %s, drops will not be "
+            "counted\n", addr, strerror(errno));
+  }
+  if (gro && setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+    fprintf(stderr, "setsockopt UDP_GRO on %s: %s\n", addr, strerror(errno));
+  }
+  if (timestamps) {
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+  }
+  if (bind(fd, (struct sockaddr *)&ss, len) == -1) {
+    fprintf(stderr, "bind %s: %s\n", addr, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  struct udp_ingest *u = malloc(sizeof(struct udp_ingest));
+  char *bufs = malloc((size_t)UDP_BATCH * UDP_BUF_SIZE);
+  if (u == NULL || bufs == NULL) {
+    fprintf(stderr, "Failed to allocate buffers for %s.\n", addr);
+    free(u);
+    free(bufs);
+    close(fd);
+    return NULL;
+  }
+  memset(u, 0, sizeof(struct udp_ingest));
+  u->fd = fd;
+  u->bufs = bufs;
+  for (int i = 0; i < UDP_BATCH; ++i) {
+    u->msg_iov[i].iov_base = u->bufs + (size_t)i * UDP_BUF_SIZE;
+    u->msg_iov[i].iov_len = UDP_BUF_SIZE;
+    u->msgs[i].msg_hdr.msg_iov = &u->msg_iov[i];
+    u->msgs[i].msg_hdr.msg_iovlen = 1;
+    u->msgs[i].msg_hdr.msg_control = u->control[i];
+  }
+  return u;
+}
+
+int udp_ingest_get_fd(struct udp_ingest *u) { return u->fd; }
+
+const struct udp_ingest_stats *udp_ingest_get_stats(struct udp_ingest *u) {
+  return &u->stats;
+}
+
+unsigned long udp_realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// 从一个 datagram 的控制消息里取出 GRO 的段长（没有合并时是 0）、溢出计数和
+// 时间戳（没有时是 0）。
+void parse_control(struct udp_ingest *u, struct msghdr *msg, int *gso_size,
+                   uint64_t *ts_ns) {
+  *gso_size = 0;
+  *ts_ns = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+      memcpy(gso_size, CMSG_DATA(cmsg), sizeof(int));
+    } else if (cmsg->cmsg_level == SOL_SOCKET &&
+               cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      u->stats.nr_drops = drops;
+    } else if (cmsg->cmsg_level == SOL_SOCKET &&
+               cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec rx;
+      memcpy(&rx, CMSG_DATA(cmsg), sizeof(rx));
+      *ts_ns = rx.tv_sec * 1000000000UL + rx.tv_nsec;
+    }
+  }
+}
+
+long udp_ingest_drain(struct udp_ingest *u, struct mux_sink *sink, int framing,
+                      uint32_t frame_flags, uint32_t source, int max_batches) {
+  const int header_len = mux_header_len(frame_flags);
+  long nr_datagrams = 0;
+  for (int batch = 0; batch < max_batches; ++batch) {
+    for (int i = 0; i < UDP_BATCH; ++i) {
+      // 内核会改写 msg_controllen。
+      u->msgs[i].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+    }
+    long n = sys_recvmmsg(u->fd, u->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+      if (n != -EAGAIN && n != -EWOULDBLOCK && n != -EINTR) {
+        fprintf(stderr, "recvmmsg: %s\n", strerror(-n));
+      }
+      break;
+    }
+    ++u->stats.nr_batches;
+
+    int out = 0;
+    for (int i = 0; i < n; ++i) {
+      struct msghdr *msg = &u->msgs[i].msg_hdr;
+      char *buf = msg->msg_iov->iov_base;
+      const int len = u->msgs[i].msg_len;
+      int gso_size;
+      uint64_t ts_ns;
+      parse_control(u, msg, &gso_size, &ts_ns);
+      if (msg->msg_flags & MSG_TRUNC) {
+        ++u->stats.nr_truncated;
+      }
+      if (len == 0) {
+        // 空的 datagram 没有内容可写，分帧时也不能写：长度为 0 的帧表示来源已经
+        // 关闭。
+        continue;
+      }
+      const int seg = gso_size > 0 && gso_size < len ? gso_size : len;
+      const int nr_segs = (len + seg - 1) / seg;
+      if (nr_segs > 1) {
+        ++u->stats.nr_gro_buffers;
+      }
+      nr_datagrams += nr_segs;
+      u->stats.nr_bytes += len;
+
+      if (!framing) {
+        u->out_iov[out++] = (struct iovec){.iov_base = buf, .iov_len = len};
+        continue;
+      }
+      if ((frame_flags & MUX_STREAM_TIMESTAMPS) && ts_ns == 0) {
+        ts_ns = udp_realtime_ns();
+      }
+      for (int off = 0; off < len; off += seg) {
+        if (out + 2 > UDP_MAX_OUT_IOV) {
+          if (sink->writev(sink, u->out_iov, out) != 0) {
+            return -1;
+          }
+          out = 0;
+        }
+        const int seg_len = len - off < seg ? len - off : seg;
+        char *hdr = u->headers[out / 2];
+        mux_put_header(hdr, frame_flags, source, seg_len, ts_ns);
+        u->out_iov[out++] =
+            (struct iovec){.iov_base = hdr, .iov_len = header_len};
+        u->out_iov[out++] =
+            (struct iovec){.iov_base = buf + off, .iov_len = seg_len};
+      }
+    }
+    if (out > 0 && sink->writev(sink, u->out_iov, out) != 0) {
+      return -1;
+    }
+    if (n < UDP_BATCH) {
+      // 接收队列已经空了。
+      break;
+    }
+  }
+  u->stats.nr_datagrams += nr_datagrams;
+  return nr_datagrams;
+}
+
+void udp_ingest_close(struct udp_ingest *u) {
+  close(u->fd);
+  free(u->bufs);
+  free(u);
+}
@@ -0,0 +1,61 @@
+#ifndef MY_UDP_INGEST
+#define MY_UDP_INGEST
+
+#include <stdint.h>
+
+#include "sink.h"
+
+// socket_mux 的 UDP 输入：监听地址写成 udp:<port> 或者 udp:<host>:<port>。
+//
+// 每次 recvmmsg 收一批（最多 UDP_BATCH 个）datagram，直接收进预先分配好的一组
+// 缓冲区里，然后用一次 writev（sink 的 writev）把整批交给下游，收和写都没有按
+// datagram 的 syscall。分帧输出时每个 datagram 是单独的一帧（来源是这个 UDP
+// 监听地址），不分帧时 datagram 的内容首尾相接。
+//
+// 开启 UDP_GRO 时内核把同一个流里连续到达的 datagram 合并成一个大缓冲区交上来，
+// 每段的长度（最后一段可以更短）在控制消息里，分帧时再按它切回一个个 datagram。
+//
+// 接收队列满了被内核丢掉的 datagram 的数目由 SO_RXQ_OVFL 随每个 datagram 报告
+// 上来，记在 nr_drops 里。
+
+#define UDP_ADDR_PREFIX "udp:"
+// 一次 recvmmsg 最多收多少个 datagram（开启 GRO 时是多少个合并后的缓冲区）。
+#define UDP_BATCH 64
+// 每个缓冲区的大小：一个最大的 datagram，也是 GRO 合并后的上限。
+#define UDP_BUF_SIZE (1024 * 64)
+
+struct udp_ingest_stats {
+  // 收到了数据的 recvmmsg 次数。
+  unsigned long nr_batches;
+  unsigned long nr_datagrams;
+  unsigned long nr_bytes;
+  // GRO 合并过（不止一段）的缓冲区的个数。
+  unsigned long nr_gro_buffers;
+  // 比缓冲区还大、被截断了的 datagram 的个数。
+  unsigned long nr_truncated;
+  // 内核报告的接收队列溢出丢掉的 datagram 的总数。
+  unsigned long nr_drops;
+};
+
+struct udp_ingest;
+
+int is_udp_addr(const char *addr);
+
+// 在 addr（带 udp: 前缀）上创建 O_NONBLOCK 的 UDP socket。gro 开启 UDP_GRO，
+// timestamps 开启 SO_TIMESTAMPNS（分帧时帧头里的时间用内核收到 datagram 的
+// 时间）。失败时打印原因并返回 NULL。
+struct udp_ingest *udp_ingest_open(const char *addr, int gro, int timestamps);
+
+int udp_ingest_get_fd(struct udp_ingest *u);
+
+const struct udp_ingest_stats *udp_ingest_get_stats(struct udp_ingest *u);
+
+// 收完接收队列里的 datagram（最多 max_batches 批），每批一次交给 sink。
+// frame_flags 见 muxframe.h，framing 为 0 时不分帧；source 是帧头里的来源编号。
+// 返回收到的 datagram 数，下游已经关闭时返回 -1。
+long udp_ingest_drain(struct udp_ingest *u, struct mux_sink *sink, int framing,
+                      uint32_t frame_flags, uint32_t source, int max_batches);
+
+void udp_ingest_close(struct udp_ingest *u);
+
+#endif
@@ -7,8 +7,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 void set_io_non_block(int fd) {
@@ -80,6 +85,216 @@ void return_chunk_to_ring_buf(char *dst_base, int *dst_start_offset,
   }
 }
 
+#define UNIX_ADDR_PREFIX "unix:"
+
+int is_unix_addr(const char *addr) {
+  return strncmp(addr, UNIX_ADDR_PREFIX, strlen(UNIX_ADDR_PREFIX)) == 0;
+}
+
+// 把 unix:<path> 或者 unix:@<name> 转换成 sockaddr_un，返回地址的长度，名字太长
+// 时返回 0。抽象命名空间的地址以 '\0' 开头，长度只算到名字的末尾。
+socklen_t make_unix_addr(struct sockaddr_un *sun, const char *addr) {
+  const char *path = addr + strlen(UNIX_ADDR_PREFIX);
+  const size_t path_len = strlen(path);
+  if (path_len == 0 || path_len >= sizeof(sun->sun_path)) {
+    fprintf(stderr, "Bad UNIX domain socket address: %s\n", addr);
+    return 0;
+  }
+
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  memcpy(sun->sun_path, path, path_len);
+  if (path[0] == '@') {
+    sun->sun_path[0] = '\0';
+    return offsetof(struct sockaddr_un, sun_path) + path_len;
+  }
+  return sizeof(*sun);
+}
+
+// 把 <port> 或者 <host>:<port> 解析成一个 IPv4 地址，host 为 NULL 时是通配地址。
+int make_tcp_addr(struct sockaddr_storage *ss, socklen_t *len, const char *addr,
+                  int passive) {
+  char host_buf[256];
+  const char *host = passive ? NULL : "127.0.0.1";
+  const char *port = addr;
+  const char *colon = strrchr(addr, ':');
+  if (colon != NULL) {
+    if (colon - addr >= (long)sizeof(host_buf)) {
+      fprintf(stderr, "Bad TCP address: %s\n", addr);
+      return -1;
+    }
+    memcpy(host_buf, addr, colon - addr);
+    host_buf[colon - addr] = '\0';
+    host = host_buf;
+    port = colon + 1;
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  int status = getaddrinfo(host, port, &hints, &res);
+  if (status != 0) {
+    fprintf(stderr, "getaddrinfo %s: %s\n", addr, gai_strerror(status));
+    return -1;
+  }
+  memcpy(ss, res->ai_addr, res->ai_addrlen);
+  *len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+int listen_on(const char *addr, int backlog) {
+  struct sockaddr_storage ss;
+  socklen_t len;
+  if (is_unix_addr(addr)) {
+    len = make_unix_addr((struct sockaddr_un *)&ss, addr);
+    if (len == 0) {
+      return -1;
+    }
+  } else if (make_tcp_addr(&ss, &len, addr, 1) != 0) {
+    return -1;
+  }
+
+  int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "socket %s: %s\n", addr, strerror(errno));
+    return -1;
+  }
+
+  struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+  if (ss.ss_family == AF_UNIX && sun->sun_path[0] != '\0') {
+    // 上一次运行留下来的 socket 文件会让 bind 失败（EADDRINUSE）。连不上说明没有
+    // 人在监听，删掉它；连得上说明另一个进程正在用，不能抢。
+    struct stat st;
+    if (lstat(sun->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (probe >= 0 && connect(probe, (struct sockaddr *)sun, len) == -1 &&
+          errno == ECONNREFUSED) {
+        unlink(sun->sun_path);
+      }
+      if (probe >= 0) {
+        close(probe);
+      }
+    }
+  }
+
+  if (bind(fd, (struct sockaddr *)&ss, len) == -1) {
+    fprintf(stderr, "bind %s: %s\n", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if (listen(fd, backlog) == -1) {
+    fprintf(stderr, "listen %s: %s\n", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+void unlisten(const char *addr) {
+  if (is_unix_addr(addr) && addr[strlen(UNIX_ADDR_PREFIX)] != '@') {
+    unlink(addr + strlen(UNIX_ADDR_PREFIX));
+  }
+}
+
+int open_reserve_fd(int *reserve_fd) {
+  if (*reserve_fd < 0) {
+    *reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+  return *reserve_fd;
+}
+
+int drop_pending_conn(int listen_fd, int *reserve_fd) {
+  if (*reserve_fd < 0) {
+    return -1;
+  }
+  close(*reserve_fd);
+  *reserve_fd = -1;
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  const int accept_errno = errno;
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (open_reserve_fd(reserve_fd) < 0) {
+    return -1;
+  }
+  if (fd >= 0) {
+    return 1;
+  }
+  return accept_errno == EMFILE || accept_errno == ENFILE ? -1 : 0;
+}
+
+int connect_to(const char *addr) {
+  struct sockaddr_storage ss;
+  socklen_t len;
+  if (is_unix_addr(addr)) {
+    len = make_unix_addr((struct sockaddr_un *)&ss, addr);
+    if (len == 0) {
+      return -1;
+    }
+  } else if (make_tcp_addr(&ss, &len, addr, 0) != 0) {
+    return -1;
+  }
+
+  int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "socket %s: %s\n", addr, strerror(errno));
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&ss, len) == -1) {
+    fprintf(stderr, "connect %s: %s\n", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void enable_rx_timestamps(int fd) {
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+int set_busy_poll(int fd, int usec) {
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1) {
+    fprintf(stderr, "setsockopt SO_BUSY_POLL on fd %d: %s\n", fd,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t readv_rx_latency(int fd, const struct iovec *iov, int iovcnt,
+                         long *latency_ns) {
+  char cmsg_buf[CMSG_SPACE(sizeof(struct timespec))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *)iov;
+  msg.msg_iovlen = iovcnt;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+
+  *latency_ns = -1;
+  ssize_t result = recvmsg(fd, &msg, 0);
+  if (result <= 0) {
+    return result;
+  }
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec rx, now;
+      memcpy(&rx, CMSG_DATA(cmsg), sizeof(rx));
+      clock_gettime(CLOCK_REALTIME, &now);
+      *latency_ns = (now.tv_sec - rx.tv_sec) * 1000000000L +
+                    (now.tv_nsec - rx.tv_nsec);
+    }
+  }
+  return result;
+}
+
 int get_peer_pretty_name(char *buf, ssize_t buflen, struct sockaddr *addr) {
   int ip_str_len = 0;
   int portnum = 0;
@@ -104,6 +319,9 @@ int get_peer_pretty_name(char *buf, ssize_t buflen, struct sockaddr *addr) {
     }
 
     return snprintf(buf, buflen, "%s:%d", ipv4_addr_buf, ntohs(s->sin_port));
+  } else if (addr->sa_family == AF_UNIX) {
+    // UNIX domain socket 的客户端一般不 bind，没有地址可以显示。
+    return snprintf(buf, buflen, "unix");
   } else {
     fprintf(stderr, "Unknown address family.\n");
     return -1;
@@ -1,6 +1,9 @@
 #ifndef MY_UTIL
 #define MY_UTIL
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 // 对一个 fd 指代的文件设定 O_NONBLOCK 操作模式。
 void set_io_non_block(int fd);
 
@@ -40,6 +43,55 @@ void return_chunk_to_ring_buf(char *dst_base, int *dst_start_offset,
                               int *dst_curr_size, const int dst_capacity,
                               const char *src, const int nbytes);
 
+// 监听地址和连接地址的写法：
+//
+//   <port>            TCP 端口（监听时是所有 IPv4 地址，连接时是 127.0.0.1）
+//   <host>:<port>     指定地址上的 TCP 端口
+//   unix:<path>       文件系统中的 UNIX domain socket
+//   unix:@<name>      抽象命名空间（abstract namespace）中的 UNIX domain socket，
+//                     不在文件系统中留下任何文件，进程退出后自动消失
+//
+// 同一台机器上的客户端走 UNIX domain socket 可以省掉整个 TCP/IP 协议栈。
+
+// 判断 addr 是不是 UNIX domain socket 地址。
+int is_unix_addr(const char *addr);
+
+// 在 addr 上创建 O_NONBLOCK | O_CLOEXEC 的 listen socket，失败时打印原因并返回
+// -1。文件系统中的 UNIX domain socket 如果已经存在而且没有人在监听（上一次运行
+// 留下来的），会先把它删掉。
+int listen_on(const char *addr, int backlog);
+
+// 删除 listen_on 在文件系统中创建的 socket 文件，其它地址什么都不做。
+void unlisten(const char *addr);
+
+// fd 用完（accept 返回 EMFILE、ENFILE）以后排队的连接一直留在 listen 队列里，
+// 水平触发的 select、poll 会不停地报告 listen socket 可读。对策是平时预留一个
+// fd（打开的 /dev/null，见 open_reserve_fd），这时关掉它腾出一个 fd，接受一个
+// 排队的连接并立即关闭，再把预留的 fd 打开回来：客户端马上知道被拒绝了，
+// 而不是一直等着。返回 1 表示丢弃了一个连接，0 表示 listen 队列已经空了，-1 表示
+// 连预留的 fd 都没有了，调用者应该暂停 accept 一段时间，之后再 open_reserve_fd。
+int drop_pending_conn(int listen_fd, int *reserve_fd);
+
+// *reserve_fd 为 -1 时打开预留的 fd，返回 *reserve_fd。
+int open_reserve_fd(int *reserve_fd);
+
+// 连接 addr，返回阻塞模式的 fd，失败时打印原因并返回 -1。
+int connect_to(const char *addr);
+
+// 让内核给收到的数据打上时间戳（SO_TIMESTAMPNS），之后可以用 readv_rx_latency
+// 知道数据在内核里等了多久才被读走。只有 TCP 支持，UNIX domain socket 上什么都
+// 不做。
+void enable_rx_timestamps(int fd);
+
+// 给 socket 设置 SO_BUSY_POLL：阻塞的读在没有数据时先在网卡队列上忙等最多 usec
+// 微秒。设置失败（比如没有 CAP_NET_ADMIN）时打印原因，返回 -1。
+int set_busy_poll(int fd, int usec);
+
+// 和 readv 一样，另外把这次读到的数据被内核收到以后过了多久（纳秒）写到
+// *latency_ns，没有时间戳时写 -1。
+ssize_t readv_rx_latency(int fd, const struct iovec *iov, int iovcnt,
+                         long *latency_ns);
+
 int get_peer_pretty_name(char *buf, ssize_t buflen, struct sockaddr *addr);
 
 void sprint_conn(char *buf, size_t buflen, int fd);
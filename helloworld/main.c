@@ -1,5 +1,5 @@
 
-extern void hello(char *msg, long len);
+extern long hello(char *msg, long len);
 
 // the *eax would be use as the EAX argument to call cpuid,
 // cpu_vendor at least 12 chars.
@@ -9,6 +9,6 @@ extern void cpuid0(int *eax, char *cpu_vendor);
 char msg[] = "hello, world!\n";
 
 int main() {
-  hello(msg, sizeof(msg));
-  return 0;
+  long result = hello(msg, sizeof(msg) - 1);
+  return result < 0 ? 1 : 0;
 }